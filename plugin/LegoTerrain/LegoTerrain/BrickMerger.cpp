@@ -0,0 +1,258 @@
+#include "BrickMerger.h"
+#include "TerrainColoring.h"
+#include "ThreadPool.h"
+#include "CoreTypes.h"
+#include <algorithm>
+
+namespace
+{
+    // Layers per merge task, so tall tiles still split across threads
+    const unsigned int LAYER_BAND = 16;
+
+    // Bricks per task when expanding instances
+    const size_t EXPAND_CHUNK = 1 << 14;
+
+    // Cell states in a tile's layer grid
+    const uint8_t CELL_EMPTY = 0;
+    const uint8_t CELL_FREE = 1;
+    const uint8_t CELL_TAKEN = 2;
+
+    struct MergeTask
+    {
+        unsigned int tileX;
+        unsigned int tileZ;
+        unsigned int yBegin;
+        unsigned int yEnd;
+    };
+
+    bool fits(const uint8_t* grid, unsigned int stride, unsigned int x, unsigned int z,
+        const BrickType& type, unsigned int tileWidth, unsigned int tileDepth)
+    {
+        if (x + type.width > tileWidth || z + type.depth > tileDepth) return false;
+
+        for (unsigned int dz = 0; dz < type.depth; dz++) {
+            const uint8_t* row = grid + (size_t)(z + dz) * stride + x;
+            for (unsigned int dx = 0; dx < type.width; dx++) {
+                if (row[dx] != CELL_FREE) return false;
+            }
+        }
+        return true;
+    }
+}
+
+const char* BrickCatalogue::DEFAULT_SPEC = "1x1,1x2,2x2,2x4,1x6";
+
+BrickCatalogue::BrickCatalogue()
+{
+    addType(1, 1);
+}
+
+void BrickCatalogue::addType(unsigned int width, unsigned int depth)
+{
+    auto add = [this](unsigned int w, unsigned int d) {
+        for (const BrickType& type : fTypes) {
+            if (type.width == w && type.depth == d) return;
+        }
+        fTypes.push_back({ (uint16_t)w, (uint16_t)d });
+    };
+
+    add(width, depth);
+    add(depth, width);
+    sortTypes();
+}
+
+void BrickCatalogue::sortTypes()
+{
+    // Largest area first; wider before deeper keeps the order stable
+    std::sort(fTypes.begin(), fTypes.end(), [](const BrickType& a, const BrickType& b) {
+        if (a.area() != b.area()) return a.area() > b.area();
+        return a.width > b.width;
+    });
+}
+
+MStatus BrickCatalogue::parse(const MString& spec, BrickCatalogue& outCatalogue)
+{
+    outCatalogue = BrickCatalogue();
+
+    MStringArray entries;
+    spec.split(',', entries);
+
+    if (entries.length() == 0) {
+        MGlobal::displayError("Brick list is empty");
+        return MS::kFailure;
+    }
+
+    for (unsigned int i = 0; i < entries.length(); i++) {
+        MStringArray sides;
+        entries[i].toLowerCase().split('x', sides);
+
+        if (sides.length() != 2 || !sides[0].isInt() || !sides[1].isInt()) {
+            MGlobal::displayError("Brick must be given as WIDTHxDEPTH: " + entries[i]);
+            return MS::kFailure;
+        }
+
+        int width = sides[0].asInt();
+        int depth = sides[1].asInt();
+        if (width < 1 || depth < 1 || width > (int)MAX_BRICK_SIZE || depth > (int)MAX_BRICK_SIZE) {
+            MGlobal::displayError(MString("Brick sides must be between 1 and ") + MAX_BRICK_SIZE + ": " + entries[i]);
+            return MS::kFailure;
+        }
+
+        outCatalogue.addType(width, depth);
+    }
+
+    return MS::kSuccess;
+}
+
+void BrickLayout::clear()
+{
+    types.clear();
+    bricks.clear();
+}
+
+std::vector<uint64_t> BrickLayout::countByType() const
+{
+    std::vector<uint64_t> counts(types.size(), 0);
+    for (const BrickInstance& brick : bricks) {
+        counts[brick.type] += types[brick.type].area();
+    }
+    return counts;
+}
+
+void BrickLayout::expandInstances(float voxelSize, MVector* outCenters, double* outTypeIndices,
+    const TerrainSpans* spans, const TerrainColoring* coloring, MVector* outColors) const
+{
+    bool colored = spans && coloring && outColors;
+    ThreadPool::global().parallelFor(0, bricks.size(), EXPAND_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const BrickInstance& brick = bricks[i];
+            const BrickType& type = types[brick.type];
+
+            float worldX = ((float)brick.x + (type.width - 1) * 0.5f) * voxelSize;
+            float worldY = (float)brick.y * voxelSize;
+            float worldZ = ((float)brick.z + (type.depth - 1) * 0.5f) * voxelSize;
+
+            outCenters[i] = MVector(worldX, worldY, worldZ);
+            outTypeIndices[i] = brick.type;
+
+            if (colored) {
+                size_t column = (size_t)brick.z * spans->terrainWidth + brick.x;
+                outColors[i] = TerrainColoring::toVector(coloring->voxelColor(coloring->columnColor(*spans, column), brick.y));
+            }
+        }
+    });
+}
+
+MStatus BrickMerger::merge(const TerrainSpans& spans, const BrickCatalogue& catalogue, BrickLayout& outLayout)
+{
+    outLayout.clear();
+    outLayout.types = catalogue.types();
+
+    unsigned int terrainWidth = spans.terrainWidth;
+    unsigned int terrainHeight = spans.terrainHeight;
+
+    if (spans.spans.empty()) {
+        return MS::kSuccess;
+    }
+
+    if (spans.spans.size() != (size_t)terrainWidth * terrainHeight) {
+        MGlobal::displayError("Brick merging needs one span per terrain column");
+        return MS::kFailure;
+    }
+
+    ThreadPool& pool = ThreadPool::global();
+    const ColumnSpan* columns = spans.spans.data();
+    unsigned int tilesX = (terrainWidth + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned int tilesZ = (terrainHeight + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Layer range of every tile, so empty layers are never visited
+    std::vector<uint16_t> tileLow((size_t)tilesX * tilesZ);
+    std::vector<uint16_t> tileHigh((size_t)tilesX * tilesZ);
+
+    pool.parallelFor(0, tileLow.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t tile = begin; tile < end; tile++) {
+            unsigned int x0 = (unsigned int)(tile % tilesX) * TILE_SIZE;
+            unsigned int z0 = (unsigned int)(tile / tilesX) * TILE_SIZE;
+            unsigned int x1 = std::min(x0 + TILE_SIZE, terrainWidth);
+            unsigned int z1 = std::min(z0 + TILE_SIZE, terrainHeight);
+
+            uint16_t low = 0xFFFF;
+            uint16_t high = 0;
+            for (unsigned int z = z0; z < z1; z++) {
+                const ColumnSpan* row = columns + (size_t)z * terrainWidth;
+                for (unsigned int x = x0; x < x1; x++) {
+                    low = std::min(low, row[x].yMin);
+                    high = std::max(high, row[x].yMax);
+                }
+            }
+            tileLow[tile] = low;
+            tileHigh[tile] = high;
+        }
+    });
+
+    std::vector<MergeTask> tasks;
+    for (unsigned int tileZ = 0; tileZ < tilesZ; tileZ++) {
+        for (unsigned int tileX = 0; tileX < tilesX; tileX++) {
+            size_t tile = (size_t)tileZ * tilesX + tileX;
+            for (unsigned int y = tileLow[tile]; y <= tileHigh[tile]; y += LAYER_BAND) {
+                tasks.push_back({ tileX, tileZ, y, std::min<unsigned int>(y + LAYER_BAND, tileHigh[tile] + 1) });
+            }
+        }
+    }
+
+    const std::vector<BrickType>& types = outLayout.types;
+    std::vector<std::vector<BrickInstance>> taskBricks(tasks.size());
+
+    pool.parallelFor(0, tasks.size(), 1, [&](size_t begin, size_t end) {
+        std::vector<uint8_t> grid(TILE_SIZE * TILE_SIZE);
+
+        for (size_t t = begin; t < end; t++) {
+            const MergeTask& task = tasks[t];
+            unsigned int x0 = task.tileX * TILE_SIZE;
+            unsigned int z0 = task.tileZ * TILE_SIZE;
+            unsigned int tileWidth = std::min(TILE_SIZE, terrainWidth - x0);
+            unsigned int tileDepth = std::min(TILE_SIZE, terrainHeight - z0);
+            std::vector<BrickInstance>& out = taskBricks[t];
+
+            for (unsigned int y = task.yBegin; y < task.yEnd; y++) {
+                for (unsigned int z = 0; z < tileDepth; z++) {
+                    const ColumnSpan* row = columns + (size_t)(z0 + z) * terrainWidth + x0;
+                    uint8_t* cells = grid.data() + z * TILE_SIZE;
+                    for (unsigned int x = 0; x < tileWidth; x++) {
+                        cells[x] = (row[x].yMin <= y && y <= row[x].yMax) ? CELL_FREE : CELL_EMPTY;
+                    }
+                }
+
+                for (unsigned int z = 0; z < tileDepth; z++) {
+                    for (unsigned int x = 0; x < tileWidth; x++) {
+                        if (grid[z * TILE_SIZE + x] != CELL_FREE) continue;
+
+                        // The catalogue ends in 1x1, which always fits a free cell
+                        for (size_t typeIndex = 0; typeIndex < types.size(); typeIndex++) {
+                            const BrickType& type = types[typeIndex];
+                            if (!fits(grid.data(), TILE_SIZE, x, z, type, tileWidth, tileDepth)) continue;
+
+                            for (unsigned int dz = 0; dz < type.depth; dz++) {
+                                std::fill_n(grid.data() + (z + dz) * TILE_SIZE + x, type.width, CELL_TAKEN);
+                            }
+                            out.push_back({ (uint16_t)(x0 + x), (uint16_t)(z0 + z), (uint16_t)y, (uint16_t)typeIndex });
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    size_t totalBricks = 0;
+    for (const std::vector<BrickInstance>& bricks : taskBricks) {
+        totalBricks += bricks.size();
+    }
+
+    outLayout.bricks.reserve(totalBricks);
+    for (const std::vector<BrickInstance>& bricks : taskBricks) {
+        outLayout.bricks.insert(outLayout.bricks.end(), bricks.begin(), bricks.end());
+    }
+
+    return MS::kSuccess;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "TerrainSpans.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Footprint of one rectangular brick, in voxels
+ *
+ * Width runs along x and depth along z. A rotated brick is its own type, so
+ * every type maps to exactly one instanced shape.
+ */
+struct BrickType
+{
+    uint16_t width;
+    uint16_t depth;
+
+    uint32_t area() const { return (uint32_t)width * depth; }
+};
+
+/**
+ * @brief One placed brick: the voxel at its lowest x and z, and its type
+ */
+struct BrickInstance
+{
+    uint16_t x;
+    uint16_t z;
+    uint16_t y;
+    uint16_t type;
+};
+
+static_assert(sizeof(BrickInstance) == 8, "BrickInstance should stay packed");
+
+/**
+ * @brief Bricks the merger may place, largest first
+ *
+ * Parsed from a list like "1x1,1x2,2x2,2x4,1x6". Both orientations of every
+ * non-square brick are added, and 1x1 is always present so that every voxel
+ * can be covered.
+ */
+class BrickCatalogue
+{
+public:
+    static const char* DEFAULT_SPEC;
+
+    // Largest brick side; bricks never cross a merge tile
+    static const unsigned int MAX_BRICK_SIZE = 16;
+
+    BrickCatalogue();
+
+    static MStatus parse(const MString& spec, BrickCatalogue& outCatalogue);
+
+    const std::vector<BrickType>& types() const { return fTypes; }
+
+    void addType(unsigned int width, unsigned int depth);
+
+private:
+    std::vector<BrickType> fTypes;
+
+    void sortTypes();
+};
+
+/**
+ * @brief Terrain as merged bricks, one instance per brick
+ */
+struct BrickLayout
+{
+    std::vector<BrickType> types;
+    std::vector<BrickInstance> bricks;
+
+    void clear();
+
+    // Voxels covered by each type, for reporting
+    std::vector<uint64_t> countByType() const;
+
+    /**
+     * @brief Brick centres and type indices, ready for the particle instancer
+     *
+     * Both arrays must hold bricks.size() elements. Centres use the same
+     * voxel grid as TerrainSpans::expandPositions, so a 1x1 brick sits
+     * exactly where its voxel did. With a coloring, each brick takes the
+     * colour of the voxel at its lowest corner, written to outColors in the
+     * same pass.
+     */
+    void expandInstances(float voxelSize, MVector* outCenters, double* outTypeIndices,
+        const TerrainSpans* spans = nullptr, const TerrainColoring* coloring = nullptr, MVector* outColors = nullptr) const;
+};
+
+/**
+ * @brief Greedy packing of terrain voxels into larger bricks
+ *
+ * Each layer is cut into square tiles that are merged independently on
+ * ThreadPool::global(). Within a tile, cells are visited in row-major order
+ * and each free voxel starts the largest catalogue brick that fits entirely
+ * on free, occupied voxels of the same layer. The result is deterministic
+ * and independent of the thread count.
+ */
+class BrickMerger
+{
+public:
+    // Tile side in voxels; a multiple of the common brick lengths
+    static const unsigned int TILE_SIZE = 48;
+
+    static MStatus merge(const TerrainSpans& spans, const BrickCatalogue& catalogue, BrickLayout& outLayout);
+};
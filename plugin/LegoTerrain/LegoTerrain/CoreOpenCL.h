@@ -0,0 +1,17 @@
+#pragma once
+
+/**
+ * @brief OpenCL for the compute shader, from Maya or from the system
+ *
+ * In the plugin the API comes through Maya's clew loader and the context is
+ * Maya's own. The standalone build links the system OpenCL library and
+ * creates its own context in StandaloneOpenCL; it only compiles this when
+ * LEGOTERRAIN_HAS_OPENCL is set.
+ */
+#if defined(LEGOTERRAIN_STANDALONE)
+#include "StandaloneOpenCL.h"
+#else
+#include <maya/MOpenCLInfo.h>
+#include <maya/MOpenCLAutoPtr.h>
+#include <clew/clew.h>
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+/**
+ * @brief The Maya value types the terrain core is written against
+ *
+ * The core (generation, merging, LOD, meshing, caching) only needs MStatus,
+ * MString, MStringArray, MVector, MVectorArray, MImage and MGlobal's message
+ * functions. The plugin takes them from the devkit. The standalone build
+ * defines LEGOTERRAIN_STANDALONE and gets the same interfaces from
+ * StandaloneTypes.h, so core files compile unchanged without Maya.
+ *
+ * Core files include this instead of the Maya headers; only the command, the
+ * node and pluginMain include Maya directly.
+ */
+#if defined(LEGOTERRAIN_STANDALONE)
+#include "StandaloneTypes.h"
+#else
+#include <maya/MGlobal.h>
+#include <maya/MImage.h>
+#include <maya/MStatus.h>
+#include <maya/MString.h>
+#include <maya/MStringArray.h>
+#include <maya/MVector.h>
+#include <maya/MVectorArray.h>
+#endif
+
+// The plugin always has Maya's OpenCL; the standalone build only when it found one
+#if !defined(LEGOTERRAIN_STANDALONE) && !defined(LEGOTERRAIN_HAS_OPENCL)
+#define LEGOTERRAIN_HAS_OPENCL 1
+#endif
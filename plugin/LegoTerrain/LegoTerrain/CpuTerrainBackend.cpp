@@ -0,0 +1,292 @@
+#include "CpuTerrainBackend.h"
+#include "ThreadPool.h"
+#include "SimdKernels.h"
+#include "Profiler.h"
+#include "ProceduralNoise.h"
+#include "CoreTypes.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace
+{
+    // Rows per task; small enough to balance, large enough to amortize scheduling
+    const size_t TILE_ROWS = 32;
+
+    // Source pixel pair and exact fractional offset for one terrain row or column
+    struct SamplePoint
+    {
+        uint32_t i0;
+        uint32_t i1;
+        uint64_t frac;
+    };
+
+    // Matches the integer math in the resampleHeights kernel
+    std::vector<SamplePoint> samplePoints(unsigned int start, unsigned int count, unsigned int imageSize, uint64_t denom)
+    {
+        std::vector<SamplePoint> points(count);
+        for (unsigned int i = 0; i < count; i++) {
+            uint64_t n = (uint64_t)(start + i) * (imageSize - 1);
+            points[i].i0 = (uint32_t)(n / denom);
+            points[i].i1 = std::min(points[i].i0 + 1, imageSize - 1);
+            points[i].frac = n % denom;
+        }
+        return points;
+    }
+
+    // Matches resampleHeightsFloat operation for operation; the kernel turns
+    // FP_CONTRACT off and the core builds with contraction off, so neither
+    // side fuses them into an fma
+    uint16_t quantizeFloatHeight(float g00, float g10, float g01, float g11,
+        float wx, float wy, float low, float scale, unsigned int maxHeight)
+    {
+        float h0 = (g10 - g00) * wx;
+        h0 = g00 + h0;
+        float h1 = (g11 - g01) * wx;
+        h1 = g01 + h1;
+        float h = (h1 - h0) * wy;
+        h = h0 + h;
+        h = h - low;
+        float scaled = h * scale;
+
+        // Negative and NaN samples give an empty column
+        if (!(scaled > 0.0f)) return 0;
+        if (scaled >= (float)maxHeight) return (uint16_t)maxHeight;
+        return (uint16_t)std::min<float>(std::floor(scaled + 0.5f), (float)maxHeight);
+    }
+
+    // Cuts the base layers off a column height
+    uint16_t trimBase(unsigned int heightVoxels, unsigned int base)
+    {
+        return (uint16_t)(heightVoxels > base ? heightVoxels - base : 0);
+    }
+}
+
+CpuTerrainBackend::CpuTerrainBackend()
+    : fInitialized(false)
+{
+}
+
+CpuTerrainBackend::~CpuTerrainBackend()
+{
+    cleanup();
+}
+
+MStatus CpuTerrainBackend::initialize()
+{
+    if (fInitialized) {
+        MGlobal::displayWarning("CpuTerrainBackend already initialized");
+        return MS::kSuccess;
+    }
+
+    fInitialized = true;
+
+    MGlobal::displayInfo(MString("CPU backend using ") + ThreadPool::global().concurrency() +
+        " threads, " + (Simd::hasAvx2() ? "AVX2" : "SSE2"));
+
+    return MS::kSuccess;
+}
+
+void CpuTerrainBackend::cleanup()
+{
+    fInitialized = false;
+}
+
+bool CpuTerrainBackend::isInitialized() const
+{
+    return fInitialized;
+}
+
+const char* CpuTerrainBackend::name() const
+{
+    return "CPU";
+}
+
+MStatus CpuTerrainBackend::generateTile(
+    const Heightfield& heightfield,
+    const TerrainTile& tile,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    unsigned int maxHeight,
+    const HeightRange& range,
+    std::vector<ColumnSpan>& outSpans)
+{
+    ThreadPool& pool = ThreadPool::global();
+    unsigned int width = heightfield.width;
+    unsigned int height = heightfield.height;
+
+    // Stage 1: resample the tile and its halo once into the height grid
+    TerrainTile region = haloRegion(tile, terrainWidth, terrainHeight);
+    unsigned int regionWidth = region.width;
+    std::vector<uint16_t> heights(region.columnCount());
+
+    uint64_t du = std::max(terrainWidth, 2u) - 1;
+    uint64_t dv = std::max(terrainHeight, 2u) - 1;
+    std::vector<SamplePoint> columns;
+    std::vector<SamplePoint> rows;
+    if (!heightfield.isProcedural()) {
+        columns = samplePoints(region.x, region.width, width, du);
+        rows = samplePoints(region.z, region.height, height, dv);
+    }
+
+    {
+        ProfileScope scope("resample");
+        if (heightfield.isProcedural()) {
+            // Evaluated per cell, so only this tile's region is ever generated
+            const NoiseSettings& noise = heightfield.noise;
+            float amplitudeScale = noise.amplitudeScale();
+
+            pool.parallelFor(0, region.height, TILE_ROWS, [&](size_t rowBegin, size_t rowEnd) {
+                for (size_t y = rowBegin; y < rowEnd; y++) {
+                    uint16_t* out = heights.data() + y * regionWidth;
+                    unsigned int z = region.z + (unsigned int)y;
+                    for (unsigned int x = 0; x < regionWidth; x++) {
+                        out[x] = trimBase(ProceduralNoise::quantizedHeight(noise, amplitudeScale, region.x + x, z, maxHeight), range.base);
+                    }
+                }
+            });
+        }
+        else if (heightfield.format == SampleFormat::Float32) {
+            const float* samples = heightfield.floatSamples();
+            float invDu = 1.0f / (float)du;
+            float invDv = 1.0f / (float)dv;
+            float scale = range.scale(maxHeight);
+
+            pool.parallelFor(0, region.height, TILE_ROWS, [&](size_t rowBegin, size_t rowEnd) {
+                for (size_t y = rowBegin; y < rowEnd; y++) {
+                    const SamplePoint& row = rows[y];
+                    const float* row0 = samples + (size_t)row.i0 * width;
+                    const float* row1 = samples + (size_t)row.i1 * width;
+                    float wy = (float)row.frac * invDv;
+                    uint16_t* out = heights.data() + y * regionWidth;
+
+                    for (unsigned int x = 0; x < regionWidth; x++) {
+                        const SamplePoint& col = columns[x];
+                        float wx = (float)col.frac * invDu;
+                        out[x] = trimBase(quantizeFloatHeight(row0[col.i0], row0[col.i1], row1[col.i0], row1[col.i1],
+                            wx, wy, range.lowHeight, scale, maxHeight), range.base);
+                    }
+                }
+            });
+        }
+        else {
+            const uint16_t* samples = heightfield.uint16Samples();
+            uint64_t offset = du * dv * range.lowValue;
+
+            // The divisor is the same for every cell, so its reciprocal is worked out once
+            Simd::RoundingDivisor divisor(du * dv * (range.high(heightfield.maxValue) - range.lowValue), maxHeight);
+
+            pool.parallelFor(0, region.height, TILE_ROWS, [&](size_t rowBegin, size_t rowEnd) {
+                // Each row is blended across x first, then the two blends down it are
+                // divided together; both fit 32 bits
+                std::vector<uint32_t> top(regionWidth);
+                std::vector<uint32_t> bottom(regionWidth);
+
+                for (size_t y = rowBegin; y < rowEnd; y++) {
+                    const SamplePoint& row = rows[y];
+                    const uint16_t* row0 = samples + (size_t)row.i0 * width;
+                    const uint16_t* row1 = samples + (size_t)row.i1 * width;
+                    uint16_t* out = heights.data() + y * regionWidth;
+
+                    for (unsigned int x = 0; x < regionWidth; x++) {
+                        const SamplePoint& col = columns[x];
+                        uint32_t w0 = (uint32_t)(du - col.frac);
+                        uint32_t w1 = (uint32_t)col.frac;
+                        top[x] = row0[col.i0] * w0 + row0[col.i1] * w1;
+                        bottom[x] = row1[col.i0] * w0 + row1[col.i1] * w1;
+                    }
+
+                    // Samples below the low value stay on the ground
+                    Simd::blendDivide(top.data(), bottom.data(), (uint32_t)(dv - row.frac), (uint32_t)row.frac,
+                        offset, divisor, out, regionWidth);
+
+                    if (range.base > 0) {
+                        for (unsigned int x = 0; x < regionWidth; x++) {
+                            out[x] = trimBase(out[x], range.base);
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+    // Stage 2: fill every tile column down to its lowest neighbour and write its span.
+    // The halo rows and columns only serve as neighbours.
+    ProfileScope fillScope("fillColumns");
+    outSpans.resize(tile.columnCount());
+    ColumnSpan* spans = outSpans.data();
+    unsigned int offsetX = tile.x - region.x;
+    unsigned int offsetZ = tile.z - region.z;
+
+    pool.parallelFor(0, tile.height, TILE_ROWS, [&](size_t rowBegin, size_t rowEnd) {
+        std::vector<uint16_t> columnMin(regionWidth);
+        std::vector<uint16_t> base(regionWidth);
+
+        for (size_t row = rowBegin; row < rowEnd; row++) {
+            size_t y = row + offsetZ;
+            const uint16_t* cur = heights.data() + y * regionWidth;
+            const uint16_t* up = y > 0 ? cur - regionWidth : cur;
+            const uint16_t* down = y + 1 < region.height ? cur + regionWidth : cur;
+
+            // Vertical then horizontal min gives the 3x3 neighbourhood min
+            Simd::min3(up, cur, down, columnMin.data(), regionWidth);
+
+            if (regionWidth == 1) {
+                base[0] = columnMin[0];
+            }
+            else {
+                base[0] = std::min(columnMin[0], columnMin[1]);
+                base[regionWidth - 1] = std::min(columnMin[regionWidth - 2], columnMin[regionWidth - 1]);
+                if (regionWidth > 2) {
+                    Simd::min3(columnMin.data(), columnMin.data() + 1, columnMin.data() + 2, base.data() + 1, regionWidth - 2);
+                }
+            }
+
+            ColumnSpan* out = spans + row * tile.width;
+            uint16_t z = (uint16_t)(tile.z + row);
+            for (unsigned int x = 0; x < tile.width; x++) {
+                out[x] = { (uint16_t)(tile.x + x), z, base[offsetX + x], cur[offsetX + x] };
+            }
+        }
+    });
+
+    return MS::kSuccess;
+}
+
+unsigned int CpuTerrainBackend::pipelineDepth() const
+{
+    return PIPELINE_DEPTH;
+}
+
+MStatus CpuTerrainBackend::beginTile(
+    unsigned int slot,
+    const Heightfield& heightfield,
+    const TerrainTile& tile,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    unsigned int maxHeight,
+    const HeightRange& range)
+{
+    // The heightfield outlives the pipeline, which ends every tile it begins
+    fSlotResults[slot] = std::async(std::launch::async, [=, &heightfield]() {
+        return generateTile(heightfield, tile, terrainWidth, terrainHeight, maxHeight, range, fSlotSpans[slot]);
+    });
+    return MS::kSuccess;
+}
+
+MStatus CpuTerrainBackend::endTile(unsigned int slot, const ColumnSpan*& outSpans)
+{
+    MStatus status = fSlotResults[slot].get();
+    outSpans = fSlotSpans[slot].data();
+    return status;
+}
+
+void CpuTerrainBackend::abortTiles()
+{
+    for (std::future<MStatus>& result : fSlotResults) {
+        if (result.valid()) {
+            result.wait();
+            result = std::future<MStatus>();
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "TerrainComputeBackend.h"
+#include <future>
+#include <vector>
+
+/**
+ * @brief Multithreaded CPU heightmap to voxel converter
+ *
+ * Runs the same resample / min-neighbour / span pipeline as the OpenCL
+ * backend for machines without a usable GPU. The terrain is split into row
+ * tiles that are spread over ThreadPool::global(), and the min-neighbour
+ * inner loop uses AVX2 when the CPU supports it, SSE2 otherwise. All
+ * arithmetic mirrors the kernels exactly, so the output is identical to
+ * HeightmapComputeShader.
+ *
+ * When tiling, each tile is generated on a background task so the caller's
+ * handling of the previous tile overlaps it.
+ */
+class CpuTerrainBackend : public TerrainComputeBackend
+{
+public:
+    CpuTerrainBackend();
+    ~CpuTerrainBackend() override;
+
+    MStatus initialize() override;
+    void cleanup() override;
+    bool isInitialized() const override;
+    const char* name() const override;
+
+protected:
+    MStatus generateTile(
+        const Heightfield& heightfield,
+        const TerrainTile& tile,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        unsigned int maxHeight,
+        const HeightRange& range,
+        std::vector<ColumnSpan>& outSpans
+    ) override;
+
+    unsigned int pipelineDepth() const override;
+    MStatus beginTile(
+        unsigned int slot,
+        const Heightfield& heightfield,
+        const TerrainTile& tile,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        unsigned int maxHeight,
+        const HeightRange& range
+    ) override;
+    MStatus endTile(unsigned int slot, const ColumnSpan*& outSpans) override;
+    void abortTiles() override;
+
+private:
+    // The next tile is generated on the pool while the caller handles the last
+    static const unsigned int PIPELINE_DEPTH = 2;
+
+    bool fInitialized;
+    std::vector<ColumnSpan> fSlotSpans[PIPELINE_DEPTH];
+    std::future<MStatus> fSlotResults[PIPELINE_DEPTH];
+};
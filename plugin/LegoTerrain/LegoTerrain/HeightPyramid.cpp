@@ -0,0 +1,91 @@
+#include "HeightPyramid.h"
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace
+{
+    // Rows per task when reducing a level
+    const size_t REDUCE_ROWS = 32;
+
+    // Columns per task when copying the spans into level 0
+    const size_t COPY_CHUNK = 1 << 14;
+}
+
+unsigned int HeightPyramid::rootLevel(unsigned int terrainWidth, unsigned int terrainHeight)
+{
+    unsigned int level = 0;
+    while ((std::max(terrainWidth, terrainHeight) - 1) >> level > 0) {
+        level++;
+    }
+    return level;
+}
+
+void HeightPyramid::build(const TerrainSpans& spans, unsigned int topLevel)
+{
+    fLevels.clear();
+    if (spans.spans.empty()) {
+        return;
+    }
+
+    ThreadPool& pool = ThreadPool::global();
+    fLevels.resize(topLevel + 1);
+
+    Level& base = fLevels[0];
+    base.width = spans.terrainWidth;
+    base.height = spans.terrainHeight;
+    base.low.resize(spans.spans.size());
+    base.high.resize(spans.spans.size());
+
+    pool.parallelFor(0, spans.spans.size(), COPY_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            base.low[i] = spans.spans[i].yMin;
+            base.high[i] = spans.spans[i].yMax;
+        }
+    });
+
+    for (unsigned int level = 1; level <= topLevel; level++) {
+        const Level& fine = fLevels[level - 1];
+        Level& coarse = fLevels[level];
+        coarse.width = (fine.width + 1) / 2;
+        coarse.height = (fine.height + 1) / 2;
+        coarse.low.resize((size_t)coarse.width * coarse.height);
+        coarse.high.resize((size_t)coarse.width * coarse.height);
+
+        pool.parallelFor(0, coarse.height, REDUCE_ROWS, [&](size_t rowBegin, size_t rowEnd) {
+            for (size_t z = rowBegin; z < rowEnd; z++) {
+                size_t z0 = z * 2;
+                size_t z1 = std::min<size_t>(z0 + 1, fine.height - 1);
+
+                for (unsigned int x = 0; x < coarse.width; x++) {
+                    size_t x0 = (size_t)x * 2;
+                    size_t x1 = std::min<size_t>(x0 + 1, fine.width - 1);
+                    size_t cells[4] = { z0 * fine.width + x0, z0 * fine.width + x1, z1 * fine.width + x0, z1 * fine.width + x1 };
+
+                    uint16_t low = fine.low[cells[0]];
+                    uint16_t high = fine.high[cells[0]];
+                    for (size_t cell : cells) {
+                        low = std::min(low, fine.low[cell]);
+                        high = std::max(high, fine.high[cell]);
+                    }
+
+                    coarse.low[z * coarse.width + x] = low;
+                    coarse.high[z * coarse.width + x] = high;
+                }
+            }
+        });
+    }
+}
+
+void HeightPyramid::clear()
+{
+    fLevels.clear();
+}
+
+size_t HeightPyramid::byteSize() const
+{
+    size_t bytes = 0;
+    for (const Level& level : fLevels) {
+        bytes += (level.low.size() + level.high.size()) * sizeof(uint16_t);
+    }
+    return bytes;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "TerrainSpans.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Min/max mip pyramid over the column spans of a terrain
+ *
+ * Level 0 holds every column's yMin and yMax; each level above halves both
+ * sides and keeps the lowest base and highest top of the four cells below
+ * it. Cell (x, z) of level L covers columns x << L to ((x + 1) << L) - 1 and
+ * the same in z, cut to the terrain on its far edges, so every voxel of
+ * those columns lies within the cell's low and high.
+ */
+class HeightPyramid
+{
+public:
+    struct Level
+    {
+        unsigned int width = 0;
+        unsigned int height = 0;
+        std::vector<uint16_t> low;
+        std::vector<uint16_t> high;
+    };
+
+    // Level whose single cell covers a terrain of this size
+    static unsigned int rootLevel(unsigned int terrainWidth, unsigned int terrainHeight);
+
+    // Build levels 0 to topLevel, in parallel over ThreadPool::global()
+    void build(const TerrainSpans& spans, unsigned int topLevel);
+    void clear();
+    bool isEmpty() const { return fLevels.empty(); }
+
+    unsigned int topLevel() const { return (unsigned int)fLevels.size() - 1; }
+    const Level& level(unsigned int index) const { return fLevels[index]; }
+
+    // Bytes held by all levels
+    size_t byteSize() const;
+
+private:
+    std::vector<Level> fLevels;
+};
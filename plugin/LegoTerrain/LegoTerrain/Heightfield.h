@@ -0,0 +1,107 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "ProceduralNoise.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Storage of one heightfield sample
+ */
+enum class SampleFormat
+{
+    UInt16,     // A sample of maxValue maps to the terrain's max height
+    Float32,    // A sample of 1.0 maps to the terrain's max height
+    Procedural  // No samples: heights are noise evaluated at each terrain cell
+};
+
+/**
+ * @brief Which samples map to the ground and to the terrain's max height
+ *
+ * By default a 0 sample is the ground and a full one is maxHeight. A
+ * normalized range stretches the samples between the low and high values
+ * over the whole height instead. base layers are then cut from the bottom
+ * of every column, lowering the terrain onto the ground.
+ */
+struct HeightRange
+{
+    uint32_t lowValue = 0;          // UInt16 sample at the ground
+    uint32_t highValue = 0;         // UInt16 sample at maxHeight, 0 for the heightfield's maxValue
+    float lowHeight = 0.0f;         // Float32 sample at the ground
+    float highHeight = 1.0f;        // Float32 sample at maxHeight
+    unsigned int base = 0;          // Layers cut from the bottom of every column
+
+    uint32_t high(uint32_t maxValue) const { return highValue > 0 ? highValue : maxValue; }
+
+    // Float32 heights above lowHeight are multiplied by this, on every backend
+    float scale(unsigned int maxHeight) const { return (float)maxHeight / (highHeight - lowHeight); }
+};
+
+/**
+ * @brief Decoded single-channel heightmap shared by all backends
+ *
+ * 8-bit RGBA images are stored as the r + g + b sum of each pixel, which
+ * keeps the full precision of the grayscale average at half the size of the
+ * pixels. 16-bit images keep their samples as they are. Raw .r16 and .r32
+ * files are not decoded at all: the samples are read in place from a
+ * mapping of the file.
+ *
+ * A procedural heightfield has no image at all. Its width and height are 0
+ * and the backends evaluate the noise in the resample stage instead, so
+ * nothing is read, decoded or uploaded.
+ */
+struct Heightfield
+{
+    // Bins of the sample histogram
+    static constexpr unsigned int HISTOGRAM_BINS = 1024;
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+    SampleFormat format = SampleFormat::UInt16;
+    uint32_t maxValue = 765;
+    uint32_t minValue = 0;          // Smallest UInt16 sample in the image
+    uint32_t peakValue = 0;         // Largest UInt16 sample in the image
+    float floorHeight = 0.0f;       // Smallest Float32 sample in the image, NaN aside
+    float peakHeight = 0.0f;        // Largest Float32 sample in the image
+
+    // Sample counts, measured with the min and peak. UInt16 sample v is in
+    // bin v >> histogramShift; Float32 samples are binned over [0, 1] with
+    // the ones outside it in the end bins.
+    std::vector<uint64_t> histogram;
+    unsigned int histogramShift = 0;
+
+    std::vector<uint16_t> samples;
+    std::shared_ptr<MappedFile> mapping;
+    NoiseSettings noise;            // Used by Procedural heightfields
+
+    static Heightfield procedural(const NoiseSettings& settings)
+    {
+        Heightfield heightfield;
+        heightfield.format = SampleFormat::Procedural;
+        heightfield.noise = settings;
+        return heightfield;
+    }
+
+    bool isProcedural() const { return format == SampleFormat::Procedural; }
+
+    size_t sampleSize() const
+    {
+        if (format == SampleFormat::Procedural) return 0;
+        return format == SampleFormat::Float32 ? sizeof(float) : sizeof(uint16_t);
+    }
+    size_t byteSize() const { return (size_t)width * height * sampleSize(); }
+
+    const void* data() const { return mapping ? mapping->data() : samples.data(); }
+    const uint16_t* uint16Samples() const { return static_cast<const uint16_t*>(data()); }
+    const float* floatSamples() const { return static_cast<const float*>(data()); }
+
+    // Same threshold as the old grayscale average: (r + g + b) / 3 == 0
+    bool isBlack() const
+    {
+        if (format == SampleFormat::Procedural) return false;
+        if (format == SampleFormat::Float32) return !(peakHeight * 255.0f >= 1.0f);
+        return peakValue * 255 / maxValue == 0;
+    }
+};
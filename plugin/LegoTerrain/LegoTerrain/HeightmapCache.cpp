@@ -0,0 +1,428 @@
+#include "HeightmapCache.h"
+#include "SimdKernels.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
+#include "CoreTypes.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+
+namespace
+{
+    // Pixels per task for the grayscale conversion
+    const size_t GRAY_CHUNK = 1 << 16;
+
+    // Pixels per task for the height statistics; each task keeps its own histogram
+    const size_t STATS_CHUNK = 1 << 20;
+
+    // PNG IHDR fields, at fixed offsets after the signature
+    const size_t PNG_HEADER_SIZE = 26;
+    const size_t PNG_BIT_DEPTH_OFFSET = 24;
+    const size_t PNG_COLOR_TYPE_OFFSET = 25;
+
+    // MImage is not documented as thread-safe, so file reads are serialized;
+    // the pixel conversion after each read still runs in parallel
+    std::mutex imageReadMutex;
+
+    // Set while acquireDeferred() runs on this thread
+    thread_local MString* errorSink = nullptr;
+
+    void reportError(const MString& message)
+    {
+        if (!errorSink) {
+            MGlobal::displayError(message);
+        }
+        else if (errorSink->length() == 0) {
+            *errorSink = message;
+        }
+    }
+
+    MString extensionOf(const MString& path)
+    {
+        int dot = path.rindexW('.');
+        if (dot < 0) return MString();
+        return path.substringW(dot, path.length() - 1).toLowerCase();
+    }
+}
+
+HeightmapCache::HeightmapCache(size_t budgetBytes)
+    : fBudget(budgetBytes)
+    , fUsage(0)
+{
+}
+
+bool HeightmapCache::isSupportedPath(const MString& path)
+{
+    MString extension = extensionOf(path);
+    return extension == ".png" || extension == ".r16" || extension == ".r32";
+}
+
+MStatus HeightmapCache::acquire(const MString& path, std::shared_ptr<const Heightfield>& outHeightfield,
+    unsigned int rawWidth)
+{
+    std::error_code error;
+    std::filesystem::path filePath(path.asChar());
+
+    uint64_t fileSize = std::filesystem::file_size(filePath, error);
+    if (error) {
+        reportError("Height map file does not exist: " + path);
+        return MS::kFailure;
+    }
+
+    int64_t modifiedTime = std::filesystem::last_write_time(filePath, error).time_since_epoch().count();
+    if (error) {
+        reportError("Failed to read modification time of height map: " + path);
+        return MS::kFailure;
+    }
+
+    // The layout of a raw file is part of its identity
+    std::string key = path.asChar();
+    if (rawWidth > 0) {
+        key += "|" + std::to_string(rawWidth);
+    }
+    {
+        std::lock_guard<std::mutex> lock(fMutex);
+
+        auto found = fIndex.find(key);
+        if (found != fIndex.end()) {
+            auto entry = found->second;
+            if (entry->modifiedTime == modifiedTime && entry->fileSize == fileSize) {
+                fEntries.splice(fEntries.begin(), fEntries, entry);
+                outHeightfield = entry->heightfield;
+                return MS::kSuccess;
+            }
+
+            // Stale, the file changed on disk
+            erase(entry);
+        }
+    }
+
+    // Decode outside the lock so other files can be looked up meanwhile
+    std::shared_ptr<Heightfield> heightfield = std::make_shared<Heightfield>();
+    MStatus status = decode(path, rawWidth, *heightfield);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    outHeightfield = heightfield;
+
+    std::lock_guard<std::mutex> lock(fMutex);
+    size_t bytes = heightfield->byteSize();
+    if (bytes > fBudget || fIndex.count(key) != 0) {
+        return MS::kSuccess;
+    }
+
+    evictToFit(bytes);
+    fEntries.push_front({ key, modifiedTime, fileSize, heightfield });
+    fIndex[key] = fEntries.begin();
+    fUsage += bytes;
+
+    return MS::kSuccess;
+}
+
+MStatus HeightmapCache::acquireDeferred(const MString& path, std::shared_ptr<const Heightfield>& outHeightfield,
+    unsigned int rawWidth, MString& outError)
+{
+    outError.clear();
+
+    MString* previousSink = errorSink;
+    errorSink = &outError;
+    MStatus status = acquire(path, outHeightfield, rawWidth);
+    errorSink = previousSink;
+
+    return status;
+}
+
+void HeightmapCache::setBudget(size_t budgetBytes)
+{
+    std::lock_guard<std::mutex> lock(fMutex);
+    fBudget = budgetBytes;
+    evictToFit(0);
+}
+
+size_t HeightmapCache::budget() const
+{
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fBudget;
+}
+
+size_t HeightmapCache::usage() const
+{
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fUsage;
+}
+
+void HeightmapCache::clear()
+{
+    std::lock_guard<std::mutex> lock(fMutex);
+    fEntries.clear();
+    fIndex.clear();
+    fUsage = 0;
+}
+
+void HeightmapCache::evictToFit(size_t incomingBytes)
+{
+    while (!fEntries.empty() && fUsage + incomingBytes > fBudget) {
+        erase(std::prev(fEntries.end()));
+    }
+}
+
+void HeightmapCache::erase(std::list<Entry>::iterator entry)
+{
+    fUsage -= entry->heightfield->byteSize();
+    fIndex.erase(entry->path);
+    fEntries.erase(entry);
+}
+
+MStatus HeightmapCache::decode(const MString& path, unsigned int rawWidth, Heightfield& outHeightfield)
+{
+    ProfileScope scope("decode");
+    MString extension = extensionOf(path);
+    if (extension == ".r16") {
+        return decodeRaw(path, SampleFormat::UInt16, rawWidth, outHeightfield);
+    }
+    if (extension == ".r32") {
+        return decodeRaw(path, SampleFormat::Float32, rawWidth, outHeightfield);
+    }
+    return decodePng(path, outHeightfield);
+}
+
+MStatus HeightmapCache::decodePng(const MString& path, Heightfield& outHeightfield)
+{
+    // Reject non-PNG files before handing them to the decoder
+    unsigned char pngSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    unsigned char fileHeader[PNG_HEADER_SIZE] = {};
+
+    std::ifstream file(path.asChar(), std::ios::binary);
+    file.read(reinterpret_cast<char*>(fileHeader), PNG_HEADER_SIZE);
+    if (file.gcount() < (std::streamsize)PNG_HEADER_SIZE || memcmp(fileHeader, pngSignature, 8) != 0) {
+        reportError("Height map file is not in PNG format: " + path);
+        return MS::kFailure;
+    }
+    file.close();
+
+    // Color types 0 and 4 are grayscale without and with alpha
+    unsigned char colorType = fileHeader[PNG_COLOR_TYPE_OFFSET];
+    if (fileHeader[PNG_BIT_DEPTH_OFFSET] == 16) {
+        return decodePng16(path, colorType == 0 || colorType == 4, outHeightfield);
+    }
+
+    MImage image;
+    MStatus status;
+    {
+        std::lock_guard<std::mutex> lock(imageReadMutex);
+        ProfileScope scope("readImage");
+        status = image.readFromFile(path);
+    }
+    if (status != MS::kSuccess) {
+        reportError("Failed to load image: " + path);
+        return status;
+    }
+
+    unsigned int width, height;
+    image.getSize(width, height);
+
+    if (width == 0 || height == 0) {
+        reportError("Invalid image dimensions");
+        return MS::kFailure;
+    }
+
+    const unsigned char* pixels = image.pixels();
+    if (!pixels) {
+        reportError("Failed to get image pixel data");
+        return MS::kFailure;
+    }
+
+    size_t pixelCount = (size_t)width * height;
+    outHeightfield.width = width;
+    outHeightfield.height = height;
+    outHeightfield.format = SampleFormat::UInt16;
+    outHeightfield.maxValue = 765;
+    outHeightfield.samples.resize(pixelCount);
+
+    // Convert to r + g + b sums once
+    uint16_t* samples = outHeightfield.samples.data();
+    {
+        ProfileScope scope("convertPixels");
+        ThreadPool::global().parallelFor(0, pixelCount, GRAY_CHUNK, [&](size_t begin, size_t end) {
+            Simd::graySumFromRgba(pixels + begin * 4, samples + begin, end - begin);
+        });
+    }
+
+    measureHeights(outHeightfield);
+
+    return MS::kSuccess;
+}
+
+MStatus HeightmapCache::decodePng16(const MString& path, bool grayscale, Heightfield& outHeightfield)
+{
+    // Asking for float pixels keeps all 16 bits of each channel
+    MImage image;
+    MStatus status;
+    {
+        std::lock_guard<std::mutex> lock(imageReadMutex);
+        ProfileScope scope("readImage");
+        status = image.readFromFile(path, MImage::kFloat);
+    }
+    if (status != MS::kSuccess) {
+        reportError("Failed to load image: " + path);
+        return status;
+    }
+
+    unsigned int width, height;
+    image.getSize(width, height);
+
+    if (width == 0 || height == 0) {
+        reportError("Invalid image dimensions");
+        return MS::kFailure;
+    }
+
+    const float* pixels = image.floatPixels();
+    if (!pixels) {
+        reportError("Failed to get image pixel data");
+        return MS::kFailure;
+    }
+
+    size_t pixelCount = (size_t)width * height;
+    outHeightfield.width = width;
+    outHeightfield.height = height;
+    outHeightfield.format = SampleFormat::UInt16;
+    outHeightfield.maxValue = 65535;
+    outHeightfield.samples.resize(pixelCount);
+
+    // Back to 16-bit samples, averaging the channels of color images
+    uint16_t* samples = outHeightfield.samples.data();
+    {
+        ProfileScope scope("convertPixels");
+        ThreadPool::global().parallelFor(0, pixelCount, GRAY_CHUNK, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const float* pixel = pixels + i * 4;
+                float value = grayscale ? pixel[0] : (pixel[0] + pixel[1] + pixel[2]) / 3.0f;
+                value = std::min(std::max(value, 0.0f), 1.0f);
+                samples[i] = (uint16_t)(value * 65535.0f + 0.5f);
+            }
+        });
+    }
+
+    measureHeights(outHeightfield);
+
+    return MS::kSuccess;
+}
+
+MStatus HeightmapCache::decodeRaw(const MString& path, SampleFormat format, unsigned int rawWidth, Heightfield& outHeightfield)
+{
+    std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+    MStatus status;
+    {
+        ProfileScope scope("mapFile");
+        status = mapping->open(path);
+    }
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    outHeightfield.format = format;
+    size_t sampleSize = outHeightfield.sampleSize();
+    size_t sampleCount = mapping->size() / sampleSize;
+
+    if (sampleCount == 0 || mapping->size() % sampleSize != 0) {
+        reportError(MString("Raw height map size is not a multiple of ") + (int)sampleSize + " bytes: " + path);
+        return MS::kFailure;
+    }
+
+    // Raw files carry no header, so the layout is either given or square
+    unsigned int width = rawWidth;
+    if (width == 0) {
+        width = (unsigned int)std::llround(std::sqrt((double)sampleCount));
+        if ((size_t)width * width != sampleCount) {
+            reportError("Raw height map is not square, its width must be given: " + path);
+            return MS::kFailure;
+        }
+    }
+    else if (sampleCount % width != 0) {
+        reportError(MString("Raw height map size does not match width ") + width + ": " + path);
+        return MS::kFailure;
+    }
+
+    outHeightfield.width = width;
+    outHeightfield.height = (unsigned int)(sampleCount / width);
+    outHeightfield.maxValue = 65535;
+    outHeightfield.mapping = mapping;
+
+    measureHeights(outHeightfield);
+
+    return MS::kSuccess;
+}
+
+void HeightmapCache::measureHeights(Heightfield& heightfield)
+{
+    ProfileScope scope("measureHeights");
+    ThreadPool& pool = ThreadPool::global();
+    size_t pixelCount = (size_t)heightfield.width * heightfield.height;
+    size_t numChunks = (pixelCount + STATS_CHUNK - 1) / STATS_CHUNK;
+    const size_t bins = Heightfield::HISTOGRAM_BINS;
+
+    // One pass over the samples: each chunk finds its own min, peak and
+    // histogram, and the chunks are merged afterwards
+    std::vector<uint64_t> chunkHistograms(numChunks * bins, 0);
+
+    if (heightfield.format == SampleFormat::Float32) {
+        const float* samples = heightfield.floatSamples();
+        std::vector<float> chunkFloors(numChunks, INFINITY);
+        std::vector<float> chunkPeaks(numChunks, 0.0f);
+
+        pool.parallelFor(0, pixelCount, STATS_CHUNK, [&](size_t begin, size_t end) {
+            size_t chunk = begin / STATS_CHUNK;
+            uint64_t* histogram = chunkHistograms.data() + chunk * bins;
+
+            // NaN fails every compare, so it is skipped
+            float low = INFINITY;
+            float peak = 0.0f;
+            for (size_t i = begin; i < end; i++) {
+                float sample = samples[i];
+                if (!(sample == sample)) continue;
+                if (sample < low) low = sample;
+                if (sample > peak) peak = sample;
+                float scaled = sample * (float)bins;
+                size_t bin = scaled > 0.0f ? (size_t)std::min<float>(scaled, (float)(bins - 1)) : 0;
+                histogram[bin]++;
+            }
+            chunkFloors[chunk] = low;
+            chunkPeaks[chunk] = peak;
+        });
+
+        float low = *std::min_element(chunkFloors.begin(), chunkFloors.end());
+        heightfield.floorHeight = std::isinf(low) ? 0.0f : low;
+        heightfield.peakHeight = *std::max_element(chunkPeaks.begin(), chunkPeaks.end());
+        heightfield.histogramShift = 0;
+    }
+    else {
+        const uint16_t* samples = heightfield.uint16Samples();
+        std::vector<uint16_t> chunkMins(numChunks, 0);
+        std::vector<uint16_t> chunkPeaks(numChunks, 0);
+
+        unsigned int shift = 0;
+        while ((heightfield.maxValue >> shift) >= bins) shift++;
+
+        pool.parallelFor(0, pixelCount, STATS_CHUNK, [&](size_t begin, size_t end) {
+            size_t chunk = begin / STATS_CHUNK;
+            uint64_t* histogram = chunkHistograms.data() + chunk * bins;
+
+            Simd::minMax(samples + begin, end - begin, chunkMins[chunk], chunkPeaks[chunk]);
+            for (size_t i = begin; i < end; i++) {
+                histogram[samples[i] >> shift]++;
+            }
+        });
+
+        heightfield.minValue = *std::min_element(chunkMins.begin(), chunkMins.end());
+        heightfield.peakValue = *std::max_element(chunkPeaks.begin(), chunkPeaks.end());
+        heightfield.histogramShift = shift;
+    }
+
+    heightfield.histogram.assign(bins, 0);
+    for (size_t chunk = 0; chunk < numChunks; chunk++) {
+        const uint64_t* histogram = chunkHistograms.data() + chunk * bins;
+        for (size_t bin = 0; bin < bins; bin++) {
+            heightfield.histogram[bin] += histogram[bin];
+        }
+    }
+}
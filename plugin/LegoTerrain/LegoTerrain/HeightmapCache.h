@@ -0,0 +1,80 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "Heightfield.h"
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief LRU cache of decoded heightmaps with a memory budget
+ *
+ * Entries are keyed by path and validated against the file's modification
+ * time and size, so an edited heightmap is decoded again while re-running
+ * with different terrain parameters reuses the samples. Once the budget is
+ * exceeded the least recently used entries are dropped; callers still holding
+ * one keep it alive until they release it.
+ */
+class HeightmapCache
+{
+public:
+    static constexpr size_t DEFAULT_BUDGET = size_t(1024) * 1024 * 1024;
+
+    explicit HeightmapCache(size_t budgetBytes = DEFAULT_BUDGET);
+
+    /**
+     * @brief Decode the file, or return the cached samples if it has not changed
+     *
+     * PNGs (8 or 16 bits per channel) are decoded through MImage. Raw .r16
+     * (little-endian uint16) and .r32 (float) files are mapped instead; they
+     * are assumed square unless rawWidth is given.
+     */
+    MStatus acquire(const MString& path, std::shared_ptr<const Heightfield>& outHeightfield,
+        unsigned int rawWidth = 0);
+
+    /**
+     * @brief acquire() for worker threads
+     *
+     * Nothing is written to the Script Editor. The first error is returned in
+     * outError instead, for the caller to report from the main thread.
+     */
+    MStatus acquireDeferred(const MString& path, std::shared_ptr<const Heightfield>& outHeightfield,
+        unsigned int rawWidth, MString& outError);
+
+    // True for the extensions acquire() can read
+    static bool isSupportedPath(const MString& path);
+
+    void setBudget(size_t budgetBytes);
+    size_t budget() const;
+    size_t usage() const;
+    void clear();
+
+private:
+    struct Entry
+    {
+        std::string path;
+        int64_t modifiedTime;
+        uint64_t fileSize;
+        std::shared_ptr<const Heightfield> heightfield;
+    };
+
+    // Most recently used first
+    std::list<Entry> fEntries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> fIndex;
+    size_t fBudget;
+    size_t fUsage;
+    mutable std::mutex fMutex;
+
+    void evictToFit(size_t incomingBytes);
+    void erase(std::list<Entry>::iterator entry);
+
+    static MStatus decode(const MString& path, unsigned int rawWidth, Heightfield& outHeightfield);
+    static MStatus decodePng(const MString& path, Heightfield& outHeightfield);
+    static MStatus decodePng16(const MString& path, bool grayscale, Heightfield& outHeightfield);
+    static MStatus decodeRaw(const MString& path, SampleFormat format, unsigned int rawWidth, Heightfield& outHeightfield);
+    // Fills in the min, peak and histogram of the samples
+    static void measureHeights(Heightfield& heightfield);
+};
@@ -1,16 +1,20 @@
 #include "HeightmapComputeShader.h"
-#include <maya/MGlobal.h>
-#include <maya/MImage.h>
-#include <maya/MOpenCLInfo.h>
-#include <maya/MOpenCLAutoPtr.h>
-#include <maya/MVector.h>
+#include "CoreTypes.h"
+#include "CoreOpenCL.h"
+#include "Profiler.h"
 #include <vector>
 #include <algorithm>
 #include <cmath>
+#include <string>
+
+// Passed to the kernels as -DTILE_SIZE
+static const size_t TILE_SIZE = 16;
 
 HeightmapComputeShader::HeightmapComputeShader()
     : fContext(nullptr)
-    , fQueue(nullptr)
+    , fDevice(nullptr)
+    , fMaxAllocSize(SIZE_MAX)
+    , fProfiling(false)
     , fInitialized(false)
 {
 }
@@ -28,135 +32,492 @@ bool HeightmapComputeShader::isInitialized() const
 const char* HeightmapComputeShader::getKernelSource()
 {
     return R"(
-// Bilinear interpolation
-float sampleHeight(__global uchar4* input, int imgWidth, int imgHeight, float u, float v, int maxHeight)
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+
+// Float samples are interpolated with the same sequence of operations on the
+// CPU backend, so nothing may be fused
+#pragma OPENCL FP_CONTRACT OFF
+
+// Stage 1: resample the image once into a quantized height grid.
+// Sample positions are the rationals x * (width - 1) / (terrainWidth - 1), so the
+// bilinear interpolation is done exactly in integers and rounded once at the end.
+// Only a region of the terrain is resampled, from the part of the image it reads.
+__kernel void resampleHeights(
+    __global const ushort* input,
+    __global ushort* heights,
+    int width,              // Image width
+    int height,             // Image height
+    int inputX,             // Image pixel at input[0]
+    int inputY,
+    int inputPitch,         // Samples per input row
+    int terrainWidth,       // Voxel terrain width
+    int terrainHeight,      // Voxel terrain height
+    int regionX,            // Terrain cell at heights[0]
+    int regionY,
+    int regionWidth,
+    int regionHeight,
+    int maxHeight,
+    uint lowValue,          // Sample value that maps to the ground
+    uint valueRange,        // Sample values from lowValue to maxHeight
+    int base)               // Layers cut off the bottom of every column
 {
-    u = clamp(u, 0.0f, (float)(imgWidth - 1));
-    v = clamp(v, 0.0f, (float)(imgHeight - 1));
+    int rx = get_global_id(0);
+    int ry = get_global_id(1);
+
+    if (rx >= regionWidth || ry >= regionHeight) return;
 
-    int x0 = (int)floor(u);
-    int y0 = (int)floor(v);
-    int x1 = min(x0 + 1, imgWidth - 1);
-    int y1 = min(y0 + 1, imgHeight - 1);
-    
-    float fx = u - (float)x0;
-    float fy = v - (float)y0;
+    int x = regionX + rx;
+    int y = regionY + ry;
+
+    ulong du = (ulong)max(terrainWidth - 1, 1);
+    ulong dv = (ulong)max(terrainHeight - 1, 1);
+
+    ulong un = (ulong)x * (ulong)(width - 1);
+    ulong vn = (ulong)y * (ulong)(height - 1);
+    int x0 = (int)(un / du);
+    int y0 = (int)(vn / dv);
+    int x1 = min(x0 + 1, width - 1);
+    int y1 = min(y0 + 1, height - 1);
+    ulong fx = un % du;
+    ulong fy = vn % dv;
 
     // Corner sampling
-    uchar4 p00 = input[y0 * imgWidth + x0];
-    uchar4 p10 = input[y0 * imgWidth + x1];
-    uchar4 p01 = input[y1 * imgWidth + x0];
-    uchar4 p11 = input[y1 * imgWidth + x1];
-
-    // Get grayscale heights
-    float h00 = ((float)p00.x + (float)p00.y + (float)p00.z) / 3.0f;
-    float h10 = ((float)p10.x + (float)p10.y + (float)p10.z) / 3.0f;
-    float h01 = ((float)p01.x + (float)p01.y + (float)p01.z) / 3.0f;
-    float h11 = ((float)p11.x + (float)p11.y + (float)p11.z) / 3.0f;
-
-    // Bi linear interpolation
-    float h0 = mix(h00, h10, fx);
-    float h1 = mix(h01, h11, fx);
-    float heightGray = mix(h0, h1, fy);
-
-    // scale to the max height
-    return (heightGray / 255.0f) * (float)maxHeight;
+    __global const ushort* row0 = input + (size_t)(y0 - inputY) * inputPitch;
+    __global const ushort* row1 = input + (size_t)(y1 - inputY) * inputPitch;
+    x0 -= inputX;
+    x1 -= inputX;
+    ulong g00 = row0[x0];
+    ulong g10 = row0[x1];
+    ulong g01 = row1[x0];
+    ulong g11 = row1[x1];
+
+    // Bilinear interpolation scaled by du * dv
+    ulong h0 = g00 * (du - fx) + g10 * fx;
+    ulong h1 = g01 * (du - fx) + g11 * fx;
+    ulong num = h0 * (dv - fy) + h1 * fy;
+    ulong den = du * dv * valueRange;
+    ulong offset = du * dv * lowValue;
+    num = num > offset ? num - offset : 0;
+
+    // Round to nearest and scale to the max height. num * maxHeight can
+    // overflow for 16-bit samples, so the whole and fractional parts are
+    // scaled separately.
+    ulong scaled = (num % den) * (ulong)maxHeight;
+    ulong heightVoxels = (num / den) * (ulong)maxHeight + scaled / den;
+    if ((scaled % den) * 2 >= den) heightVoxels++;
+    heightVoxels = min(heightVoxels, (ulong)maxHeight);
+    heights[ry * regionWidth + rx] = (ushort)(heightVoxels > (ulong)base ? heightVoxels - (ulong)base : 0);
 }
 
-// Single-pass kernel: generate voxels with scaling/interpolation support
-__kernel void generateVoxels(
-    __global uchar4* input,
-    __global float3* voxelPositions,
+// Stage 1 for 32-bit float samples, where lowHeight maps to the ground and
+// scale takes the rest to voxels. The weights and scale are computed on the
+// host so both backends round identically.
+__kernel void resampleHeightsFloat(
+    __global const float* input,
+    __global ushort* heights,
     int width,              // Image width
     int height,             // Image height
+    int inputX,             // Image pixel at input[0]
+    int inputY,
+    int inputPitch,         // Samples per input row
     int terrainWidth,       // Voxel terrain width
     int terrainHeight,      // Voxel terrain height
-    float voxelSize,
-    int maxHeight)
+    int regionX,            // Terrain cell at heights[0]
+    int regionY,
+    int regionWidth,
+    int regionHeight,
+    int maxHeight,
+    float invDu,            // 1 / max(terrainWidth - 1, 1)
+    float invDv,            // 1 / max(terrainHeight - 1, 1)
+    float lowHeight,        // Sample value that maps to the ground
+    float scale,            // Voxels per sample unit above lowHeight
+    int base)               // Layers cut off the bottom of every column
+{
+    int rx = get_global_id(0);
+    int ry = get_global_id(1);
+
+    if (rx >= regionWidth || ry >= regionHeight) return;
+
+    int x = regionX + rx;
+    int y = regionY + ry;
+
+    ulong du = (ulong)max(terrainWidth - 1, 1);
+    ulong dv = (ulong)max(terrainHeight - 1, 1);
+
+    ulong un = (ulong)x * (ulong)(width - 1);
+    ulong vn = (ulong)y * (ulong)(height - 1);
+    int x0 = (int)(un / du);
+    int y0 = (int)(vn / dv);
+    int x1 = min(x0 + 1, width - 1);
+    int y1 = min(y0 + 1, height - 1);
+    float wx = (float)(un % du) * invDu;
+    float wy = (float)(vn % dv) * invDv;
+
+    __global const float* row0 = input + (size_t)(y0 - inputY) * inputPitch;
+    __global const float* row1 = input + (size_t)(y1 - inputY) * inputPitch;
+    x0 -= inputX;
+    x1 -= inputX;
+    float g00 = row0[x0];
+    float g10 = row0[x1];
+    float g01 = row1[x0];
+    float g11 = row1[x1];
+
+    float h0 = (g10 - g00) * wx;
+    h0 = g00 + h0;
+    float h1 = (g11 - g01) * wx;
+    h1 = g01 + h1;
+    float h = (h1 - h0) * wy;
+    h = h0 + h;
+    h = h - lowHeight;
+    float scaled = h * scale;
+
+    // Samples below lowHeight and NaN give an empty column
+    ushort heightVoxels = 0;
+    if (scaled >= (float)maxHeight) {
+        heightVoxels = (ushort)maxHeight;
+    }
+    else if (scaled > 0.0f) {
+        heightVoxels = (ushort)min(floor(scaled + 0.5f), (float)maxHeight);
+    }
+    heights[ry * regionWidth + rx] = (ushort)(heightVoxels > base ? heightVoxels - base : 0);
+}
+
+// Stage 1 for procedural heightfields: fractal simplex noise evaluated at each
+// cell, with nothing uploaded. Everything from here to resampleProcedural
+// mirrors ProceduralNoise.cpp operation for operation.
+__constant float GRAD_X[8] = { 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 0.0f, 0.0f };
+__constant float GRAD_Y[8] = { 1.0f, 1.0f, -1.0f, -1.0f, 0.0f, 0.0f, 1.0f, -1.0f };
+
+uint hashCorner(int i, int j, uint seed)
+{
+    uint h = seed ^ ((uint)i * 0x85EBCA6Bu);
+    h = (h << 13) | (h >> 19);
+    h ^= (uint)j * 0xC2B2AE35u;
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// The host flushes denormals too, whether or not this device does
+float flushTiny(float value)
+{
+    return fabs(value) < FLT_MIN ? 0.0f : value;
+}
+
+float simplexCorner(uint h, float x, float y)
+{
+    float t = 0.5f - x * x;
+    t = t - y * y;
+    if (!(t > 0.0f)) return 0.0f;
+
+    float d = GRAD_X[h & 7] * x;
+    d = d + GRAD_Y[h & 7] * y;
+    t = t * t;
+    t = t * t;
+    return flushTiny(t * d);
+}
+
+float simplex(float x, float y, uint seed)
+{
+    float s = (x + y) * 0.36602540378f;
+    float fi = floor(x + s);
+    float fj = floor(y + s);
+    float t = (fi + fj) * 0.21132486540f;
+    float x0 = x - (fi - t);
+    float y0 = y - (fj - t);
+
+    float i1 = x0 > y0 ? 1.0f : 0.0f;
+    float j1 = 1.0f - i1;
+    float x1 = (x0 - i1) + 0.21132486540f;
+    float y1 = (y0 - j1) + 0.21132486540f;
+    float x2 = x0 + -0.57735026919f;
+    float y2 = y0 + -0.57735026919f;
+
+    int i = (int)fi;
+    int j = (int)fj;
+    float n = simplexCorner(hashCorner(i, j, seed), x0, y0);
+    n = n + simplexCorner(hashCorner(i + (int)i1, j + (int)j1, seed), x1, y1);
+    n = n + simplexCorner(hashCorner(i + 1, j + 1, seed), x2, y2);
+    return flushTiny(n * 70.0f);
+}
+
+__kernel void resampleProcedural(
+    __global ushort* heights,
+    int regionX,            // Terrain cell at heights[0]
+    int regionY,
+    int regionWidth,
+    int regionHeight,
+    int maxHeight,
+    uint seed,
+    int octaves,
+    float frequency,        // Cycles per voxel of the first octave
+    float lacunarity,
+    float gain,
+    int variant,            // 0 fbm, 1 ridged, 2 billow
+    float warp,             // Domain warp distance in voxels
+    float amplitudeScale,   // 1 / sum of the octave amplitudes, from the host
+    int base)               // Layers cut off the bottom of every column
+{
+    int rx = get_global_id(0);
+    int ry = get_global_id(1);
+
+    if (rx >= regionWidth || ry >= regionHeight) return;
+
+    float px = (float)(regionX + rx);
+    float pz = (float)(regionY + ry);
+
+    if (warp > 0.0f) {
+        float wx = px * frequency;
+        float wz = pz * frequency;
+        float offsetX = warp * simplex(wx, wz, seed ^ 0x68E31DA4u);
+        float offsetZ = warp * simplex(wx, wz, seed ^ 0xB5297A4Du);
+        px = px + offsetX;
+        pz = pz + offsetZ;
+    }
+
+    float fx = px * frequency;
+    float fz = pz * frequency;
+    float sum = 0.0f;
+    float amplitude = 1.0f;
+    for (int octave = 0; octave < octaves; octave++) {
+        float n = simplex(fx, fz, seed + (uint)octave * 0x9E3779B9u);
+        if (variant == 1) {
+            n = 1.0f - fabs(n);
+            n = n * n;
+        }
+        else if (variant == 2) {
+            n = fabs(n) * 2.0f;
+            n = n - 1.0f;
+        }
+
+        float term = n * amplitude;
+        sum = sum + term;
+        amplitude = amplitude * gain;
+        fx = fx * lacunarity;
+        fz = fz * lacunarity;
+    }
+
+    float h = sum * amplitudeScale;
+    if (variant != 1) {
+        h = h * 0.5f;
+        h = h + 0.5f;
+    }
+
+    float scaled = h * (float)maxHeight;
+    ushort heightVoxels = 0;
+    if (scaled >= (float)maxHeight) {
+        heightVoxels = (ushort)maxHeight;
+    }
+    else if (scaled > 0.0f) {
+        heightVoxels = (ushort)min(floor(scaled + 0.5f), (float)maxHeight);
+    }
+    heights[ry * regionWidth + rx] = (ushort)(heightVoxels > base ? heightVoxels - base : 0);
+}
+
+// Stage 2: fill every column of the tile down to its lowest neighbour and
+// write it as a span. The height grid covers the tile plus a one-cell halo
+// wherever the terrain continues. Each work-group loads its block of the grid
+// plus a one-cell border into local memory.
+__kernel __attribute__((reqd_work_group_size(TILE_SIZE, TILE_SIZE, 1)))
+void fillColumns(
+    __global const ushort* heights,
+    __global ushort4* spans,
+    int regionX,            // Terrain cell at heights[0]
+    int regionY,
+    int regionWidth,
+    int regionHeight,
+    int tileX,              // Terrain cell at spans[0]
+    int tileY,
+    int tileWidth,
+    int tileHeight)
 {
+    __local ushort tile[TILE_SIZE + 2][TILE_SIZE + 2];
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int originX = tileX - regionX + get_group_id(0) * TILE_SIZE - 1;
+    int originY = tileY - regionY + get_group_id(1) * TILE_SIZE - 1;
+
+    // Cells outside the terrain never win the min
+    for (int i = ly * TILE_SIZE + lx; i < (TILE_SIZE + 2) * (TILE_SIZE + 2); i += TILE_SIZE * TILE_SIZE) {
+        int tx = i % (TILE_SIZE + 2);
+        int ty = i / (TILE_SIZE + 2);
+        int sx = originX + tx;
+        int sy = originY + ty;
+        bool inside = sx >= 0 && sx < regionWidth && sy >= 0 && sy < regionHeight;
+        tile[ty][tx] = inside ? heights[sy * regionWidth + sx] : (ushort)0xFFFF;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
     int x = get_global_id(0);
     int y = get_global_id(1);
-    
-    // Now we iterate over terrain dimensions, not image dimensions
-    if (x >= terrainWidth || y >= terrainHeight) return;
-    
-    // Calculate UV coordinates in image space
-    float u = ((float)x / (float)(terrainWidth - 1)) * (float)(width - 1);
-    float v = ((float)y / (float)(terrainHeight - 1)) * (float)(height - 1);
-    
-    // Sample height using bilinear interpolation
-    float heightValue = sampleHeight(input, width, height, u, v, maxHeight);
-    int heightVoxels = (int)round(heightValue);
-    
-    // Clamp to valid range
-    heightVoxels = clamp(heightVoxels, 0, maxHeight);
-    
+
+    if (x >= tileWidth || y >= tileHeight) return;
+
     // Sample neighbor heights for filling
-    int minNeighborHeight = heightVoxels;
-    for (int dy = -1; dy <= 1; dy++) {
-        for (int dx = -1; dx <= 1; dx++) {
-            if (dx == 0 && dy == 0) continue;
-            
-            int nx = x + dx;
-            int ny = y + dy;
-            
-            if (nx < 0 || nx >= terrainWidth || ny < 0 || ny >= terrainHeight) continue;
-            
-            // Sample neighbor position in image space
-            float nu = ((float)nx / (float)(terrainWidth - 1)) * (float)(width - 1);
-            float nv = ((float)ny / (float)(terrainHeight - 1)) * (float)(height - 1);
-            
-            float neighborHeightValue = sampleHeight(input, width, height, nu, nv, maxHeight);
-            int neighborHeight = (int)round(neighborHeightValue);
-            neighborHeight = clamp(neighborHeight, 0, maxHeight);
-            
-            if (neighborHeight < minNeighborHeight) {
-                minNeighborHeight = neighborHeight;
-            }
+    ushort heightVoxels = tile[ly + 1][lx + 1];
+    ushort minNeighborHeight = heightVoxels;
+    for (int dy = 0; dy <= 2; dy++) {
+        for (int dx = 0; dx <= 2; dx++) {
+            minNeighborHeight = min(minNeighborHeight, tile[ly + dy][lx + dx]);
         }
     }
-    
-    // Calculate output index based on terrain dimensions
-    int idx = y * terrainWidth + x;
-    int outputBase = idx * maxHeight;
-    
-    float worldX = (float)x * voxelSize;
-    float worldZ = (float)y * voxelSize;
-    
-    // Generate voxels from minNeighborHeight to heightVoxels
-    int writeOffset = 0;
-    for (int h = minNeighborHeight; h <= heightVoxels && writeOffset < maxHeight; h++) {
-        float worldY = (float)h * voxelSize;
-        voxelPositions[outputBase + writeOffset] = (float3)(worldX, worldY, worldZ);
-        writeOffset++;
-    }
-    
-    // Mark remaining slots as invalid
-    for (int i = writeOffset; i < maxHeight; i++) {
-        voxelPositions[outputBase + i] = (float3)(NAN, NAN, NAN);
-    }
+
+    // The column is filled from minNeighborHeight up to heightVoxels inclusive
+    spans[y * tileWidth + x] = (ushort4)((ushort)(tileX + x), (ushort)(tileY + y), minNeighborHeight, heightVoxels);
 }
     )";
 }
 
-MStatus HeightmapComputeShader::createKernels()
+std::string HeightmapComputeShader::defaultBuildOptions()
+{
+    return "-DTILE_SIZE=" + std::to_string(TILE_SIZE);
+}
+
+MStatus HeightmapComputeShader::getKernels(const std::string& buildOptions, KernelSet*& outKernels)
 {
+    // Compiled programs live until cleanup(), one per distinct option set
+    auto cached = fKernelSets.find(buildOptions);
+    if (cached != fKernelSets.end()) {
+        outKernels = &cached->second;
+        return MS::kSuccess;
+    }
+
     const char* kernelSource = getKernelSource();
+    cl_int err;
+
+    KernelSet kernels;
+    kernels.program = clCreateProgramWithSource(fContext, 1, &kernelSource, NULL, &err);
+    if (err != CL_SUCCESS) {
+        MGlobal::displayError("Failed to create HeightmapVoxelProgram");
+        MOpenCLInfo::checkCLErrorStatus(err);
+        return MS::kFailure;
+    }
+
+    err = clBuildProgram(kernels.program, 1, &fDevice, buildOptions.c_str(), NULL, NULL);
+    if (err != CL_SUCCESS) {
+        size_t logSize = 0;
+        clGetProgramBuildInfo(kernels.program, fDevice, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+        std::string log(logSize, '\0');
+        clGetProgramBuildInfo(kernels.program, fDevice, CL_PROGRAM_BUILD_LOG, logSize, &log[0], NULL);
+
+        MGlobal::displayError(MString("Failed to build HeightmapVoxelProgram (") + buildOptions.c_str() + "):\n" + log.c_str());
+        releaseKernels(kernels);
+        return MS::kFailure;
+    }
+
+    struct KernelEntry {
+        cl_kernel* kernel;
+        const char* entry;
+    };
+    const KernelEntry entries[] = {
+        { &kernels.resample, "resampleHeights" },
+        { &kernels.resampleFloat, "resampleHeightsFloat" },
+        { &kernels.resampleProcedural, "resampleProcedural" },
+        { &kernels.fill, "fillColumns" },
+    };
+
+    for (const KernelEntry& entry : entries) {
+        *entry.kernel = clCreateKernel(kernels.program, entry.entry, &err);
+        if (err != CL_SUCCESS) {
+            MGlobal::displayError(MString("Failed to create ") + entry.entry + " kernel");
+            MOpenCLInfo::checkCLErrorStatus(err);
+            releaseKernels(kernels);
+            return MS::kFailure;
+        }
+    }
+
+    outKernels = &(fKernelSets[buildOptions] = kernels);
+    return MS::kSuccess;
+}
 
-    fGenerateKernel = MOpenCLInfo::getOpenCLKernelFromString(
-        kernelSource,
-        "HeightmapVoxelProgram",
-        "generateVoxels"
-    );
+void HeightmapComputeShader::releaseKernels(KernelSet& kernels)
+{
+    cl_kernel* handles[] = { &kernels.resample, &kernels.resampleFloat, &kernels.resampleProcedural, &kernels.fill };
+    for (cl_kernel* kernel : handles) {
+        if (*kernel) {
+            clReleaseKernel(*kernel);
+            *kernel = nullptr;
+        }
+    }
+
+    if (kernels.program) {
+        clReleaseProgram(kernels.program);
+        kernels.program = nullptr;
+    }
+}
 
-    if (fGenerateKernel.get() == nullptr) {
-        MGlobal::displayError("Failed to compile generateVoxels kernel");
+MStatus HeightmapComputeShader::ensureCapacity(DeviceBuffer& buffer, size_t bytes, cl_mem_flags flags, const char* label)
+{
+    // Buffers only ever grow, so repeat runs at or below the high-water mark allocate nothing
+    if (buffer.capacity >= bytes && buffer.mem.get()) {
+        return MS::kSuccess;
+    }
+
+    buffer.mem.reset();
+    buffer.capacity = 0;
+
+    cl_int err;
+    cl_mem mem = clCreateBuffer(fContext, flags, std::max<size_t>(bytes, 1), NULL, &err);
+    if (err != CL_SUCCESS) {
+        MGlobal::displayError(MString("Failed to create ") + label + " buffer");
+        MOpenCLInfo::checkCLErrorStatus(err);
         return MS::kFailure;
     }
 
+    buffer.mem.attach(mem);
+    buffer.capacity = bytes;
     return MS::kSuccess;
 }
 
+MStatus HeightmapComputeShader::ensurePinned(cl_command_queue queue, PinnedBuffer& buffer, size_t bytes)
+{
+    if (buffer.capacity >= bytes && buffer.host) {
+        return MS::kSuccess;
+    }
+
+    releasePinned(queue, buffer);
+
+    // ALLOC_HOST_PTR lets the driver hand out page-locked memory it can DMA into
+    cl_int err;
+    cl_mem mem = clCreateBuffer(fContext, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, std::max<size_t>(bytes, 1), NULL, &err);
+    if (err != CL_SUCCESS) {
+        MGlobal::displayError("Failed to create pinned span buffer");
+        MOpenCLInfo::checkCLErrorStatus(err);
+        return MS::kFailure;
+    }
+    buffer.mem.attach(mem);
+
+    buffer.host = clEnqueueMapBuffer(queue, mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
+        std::max<size_t>(bytes, 1), 0, NULL, NULL, &err);
+    if (err != CL_SUCCESS) {
+        MGlobal::displayError("Failed to map pinned span buffer");
+        MOpenCLInfo::checkCLErrorStatus(err);
+        buffer.mem.reset();
+        buffer.host = nullptr;
+        return MS::kFailure;
+    }
+
+    buffer.capacity = bytes;
+    return MS::kSuccess;
+}
+
+void HeightmapComputeShader::releasePinned(cl_command_queue queue, PinnedBuffer& buffer)
+{
+    if (buffer.host && queue) {
+        clEnqueueUnmapMemObject(queue, buffer.mem.get(), buffer.host, 0, NULL, NULL);
+        clFinish(queue);
+    }
+    buffer.mem.reset();
+    buffer.host = nullptr;
+    buffer.capacity = 0;
+}
+
 MStatus HeightmapComputeShader::initialize()
 {
     if (fInitialized) {
@@ -165,14 +526,26 @@ MStatus HeightmapComputeShader::initialize()
     }
 
     fContext = MOpenCLInfo::getOpenCLContext();
-    fQueue = MOpenCLInfo::getMayaDefaultOpenCLCommandQueue();
+    fDevice = MOpenCLInfo::getOpenCLDeviceId();
 
-    if (!fContext || !fQueue) {
-        MGlobal::displayError("Failed to get OpenCL context or queue");
+    if (!fContext || !fDevice) {
+        MGlobal::displayError("Failed to get OpenCL context or device");
         return MS::kFailure;
     }
 
-    MStatus status = createKernels();
+    MStatus status = createQueues();
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    // Tiles are sized so that no buffer exceeds this
+    cl_ulong maxAllocSize = 0;
+    if (clGetDeviceInfo(fDevice, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocSize), &maxAllocSize, NULL) == CL_SUCCESS
+        && maxAllocSize > 0) {
+        fMaxAllocSize = (size_t)std::min<cl_ulong>(maxAllocSize, SIZE_MAX);
+    }
+
+    // Compile the default program up front so a broken driver fails here
+    KernelSet* kernels = nullptr;
+    status = getKernels(defaultBuildOptions(), kernels);
     if (status != MS::kSuccess) {
         return status;
     }
@@ -181,184 +554,363 @@ MStatus HeightmapComputeShader::initialize()
     return MS::kSuccess;
 }
 
-MStatus HeightmapComputeShader::generateVoxelsFromHeightmap(
-    const MString& filepath,
-    std::vector<MVector>& outVoxelPositions,
-    unsigned int& terrainWidth,
-    unsigned int& terrainHeight,
-    float voxelSize,
-    unsigned int maxHeight)
+MStatus HeightmapComputeShader::createQueues()
+{
+    // One in-order queue per slot; Maya's own queue stays free for Maya
+    cl_command_queue_properties properties = fProfiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+    for (PipelineSlot& slot : fSlots) {
+        cl_int err;
+        slot.queue = clCreateCommandQueue(fContext, fDevice, properties, &err);
+        if (err != CL_SUCCESS) {
+            MGlobal::displayError("Failed to create OpenCL command queue");
+            MOpenCLInfo::checkCLErrorStatus(err);
+            cleanup();
+            return MS::kFailure;
+        }
+    }
+    return MS::kSuccess;
+}
+
+MStatus HeightmapComputeShader::setProfiling(bool enabled)
 {
+    if (enabled == fProfiling) {
+        return MS::kSuccess;
+    }
+    fProfiling = enabled;
     if (!fInitialized) {
-        MGlobal::displayError("HeightmapComputeShader not initialized. Call initialize() first.");
-        return MS::kFailure;
+        return MS::kSuccess;
     }
 
-    if (voxelSize <= 0.0f) {
-        MGlobal::displayError("Voxel size must be greater than zero");
-        return MS::kFailure;
+    // Queue properties are fixed at creation. The pinned buffers are mapped
+    // through the old queues, so they go with them; device buffers stay.
+    abortTiles();
+    for (PipelineSlot& slot : fSlots) {
+        releasePinned(slot.queue, slot.hostSpans);
+        clReleaseCommandQueue(slot.queue);
+        slot.queue = nullptr;
     }
+    return createQueues();
+}
 
-    if (terrainWidth < 1 || terrainHeight < 1) {
-        MGlobal::displayError("Terrain size must be atleast 1x1");
-        return MS::kFailure;
+cl_event* HeightmapComputeShader::profiledEvent(PipelineSlot& slot, const char* name)
+{
+    Profiler* profiler = fProfiling ? Profiler::active() : nullptr;
+    if (!profiler) {
+        return NULL;
     }
+    slot.profiled.push_back({ name, nullptr, profiler->now() });
+    return &slot.profiled.back().event;
+}
+
+void HeightmapComputeShader::recordProfiledCommands(unsigned int slotIndex)
+{
+    PipelineSlot& slot = fSlots[slotIndex];
+    Profiler* profiler = Profiler::active();
+    std::string track = "OpenCL queue " + std::to_string(slotIndex);
+
+    for (ProfiledCommand& command : slot.profiled) {
+        if (!command.event) continue;
+
+        cl_ulong queued = 0, start = 0, end = 0;
+        if (profiler
+            && clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS) {
+            // The device clock is only comparable with itself, so the command
+            // is placed relative to the host time it was queued at
+            profiler->addEvent(command.name, "device", track,
+                command.queuedUs + (double)(start - queued) / 1000.0, (double)(end - start) / 1000.0);
+        }
+        clReleaseEvent(command.event);
+    }
+    slot.profiled.clear();
+}
 
-    // Load image
-    MImage image;
-    MStatus status = image.readFromFile(filepath);
+bool HeightmapComputeShader::isAvailable()
+{
+    return MOpenCLInfo::getOpenCLContext() != nullptr;
+}
+
+const char* HeightmapComputeShader::name() const
+{
+    return "OpenCL";
+}
+
+MStatus HeightmapComputeShader::generateTile(
+    const Heightfield& heightfield,
+    const TerrainTile& tile,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    unsigned int maxHeight,
+    const HeightRange& range,
+    std::vector<ColumnSpan>& outSpans)
+{
+    MStatus status = beginTile(0, heightfield, tile, terrainWidth, terrainHeight, maxHeight, range);
     if (status != MS::kSuccess) {
-        MGlobal::displayError("Failed to load image: " + filepath);
+        abortTiles();
         return status;
     }
 
-    unsigned int width, height;
-    image.getSize(width, height);
+    const ColumnSpan* spans = nullptr;
+    status = endTile(0, spans);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
 
-    if (width == 0 || height == 0) {
-        MGlobal::displayError("Invalid image dimensions");
-        return MS::kFailure;
-    }
+    outSpans.assign(spans, spans + tile.columnCount());
+    return MS::kSuccess;
+}
 
-    unsigned char* pixels = image.pixels();
-    if (!pixels) {
-        MGlobal::displayError("Failed to get image pixel data");
-        return MS::kFailure;
-    }
+unsigned int HeightmapComputeShader::pipelineDepth() const
+{
+    return PIPELINE_DEPTH;
+}
 
-    // Find maximum grayscale value to optimize buffer size
-    static const size_t BYTES_PER_PIXEL = 4; // RGBA
-    size_t imagePixelCount = width * height;
-    unsigned char maxGray = 0;
+MStatus HeightmapComputeShader::beginTile(
+    unsigned int slotIndex,
+    const Heightfield& heightfield,
+    const TerrainTile& tile,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    unsigned int maxHeight,
+    const HeightRange& range)
+{
+    PipelineSlot& slot = fSlots[slotIndex];
+    cl_command_queue queue = slot.queue;
+    unsigned int width = heightfield.width;
+    unsigned int height = heightfield.height;
+    cl_int base = (cl_int)range.base;
+    bool floatSamples = heightfield.format == SampleFormat::Float32;
+    size_t sampleSize = heightfield.sampleSize();
+    cl_int err;
 
-    for (size_t i = 0; i < imagePixelCount * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-        unsigned char gray = (pixels[i] + pixels[i + 1] + pixels[i + 2]) / 3;
-        maxGray = std::max(maxGray, gray);
-    }
+    // The tile plus its halo, and the image pixels that region samples.
+    // Procedural heights are generated on the device, so they have neither.
+    bool procedural = heightfield.isProcedural();
+    TerrainTile region = haloRegion(tile, terrainWidth, terrainHeight);
+    TerrainTile image = procedural ? TerrainTile() : imageRegion(heightfield, region, terrainWidth, terrainHeight);
 
-    if (maxGray == 0) {
-        MGlobal::displayWarning("Image is completely black, no voxels to generate");
-        outVoxelPositions.clear();
-        return MS::kSuccess;
-    }
+    KernelSet* kernels = nullptr;
+    MStatus status = getKernels(defaultBuildOptions(), kernels);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
 
-    MGlobal::displayInfo(MString("Max height: ") + maxHeight);
+    // Input pixels plus one height per region cell and one span per tile column
+    if (!procedural) {
+        status = ensureCapacity(slot.input, image.columnCount() * sampleSize, CL_MEM_READ_ONLY, "input");
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    }
+    status = ensureCapacity(slot.heights, region.columnCount() * sizeof(cl_ushort), CL_MEM_READ_WRITE, "height grid");
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    status = ensureCapacity(slot.spans, tile.columnCount() * sizeof(ColumnSpan), CL_MEM_WRITE_ONLY, "column spans");
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    status = ensurePinned(queue, slot.hostSpans, tile.columnCount() * sizeof(ColumnSpan));
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    cl_mem clInputBuffer = slot.input.mem.get();
+    cl_mem clHeights = slot.heights.mem.get();
+    cl_mem clSpans = slot.spans.mem.get();
+
+    // 2 or 4 bytes per pixel, straight from the decoded samples or the mapped file.
+    // Nothing below blocks: the heightfield outlives the pipeline, and the slot's
+    // in-order queue runs upload, kernels and readback one after another.
+    if (!procedural) {
+        size_t bufferOrigin[3] = { 0, 0, 0 };
+        size_t hostOrigin[3] = { image.x * sampleSize, image.z, 0 };
+        size_t copyRegion[3] = { image.width * sampleSize, image.height, 1 };
+        err = clEnqueueWriteBufferRect(queue, clInputBuffer, CL_FALSE, bufferOrigin, hostOrigin, copyRegion,
+            image.width * sampleSize, 0, width * sampleSize, 0, heightfield.data(), 0, NULL, profiledEvent(slot, "upload"));
+        if (err != CL_SUCCESS) {
+            MGlobal::displayError("Failed to upload heightmap");
+            MOpenCLInfo::checkCLErrorStatus(err);
+            return MS::kFailure;
+        }
+    }
 
-    size_t imageSize = imagePixelCount * BYTES_PER_PIXEL;
-    cl_int err;
+    size_t globalWorkSize[2] = { region.width, region.height };
+
+    // Stage 1: sample every region cell once into the height grid
+    cl_kernel resampleKernel;
+    if (procedural) {
+        const NoiseSettings& noise = heightfield.noise;
+        cl_uint seed = noise.seed;
+        cl_int octaves = (cl_int)noise.octaves;
+        cl_int variant = (cl_int)noise.variant;
+        cl_float amplitudeScale = noise.amplitudeScale();
+
+        resampleKernel = kernels->resampleProcedural;
+        clSetKernelArg(resampleKernel, 0, sizeof(cl_mem), &clHeights);
+        clSetKernelArg(resampleKernel, 1, sizeof(int), &region.x);
+        clSetKernelArg(resampleKernel, 2, sizeof(int), &region.z);
+        clSetKernelArg(resampleKernel, 3, sizeof(int), &region.width);
+        clSetKernelArg(resampleKernel, 4, sizeof(int), &region.height);
+        clSetKernelArg(resampleKernel, 5, sizeof(int), &maxHeight);
+        clSetKernelArg(resampleKernel, 6, sizeof(cl_uint), &seed);
+        clSetKernelArg(resampleKernel, 7, sizeof(cl_int), &octaves);
+        clSetKernelArg(resampleKernel, 8, sizeof(cl_float), &noise.frequency);
+        clSetKernelArg(resampleKernel, 9, sizeof(cl_float), &noise.lacunarity);
+        clSetKernelArg(resampleKernel, 10, sizeof(cl_float), &noise.gain);
+        clSetKernelArg(resampleKernel, 11, sizeof(cl_int), &variant);
+        clSetKernelArg(resampleKernel, 12, sizeof(cl_float), &noise.warp);
+        clSetKernelArg(resampleKernel, 13, sizeof(cl_float), &amplitudeScale);
+        clSetKernelArg(resampleKernel, 14, sizeof(cl_int), &base);
+    }
+    else {
+        resampleKernel = floatSamples ? kernels->resampleFloat : kernels->resample;
+        clSetKernelArg(resampleKernel, 0, sizeof(cl_mem), &clInputBuffer);
+        clSetKernelArg(resampleKernel, 1, sizeof(cl_mem), &clHeights);
+        clSetKernelArg(resampleKernel, 2, sizeof(int), &width);
+        clSetKernelArg(resampleKernel, 3, sizeof(int), &height);
+        clSetKernelArg(resampleKernel, 4, sizeof(int), &image.x);
+        clSetKernelArg(resampleKernel, 5, sizeof(int), &image.z);
+        clSetKernelArg(resampleKernel, 6, sizeof(int), &image.width);
+        clSetKernelArg(resampleKernel, 7, sizeof(int), &terrainWidth);
+        clSetKernelArg(resampleKernel, 8, sizeof(int), &terrainHeight);
+        clSetKernelArg(resampleKernel, 9, sizeof(int), &region.x);
+        clSetKernelArg(resampleKernel, 10, sizeof(int), &region.z);
+        clSetKernelArg(resampleKernel, 11, sizeof(int), &region.width);
+        clSetKernelArg(resampleKernel, 12, sizeof(int), &region.height);
+        clSetKernelArg(resampleKernel, 13, sizeof(int), &maxHeight);
+        if (floatSamples) {
+            // Same reciprocals as the CPU backend
+            cl_float invDu = 1.0f / (float)(std::max(terrainWidth, 2u) - 1);
+            cl_float invDv = 1.0f / (float)(std::max(terrainHeight, 2u) - 1);
+            cl_float scale = range.scale(maxHeight);
+            clSetKernelArg(resampleKernel, 14, sizeof(cl_float), &invDu);
+            clSetKernelArg(resampleKernel, 15, sizeof(cl_float), &invDv);
+            clSetKernelArg(resampleKernel, 16, sizeof(cl_float), &range.lowHeight);
+            clSetKernelArg(resampleKernel, 17, sizeof(cl_float), &scale);
+            clSetKernelArg(resampleKernel, 18, sizeof(cl_int), &base);
+        }
+        else {
+            cl_uint lowValue = range.lowValue;
+            cl_uint valueRange = range.high(heightfield.maxValue) - range.lowValue;
+            clSetKernelArg(resampleKernel, 14, sizeof(cl_uint), &lowValue);
+            clSetKernelArg(resampleKernel, 15, sizeof(cl_uint), &valueRange);
+            clSetKernelArg(resampleKernel, 16, sizeof(cl_int), &base);
+        }
+    }
 
-    // Create input buffer
-    MAutoCLMem inputBuffer;
-    cl_mem clInputBuffer = clCreateBuffer(fContext,
-        CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        imageSize, pixels, &err);
+    err = clEnqueueNDRangeKernel(queue, resampleKernel, 2, NULL,
+        globalWorkSize, NULL, 0, NULL, profiledEvent(slot, "resampleKernel"));
     if (err != CL_SUCCESS) {
-        MGlobal::displayError("Failed to create input buffer");
+        MGlobal::displayError("Failed to enqueue resample kernel");
         MOpenCLInfo::checkCLErrorStatus(err);
         return MS::kFailure;
     }
-    inputBuffer.attach(clInputBuffer);
-
-    // Create output buffer with fixed stride per terrain voxel
-    size_t terrainPixelCount = terrainWidth * terrainHeight;
-    size_t bufferSize = terrainPixelCount * maxHeight;
-    
-    MGlobal::displayInfo(MString("Allocating buffer for: ") + (bufferSize) + " voxel slots");
-    
-    MAutoCLMem voxelPositionsBuffer;
-    cl_mem clVoxelPositions = clCreateBuffer(fContext,
-        CL_MEM_WRITE_ONLY,
-        bufferSize * sizeof(cl_float3), NULL, &err);
+
+    // Stage 2: fill the tile's columns from the grid, in whole work-groups
+    size_t tileWorkSize[2] = { TILE_SIZE, TILE_SIZE };
+    size_t tiledWorkSize[2] = {
+        ((tile.width + TILE_SIZE - 1) / TILE_SIZE) * TILE_SIZE,
+        ((tile.height + TILE_SIZE - 1) / TILE_SIZE) * TILE_SIZE
+    };
+
+    cl_kernel fillKernel = kernels->fill;
+    clSetKernelArg(fillKernel, 0, sizeof(cl_mem), &clHeights);
+    clSetKernelArg(fillKernel, 1, sizeof(cl_mem), &clSpans);
+    clSetKernelArg(fillKernel, 2, sizeof(int), &region.x);
+    clSetKernelArg(fillKernel, 3, sizeof(int), &region.z);
+    clSetKernelArg(fillKernel, 4, sizeof(int), &region.width);
+    clSetKernelArg(fillKernel, 5, sizeof(int), &region.height);
+    clSetKernelArg(fillKernel, 6, sizeof(int), &tile.x);
+    clSetKernelArg(fillKernel, 7, sizeof(int), &tile.z);
+    clSetKernelArg(fillKernel, 8, sizeof(int), &tile.width);
+    clSetKernelArg(fillKernel, 9, sizeof(int), &tile.height);
+
+    err = clEnqueueNDRangeKernel(queue, fillKernel, 2, NULL,
+        tiledWorkSize, tileWorkSize, 0, NULL, profiledEvent(slot, "fillKernel"));
     if (err != CL_SUCCESS) {
-        MGlobal::displayError("Failed to create voxel positions buffer");
+        MGlobal::displayError("Failed to enqueue fillColumns kernel");
         MOpenCLInfo::checkCLErrorStatus(err);
         return MS::kFailure;
     }
-    voxelPositionsBuffer.attach(clVoxelPositions);
-
-    // Execute single-pass kernel
-    cl_kernel generateKernel = fGenerateKernel.get();
-    clSetKernelArg(generateKernel, 0, sizeof(cl_mem), &clInputBuffer);
-    clSetKernelArg(generateKernel, 1, sizeof(cl_mem), &clVoxelPositions);
-    clSetKernelArg(generateKernel, 2, sizeof(int), &width);
-    clSetKernelArg(generateKernel, 3, sizeof(int), &height);
-    clSetKernelArg(generateKernel, 4, sizeof(int), &terrainWidth);
-    clSetKernelArg(generateKernel, 5, sizeof(int), &terrainHeight);
-    clSetKernelArg(generateKernel, 6, sizeof(float), &voxelSize);
-    clSetKernelArg(generateKernel, 7, sizeof(int), &maxHeight);
-
-    size_t globalWorkSize[2] = { terrainWidth, terrainHeight };
-    err = clEnqueueNDRangeKernel(fQueue, generateKernel, 2, NULL,
-        globalWorkSize, NULL, 0, NULL, NULL);
+
+    // Read the spans into pinned memory, 8 bytes per column; endTile waits on the event
+    err = clEnqueueReadBuffer(queue, clSpans, CL_FALSE, 0,
+        tile.columnCount() * sizeof(ColumnSpan), slot.hostSpans.host, 0, NULL, &slot.readDone);
     if (err != CL_SUCCESS) {
-        MGlobal::displayError("Failed to enqueue generateVoxels kernel");
+        MGlobal::displayError("Failed to read column spans");
         MOpenCLInfo::checkCLErrorStatus(err);
         return MS::kFailure;
     }
-    clFinish(fQueue);
+    if (cl_event* readEvent = profiledEvent(slot, "readSpans")) {
+        clRetainEvent(slot.readDone);
+        *readEvent = slot.readDone;
+    }
 
-    // Read back voxel positions
-    std::vector<cl_float3> clVoxelPositionsData(bufferSize);
-    err = clEnqueueReadBuffer(fQueue, clVoxelPositions, CL_TRUE, 0,
-        bufferSize * sizeof(cl_float3), clVoxelPositionsData.data(), 0, NULL, NULL);
-    if (err != CL_SUCCESS) {
-        MGlobal::displayError("Failed to read voxel positions");
-        MOpenCLInfo::checkCLErrorStatus(err);
+    // Submit now so the device starts while the host moves on to the next slot
+    clFlush(queue);
+    return MS::kSuccess;
+}
+
+MStatus HeightmapComputeShader::endTile(unsigned int slotIndex, const ColumnSpan*& outSpans)
+{
+    PipelineSlot& slot = fSlots[slotIndex];
+    if (!slot.readDone) {
+        MGlobal::displayError("No tile in flight on this slot");
         return MS::kFailure;
     }
 
-    // CPU post-processing
-    outVoxelPositions.clear();
+    cl_int err = clWaitForEvents(1, &slot.readDone);
+    clReleaseEvent(slot.readDone);
+    slot.readDone = nullptr;
+    recordProfiledCommands(slotIndex);
 
-    // Estimate the voxel depth at a point is on average less than 3
-    outVoxelPositions.reserve(terrainPixelCount * 3);
-    for (size_t i = 0; i < bufferSize; i++) {
-        const cl_float3& pos = clVoxelPositionsData[i];
-        // Check if valid voxel
-        if (!std::isnan(pos.s[0])) {
-            outVoxelPositions.push_back(MVector(pos.s[0], pos.s[1], pos.s[2]));
-        }
+    if (err != CL_SUCCESS) {
+        MGlobal::displayError("Failed to generate tile");
+        MOpenCLInfo::checkCLErrorStatus(err);
+        return MS::kFailure;
     }
 
-    MGlobal::displayInfo(MString("Generated ") + (int)outVoxelPositions.size() + " voxels");
-
+    outSpans = static_cast<const ColumnSpan*>(slot.hostSpans.host);
     return MS::kSuccess;
 }
 
-MStatus HeightmapComputeShader::generateVoxelsFromHeightmap(
-    const MString& filepath,
-    std::vector<MVector>& outVoxelPositions,
-    unsigned int& outWidth,
-    unsigned int& outHeight,
-    unsigned int& terrainWidth,
-    unsigned int& terrainHeight,
-    float voxelSize,
-    unsigned int maxHeight)
+void HeightmapComputeShader::abortTiles()
 {
-    if (!fInitialized) {
-        MGlobal::displayError("HeightmapComputeShader not initialized. Call initialize() first.");
-        return MS::kFailure;
-    }
-
-    MImage image;
-    MStatus status = image.readFromFile(filepath);
-    if (status != MS::kSuccess) {
-        MGlobal::displayError("Failed to load image: " + filepath);
-        return status;
+    // Let queued work finish so no transfer lands in memory that is about to go
+    for (unsigned int i = 0; i < PIPELINE_DEPTH; i++) {
+        PipelineSlot& slot = fSlots[i];
+        if (slot.queue) {
+            clFinish(slot.queue);
+        }
+        if (slot.readDone) {
+            clReleaseEvent(slot.readDone);
+            slot.readDone = nullptr;
+        }
+        recordProfiledCommands(i);
     }
+}
 
-    image.getSize(outWidth, outHeight);
-    return generateVoxelsFromHeightmap(filepath, 
-        outVoxelPositions, terrainWidth, terrainHeight, voxelSize, maxHeight);
+size_t HeightmapComputeShader::maxBufferBytes() const
+{
+    return fMaxAllocSize;
 }
 
 void HeightmapComputeShader::cleanup()
 {
-    if (fGenerateKernel.get()) {
-        MOpenCLInfo::releaseOpenCLKernel(fGenerateKernel);
+    abortTiles();
+
+    for (auto& entry : fKernelSets) {
+        releaseKernels(entry.second);
+    }
+    fKernelSets.clear();
+
+    for (PipelineSlot& slot : fSlots) {
+        releasePinned(slot.queue, slot.hostSpans);
+
+        DeviceBuffer* buffers[] = { &slot.input, &slot.heights, &slot.spans };
+        for (DeviceBuffer* buffer : buffers) {
+            buffer->mem.reset();
+            buffer->capacity = 0;
+        }
+
+        if (slot.queue) {
+            clReleaseCommandQueue(slot.queue);
+            slot.queue = nullptr;
+        }
     }
 
     fContext = nullptr;
-    fQueue = nullptr;
+    fDevice = nullptr;
+    fMaxAllocSize = SIZE_MAX;
     fInitialized = false;
 }
\ No newline at end of file
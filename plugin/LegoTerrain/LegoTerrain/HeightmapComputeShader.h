@@ -1,12 +1,11 @@
 #pragma once
 
-#include <maya/MGlobal.h>
-#include <maya/MStatus.h>
-#include <maya/MString.h>
-#include <maya/MVector.h>
-#include <maya/MOpenCLAutoPtr.h>
-#include <clew/clew.h>
+#include "CoreTypes.h"
+#include "CoreOpenCL.h"
+#include "TerrainComputeBackend.h"
 #include <vector>
+#include <map>
+#include <string>
 
 typedef struct _cl_context* cl_context;
 typedef struct _cl_command_queue* cl_command_queue;
@@ -16,48 +15,137 @@ typedef struct _cl_command_queue* cl_command_queue;
  *
  * This class uses OpenCL compute shaders to efficiently convert a heightmap
  * image into a 3D voxel grid. It performs a two-pass algorithm:
- * 1. Count the number of voxels each pixel will generate
- * 2. Generate the actual voxel positions based on the counts
+ * 1. Resample the image once into a quantized height grid
+ * 2. Fill each column down to its lowest neighbour and write it as a span
+ *
+ * Only the 8 byte spans are read back; positions are expanded on the host
+ * where they are needed. Each tile uploads just the image rectangle it
+ * samples, and tiles are sized so no buffer exceeds the device's
+ * CL_DEVICE_MAX_MEM_ALLOC_SIZE. Procedural heightfields upload nothing: the
+ * noise is evaluated on the device in place of the resample.
+ *
+ * Large terrains keep PIPELINE_DEPTH tiles in flight. Every slot has its own
+ * in-order queue and buffers, so the upload, kernels and readback of one tile
+ * overlap those of the others, and spans are read into pinned host memory
+ * that the caller consumes while the next tiles run.
+ *
+ * With profiling on, the slot queues are recreated with
+ * CL_QUEUE_PROFILING_ENABLE and every command gets an event whose device
+ * times are added to the active Profiler when its tile ends.
+ *
+ * Compiled programs (per build option set) and device buffers are kept until
+ * cleanup(), so a long-lived instance only pays for them on the first run or
+ * when a terrain outgrows the previous high-water mark.
  */
-class HeightmapComputeShader
+class HeightmapComputeShader : public TerrainComputeBackend
 {
 public:
     HeightmapComputeShader();
-    ~HeightmapComputeShader();
-
-    MStatus initialize();
-
-    MStatus generateVoxelsFromHeightmap(
-        const MString& filepath,
-        std::vector<MVector>& outVoxelPositions,
-        unsigned int& terrainWidth,
-        unsigned int& terrainHeight,
-        float voxelSize = 1.0f,
-        unsigned int maxHeight = 256
-    );
-
-    MStatus generateVoxelsFromHeightmap(
-        const MString& filepath,
-        std::vector<MVector>& outVoxelPositions,
-        unsigned int& outWidth,
-        unsigned int& outHeight,
-        unsigned int& terrainWidth,
-        unsigned int& terrainHeight,
-        float voxelSize = 1.0f,
-        unsigned int maxHeight = 256
-    );
-
-    void cleanup();
-    bool isInitialized() const;
+    ~HeightmapComputeShader() override;
+
+    // True when there is an OpenCL context to hand out
+    static bool isAvailable();
+
+    MStatus initialize() override;
+    void cleanup() override;
+    bool isInitialized() const override;
+    const char* name() const override;
+    MStatus setProfiling(bool enabled) override;
+
+protected:
+    MStatus generateTile(
+        const Heightfield& heightfield,
+        const TerrainTile& tile,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        unsigned int maxHeight,
+        const HeightRange& range,
+        std::vector<ColumnSpan>& outSpans
+    ) override;
+
+    size_t maxBufferBytes() const override;
+
+    unsigned int pipelineDepth() const override;
+    MStatus beginTile(
+        unsigned int slot,
+        const Heightfield& heightfield,
+        const TerrainTile& tile,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        unsigned int maxHeight,
+        const HeightRange& range
+    ) override;
+    MStatus endTile(unsigned int slot, const ColumnSpan*& outSpans) override;
+    void abortTiles() override;
 
 private:
+    // One compiled program and its kernels for a set of build options
+    struct KernelSet
+    {
+        cl_program program = nullptr;
+        cl_kernel resample = nullptr;
+        cl_kernel resampleFloat = nullptr;
+        cl_kernel resampleProcedural = nullptr;
+        cl_kernel fill = nullptr;
+    };
+
+    // Device allocation that is kept between runs and only grows
+    struct DeviceBuffer
+    {
+        MAutoCLMem mem;
+        size_t capacity = 0;
+    };
+
+    // Host memory the spans are read into, mapped for as long as it exists
+    struct PinnedBuffer
+    {
+        MAutoCLMem mem;
+        void* host = nullptr;
+        size_t capacity = 0;
+    };
+
+    // A queued command whose device times are read once it has run
+    struct ProfiledCommand
+    {
+        const char* name;
+        cl_event event;
+        double queuedUs;        // Host time it was queued at
+    };
+
+    // Everything one tile in flight needs
+    struct PipelineSlot
+    {
+        cl_command_queue queue = nullptr;
+        DeviceBuffer input;
+        DeviceBuffer heights;
+        DeviceBuffer spans;
+        PinnedBuffer hostSpans;
+        cl_event readDone = nullptr;
+        std::vector<ProfiledCommand> profiled;
+    };
+
+    // Upload, generate and read back of up to three tiles overlap
+    static const unsigned int PIPELINE_DEPTH = 3;
+
     cl_context fContext;
-    cl_command_queue fQueue;
-    MAutoCLKernel fCountKernel;
-    MAutoCLKernel fGenerateKernel;
+    cl_device_id fDevice;
+    size_t fMaxAllocSize;
+    std::map<std::string, KernelSet> fKernelSets;
+    PipelineSlot fSlots[PIPELINE_DEPTH];
+    bool fProfiling;
     bool fInitialized;
 
-    MStatus createKernels();
+    static std::string defaultBuildOptions();
+    MStatus getKernels(const std::string& buildOptions, KernelSet*& outKernels);
+    static void releaseKernels(KernelSet& kernels);
+    MStatus ensureCapacity(DeviceBuffer& buffer, size_t bytes, cl_mem_flags flags, const char* label);
+    MStatus ensurePinned(cl_command_queue queue, PinnedBuffer& buffer, size_t bytes);
+    static void releasePinned(cl_command_queue queue, PinnedBuffer& buffer);
+    MStatus createQueues();
+
+    // Event for a command about to be queued on slot, or NULL when not profiling
+    cl_event* profiledEvent(PipelineSlot& slot, const char* name);
+    void recordProfiledCommands(unsigned int slotIndex);
 
     static const char* getKernelSource();
 };
\ No newline at end of file
@@ -0,0 +1,498 @@
+#include "LegoTerrainNode.h"
+#include "TerrainComputeBackend.h"
+#include "TerrainComputeService.h"
+#include <maya/MGlobal.h>
+#include <maya/MPlug.h>
+#include <maya/MDataBlock.h>
+#include <maya/MDataHandle.h>
+#include <maya/MFnTypedAttribute.h>
+#include <maya/MFnNumericAttribute.h>
+#include <maya/MFnStringData.h>
+#include <maya/MFnArrayAttrsData.h>
+#include <maya/MVectorArray.h>
+#include <maya/MDoubleArray.h>
+#include <algorithm>
+#include <string>
+
+namespace
+{
+	// Smallest rectangle holding both; an empty one is ignored
+	TerrainTile unionRegion(const TerrainTile& a, const TerrainTile& b)
+	{
+		if (a.columnCount() == 0) return b;
+		if (b.columnCount() == 0) return a;
+
+		TerrainTile result;
+		result.x = std::min(a.x, b.x);
+		result.z = std::min(a.z, b.z);
+		result.width = std::max(a.x + a.width, b.x + b.width) - result.x;
+		result.height = std::max(a.z + a.height, b.z + b.height) - result.z;
+		return result;
+	}
+
+	bool sameRange(const HeightRange& a, const HeightRange& b)
+	{
+		return a.lowValue == b.lowValue && a.highValue == b.highValue
+			&& a.lowHeight == b.lowHeight && a.highHeight == b.highHeight && a.base == b.base;
+	}
+}
+
+const char* LegoTerrainNode::nodeName = "legoTerrain";
+const MTypeId LegoTerrainNode::id(0x00071A00);
+
+MObject LegoTerrainNode::aHeightMapPath;
+MObject LegoTerrainNode::aRawWidth;
+MObject LegoTerrainNode::aBackend;
+MObject LegoTerrainNode::aBrickScale;
+MObject LegoTerrainNode::aTerrainWidth;
+MObject LegoTerrainNode::aTerrainHeight;
+MObject LegoTerrainNode::aTerrainDimensions;
+MObject LegoTerrainNode::aMaxHeight;
+MObject LegoTerrainNode::aNormalizeHeights;
+MObject LegoTerrainNode::aTrimBase;
+MObject LegoTerrainNode::aBricks;
+MObject LegoTerrainNode::aLodCamera;
+MObject LegoTerrainNode::aLodDistance;
+MObject LegoTerrainNode::aLodLevels;
+MObject LegoTerrainNode::aOutPoints;
+MObject LegoTerrainNode::aOutCount;
+
+LegoTerrainNode::LegoTerrainNode()
+{
+	m_rawWidth = 0;
+	m_terrainWidth = 0;
+	m_terrainHeight = 0;
+	m_maxHeight = 0;
+	m_normalizeClip = -1.0;
+	m_trimBase = 0;
+	m_spansValid = false;
+	m_mergeBricks = false;
+	m_bricksValid = false;
+	m_brickScale = 0.0;
+	m_outPointsValid = false;
+	m_pyramidValid = false;
+	m_useLod = false;
+}
+
+LegoTerrainNode::~LegoTerrainNode()
+{
+
+}
+
+void* LegoTerrainNode::creator()
+{
+	return new LegoTerrainNode();
+}
+
+MStatus LegoTerrainNode::initialize()
+{
+	MStatus status;
+	MFnTypedAttribute typedAttrFn;
+	MFnNumericAttribute numericAttrFn;
+	MFnStringData stringDataFn;
+
+	aHeightMapPath = typedAttrFn.create("heightMapPath", "h", MFnData::kString, MObject::kNullObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	typedAttrFn.setUsedAsFilename(true);
+
+	// 0 treats raw .r16 and .r32 files as square
+	aRawWidth = numericAttrFn.create("rawWidth", "rw", MFnNumericData::kInt, 0, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setMin(0);
+
+	aBackend = typedAttrFn.create("backend", "b", MFnData::kString, stringDataFn.create("auto"), &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	aBrickScale = numericAttrFn.create("brickScale", "s", MFnNumericData::kDouble, 1.0, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setMin(0.001);
+	numericAttrFn.setKeyable(true);
+
+	aTerrainWidth = numericAttrFn.create("terrainWidth", "tw", MFnNumericData::kInt, 512, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	aTerrainHeight = numericAttrFn.create("terrainHeight", "th", MFnNumericData::kInt, 512, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	aTerrainDimensions = numericAttrFn.create("terrainDimensions", "d", aTerrainWidth, aTerrainHeight, MObject::kNullObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setMin(1, 1);
+	numericAttrFn.setMax((int)TerrainSpans::MAX_DIMENSION, (int)TerrainSpans::MAX_DIMENSION);
+
+	aMaxHeight = numericAttrFn.create("maxHeight", "m", MFnNumericData::kInt, 256, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setMin(0);
+	numericAttrFn.setMax(TerrainSpans::MAX_HEIGHT);
+	numericAttrFn.setKeyable(true);
+
+	// Same as the command's -normalizeHeights clip, -1 leaves the samples as they are
+	aNormalizeHeights = numericAttrFn.create("normalizeHeights", "nh", MFnNumericData::kDouble, -1.0, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setMin(-1.0);
+	numericAttrFn.setSoftMax(0.01);
+
+	// Base layers to cut, -1 cuts everything below the lowest column
+	aTrimBase = numericAttrFn.create("trimBase", "tb", MFnNumericData::kInt, 0, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setMin(-1);
+	numericAttrFn.setMax(TerrainSpans::MAX_HEIGHT);
+
+	// Empty for one cube per voxel, "default" for BrickCatalogue::DEFAULT_SPEC
+	aBricks = typedAttrFn.create("bricks", "bk", MFnData::kString, MObject::kNullObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	// World position to pick LOD levels from, usually connected to a camera's translate
+	aLodCamera = numericAttrFn.create("lodCamera", "lc", MFnNumericData::k3Double, 0.0, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	aLodDistance = numericAttrFn.create("lodDistance", "ld", MFnNumericData::kDouble, 64.0, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setMin(0.001);
+
+	// 0 turns LOD off
+	aLodLevels = numericAttrFn.create("lodLevels", "ll", MFnNumericData::kInt, 0, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setMin(0);
+	numericAttrFn.setMax(LodPyramid::MAX_LEVELS);
+
+	aOutPoints = typedAttrFn.create("outPoints", "op", MFnData::kDynArrayAttrs, MObject::kNullObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	typedAttrFn.setWritable(false);
+	typedAttrFn.setStorable(false);
+
+	aOutCount = numericAttrFn.create("outCount", "oc", MFnNumericData::kInt, 0, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	numericAttrFn.setWritable(false);
+	numericAttrFn.setStorable(false);
+
+	const MObject inputs[] = { aHeightMapPath, aRawWidth, aBackend, aBrickScale, aTerrainDimensions, aMaxHeight,
+		aNormalizeHeights, aTrimBase, aBricks, aLodCamera, aLodDistance, aLodLevels };
+	const MObject outputs[] = { aOutPoints, aOutCount };
+
+	for (const MObject& attr : inputs) {
+		CHECK_MSTATUS_AND_RETURN_IT(addAttribute(attr));
+	}
+	for (const MObject& attr : outputs) {
+		CHECK_MSTATUS_AND_RETURN_IT(addAttribute(attr));
+	}
+	for (const MObject& input : inputs) {
+		for (const MObject& output : outputs) {
+			CHECK_MSTATUS_AND_RETURN_IT(attributeAffects(input, output));
+		}
+	}
+
+	return MS::kSuccess;
+}
+
+MStatus LegoTerrainNode::compute(const MPlug& plug, MDataBlock& data)
+{
+	if (plug != aOutPoints && plug != aOutCount) {
+		return MS::kUnknownParameter;
+	}
+
+	MString path = data.inputValue(aHeightMapPath).asString();
+	unsigned int rawWidth = (unsigned int)std::max(data.inputValue(aRawWidth).asInt(), 0);
+	MString backend = data.inputValue(aBackend).asString().toLowerCase();
+	double brickScale = data.inputValue(aBrickScale).asDouble();
+	int2& dimensions = data.inputValue(aTerrainDimensions).asInt2();
+	int maxHeight = data.inputValue(aMaxHeight).asInt();
+	double normalizeClip = data.inputValue(aNormalizeHeights).asDouble();
+	int trimBase = data.inputValue(aTrimBase).asInt();
+	MString bricksSpec = data.inputValue(aBricks).asString();
+	double3& lodCamera = data.inputValue(aLodCamera).asDouble3();
+	int lodLevels = data.inputValue(aLodLevels).asInt();
+
+	LodSettings lodSettings;
+	lodSettings.camera = MVector(lodCamera[0], lodCamera[1], lodCamera[2]);
+	lodSettings.voxelSize = (float)brickScale;
+	lodSettings.baseDistance = (float)data.inputValue(aLodDistance).asDouble();
+	lodSettings.levels = (unsigned int)std::min(std::max(lodLevels, 0), (int)LodPyramid::MAX_LEVELS);
+
+	if (dimensions[0] <= 0 || dimensions[1] <= 0) {
+		MGlobal::displayError("Terrain width and height must be a integer greater than 0");
+		return MS::kFailure;
+	}
+	if (brickScale <= 0) {
+		MGlobal::displayError("Brick scale must be a float greater than 0");
+		return MS::kFailure;
+	}
+	if (lodLevels > 0 && bricksSpec.length() > 0) {
+		MGlobal::displayError("Bricks and LOD can't be combined, clear one of them");
+		return MS::kFailure;
+	}
+	if (normalizeClip >= 0.5) {
+		MGlobal::displayError("Normalize clip must be a fraction of the samples, below 0.5, or negative to turn it off");
+		return MS::kFailure;
+	}
+	maxHeight = std::min(std::max(maxHeight, 0), (int)TerrainSpans::MAX_HEIGHT);
+	normalizeClip = normalizeClip < 0.0 ? -1.0 : normalizeClip;
+	trimBase = std::max(trimBase, -1);
+
+	// Each stage reruns only when its own inputs or an earlier stage changed
+	MStatus status = updateHeightfield(path, rawWidth);
+	if (status == MS::kSuccess) {
+		status = updateSpans(backend, dimensions[0], dimensions[1], maxHeight, normalizeClip, trimBase);
+	}
+	if (status == MS::kSuccess) {
+		status = updateBricks(bricksSpec);
+	}
+	if (status == MS::kSuccess) {
+		status = updateOutPoints(brickScale, lodLevels > 0 ? &lodSettings : nullptr);
+	}
+
+	// A failed stage leaves an empty terrain rather than a stale one
+	if (status != MS::kSuccess) {
+		MFnArrayAttrsData arrayFn;
+		m_outPoints = arrayFn.create();
+		m_outPointsValid = false;
+	}
+
+	MFnArrayAttrsData outFn(m_outPoints);
+	MDataHandle outPointsHandle = data.outputValue(aOutPoints);
+	outPointsHandle.set(m_outPoints);
+	outPointsHandle.setClean();
+
+	MDataHandle outCountHandle = data.outputValue(aOutCount);
+	outCountHandle.set((int)outFn.count());
+	outCountHandle.setClean();
+
+	return status;
+}
+
+MStatus LegoTerrainNode::updateHeightfield(const MString& path, unsigned int rawWidth)
+{
+	if (path != m_heightmapPath || rawWidth != m_rawWidth) {
+		m_heightmapPath = path;
+		m_rawWidth = rawWidth;
+		m_heightfield.reset();
+		m_spansValid = false;
+	}
+
+	// No heightmap yet gives an empty terrain
+	if (path.length() == 0) {
+		return MS::kSuccess;
+	}
+
+	if (!HeightmapCache::isSupportedPath(path)) {
+		MGlobal::displayError("Height map file must be a .png, .r16 or .r32 file: " + path);
+		m_spansValid = false;
+		return MS::kFailure;
+	}
+
+	TerrainComputeService* service = TerrainComputeService::instance();
+	if (!service) {
+		MGlobal::displayError("Terrain compute service is not running");
+		return MS::kFailure;
+	}
+
+	// Only a stat when the file is unchanged; a new heightfield means it was edited
+	std::shared_ptr<const Heightfield> heightfield;
+	MStatus status = service->heightmapCache().acquire(path, heightfield, rawWidth);
+	if (status != MS::kSuccess) {
+		m_heightfield.reset();
+		m_spansValid = false;
+		return status;
+	}
+
+	if (heightfield == m_heightfield) {
+		return MS::kSuccess;
+	}
+
+	// Patch just the edited pixels when the old image is still there to compare
+	// against. A mapped raw file already shows the new contents, so it can't be.
+	TerrainTile pixels;
+	bool patchable = m_spansValid && m_heightfield && !m_heightfield->mapping
+		&& TerrainComputeBackend::diffHeightfields(*m_heightfield, *heightfield, pixels);
+
+	if (patchable) {
+		TerrainTile cells = TerrainComputeBackend::affectedRegion(*heightfield, pixels, m_terrainWidth, m_terrainHeight);
+		m_dirtyCells = unionRegion(m_dirtyCells, cells);
+	}
+	else {
+		m_spansValid = false;
+	}
+
+	m_heightfield = heightfield;
+	return MS::kSuccess;
+}
+
+MStatus LegoTerrainNode::updateSpans(const MString& backend, unsigned int terrainWidth, unsigned int terrainHeight, unsigned int maxHeight,
+	double normalizeClip, int trimBase)
+{
+	if (backend != m_backend || terrainWidth != m_terrainWidth
+		|| terrainHeight != m_terrainHeight || maxHeight != m_maxHeight
+		|| normalizeClip != m_normalizeClip || trimBase != m_trimBase) {
+		m_backend = backend;
+		m_terrainWidth = terrainWidth;
+		m_terrainHeight = terrainHeight;
+		m_maxHeight = maxHeight;
+		m_normalizeClip = normalizeClip;
+		m_trimBase = trimBase;
+		m_spansValid = false;
+	}
+
+	if (m_spansValid && m_dirtyCells.columnCount() == 0) {
+		return MS::kSuccess;
+	}
+
+	if (!m_heightfield) {
+		m_spans.clear();
+		m_spansValid = true;
+		m_dirtyCells = TerrainTile();
+		m_dirtyRows = TerrainTile();
+		m_rowOffsets.clear();
+		m_bricksValid = false;
+		m_pyramidValid = false;
+		m_outPointsValid = false;
+		return MS::kSuccess;
+	}
+
+	if (backend != "cpu" && backend != "opencl" && backend != "auto") {
+		MGlobal::displayError("Backend must be one of cpu, opencl or auto: " + backend);
+		return MS::kFailure;
+	}
+
+	MStatus status;
+	TerrainComputeBackend* computeBackend = TerrainComputeService::instance()->backend(backend, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	// Measured from this heightfield, so an edit can move the range
+	HeightRange range;
+	status = TerrainComputeBackend::heightRange(*m_heightfield, normalizeClip, trimBase, maxHeight, range);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	// An edit to a generated terrain only regenerates the columns it touched,
+	// as long as neither image was black, which leaves no spans to patch, and
+	// the range the other columns were generated with still holds
+	bool patch = m_spansValid && !m_heightfield->isBlack()
+		&& m_spans.spans.size() == (size_t)terrainWidth * terrainHeight
+		&& sameRange(range, m_range);
+
+	if (patch) {
+		status = computeBackend->regenerateRegion(*m_heightfield, m_dirtyCells, maxHeight, m_spans, range);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		m_dirtyRows = unionRegion(m_dirtyRows, m_dirtyCells);
+	}
+	else {
+		// Resamples the already decoded heightmap, the file is not read again
+		status = computeBackend->generateSpansFromHeightfield(*m_heightfield, m_spans, terrainWidth, terrainHeight, maxHeight,
+			0, range);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		m_outPointsValid = false;
+	}
+
+	m_range = range;
+	m_spansValid = true;
+	m_dirtyCells = TerrainTile();
+	m_bricksValid = false;
+	m_pyramidValid = false;
+	return MS::kSuccess;
+}
+
+MStatus LegoTerrainNode::updateBricks(const MString& bricksSpec)
+{
+	if (m_bricksValid && bricksSpec == m_bricksSpec) {
+		return MS::kSuccess;
+	}
+
+	bool wasMerging = m_mergeBricks;
+	m_bricksSpec = bricksSpec;
+	m_bricks.clear();
+	m_mergeBricks = bricksSpec.length() > 0;
+	m_bricksValid = false;
+
+	// Bricks are always merged and expanded again, voxels can be spliced
+	if (m_mergeBricks || wasMerging) {
+		m_outPointsValid = false;
+	}
+
+	if (m_mergeBricks) {
+		BrickCatalogue catalogue;
+		MStatus status = BrickCatalogue::parse(bricksSpec == "default" ? MString(BrickCatalogue::DEFAULT_SPEC) : bricksSpec, catalogue);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		status = BrickMerger::merge(m_spans, catalogue, m_bricks);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+
+	m_bricksValid = true;
+	return MS::kSuccess;
+}
+
+MStatus LegoTerrainNode::updateOutPoints(double brickScale, const LodSettings* lod)
+{
+	// LOD levels follow the camera, so any change to it or to the pyramid
+	// picks levels again; the pyramid itself only follows the spans
+	bool lodChanged = (lod != nullptr) != m_useLod;
+	if (lod) {
+		lodChanged = lodChanged || !m_pyramidValid || lod->levels != m_lodSettings.levels
+			|| lod->baseDistance != m_lodSettings.baseDistance || lod->camera != m_lodSettings.camera;
+	}
+
+	if (m_outPointsValid && brickScale == m_brickScale && !lodChanged) {
+		if (m_dirtyRows.columnCount() > 0) {
+			// Splice the edited rows into the positions already handed out
+			MFnArrayAttrsData arrayFn(m_outPoints);
+			MVectorArray positions = arrayFn.vectorArray("position");
+			m_spans.spliceRows((float)brickScale, m_dirtyRows.z, m_dirtyRows.z + m_dirtyRows.height, positions, m_rowOffsets);
+			m_dirtyRows = TerrainTile();
+		}
+		return MS::kSuccess;
+	}
+
+	m_brickScale = brickScale;
+	m_dirtyRows = TerrainTile();
+	m_useLod = lod != nullptr;
+	m_outPointsValid = false;
+	m_rowOffsets.clear();
+
+	// A new block each time, since the data block may still hold the previous one.
+	// The arrays belong to the block, so positions are expanded straight into it.
+	MStatus status;
+	MFnArrayAttrsData arrayFn;
+	m_outPoints = arrayFn.create(&status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	MVectorArray positions = arrayFn.vectorArray("position", &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	if (lod) {
+		m_lodSettings = *lod;
+		if (!m_pyramidValid) {
+			m_pyramid.build(m_spans);
+			m_pyramidValid = true;
+		}
+
+		LodLayout layout;
+		status = m_pyramid.select(*lod, layout);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		MVectorArray scales = arrayFn.vectorArray("scale", &status);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		unsigned int count = (unsigned int)layout.blocks.size();
+		positions.setLength(count);
+		scales.setLength(count);
+		if (count > 0) {
+			layout.expandInstances((float)brickScale, &positions[0], &scales[0]);
+		}
+	}
+	else if (m_mergeBricks) {
+		MDoubleArray objectIndices = arrayFn.doubleArray("objectIndex", &status);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		unsigned int count = (unsigned int)m_bricks.bricks.size();
+		positions.setLength(count);
+		objectIndices.setLength(count);
+		if (count > 0) {
+			m_bricks.expandInstances((float)brickScale, &positions[0], &objectIndices[0]);
+		}
+	}
+	else {
+		m_spans.expandPositions((float)brickScale, positions);
+		m_spans.rowOffsets(m_rowOffsets);
+	}
+
+	m_outPointsValid = true;
+	return MS::kSuccess;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <maya/MPxNode.h>
+#include <maya/MTypeId.h>
+#include <maya/MString.h>
+#include "Heightfield.h"
+#include "TerrainSpans.h"
+#include "BrickMerger.h"
+#include "TerrainComputeBackend.h"
+#include "TerrainLod.h"
+#include <memory>
+
+/**
+ * @brief Dependency graph node that generates terrain for an instancer
+ *
+ * Takes the same inputs as voxelizeTerrain and writes outPoints, an
+ * arrayAttrs block with a position per voxel (and objectIndex per brick when
+ * bricks is set), which connects straight to an instancer's inputPoints.
+ *
+ * Each stage keeps its result together with the inputs it was built from:
+ * the decoded heightmap, the column spans, the merged bricks and the output
+ * block. A compute only reruns the stages whose inputs changed, so changing
+ * brickScale just re-expands the cached spans, and changing maxHeight or the
+ * dimensions regenerates spans from the decoded heightmap without reading
+ * the file again.
+ *
+ * Any input change, including setting heightMapPath to the same file,
+ * checks the file for edits. An edited image is diffed against the previous
+ * one. Only the columns that sample a changed pixel, plus their
+ * neighbours, are regenerated, and their voxels are spliced into the
+ * existing position array in place. Merged bricks are merged again. When
+ * normalizeHeights or trimBase measure the range from the image and the
+ * edit moves it, the whole terrain is regenerated instead.
+ *
+ * With lodLevels above 0, far chunks are emitted as larger blocks with a
+ * per-instance scale. The min/max pyramid is built once per set of spans,
+ * so moving the camera connected to lodCamera only picks levels again.
+ */
+class LegoTerrainNode : public MPxNode
+{
+public:
+	static const char* nodeName;
+	static const MTypeId id;
+
+	static MObject aHeightMapPath;
+	static MObject aRawWidth;
+	static MObject aBackend;
+	static MObject aBrickScale;
+	static MObject aTerrainWidth;
+	static MObject aTerrainHeight;
+	static MObject aTerrainDimensions;
+	static MObject aMaxHeight;
+	static MObject aNormalizeHeights;
+	static MObject aTrimBase;
+	static MObject aBricks;
+	static MObject aLodCamera;
+	static MObject aLodDistance;
+	static MObject aLodLevels;
+	static MObject aOutPoints;
+	static MObject aOutCount;
+
+	LegoTerrainNode();
+	~LegoTerrainNode() override;
+
+	MStatus compute(const MPlug& plug, MDataBlock& data) override;
+
+	static void* creator();
+	static MStatus initialize();
+
+private:
+	// Stage 1: decoded heightmap, shared with the heightmap cache
+	MString m_heightmapPath;
+	unsigned int m_rawWidth;
+	std::shared_ptr<const Heightfield> m_heightfield;
+
+	// Stage 2: one span per terrain column
+	MString m_backend;
+	unsigned int m_terrainWidth;
+	unsigned int m_terrainHeight;
+	unsigned int m_maxHeight;
+	double m_normalizeClip;
+	int m_trimBase;
+	HeightRange m_range;            // Measured from the heightfield the spans came from
+	TerrainSpans m_spans;
+	bool m_spansValid;
+	TerrainTile m_dirtyCells;       // Columns to regenerate after an edit
+
+	// Stage 3: merged bricks, only when a catalogue is given
+	MString m_bricksSpec;
+	BrickLayout m_bricks;
+	bool m_mergeBricks;
+	bool m_bricksValid;
+
+	// Stage 4: the arrayAttrs block handed to the instancer, with the LOD
+	// pyramid it is selected from when LOD is on
+	double m_brickScale;
+	LodPyramid m_pyramid;
+	bool m_pyramidValid;
+	bool m_useLod;
+	LodSettings m_lodSettings;
+	MObject m_outPoints;
+	bool m_outPointsValid;
+	TerrainTile m_dirtyRows;        // Rows to splice into the positions
+	std::vector<uint64_t> m_rowOffsets;
+
+	MStatus updateHeightfield(const MString& path, unsigned int rawWidth);
+	MStatus updateSpans(const MString& backend, unsigned int terrainWidth, unsigned int terrainHeight, unsigned int maxHeight,
+		double normalizeClip, int trimBase);
+	MStatus updateBricks(const MString& bricksSpec);
+	MStatus updateOutPoints(double brickScale, const LodSettings* lod);
+};
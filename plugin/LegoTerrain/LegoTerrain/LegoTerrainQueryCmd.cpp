@@ -0,0 +1,228 @@
+#include "LegoTerrainQueryCmd.h"
+#include "TerrainComputeService.h"
+#include "TerrainQuery.h"
+#include <maya/MArgList.h>
+#include <maya/MDoubleArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MStringArray.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+const char* LegoTerrainQueryCmd::commandName = "legoTerrainQuery";
+
+const char* LegoTerrainQueryCmd::terrainFlag = "-t";
+const char* LegoTerrainQueryCmd::terrainFlagLong = "-terrain";
+const char* LegoTerrainQueryCmd::pointFlag = "-p";
+const char* LegoTerrainQueryCmd::pointFlagLong = "-point";
+const char* LegoTerrainQueryCmd::rayFlag = "-r";
+const char* LegoTerrainQueryCmd::rayFlagLong = "-ray";
+const char* LegoTerrainQueryCmd::boxFlag = "-bx";
+const char* LegoTerrainQueryCmd::boxFlagLong = "-box";
+const char* LegoTerrainQueryCmd::occupiedFlag = "-oc";
+const char* LegoTerrainQueryCmd::occupiedFlagLong = "-occupied";
+const char* LegoTerrainQueryCmd::maxDistanceFlag = "-md";
+const char* LegoTerrainQueryCmd::maxDistanceFlagLong = "-maxDistance";
+
+LegoTerrainQueryCmd::LegoTerrainQueryCmd()
+{
+}
+
+LegoTerrainQueryCmd::~LegoTerrainQueryCmd()
+{
+}
+
+void* LegoTerrainQueryCmd::creator()
+{
+	return new LegoTerrainQueryCmd();
+}
+
+MSyntax LegoTerrainQueryCmd::newSyntax()
+{
+	MSyntax syntax;
+	syntax.addFlag(terrainFlag, terrainFlagLong, MSyntax::kString);
+	syntax.addFlag(pointFlag, pointFlagLong, MSyntax::kDouble, MSyntax::kDouble);
+	syntax.addFlag(rayFlag, rayFlagLong, MSyntax::kDouble, MSyntax::kDouble, MSyntax::kDouble,
+		MSyntax::kDouble, MSyntax::kDouble, MSyntax::kDouble);
+	syntax.addFlag(boxFlag, boxFlagLong, MSyntax::kDouble, MSyntax::kDouble, MSyntax::kDouble,
+		MSyntax::kDouble, MSyntax::kDouble, MSyntax::kDouble);
+	syntax.addFlag(occupiedFlag, occupiedFlagLong);
+	syntax.addFlag(maxDistanceFlag, maxDistanceFlagLong, MSyntax::kDouble);
+
+	// Any number of queries of one kind per call
+	syntax.makeFlagMultiUse(pointFlag);
+	syntax.makeFlagMultiUse(rayFlag);
+	syntax.makeFlagMultiUse(boxFlag);
+
+	// The terrain's output name can also be given as the object
+	syntax.setObjectType(MSyntax::kStringObjects, 0);
+
+	return syntax;
+}
+
+MStatus LegoTerrainQueryCmd::doIt(const MArgList& args)
+{
+	MStatus status;
+	MArgDatabase argData(newSyntax(), args, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	// Get the terrain, by the same name voxelizeTerrain was given as -outputName
+	MString name = "terrain";
+	MStringArray objects;
+	argData.getObjects(objects);
+	if (argData.isFlagSet(terrainFlag)) {
+		name = argData.flagArgumentString(terrainFlag, 0);
+	}
+	else if (objects.length() > 0) {
+		name = objects[0];
+	}
+
+	std::shared_ptr<const TerrainQuery> query = TerrainComputeService::instance()->terrain(name);
+	if (!query || query->isEmpty()) {
+		MGlobal::displayError("No terrain has been generated with the output name " + name);
+		return MS::kFailure;
+	}
+
+	unsigned int pointCount = argData.numberOfFlagUses(pointFlag);
+	unsigned int rayCount = argData.numberOfFlagUses(rayFlag);
+	unsigned int boxCount = argData.numberOfFlagUses(boxFlag);
+	int kinds = (pointCount > 0 ? 1 : 0) + (rayCount > 0 ? 1 : 0) + (boxCount > 0 ? 1 : 0);
+	if (kinds != 1) {
+		MGlobal::displayError("Give points, rays or boxes to query, one kind per call");
+		return MS::kFailure;
+	}
+
+	if (argData.isFlagSet(maxDistanceFlag) && rayCount == 0) {
+		MGlobal::displayError("Max distance only applies to ray queries");
+		return MS::kFailure;
+	}
+	if (argData.isFlagSet(occupiedFlag) && boxCount == 0) {
+		MGlobal::displayError("Occupied only applies to box queries");
+		return MS::kFailure;
+	}
+
+	if (pointCount > 0) {
+		return queryPoints(argData, *query);
+	}
+	if (rayCount > 0) {
+		return queryRays(argData, *query);
+	}
+	return queryBoxes(argData, *query);
+}
+
+bool LegoTerrainQueryCmd::isUndoable() const
+{
+	// Queries only read the terrain
+	return false;
+}
+
+MStatus LegoTerrainQueryCmd::queryPoints(const MArgDatabase& argData, const TerrainQuery& query)
+{
+	unsigned int count = argData.numberOfFlagUses(pointFlag);
+	MDoubleArray result(count, -1.0);
+
+	for (unsigned int i = 0; i < count; i++) {
+		MArgList flagArgs;
+		argData.getFlagArgumentList(pointFlag, i, flagArgs);
+
+		double height;
+		if (query.surfaceHeight(flagArgs.asDouble(0), flagArgs.asDouble(1), height)) {
+			result[i] = height;
+		}
+	}
+
+	MPxCommand::setResult(result);
+
+	return MS::kSuccess;
+}
+
+MStatus LegoTerrainQueryCmd::queryRays(const MArgDatabase& argData, const TerrainQuery& query)
+{
+	double maxDistance = std::numeric_limits<double>::infinity();
+	if (argData.isFlagSet(maxDistanceFlag)) {
+		maxDistance = argData.flagArgumentDouble(maxDistanceFlag, 0);
+		if (!(maxDistance >= 0.0)) {
+			MGlobal::displayError("Max distance can't be negative");
+			return MS::kFailure;
+		}
+	}
+
+	unsigned int count = argData.numberOfFlagUses(rayFlag);
+	std::vector<TerrainRay> rays(count);
+	for (unsigned int i = 0; i < count; i++) {
+		MArgList flagArgs;
+		argData.getFlagArgumentList(rayFlag, i, flagArgs);
+
+		TerrainRay& ray = rays[i];
+		ray.origin = MVector(flagArgs.asDouble(0), flagArgs.asDouble(1), flagArgs.asDouble(2));
+		ray.direction = MVector(flagArgs.asDouble(3), flagArgs.asDouble(4), flagArgs.asDouble(5));
+		ray.maxDistance = maxDistance;
+		if (ray.direction.length() == 0.0) {
+			MGlobal::displayError(MString("Ray ") + (int)(i + 1) + " has no direction");
+			return MS::kFailure;
+		}
+	}
+
+	std::vector<TerrainHit> hits(count);
+	query.castRays(rays.data(), count, hits.data());
+
+	// Distance, point and normal per ray
+	MDoubleArray result(count * 7, 0.0);
+	for (unsigned int i = 0; i < count; i++) {
+		const TerrainHit& hit = hits[i];
+		unsigned int first = i * 7;
+		if (!hit.hit) {
+			result[first] = -1.0;
+			continue;
+		}
+
+		result[first] = hit.distance;
+		result[first + 1] = hit.point.x;
+		result[first + 2] = hit.point.y;
+		result[first + 3] = hit.point.z;
+		result[first + 4] = hit.normal.x;
+		result[first + 5] = hit.normal.y;
+		result[first + 6] = hit.normal.z;
+	}
+
+	MPxCommand::setResult(result);
+
+	return MS::kSuccess;
+}
+
+MStatus LegoTerrainQueryCmd::queryBoxes(const MArgDatabase& argData, const TerrainQuery& query)
+{
+	bool occupied = argData.isFlagSet(occupiedFlag);
+	unsigned int count = argData.numberOfFlagUses(boxFlag);
+
+	// Counts can pass the range of an int, doubles hold them exactly
+	MDoubleArray counts(occupied ? 0 : count, 0.0);
+	MIntArray flags(occupied ? count : 0, 0);
+
+	for (unsigned int i = 0; i < count; i++) {
+		MArgList flagArgs;
+		argData.getFlagArgumentList(boxFlag, i, flagArgs);
+
+		// Either corner may come first
+		MVector a(flagArgs.asDouble(0), flagArgs.asDouble(1), flagArgs.asDouble(2));
+		MVector b(flagArgs.asDouble(3), flagArgs.asDouble(4), flagArgs.asDouble(5));
+		MVector boxMin(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+		MVector boxMax(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+
+		if (occupied) {
+			flags[i] = query.countVoxels(boxMin, boxMax, 1) > 0 ? 1 : 0;
+		}
+		else {
+			counts[i] = (double)query.countVoxels(boxMin, boxMax);
+		}
+	}
+
+	if (occupied) {
+		MPxCommand::setResult(flags);
+	}
+	else {
+		MPxCommand::setResult(counts);
+	}
+
+	return MS::kSuccess;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <maya/MGlobal.h>
+#include <maya/MPxCommand.h>
+#include <maya/MSyntax.h>
+#include <maya/MArgDatabase.h>
+
+class TerrainQuery;
+
+/**
+ * @brief Point, ray and box queries against a terrain made by voxelizeTerrain
+ *
+ * The terrain is named by its output name. Each call asks one kind of
+ * query, any number of times:
+ *   -point x z                     height of the surface, -1 off the terrain
+ *   -ray ox oy oz dx dy dz         distance, point and normal of the first hit,
+ *                                  7 values per ray with a distance of -1 on a miss
+ *   -box x0 y0 z0 x1 y1 z1         voxels inside the box, or 1/0 with -occupied
+ */
+class LegoTerrainQueryCmd : public MPxCommand
+{
+public:
+	static const char* commandName;
+
+	LegoTerrainQueryCmd();
+	virtual ~LegoTerrainQueryCmd();
+
+	virtual MStatus doIt(const MArgList& args) override;
+	virtual bool isUndoable() const override;
+
+	static void* creator();
+
+	static MSyntax newSyntax();
+
+private:
+	static const char* terrainFlag;
+	static const char* terrainFlagLong;
+	static const char* pointFlag;
+	static const char* pointFlagLong;
+	static const char* rayFlag;
+	static const char* rayFlagLong;
+	static const char* boxFlag;
+	static const char* boxFlagLong;
+	static const char* occupiedFlag;
+	static const char* occupiedFlagLong;
+	static const char* maxDistanceFlag;
+	static const char* maxDistanceFlagLong;
+
+	MStatus queryPoints(const MArgDatabase& argData, const TerrainQuery& query);
+	MStatus queryRays(const MArgDatabase& argData, const TerrainQuery& query);
+	MStatus queryBoxes(const MArgDatabase& argData, const TerrainQuery& query);
+};
@@ -0,0 +1,100 @@
+#include "MappedFile.h"
+#include "CoreTypes.h"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+    : fData(nullptr)
+    , fSize(0)
+#if defined(_WIN32)
+    , fFile(INVALID_HANDLE_VALUE)
+    , fMapping(nullptr)
+#else
+    , fFile(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+MStatus MappedFile::open(const MString& path)
+{
+    close();
+
+#if defined(_WIN32)
+    fFile = CreateFileW(path.asWChar(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (fFile == INVALID_HANDLE_VALUE) {
+        MGlobal::displayError("Failed to open file: " + path);
+        return MS::kFailure;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fFile, &fileSize)) {
+        MGlobal::displayError("Failed to get size of file: " + path);
+        close();
+        return MS::kFailure;
+    }
+    fSize = (size_t)fileSize.QuadPart;
+
+    if (fSize > 0) {
+        fMapping = CreateFileMappingW(fFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        fData = fMapping ? MapViewOfFile(fMapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    }
+#else
+    fFile = ::open(path.asChar(), O_RDONLY);
+    if (fFile < 0) {
+        MGlobal::displayError("Failed to open file: " + path);
+        return MS::kFailure;
+    }
+
+    struct stat fileStat;
+    if (fstat(fFile, &fileStat) != 0) {
+        MGlobal::displayError("Failed to get size of file: " + path);
+        close();
+        return MS::kFailure;
+    }
+    fSize = (size_t)fileStat.st_size;
+
+    if (fSize > 0) {
+        void* mapped = mmap(nullptr, fSize, PROT_READ, MAP_PRIVATE, fFile, 0);
+        fData = mapped != MAP_FAILED ? mapped : nullptr;
+    }
+#endif
+
+    if (fSize > 0 && !fData) {
+        MGlobal::displayError("Failed to map file: " + path);
+        close();
+        return MS::kFailure;
+    }
+
+    return MS::kSuccess;
+}
+
+void MappedFile::close()
+{
+#if defined(_WIN32)
+    if (fData) UnmapViewOfFile(fData);
+    if (fMapping) CloseHandle(fMapping);
+    if (fFile != INVALID_HANDLE_VALUE) CloseHandle(fFile);
+    fMapping = nullptr;
+    fFile = INVALID_HANDLE_VALUE;
+#else
+    if (fData) munmap(fData, fSize);
+    if (fFile >= 0) ::close(fFile);
+    fFile = -1;
+#endif
+    fData = nullptr;
+    fSize = 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include <cstddef>
+
+/**
+ * @brief Read-only memory mapping of a whole file
+ *
+ * Raw heightfields are read in place through the mapping, so decoding them
+ * costs no copy and the OS pages samples in only as they are touched.
+ */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MStatus open(const MString& path);
+    void close();
+
+    const void* data() const { return fData; }
+    size_t size() const { return fSize; }
+
+private:
+    void* fData;
+    size_t fSize;
+#if defined(_WIN32)
+    void* fFile;
+    void* fMapping;
+#else
+    int fFile;
+#endif
+};
@@ -0,0 +1,241 @@
+#include "ProceduralNoise.h"
+#include "CoreTypes.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+
+namespace
+{
+    // Skew and unskew factors of the 2D simplex grid
+    const float F2 = 0.36602540378f;            // (sqrt(3) - 1) / 2
+    const float G2 = 0.21132486540f;            // (3 - sqrt(3)) / 6
+    const float LAST_CORNER = -0.57735026919f;  // 2 * G2 - 1
+
+    // Brings the sum of the three corners to about [-1, 1]
+    const float SIMPLEX_SCALE = 70.0f;
+
+    // Keeps every octave coordinate well inside int range
+    const float MAX_OCTAVE_FREQUENCY = 256.0f;
+
+    const float GRAD_X[8] = { 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 0.0f, 0.0f };
+    const float GRAD_Y[8] = { 1.0f, 1.0f, -1.0f, -1.0f, 0.0f, 0.0f, 1.0f, -1.0f };
+
+    // Seeds of the two warp offsets and the step between octave seeds
+    const uint32_t WARP_SEED_X = 0x68E31DA4u;
+    const uint32_t WARP_SEED_Z = 0xB5297A4Du;
+    const uint32_t OCTAVE_SEED_STEP = 0x9E3779B9u;
+
+    uint32_t hashCorner(int32_t i, int32_t j, uint32_t seed)
+    {
+        uint32_t h = seed ^ ((uint32_t)i * 0x85EBCA6Bu);
+        h = (h << 13) | (h >> 19);
+        h ^= (uint32_t)j * 0xC2B2AE35u;
+        h ^= h >> 16;
+        h *= 0x7FEB352Du;
+        h ^= h >> 15;
+        h *= 0x846CA68Bu;
+        h ^= h >> 16;
+        return h;
+    }
+
+    // Devices may flush denormals to zero, so both sides do
+    float flushTiny(float value)
+    {
+        return std::fabs(value) < FLT_MIN ? 0.0f : value;
+    }
+
+    float corner(uint32_t h, float x, float y)
+    {
+        float t = 0.5f - x * x;
+        t = t - y * y;
+        if (!(t > 0.0f)) return 0.0f;
+
+        float d = GRAD_X[h & 7] * x;
+        d = d + GRAD_Y[h & 7] * y;
+        t = t * t;
+        t = t * t;
+        return flushTiny(t * d);
+    }
+
+    // Matches simplex in the resampleProcedural kernel
+    float simplex(float x, float y, uint32_t seed)
+    {
+        float s = (x + y) * F2;
+        float fi = std::floor(x + s);
+        float fj = std::floor(y + s);
+        float t = (fi + fj) * G2;
+        float x0 = x - (fi - t);
+        float y0 = y - (fj - t);
+
+        // Which of the two triangles of the cell the point is in
+        float i1 = x0 > y0 ? 1.0f : 0.0f;
+        float j1 = 1.0f - i1;
+        float x1 = (x0 - i1) + G2;
+        float y1 = (y0 - j1) + G2;
+        float x2 = x0 + LAST_CORNER;
+        float y2 = y0 + LAST_CORNER;
+
+        int32_t i = (int32_t)fi;
+        int32_t j = (int32_t)fj;
+        float n = corner(hashCorner(i, j, seed), x0, y0);
+        n = n + corner(hashCorner(i + (int32_t)i1, j + (int32_t)j1, seed), x1, y1);
+        n = n + corner(hashCorner(i + 1, j + 1, seed), x2, y2);
+        return flushTiny(n * SIMPLEX_SCALE);
+    }
+
+    const char* variantName(NoiseVariant variant)
+    {
+        switch (variant) {
+        case NoiseVariant::Ridged: return "ridged";
+        case NoiseVariant::Billow: return "billow";
+        default: return "fbm";
+        }
+    }
+}
+
+MStatus NoiseSettings::parse(const MString& spec, NoiseSettings& outSettings)
+{
+    outSettings = NoiseSettings();
+
+    MStringArray entries;
+    spec.split(',', entries);
+
+    for (unsigned int i = 0; i < entries.length(); i++) {
+        MStringArray fields;
+        entries[i].split('=', fields);
+        if (fields.length() != 2) {
+            MGlobal::displayError("Procedural setting must be given as KEY=VALUE: " + entries[i]);
+            return MS::kFailure;
+        }
+
+        MString key = fields[0].toLowerCase();
+        const MString& value = fields[1];
+        if (key == "type") {
+            MString type = value.toLowerCase();
+            if (type == "fbm") outSettings.variant = NoiseVariant::Fbm;
+            else if (type == "ridged") outSettings.variant = NoiseVariant::Ridged;
+            else if (type == "billow") outSettings.variant = NoiseVariant::Billow;
+            else {
+                MGlobal::displayError("Procedural type must be fbm, ridged or billow: " + value);
+                return MS::kFailure;
+            }
+            continue;
+        }
+
+        if (!value.isDouble()) {
+            MGlobal::displayError("Procedural setting must be a number: " + entries[i]);
+            return MS::kFailure;
+        }
+
+        double number = value.asDouble();
+        if (key == "seed") {
+            if (!value.isInt() && !(number >= 0.0 && number <= 4294967295.0 && number == std::floor(number))) {
+                MGlobal::displayError("Procedural seed must be a whole number: " + value);
+                return MS::kFailure;
+            }
+            outSettings.seed = value.isInt() ? (uint32_t)value.asInt() : (uint32_t)number;
+        }
+        else if (key == "octaves") {
+            if (!value.isInt() || value.asInt() < 1 || value.asInt() > (int)MAX_OCTAVES) {
+                MGlobal::displayError(MString("Procedural octaves must be between 1 and ") + (int)MAX_OCTAVES + ": " + value);
+                return MS::kFailure;
+            }
+            outSettings.octaves = (unsigned int)value.asInt();
+        }
+        else if (key == "frequency") outSettings.frequency = (float)number;
+        else if (key == "lacunarity") outSettings.lacunarity = (float)number;
+        else if (key == "gain") outSettings.gain = (float)number;
+        else if (key == "warp") outSettings.warp = (float)number;
+        else {
+            MGlobal::displayError("Unknown procedural setting, expected seed, octaves, frequency, lacunarity, gain, type or warp: " + fields[0]);
+            return MS::kFailure;
+        }
+    }
+
+    if (!(outSettings.frequency > 0.0f) || !(outSettings.lacunarity >= 1.0f) || !(outSettings.gain > 0.0f)
+        || !(outSettings.warp >= 0.0f && outSettings.warp <= 65536.0f)) {
+        MGlobal::displayError("Procedural frequency and gain must be positive, lacunarity at least 1 and warp between 0 and 65536: " + spec);
+        return MS::kFailure;
+    }
+
+    if (outSettings.frequency * std::pow(outSettings.lacunarity, (float)(outSettings.octaves - 1)) > MAX_OCTAVE_FREQUENCY) {
+        MGlobal::displayError(MString("Procedural frequency of the last octave must be at most ") + MAX_OCTAVE_FREQUENCY
+            + " cycles per voxel: " + spec);
+        return MS::kFailure;
+    }
+
+    return MS::kSuccess;
+}
+
+MString NoiseSettings::toString() const
+{
+    // 9 digits round-trip a float, so equal strings mean equal terrains
+    char text[256];
+    snprintf(text, sizeof(text), "seed=%u,octaves=%u,frequency=%.9g,lacunarity=%.9g,gain=%.9g,type=%s,warp=%.9g",
+        seed, octaves, frequency, lacunarity, gain, variantName(variant), warp);
+    return MString(text);
+}
+
+float NoiseSettings::amplitudeScale() const
+{
+    float total = 0.0f;
+    float amplitude = 1.0f;
+    for (unsigned int octave = 0; octave < octaves; octave++) {
+        total = total + amplitude;
+        amplitude = amplitude * gain;
+    }
+    return 1.0f / total;
+}
+
+uint16_t ProceduralNoise::quantizedHeight(const NoiseSettings& settings, float amplitudeScale,
+    unsigned int x, unsigned int z, unsigned int maxHeight)
+{
+    float px = (float)x;
+    float pz = (float)z;
+
+    // Offset the sample point by low-frequency noise, bending the features
+    if (settings.warp > 0.0f) {
+        float wx = px * settings.frequency;
+        float wz = pz * settings.frequency;
+        float offsetX = settings.warp * simplex(wx, wz, settings.seed ^ WARP_SEED_X);
+        float offsetZ = settings.warp * simplex(wx, wz, settings.seed ^ WARP_SEED_Z);
+        px = px + offsetX;
+        pz = pz + offsetZ;
+    }
+
+    float fx = px * settings.frequency;
+    float fz = pz * settings.frequency;
+    float sum = 0.0f;
+    float amplitude = 1.0f;
+    for (unsigned int octave = 0; octave < settings.octaves; octave++) {
+        float n = simplex(fx, fz, settings.seed + octave * OCTAVE_SEED_STEP);
+        if (settings.variant == NoiseVariant::Ridged) {
+            n = 1.0f - std::fabs(n);
+            n = n * n;
+        }
+        else if (settings.variant == NoiseVariant::Billow) {
+            n = std::fabs(n) * 2.0f;
+            n = n - 1.0f;
+        }
+
+        float term = n * amplitude;
+        sum = sum + term;
+        amplitude = amplitude * settings.gain;
+        fx = fx * settings.lacunarity;
+        fz = fz * settings.lacunarity;
+    }
+
+    // Ridged sums are already in [0, 1], the others are brought there from [-1, 1]
+    float h = sum * amplitudeScale;
+    if (settings.variant != NoiseVariant::Ridged) {
+        h = h * 0.5f;
+        h = h + 0.5f;
+    }
+
+    // Quantized like a float sample
+    float scaled = h * (float)maxHeight;
+    if (!(scaled > 0.0f)) return 0;
+    if (scaled >= (float)maxHeight) return (uint16_t)maxHeight;
+    return (uint16_t)std::min<float>(std::floor(scaled + 0.5f), (float)maxHeight);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include <cstdint>
+
+/**
+ * @brief How the octaves of a procedural heightfield are shaped
+ */
+enum class NoiseVariant
+{
+    Fbm,        // Plain fractal sum, rolling hills
+    Ridged,     // Folded and squared octaves, sharp crests
+    Billow      // Folded octaves, rounded lumps and creases
+};
+
+/**
+ * @brief Parameters of a procedural heightfield
+ *
+ * Heights are fractal simplex noise evaluated at each terrain cell, so the
+ * terrain can be any size and is the same whichever tiles it is made in.
+ */
+struct NoiseSettings
+{
+    uint32_t seed = 1;
+    unsigned int octaves = 6;
+    float frequency = 1.0f / 256.0f;    // Cycles per voxel of the first octave
+    float lacunarity = 2.0f;            // Frequency multiplier per octave
+    float gain = 0.5f;                  // Amplitude multiplier per octave
+    NoiseVariant variant = NoiseVariant::Fbm;
+    float warp = 0.0f;                  // Domain warp distance in voxels, 0 for none
+
+    static const unsigned int MAX_OCTAVES = 16;
+
+    /**
+     * @brief Read settings from "key=value,..." text
+     *
+     * Keys are seed, octaves, frequency, lacunarity, gain, type (fbm, ridged
+     * or billow) and warp. Keys that are left out keep their defaults, so an
+     * empty string is valid.
+     */
+    static MStatus parse(const MString& spec, NoiseSettings& outSettings);
+
+    // Canonical text of the settings, equal for equal settings
+    MString toString() const;
+
+    // 1 / sum of the octave amplitudes, which brings the fractal sum into [-1, 1]
+    float amplitudeScale() const;
+};
+
+/**
+ * @brief Procedural heights, evaluated the same way on every backend
+ *
+ * The noise only uses float adds, multiplies and compares, integer hashing
+ * and floor, all of which round the same everywhere, and the resampleProcedural
+ * kernel mirrors this code operation for operation. The CPU and OpenCL
+ * backends therefore produce identical terrains.
+ */
+namespace ProceduralNoise
+{
+    // Height of terrain cell (x, z), scaled to maxHeight and quantized like float samples
+    uint16_t quantizedHeight(const NoiseSettings& settings, float amplitudeScale,
+        unsigned int x, unsigned int z, unsigned int maxHeight);
+}
@@ -0,0 +1,196 @@
+#include "Profiler.h"
+#include "CoreTypes.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+std::atomic<Profiler*> Profiler::sActive(nullptr);
+
+namespace
+{
+    std::string jsonString(const std::string& text)
+    {
+        std::string quoted = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') quoted += '\\';
+            if ((unsigned char)c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned int)c);
+                quoted += escaped;
+                continue;
+            }
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+
+    std::string jsonNumber(double value)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%.3f", value);
+        return text;
+    }
+}
+
+Profiler::Activation::Activation(Profiler* profiler)
+    : fPrevious(sActive.exchange(profiler, std::memory_order_acq_rel))
+{
+}
+
+Profiler::Activation::~Activation()
+{
+    sActive.store(fPrevious, std::memory_order_release);
+}
+
+Profiler::Profiler()
+    : fOrigin(std::chrono::steady_clock::now())
+{
+    threadTrack();
+}
+
+double Profiler::now() const
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - fOrigin).count();
+}
+
+void Profiler::addEvent(const std::string& name, const char* category, const std::string& track,
+    double startUs, double durationUs)
+{
+    std::lock_guard<std::mutex> lock(fMutex);
+    fEvents.push_back({ name, category, track, startUs, durationUs });
+}
+
+std::string Profiler::threadTrack()
+{
+    std::ostringstream id;
+    id << std::this_thread::get_id();
+
+    std::lock_guard<std::mutex> lock(fMutex);
+    auto found = std::find(fThreadIds.begin(), fThreadIds.end(), id.str());
+    size_t index = found - fThreadIds.begin();
+    if (found == fThreadIds.end()) {
+        fThreadIds.push_back(id.str());
+    }
+    return index == 0 ? std::string("main") : "worker " + std::to_string(index);
+}
+
+std::string Profiler::toJson() const
+{
+    std::lock_guard<std::mutex> lock(fMutex);
+
+    struct Stage
+    {
+        std::string name;
+        std::string category;
+        size_t count = 0;
+        double totalUs = 0.0;
+        double maxUs = 0.0;
+    };
+
+    std::vector<Stage> stages;
+    std::map<std::string, size_t> stageIndex;
+    double endUs = 0.0;
+    for (const Event& event : fEvents) {
+        std::string key = event.category + "/" + event.name;
+        auto found = stageIndex.find(key);
+        if (found == stageIndex.end()) {
+            found = stageIndex.emplace(key, stages.size()).first;
+            stages.push_back(Stage());
+            stages.back().name = event.name;
+            stages.back().category = event.category;
+        }
+
+        Stage& stage = stages[found->second];
+        stage.count++;
+        stage.totalUs += event.durationUs;
+        stage.maxUs = std::max(stage.maxUs, event.durationUs);
+        endUs = std::max(endUs, event.startUs + event.durationUs);
+    }
+
+    std::string json = "{\"spanMs\":" + jsonNumber(endUs / 1000.0) + ",\"stages\":[";
+    for (size_t i = 0; i < stages.size(); i++) {
+        const Stage& stage = stages[i];
+        if (i > 0) json += ",";
+        json += "{\"name\":" + jsonString(stage.name)
+            + ",\"category\":" + jsonString(stage.category)
+            + ",\"count\":" + std::to_string(stage.count)
+            + ",\"totalMs\":" + jsonNumber(stage.totalUs / 1000.0)
+            + ",\"maxMs\":" + jsonNumber(stage.maxUs / 1000.0) + "}";
+    }
+
+    json += "],\"events\":[";
+    for (size_t i = 0; i < fEvents.size(); i++) {
+        const Event& event = fEvents[i];
+        if (i > 0) json += ",";
+        json += "{\"name\":" + jsonString(event.name)
+            + ",\"category\":" + jsonString(event.category)
+            + ",\"track\":" + jsonString(event.track)
+            + ",\"startMs\":" + jsonNumber(event.startUs / 1000.0)
+            + ",\"durationMs\":" + jsonNumber(event.durationUs / 1000.0) + "}";
+    }
+    return json + "]}";
+}
+
+std::string Profiler::toChromeTrace() const
+{
+    std::lock_guard<std::mutex> lock(fMutex);
+
+    // Each track becomes a thread of one process, named by a metadata event
+    std::vector<std::string> tracks;
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (size_t i = 0; i < fEvents.size(); i++) {
+        const Event& event = fEvents[i];
+        size_t tid = std::find(tracks.begin(), tracks.end(), event.track) - tracks.begin();
+        if (tid == tracks.size()) {
+            tracks.push_back(event.track);
+        }
+
+        if (i > 0) json += ",";
+        json += "{\"name\":" + jsonString(event.name)
+            + ",\"cat\":" + jsonString(event.category)
+            + ",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string(tid)
+            + ",\"ts\":" + jsonNumber(event.startUs)
+            + ",\"dur\":" + jsonNumber(event.durationUs) + "}";
+    }
+
+    for (size_t tid = 0; tid < tracks.size(); tid++) {
+        if (!fEvents.empty() || tid > 0) json += ",";
+        json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(tid)
+            + ",\"args\":{\"name\":" + jsonString(tracks[tid]) + "}}";
+    }
+    return json + "]}";
+}
+
+MStatus Profiler::writeChromeTrace(const MString& path) const
+{
+    std::ofstream file(path.asChar(), std::ios::binary | std::ios::trunc);
+    if (!file) {
+        MGlobal::displayError("Failed to open profile trace for writing: " + path);
+        return MS::kFailure;
+    }
+
+    file << toChromeTrace();
+    if (!file) {
+        MGlobal::displayError("Failed to write profile trace: " + path);
+        return MS::kFailure;
+    }
+    return MS::kSuccess;
+}
+
+ProfileScope::ProfileScope(const char* name)
+    : fProfiler(Profiler::active())
+    , fName(name)
+    , fStart(fProfiler ? fProfiler->now() : 0.0)
+{
+}
+
+ProfileScope::~ProfileScope()
+{
+    if (fProfiler) {
+        double end = fProfiler->now();
+        fProfiler->addEvent(fName, "host", fProfiler->threadTrack(), fStart, end - fStart);
+    }
+}
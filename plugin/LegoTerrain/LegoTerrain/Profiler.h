@@ -0,0 +1,98 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Timeline of the host and device work of one command
+ *
+ * Host stages are timed with ProfileScope and land on a track per thread.
+ * Device commands are added with addEvent once they have completed, on a
+ * track per queue. Times are microseconds since the profiler was created.
+ *
+ * One profiler is active at a time, set with Profiler::Activation, so deep
+ * code can time itself without the profiler being passed down to it. With
+ * none active a ProfileScope costs a pointer load. Recording is
+ * thread-safe.
+ */
+class Profiler
+{
+public:
+    struct Event
+    {
+        std::string name;
+        std::string category;     // "host" or "device"
+        std::string track;        // Thread or queue the event ran on
+        double startUs;
+        double durationUs;
+    };
+
+    // Makes a profiler the active one for as long as it exists
+    class Activation
+    {
+    public:
+        explicit Activation(Profiler* profiler);
+        ~Activation();
+
+        Activation(const Activation&) = delete;
+        Activation& operator=(const Activation&) = delete;
+
+    private:
+        Profiler* fPrevious;
+    };
+
+    Profiler();
+
+    static Profiler* active() { return sActive.load(std::memory_order_acquire); }
+
+    // Microseconds since construction
+    double now() const;
+
+    void addEvent(const std::string& name, const char* category, const std::string& track,
+        double startUs, double durationUs);
+
+    // Track name of the calling thread: "main" for the one that created the profiler, else "worker N"
+    std::string threadTrack();
+
+    /**
+     * @brief Stage totals and every event, as one JSON object
+     *
+     * "stages" sums the events of each name and category, in order of first
+     * appearance; "events" lists them in the order they were recorded.
+     */
+    std::string toJson() const;
+
+    // Events in the Chrome trace event format, for chrome://tracing or Perfetto
+    std::string toChromeTrace() const;
+    MStatus writeChromeTrace(const MString& path) const;
+
+private:
+    std::chrono::steady_clock::time_point fOrigin;
+    mutable std::mutex fMutex;
+    std::vector<Event> fEvents;
+    std::vector<std::string> fThreadIds;
+
+    static std::atomic<Profiler*> sActive;
+};
+
+/**
+ * @brief Records the lifetime of a block as a host event on the active profiler
+ */
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char* name);
+    ~ProfileScope();
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    Profiler* fProfiler;
+    const char* fName;
+    double fStart;
+};
@@ -0,0 +1,358 @@
+#include "SimdKernels.h"
+#include <algorithm>
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace
+{
+    bool detectAvx2()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+
+        // The OS must save the YMM registers (OSXSAVE + AVX, then XCR0)
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+            return false;
+        }
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    void graySumScalar(const unsigned char* pixels, uint16_t* out, size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            const unsigned char* p = pixels + i * 4;
+            out[i] = (uint16_t)(p[0] + p[1] + p[2]);
+        }
+    }
+
+    TARGET_AVX2 void graySumAvx2(const unsigned char* pixels, uint16_t* out, size_t count)
+    {
+        const __m256i channelWeights = _mm256_set1_epi32(0x00010101); // r, g, b, not a
+        const __m256i ones = _mm256_set1_epi16(1);
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i rgba = _mm256_loadu_si256((const __m256i*)(pixels + i * 4));
+            __m256i pairs = _mm256_maddubs_epi16(rgba, channelWeights);   // (r + g, b) per pixel
+            __m256i sums = _mm256_madd_epi16(pairs, ones);                // r + g + b per pixel
+            __m256i packed = _mm256_packus_epi32(sums, sums);
+            packed = _mm256_permute4x64_epi64(packed, 0x08);
+            _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(packed));
+        }
+
+        graySumScalar(pixels + i * 4, out + i, count - i);
+    }
+
+    void min3Sse2(const uint16_t* a, const uint16_t* b, const uint16_t* c, uint16_t* out, size_t count)
+    {
+        // SSE2 only has a signed 16 bit min, so flip the sign bit around it
+        const __m128i bias = _mm_set1_epi16((short)0x8000);
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i va = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)), bias);
+            __m128i vb = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(b + i)), bias);
+            __m128i vc = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(c + i)), bias);
+            __m128i m = _mm_min_epi16(_mm_min_epi16(va, vb), vc);
+            _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(m, bias));
+        }
+
+        for (; i < count; i++) {
+            out[i] = std::min(std::min(a[i], b[i]), c[i]);
+        }
+    }
+
+    TARGET_AVX2 void min3Avx2(const uint16_t* a, const uint16_t* b, const uint16_t* c, uint16_t* out, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+            __m256i vc = _mm256_loadu_si256((const __m256i*)(c + i));
+            __m256i m = _mm256_min_epu16(_mm256_min_epu16(va, vb), vc);
+            _mm256_storeu_si256((__m256i*)(out + i), m);
+        }
+
+        for (; i < count; i++) {
+            out[i] = std::min(std::min(a[i], b[i]), c[i]);
+        }
+    }
+
+    void minMaxScalar(const uint16_t* values, size_t count, uint16_t& low, uint16_t& high)
+    {
+        for (size_t i = 0; i < count; i++) {
+            low = std::min(low, values[i]);
+            high = std::max(high, values[i]);
+        }
+    }
+
+    void minMaxSse2(const uint16_t* values, size_t count, uint16_t& outLow, uint16_t& outHigh)
+    {
+        // Signed 16 bit min and max again, with the sign bit flipped around them
+        const __m128i bias = _mm_set1_epi16((short)0x8000);
+        __m128i low = _mm_set1_epi16(0x7FFF);
+        __m128i high = _mm_set1_epi16((short)0x8000);
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(values + i)), bias);
+            low = _mm_min_epi16(low, v);
+            high = _mm_max_epi16(high, v);
+        }
+
+        alignas(16) uint16_t lanes[16];
+        _mm_store_si128((__m128i*)lanes, _mm_xor_si128(low, bias));
+        _mm_store_si128((__m128i*)(lanes + 8), _mm_xor_si128(high, bias));
+        outLow = *std::min_element(lanes, lanes + 8);
+        outHigh = *std::max_element(lanes + 8, lanes + 16);
+        minMaxScalar(values + i, count - i, outLow, outHigh);
+    }
+
+    TARGET_AVX2 void minMaxAvx2(const uint16_t* values, size_t count, uint16_t& outLow, uint16_t& outHigh)
+    {
+        __m256i low = _mm256_set1_epi16((short)0xFFFF);
+        __m256i high = _mm256_setzero_si256();
+
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(values + i));
+            low = _mm256_min_epu16(low, v);
+            high = _mm256_max_epu16(high, v);
+        }
+
+        alignas(32) uint16_t lanes[32];
+        _mm256_store_si256((__m256i*)lanes, low);
+        _mm256_store_si256((__m256i*)(lanes + 16), high);
+        outLow = *std::min_element(lanes, lanes + 16);
+        outHigh = *std::max_element(lanes + 16, lanes + 32);
+        minMaxScalar(values + i, count - i, outLow, outHigh);
+    }
+
+    uint16_t blendDivideScalar(uint64_t blend, uint64_t offset, const Simd::RoundingDivisor& d)
+    {
+        // At or past the divisor the result is the whole scale
+        uint64_t x = blend > offset ? blend - offset : 0;
+        x = std::min(x, d.divisor);
+
+        // x * scale / divisor is within 1 of the estimate, so the distance from
+        // the next rounding point is small enough to wrap exactly in 64 bits
+        uint64_t e = (uint64_t)((double)x * d.ratio + 0.5);
+        int64_t s = (int64_t)(2 * x * d.scale - (2 * e + 1) * d.divisor);
+        if (s >= 0) {
+            e++;
+        }
+        else if (s + (int64_t)(2 * d.divisor) < 0) {
+            e--;
+        }
+        return (uint16_t)e;
+    }
+
+    // All ones in the 64 bit lanes holding a negative value
+    inline __m128i negativeMask(__m128i v)
+    {
+        return _mm_shuffle_epi32(_mm_srai_epi32(v, 31), _MM_SHUFFLE(3, 3, 1, 1));
+    }
+
+    // 64 bit lanes times the low 32 bits of each lane of b, wrapping
+    inline __m128i mul64x32(__m128i a, __m128i b)
+    {
+        __m128i low = _mm_mul_epu32(a, b);
+        __m128i high = _mm_mul_epu32(_mm_srli_epi64(a, 32), b);
+        return _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+    }
+
+    // Two lanes of blendDivideScalar, top and bottom in the low 32 bits of each lane
+    inline __m128i blendDivideSse2Lanes(__m128i top, __m128i bottom, __m128i topWeight, __m128i bottomWeight,
+        __m128i offset, __m128i divisor, __m128i twoDivisor, __m128i scale, __m128d ratio)
+    {
+        const __m128i one = _mm_set1_epi64x(1);
+        const __m128i magicBits = _mm_set1_epi64x(0x4330000000000000ll);      // 2^52
+        const __m128d magic = _mm_castsi128_pd(magicBits);
+
+        __m128i x = _mm_add_epi64(_mm_mul_epu32(top, topWeight), _mm_mul_epu32(bottom, bottomWeight));
+        x = _mm_sub_epi64(x, offset);
+        x = _mm_andnot_si128(negativeMask(x), x);
+        __m128i over = _mm_sub_epi64(x, divisor);
+        x = _mm_add_epi64(divisor, _mm_and_si128(over, negativeMask(over)));
+
+        // Below 2^52 the integer is the mantissa of 2^52 + x, both ways
+        __m128d xd = _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(x, magicBits)), magic);
+        __m128d ed = _mm_add_pd(_mm_mul_pd(xd, ratio), magic);
+        __m128i e = _mm_sub_epi64(_mm_castpd_si128(ed), magicBits);
+
+        __m128i s = _mm_slli_epi64(mul64x32(x, scale), 1);
+        s = _mm_sub_epi64(s, mul64x32(divisor, _mm_add_epi64(_mm_add_epi64(e, e), one)));
+        e = _mm_add_epi64(e, _mm_add_epi64(one, negativeMask(s)));
+        e = _mm_add_epi64(e, negativeMask(_mm_add_epi64(s, twoDivisor)));
+        return e;
+    }
+
+    void blendDivideSse2(const uint32_t* top, const uint32_t* bottom, uint32_t topWeight, uint32_t bottomWeight,
+        uint64_t offset, const Simd::RoundingDivisor& d, uint16_t* out, size_t count)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i vTopWeight = _mm_set1_epi32((int)topWeight);
+        const __m128i vBottomWeight = _mm_set1_epi32((int)bottomWeight);
+        const __m128i vOffset = _mm_set1_epi64x((long long)offset);
+        const __m128i vDivisor = _mm_set1_epi64x((long long)d.divisor);
+        const __m128i vTwoDivisor = _mm_set1_epi64x((long long)(2 * d.divisor));
+        const __m128i vScale = _mm_set1_epi32((int)d.scale);
+        const __m128d vRatio = _mm_set1_pd(d.ratio);
+
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i t = _mm_loadu_si128((const __m128i*)(top + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(bottom + i));
+            __m128i low = blendDivideSse2Lanes(_mm_unpacklo_epi32(t, zero), _mm_unpacklo_epi32(b, zero),
+                vTopWeight, vBottomWeight, vOffset, vDivisor, vTwoDivisor, vScale, vRatio);
+            __m128i high = blendDivideSse2Lanes(_mm_unpackhi_epi32(t, zero), _mm_unpackhi_epi32(b, zero),
+                vTopWeight, vBottomWeight, vOffset, vDivisor, vTwoDivisor, vScale, vRatio);
+
+            // SSE2 only packs signed 32 bit values, so sign extend the 16 bit ones first
+            __m128i packed = _mm_unpacklo_epi64(_mm_shuffle_epi32(low, _MM_SHUFFLE(3, 3, 2, 0)),
+                _mm_shuffle_epi32(high, _MM_SHUFFLE(3, 3, 2, 0)));
+            packed = _mm_srai_epi32(_mm_slli_epi32(packed, 16), 16);
+            _mm_storel_epi64((__m128i*)(out + i), _mm_packs_epi32(packed, packed));
+        }
+
+        for (; i < count; i++) {
+            out[i] = blendDivideScalar((uint64_t)top[i] * topWeight + (uint64_t)bottom[i] * bottomWeight, offset, d);
+        }
+    }
+
+    TARGET_AVX2 inline __m256i mul64x32Avx2(__m256i a, __m256i b)
+    {
+        __m256i low = _mm256_mul_epu32(a, b);
+        __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+        return _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    }
+
+    TARGET_AVX2 inline __m256i blendDivideAvx2Lanes(__m256i top, __m256i bottom, __m256i topWeight, __m256i bottomWeight,
+        __m256i offset, __m256i divisor, __m256i twoDivisor, __m256i scale, __m256d ratio)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i one = _mm256_set1_epi64x(1);
+        const __m256i magicBits = _mm256_set1_epi64x(0x4330000000000000ll);
+        const __m256d magic = _mm256_castsi256_pd(magicBits);
+
+        __m256i x = _mm256_add_epi64(_mm256_mul_epu32(top, topWeight), _mm256_mul_epu32(bottom, bottomWeight));
+        x = _mm256_sub_epi64(x, offset);
+        x = _mm256_andnot_si256(_mm256_cmpgt_epi64(zero, x), x);
+        __m256i over = _mm256_sub_epi64(x, divisor);
+        x = _mm256_add_epi64(divisor, _mm256_and_si256(over, _mm256_cmpgt_epi64(zero, over)));
+
+        __m256d xd = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(x, magicBits)), magic);
+        __m256d ed = _mm256_add_pd(_mm256_mul_pd(xd, ratio), magic);
+        __m256i e = _mm256_sub_epi64(_mm256_castpd_si256(ed), magicBits);
+
+        __m256i s = _mm256_slli_epi64(mul64x32Avx2(x, scale), 1);
+        s = _mm256_sub_epi64(s, mul64x32Avx2(divisor, _mm256_add_epi64(_mm256_add_epi64(e, e), one)));
+        e = _mm256_add_epi64(e, _mm256_add_epi64(one, _mm256_cmpgt_epi64(zero, s)));
+        e = _mm256_add_epi64(e, _mm256_cmpgt_epi64(zero, _mm256_add_epi64(s, twoDivisor)));
+        return e;
+    }
+
+    TARGET_AVX2 void blendDivideAvx2(const uint32_t* top, const uint32_t* bottom, uint32_t topWeight, uint32_t bottomWeight,
+        uint64_t offset, const Simd::RoundingDivisor& d, uint16_t* out, size_t count)
+    {
+        const __m256i vTopWeight = _mm256_set1_epi32((int)topWeight);
+        const __m256i vBottomWeight = _mm256_set1_epi32((int)bottomWeight);
+        const __m256i vOffset = _mm256_set1_epi64x((long long)offset);
+        const __m256i vDivisor = _mm256_set1_epi64x((long long)d.divisor);
+        const __m256i vTwoDivisor = _mm256_set1_epi64x((long long)(2 * d.divisor));
+        const __m256i vScale = _mm256_set1_epi32((int)d.scale);
+        const __m256d vRatio = _mm256_set1_pd(d.ratio);
+        const __m256i lowHalves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i low = blendDivideAvx2Lanes(
+                _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(top + i))),
+                _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(bottom + i))),
+                vTopWeight, vBottomWeight, vOffset, vDivisor, vTwoDivisor, vScale, vRatio);
+            __m256i high = blendDivideAvx2Lanes(
+                _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(top + i + 4))),
+                _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(bottom + i + 4))),
+                vTopWeight, vBottomWeight, vOffset, vDivisor, vTwoDivisor, vScale, vRatio);
+
+            __m128i packedLow = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(low, lowHalves));
+            __m128i packedHigh = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(high, lowHalves));
+            _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi32(packedLow, packedHigh));
+        }
+
+        blendDivideSse2(top + i, bottom + i, topWeight, bottomWeight, offset, d, out + i, count - i);
+    }
+}
+
+namespace Simd
+{
+    bool hasAvx2()
+    {
+        static const bool supported = detectAvx2();
+        return supported;
+    }
+
+    void graySumFromRgba(const unsigned char* pixels, uint16_t* out, size_t count)
+    {
+        if (hasAvx2()) {
+            graySumAvx2(pixels, out, count);
+        }
+        else {
+            graySumScalar(pixels, out, count);
+        }
+    }
+
+    void min3(const uint16_t* a, const uint16_t* b, const uint16_t* c, uint16_t* out, size_t count)
+    {
+        if (hasAvx2()) {
+            min3Avx2(a, b, c, out, count);
+        }
+        else {
+            min3Sse2(a, b, c, out, count);
+        }
+    }
+
+    void minMax(const uint16_t* values, size_t count, uint16_t& outLow, uint16_t& outHigh)
+    {
+        if (hasAvx2()) {
+            minMaxAvx2(values, count, outLow, outHigh);
+        }
+        else {
+            minMaxSse2(values, count, outLow, outHigh);
+        }
+    }
+
+    RoundingDivisor::RoundingDivisor(uint64_t divisor, uint32_t scale)
+        : divisor(divisor), scale(scale), ratio((double)scale / (double)divisor)
+    {
+    }
+
+    void blendDivide(const uint32_t* top, const uint32_t* bottom, uint32_t topWeight, uint32_t bottomWeight,
+        uint64_t offset, const RoundingDivisor& divisor, uint16_t* out, size_t count)
+    {
+        if (hasAvx2()) {
+            blendDivideAvx2(top, bottom, topWeight, bottomWeight, offset, divisor, out, count);
+        }
+        else {
+            blendDivideSse2(top, bottom, topWeight, bottomWeight, offset, divisor, out, count);
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Vectorized inner loops shared by the CPU paths
+ *
+ * Each function picks AVX2 at runtime when the CPU and OS support it and
+ * falls back to SSE2 (or scalar code) otherwise.
+ */
+namespace Simd
+{
+    bool hasAvx2();
+
+    // out[i] = r + g + b of each RGBA pixel
+    void graySumFromRgba(const unsigned char* pixels, uint16_t* out, size_t count);
+
+    // out[i] = min(a[i], b[i], c[i])
+    void min3(const uint16_t* a, const uint16_t* b, const uint16_t* c, uint16_t* out, size_t count);
+
+    // Smallest and largest of count values; count must be at least 1
+    void minMax(const uint16_t* values, size_t count, uint16_t& outLow, uint16_t& outHigh);
+
+    /**
+     * @brief A divisor fixed for a whole resample, with its reciprocal precomputed
+     *
+     * There is no 64 bit multiply-high in SSE2 or AVX2, so the reciprocal is a
+     * double. It gives an estimate at most one off, which an exact check in
+     * wrapping 64 bit integers then corrects.
+     */
+    struct RoundingDivisor
+    {
+        RoundingDivisor(uint64_t divisor, uint32_t scale);
+
+        uint64_t divisor;
+        uint32_t scale;
+        double ratio;       // scale / divisor
+    };
+
+    // out[i] = (top[i] * topWeight + bottom[i] * bottomWeight - offset) * scale / divisor,
+    // rounded half up, 0 below offset and at most scale. Exact while the blend
+    // and divisor stay below 2^49 and scale below 2^16.
+    void blendDivide(const uint32_t* top, const uint32_t* bottom, uint32_t topWeight, uint32_t bottomWeight,
+        uint64_t offset, const RoundingDivisor& divisor, uint16_t* out, size_t count);
+}
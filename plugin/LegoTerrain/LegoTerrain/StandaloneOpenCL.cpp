@@ -0,0 +1,73 @@
+#include "StandaloneOpenCL.h"
+#include "StandaloneTypes.h"
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    std::once_flag contextOnce;
+    cl_context context = nullptr;
+    cl_device_id device = nullptr;
+
+    cl_device_id findDevice()
+    {
+        cl_uint platformCount = 0;
+        if (clGetPlatformIDs(0, nullptr, &platformCount) != CL_SUCCESS || platformCount == 0) {
+            return nullptr;
+        }
+        std::vector<cl_platform_id> platforms(platformCount);
+        clGetPlatformIDs(platformCount, platforms.data(), nullptr);
+
+        // A GPU on any platform beats whatever the first platform offers
+        for (cl_device_type type : { (cl_device_type)CL_DEVICE_TYPE_GPU, (cl_device_type)CL_DEVICE_TYPE_ALL }) {
+            for (cl_platform_id platform : platforms) {
+                cl_device_id found = nullptr;
+                if (clGetDeviceIDs(platform, type, 1, &found, nullptr) == CL_SUCCESS && found) {
+                    return found;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void createContext()
+    {
+        cl_device_id found = findDevice();
+        if (!found) {
+            return;
+        }
+
+        cl_int err;
+        cl_context created = clCreateContext(nullptr, 1, &found, nullptr, nullptr, &err);
+        if (err != CL_SUCCESS) {
+            MOpenCLInfo::checkCLErrorStatus(err);
+            return;
+        }
+
+        char deviceName[256] = {};
+        clGetDeviceInfo(found, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, nullptr);
+        MGlobal::displayInfo(MString("OpenCL device: ") + deviceName);
+
+        context = created;
+        device = found;
+    }
+}
+
+cl_context MOpenCLInfo::getOpenCLContext()
+{
+    std::call_once(contextOnce, createContext);
+    return context;
+}
+
+cl_device_id MOpenCLInfo::getOpenCLDeviceId()
+{
+    std::call_once(contextOnce, createContext);
+    return device;
+}
+
+void MOpenCLInfo::checkCLErrorStatus(cl_int error)
+{
+    if (error != CL_SUCCESS) {
+        MGlobal::displayError(MString("OpenCL error ") + (int)error);
+    }
+}
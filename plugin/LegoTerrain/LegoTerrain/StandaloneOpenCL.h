@@ -0,0 +1,56 @@
+#pragma once
+
+#if !defined(CL_TARGET_OPENCL_VERSION)
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#if defined(__APPLE__)
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/*
+ * Stand-ins for Maya's OpenCL helpers, for builds without the devkit. The
+ * context and device are created on first use from the first GPU found,
+ * falling back to any device, and live until the process exits.
+ */
+
+class MOpenCLInfo
+{
+public:
+    static cl_context getOpenCLContext();
+    static cl_device_id getOpenCLDeviceId();
+    static void checkCLErrorStatus(cl_int error);
+};
+
+// Owning reference to a cl_mem, released when the last copy goes
+class MAutoCLMem
+{
+public:
+    MAutoCLMem() : fMem(nullptr) {}
+    MAutoCLMem(const MAutoCLMem& other) : fMem(other.fMem) { if (fMem) clRetainMemObject(fMem); }
+    ~MAutoCLMem() { reset(); }
+
+    MAutoCLMem& operator=(const MAutoCLMem& other)
+    {
+        if (other.fMem) clRetainMemObject(other.fMem);
+        reset();
+        fMem = other.fMem;
+        return *this;
+    }
+
+    cl_mem get() const { return fMem; }
+    const cl_mem* getReadOnlyRef() const { return &fMem; }
+
+    // Takes over the caller's reference
+    void attach(cl_mem mem) { reset(); fMem = mem; }
+    void reset()
+    {
+        if (fMem) clReleaseMemObject(fMem);
+        fMem = nullptr;
+    }
+
+private:
+    cl_mem fMem;
+};
@@ -0,0 +1,261 @@
+#include "StandaloneTypes.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+
+#if defined(_WIN32)
+#include <filesystem>
+#endif
+
+#if defined(LEGOTERRAIN_HAS_PNG)
+#include <png.h>
+#endif
+
+namespace
+{
+    std::mutex messageMutex;
+    MGlobal::MessageHandler messageHandler;
+
+    void display(MGlobal::MessageLevel level, const MString& message)
+    {
+        std::lock_guard<std::mutex> lock(messageMutex);
+        if (messageHandler) {
+            messageHandler(level, message);
+            return;
+        }
+
+        const char* prefix = level == MGlobal::kError ? "Error: " : level == MGlobal::kWarning ? "Warning: " : "";
+        fprintf(stderr, "%s%s\n", prefix, message.asChar());
+    }
+
+    bool parseInt(const std::string& text, int& outValue)
+    {
+        if (text.empty()) return false;
+        char* end = nullptr;
+        long value = strtol(text.c_str(), &end, 10);
+        outValue = (int)value;
+        return *end == '\0';
+    }
+
+    bool parseDouble(const std::string& text, double& outValue)
+    {
+        if (text.empty()) return false;
+        char* end = nullptr;
+        outValue = strtod(text.c_str(), &end);
+        return *end == '\0';
+    }
+}
+
+#if defined(_WIN32)
+const wchar_t* MString::asWChar() const
+{
+    fWide = std::filesystem::u8path(fText).wstring();
+    return fWide.c_str();
+}
+#endif
+
+int MString::rindexW(char c) const
+{
+    size_t index = fText.rfind(c);
+    return index == std::string::npos ? -1 : (int)index;
+}
+
+MString MString::substringW(int start, int end) const
+{
+    // Both ends inclusive, like Maya's
+    int last = std::min(end, (int)fText.size() - 1);
+    if (start < 0 || start > last) return MString();
+    return MString(fText.substr(start, last - start + 1));
+}
+
+MString MString::toLowerCase() const
+{
+    std::string lower = fText;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    return MString(lower);
+}
+
+MStatus MString::split(char separator, MStringArray& outParts) const
+{
+    // Empty parts are dropped, as Maya does
+    outParts.clear();
+    size_t start = 0;
+    while (start <= fText.size()) {
+        size_t end = fText.find(separator, start);
+        if (end == std::string::npos) end = fText.size();
+        if (end > start) {
+            outParts.append(MString(fText.substr(start, end - start)));
+        }
+        start = end + 1;
+    }
+    return MS::kSuccess;
+}
+
+bool MString::isInt() const
+{
+    int value;
+    return parseInt(fText, value);
+}
+
+bool MString::isDouble() const
+{
+    double value;
+    return parseDouble(fText, value);
+}
+
+int MString::asInt() const
+{
+    int value = 0;
+    parseInt(fText, value);
+    return value;
+}
+
+double MString::asDouble() const
+{
+    double value = 0.0;
+    parseDouble(fText, value);
+    return value;
+}
+
+MString& MString::operator+=(double value)
+{
+    std::ostringstream stream;
+    stream << value;
+    fText += stream.str();
+    return *this;
+}
+
+MStatus MImage::readFromFile(const MString& path, MPixelType type)
+{
+    release();
+
+#if defined(LEGOTERRAIN_HAS_PNG)
+    FILE* file = fopen(path.asChar(), "rb");
+    if (!file) {
+        return MS::kFailure;
+    }
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    if (!info) {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        fclose(file);
+        return MS::kFailure;
+    }
+
+    // Only members and values set before setjmp are touched after a longjmp
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        fclose(file);
+        release();
+        return MS::kFailure;
+    }
+
+    png_init_io(png, file);
+    png_read_info(png, info);
+
+    // Everything is expanded to RGBA, keeping 16 bits only for float output
+    int bitDepth = png_get_bit_depth(png, info);
+    int colorType = png_get_color_type(png, info);
+    bool wide = bitDepth == 16 && type == kFloat;
+    png_set_expand(png);
+    if (colorType == PNG_COLOR_TYPE_GRAY || colorType == PNG_COLOR_TYPE_GRAY_ALPHA) {
+        png_set_gray_to_rgb(png);
+    }
+    if (!(colorType & PNG_COLOR_MASK_ALPHA) && !png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_add_alpha(png, wide ? 0xFFFF : 0xFF, PNG_FILLER_AFTER);
+    }
+    if (bitDepth == 16 && !wide) {
+        png_set_strip_16(png);
+    }
+    if (wide) {
+        png_set_swap(png);
+    }
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    fWidth = png_get_image_width(png, info);
+    fHeight = png_get_image_height(png, info);
+    size_t rowBytes = png_get_rowbytes(png, info);
+    fBytes.resize(rowBytes * fHeight);
+
+    // Bottom row first
+    for (int pass = 0; pass < passes; pass++) {
+        for (unsigned int y = 0; y < fHeight; y++) {
+            png_read_row(png, fBytes.data() + (size_t)(fHeight - 1 - y) * rowBytes, nullptr);
+        }
+    }
+    png_read_end(png, nullptr);
+    png_destroy_read_struct(&png, &info, nullptr);
+    fclose(file);
+
+    size_t channelCount = (size_t)fWidth * fHeight * 4;
+    if (type == kFloat) {
+        fFloats.resize(channelCount);
+        for (size_t i = 0; i < channelCount; i++) {
+            fFloats[i] = wide ? reinterpret_cast<const uint16_t*>(fBytes.data())[i] / 65535.0f : fBytes[i] / 255.0f;
+        }
+        fBytes.clear();
+        fBytes.shrink_to_fit();
+    }
+    fType = type;
+    return MS::kSuccess;
+#else
+    (void)type;
+    MGlobal::displayError("Built without libpng, can't read " + path);
+    return MS::kFailure;
+#endif
+}
+
+MStatus MImage::getSize(unsigned int& width, unsigned int& height) const
+{
+    width = fWidth;
+    height = fHeight;
+    return MS::kSuccess;
+}
+
+unsigned char* MImage::pixels() const
+{
+    return fType == kByte && !fBytes.empty() ? fBytes.data() : nullptr;
+}
+
+float* MImage::floatPixels() const
+{
+    return fType == kFloat && !fFloats.empty() ? fFloats.data() : nullptr;
+}
+
+MStatus MImage::release()
+{
+    fWidth = 0;
+    fHeight = 0;
+    fType = kUnknown;
+    fBytes.clear();
+    fBytes.shrink_to_fit();
+    fFloats.clear();
+    fFloats.shrink_to_fit();
+    return MS::kSuccess;
+}
+
+void MGlobal::displayInfo(const MString& message)
+{
+    display(kInfo, message);
+}
+
+void MGlobal::displayWarning(const MString& message)
+{
+    display(kWarning, message);
+}
+
+void MGlobal::displayError(const MString& message)
+{
+    display(kError, message);
+}
+
+void MGlobal::setMessageHandler(const MessageHandler& handler)
+{
+    std::lock_guard<std::mutex> lock(messageMutex);
+    messageHandler = handler;
+}
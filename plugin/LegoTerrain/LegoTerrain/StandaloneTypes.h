@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ * Stand-ins for the Maya value types the core uses, for builds without the
+ * devkit. Only the members the core calls exist, with Maya's signatures and
+ * behaviour, so code that compiles here compiles against Maya too.
+ */
+
+namespace MS
+{
+    enum MStatusCode
+    {
+        kSuccess = 0,
+        kFailure,
+        kInsufficientMemory,
+        kInvalidParameter,
+        kNotImplemented
+    };
+}
+
+class MStatus
+{
+public:
+    MStatus() : fCode(MS::kSuccess) {}
+    MStatus(MS::MStatusCode code) : fCode(code) {}
+
+    bool error() const { return fCode != MS::kSuccess; }
+    MS::MStatusCode statusCode() const { return fCode; }
+    operator bool() const { return fCode == MS::kSuccess; }
+
+    bool operator==(const MStatus& other) const { return fCode == other.fCode; }
+    bool operator==(MS::MStatusCode code) const { return fCode == code; }
+    bool operator!=(const MStatus& other) const { return fCode != other.fCode; }
+    bool operator!=(MS::MStatusCode code) const { return fCode != code; }
+
+private:
+    MS::MStatusCode fCode;
+};
+
+class MStringArray;
+
+class MString
+{
+public:
+    MString() {}
+    MString(const char* text) : fText(text ? text : "") {}
+    MString(const std::string& text) : fText(text) {}
+
+    const char* asChar() const { return fText.c_str(); }
+#if defined(_WIN32)
+    const wchar_t* asWChar() const;
+#endif
+    unsigned int length() const { return (unsigned int)fText.size(); }
+    unsigned int numChars() const { return length(); }
+    void clear() { fText.clear(); }
+
+    // Index of the last occurrence of c, or -1
+    int rindexW(char c) const;
+    MString substringW(int start, int end) const;
+    MString toLowerCase() const;
+    MStatus split(char separator, MStringArray& outParts) const;
+
+    bool isInt() const;
+    bool isDouble() const;
+    int asInt() const;
+    double asDouble() const;
+
+    MString& operator+=(const MString& other) { fText += other.fText; return *this; }
+    MString& operator+=(const char* text) { fText += text; return *this; }
+    MString& operator+=(int value) { fText += std::to_string(value); return *this; }
+    MString& operator+=(unsigned int value) { fText += std::to_string(value); return *this; }
+    MString& operator+=(double value);
+    MString& operator+=(float value) { return *this += (double)value; }
+
+    template <typename T>
+    MString operator+(const T& value) const
+    {
+        MString result(*this);
+        result += value;
+        return result;
+    }
+
+    bool operator==(const MString& other) const { return fText == other.fText; }
+    bool operator==(const char* text) const { return fText == text; }
+    bool operator!=(const MString& other) const { return fText != other.fText; }
+    bool operator!=(const char* text) const { return fText != text; }
+    bool operator<(const MString& other) const { return fText < other.fText; }
+
+private:
+    std::string fText;
+#if defined(_WIN32)
+    mutable std::wstring fWide;
+#endif
+};
+
+inline MString operator+(const char* text, const MString& string)
+{
+    return MString(text) + string;
+}
+
+class MStringArray
+{
+public:
+    unsigned int length() const { return (unsigned int)fItems.size(); }
+    MStatus setLength(unsigned int length) { fItems.resize(length); return MS::kSuccess; }
+    MStatus append(const MString& item) { fItems.push_back(item); return MS::kSuccess; }
+    MStatus clear() { fItems.clear(); return MS::kSuccess; }
+
+    MString& operator[](unsigned int index) { return fItems[index]; }
+    const MString& operator[](unsigned int index) const { return fItems[index]; }
+
+private:
+    std::vector<MString> fItems;
+};
+
+class MVector
+{
+public:
+    double x = 0.0;
+    double y = 0.0;
+    double z = 0.0;
+
+    MVector() {}
+    MVector(double xx, double yy, double zz = 0.0) : x(xx), y(yy), z(zz) {}
+
+    MVector operator+(const MVector& other) const { return MVector(x + other.x, y + other.y, z + other.z); }
+    MVector operator-(const MVector& other) const { return MVector(x - other.x, y - other.y, z - other.z); }
+    MVector operator*(double scale) const { return MVector(x * scale, y * scale, z * scale); }
+    double length() const { return std::sqrt(x * x + y * y + z * z); }
+};
+
+class MVectorArray
+{
+public:
+    unsigned int length() const { return (unsigned int)fItems.size(); }
+    MStatus setLength(unsigned int length) { fItems.resize(length); return MS::kSuccess; }
+    MStatus append(const MVector& item) { fItems.push_back(item); return MS::kSuccess; }
+    MStatus clear() { fItems.clear(); return MS::kSuccess; }
+
+    MVector& operator[](unsigned int index) { return fItems[index]; }
+    const MVector& operator[](unsigned int index) const { return fItems[index]; }
+
+private:
+    std::vector<MVector> fItems;
+};
+
+/**
+ * @brief PNG reader with MImage's pixel layout
+ *
+ * Pixels are RGBA, 8 bits or float per channel, with the bottom row first
+ * as Maya stores them, so terrains come out the same as in the plugin. Only
+ * PNG is read, and only when the build found libpng.
+ */
+class MImage
+{
+public:
+    enum MPixelType { kUnknown, kByte, kFloat };
+
+    MImage() {}
+
+    MStatus readFromFile(const MString& path, MPixelType type = kByte);
+    MStatus getSize(unsigned int& width, unsigned int& height) const;
+    MPixelType pixelType() const { return fType; }
+    unsigned int depth() const { return fType == kFloat ? 16 : 4; }
+    unsigned char* pixels() const;
+    float* floatPixels() const;
+    MStatus release();
+
+private:
+    unsigned int fWidth = 0;
+    unsigned int fHeight = 0;
+    MPixelType fType = kUnknown;
+    mutable std::vector<unsigned char> fBytes;
+    mutable std::vector<float> fFloats;
+};
+
+class MGlobal
+{
+public:
+    enum MessageLevel { kInfo, kWarning, kError };
+    typedef std::function<void(MessageLevel level, const MString& message)> MessageHandler;
+
+    static void displayInfo(const MString& message);
+    static void displayWarning(const MString& message);
+    static void displayError(const MString& message);
+
+    // Standalone only: where messages go, stderr by default
+    static void setMessageHandler(const MessageHandler& handler);
+};
+
+#define CHECK_MSTATUS_AND_RETURN_IT(_status)                                              \
+    do {                                                                                  \
+        MStatus _checkedStatus = (_status);                                               \
+        if (_checkedStatus != MS::kSuccess) {                                             \
+            MGlobal::displayError(MString(__FILE__) + ":" + (int)__LINE__ + ": failed");  \
+            return _checkedStatus;                                                        \
+        }                                                                                 \
+    } while (0)
+
+#define CHECK_MSTATUS(_status)                                                            \
+    do {                                                                                  \
+        MStatus _checkedStatus = (_status);                                               \
+        if (_checkedStatus != MS::kSuccess) {                                             \
+            MGlobal::displayError(MString(__FILE__) + ":" + (int)__LINE__ + ": failed");  \
+        }                                                                                 \
+    } while (0)
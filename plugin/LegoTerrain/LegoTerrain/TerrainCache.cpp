@@ -0,0 +1,369 @@
+#include "TerrainCache.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "CoreTypes.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace
+{
+    const char MAGIC[8] = { 'L', 'T', 'C', 'A', 'C', 'H', 'E', '\0' };
+
+    // Reads back as another value on a machine of the other byte order
+    const uint32_t ENDIAN_TAG = 0x01020304;
+
+    // Bytes per task when hashing and copying
+    const size_t BLOCK_SIZE = 1 << 22;
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t endianTag;
+        uint64_t sourceHash;
+        uint64_t sourceSize;
+        uint64_t rangeHash;
+        uint32_t terrainWidth;
+        uint32_t terrainHeight;
+        uint32_t maxHeight;
+        uint32_t rawWidth;
+        uint32_t imageWidth;
+        uint32_t imageHeight;
+        uint32_t lowestColumn;
+        uint32_t tallestColumn;
+        uint32_t base;
+        uint32_t reserved;
+        uint64_t voxelCount;
+        uint64_t spanCount;
+        uint64_t spansOffset;
+        uint64_t bricksHash;        // 0 when the file has no bricks
+        uint64_t brickTypeCount;
+        uint64_t brickTypesOffset;
+        uint64_t brickCount;
+        uint64_t bricksOffset;
+    };
+
+    static_assert(sizeof(FileHeader) % 8 == 0, "Sections after the header must stay 8-byte aligned");
+
+    uint64_t alignUp(uint64_t offset)
+    {
+        return (offset + 7) & ~(uint64_t)7;
+    }
+
+    uint64_t mix(uint64_t h)
+    {
+        h *= 0x9E3779B97F4A7C15ull;
+        return h ^ (h >> 32);
+    }
+
+    uint64_t hashBlock(const uint8_t* data, size_t size)
+    {
+        uint64_t h = mix(size + 1);
+        size_t words = size / 8;
+        for (size_t i = 0; i < words; i++) {
+            uint64_t word;
+            memcpy(&word, data + i * 8, 8);
+            h = mix(h ^ word);
+        }
+
+        uint64_t tail = 0;
+        memcpy(&tail, data + words * 8, size % 8);
+        return mix(h ^ tail ^ ((uint64_t)(size % 8) << 56));
+    }
+
+    void copyParallel(void* dst, const void* src, size_t bytes)
+    {
+        ThreadPool::global().parallelFor(0, bytes, BLOCK_SIZE, [&](size_t begin, size_t end) {
+            memcpy(static_cast<uint8_t*>(dst) + begin, static_cast<const uint8_t*>(src) + begin, end - begin);
+        });
+    }
+
+    // Every column sits at its own index and is solid from yMin to yMax
+    bool spansValid(const TerrainSpans& spans)
+    {
+        std::atomic<bool> valid(true);
+        ThreadPool::global().parallelFor(0, spans.spans.size(), BLOCK_SIZE / sizeof(ColumnSpan), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end && valid.load(std::memory_order_relaxed); i++) {
+                const ColumnSpan& span = spans.spans[i];
+                if (span.yMin > span.yMax || span.x != i % spans.terrainWidth || span.z != i / spans.terrainWidth) {
+                    valid = false;
+                }
+            }
+        });
+        return valid;
+    }
+
+    // Every brick has a type and lies within the terrain
+    bool bricksValid(const BrickLayout& bricks, unsigned int terrainWidth, unsigned int terrainHeight)
+    {
+        for (const BrickType& type : bricks.types) {
+            if (type.width == 0 || type.depth == 0) {
+                return false;
+            }
+        }
+
+        std::atomic<bool> valid(true);
+        ThreadPool::global().parallelFor(0, bricks.bricks.size(), BLOCK_SIZE / sizeof(BrickInstance), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end && valid.load(std::memory_order_relaxed); i++) {
+                const BrickInstance& brick = bricks.bricks[i];
+                if (brick.type >= bricks.types.size()
+                    || (uint32_t)brick.x + bricks.types[brick.type].width > terrainWidth
+                    || (uint32_t)brick.z + bricks.types[brick.type].depth > terrainHeight) {
+                    valid = false;
+                }
+            }
+        });
+        return valid;
+    }
+
+    bool sectionFits(uint64_t offset, uint64_t count, size_t elementSize, size_t fileSize)
+    {
+        return offset % 8 == 0 && offset <= fileSize && count <= (fileSize - offset) / elementSize;
+    }
+}
+
+uint64_t TerrainCache::hashBytes(const void* data, size_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    size_t blockCount = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<uint64_t> blockHashes(blockCount);
+
+    ThreadPool::global().parallelFor(0, blockCount, 1, [&](size_t begin, size_t end) {
+        for (size_t block = begin; block < end; block++) {
+            size_t offset = block * BLOCK_SIZE;
+            blockHashes[block] = hashBlock(bytes + offset, std::min(BLOCK_SIZE, size - offset));
+        }
+    });
+
+    // Combined in order, so moving blocks around changes the hash
+    uint64_t h = mix(size);
+    for (uint64_t blockHash : blockHashes) {
+        h = mix(h ^ blockHash);
+    }
+    return h;
+}
+
+uint64_t TerrainCache::catalogueHash(const BrickCatalogue& catalogue)
+{
+    const std::vector<BrickType>& types = catalogue.types();
+    uint64_t h = hashBytes(types.data(), types.size() * sizeof(BrickType));
+
+    // 0 is kept for "no bricks"
+    return h != 0 ? h : 1;
+}
+
+MStatus TerrainCache::makeKey(const MString& heightmapPath, unsigned int rawWidth, unsigned int terrainWidth,
+    unsigned int terrainHeight, unsigned int maxHeight, TerrainCacheKey& outKey)
+{
+    std::error_code error;
+    if (!std::filesystem::exists(heightmapPath.asChar(), error)) {
+        MGlobal::displayError("Height map file does not exist: " + heightmapPath);
+        return MS::kFailure;
+    }
+
+    MappedFile file;
+    MStatus status = file.open(heightmapPath);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    outKey.sourceHash = hashBytes(file.data(), file.size());
+    outKey.sourceSize = file.size();
+    outKey.terrainWidth = terrainWidth;
+    outKey.terrainHeight = terrainHeight;
+    outKey.maxHeight = maxHeight;
+    outKey.rawWidth = rawWidth;
+
+    return MS::kSuccess;
+}
+
+void TerrainCache::makeKey(const NoiseSettings& noise, unsigned int terrainWidth, unsigned int terrainHeight,
+    unsigned int maxHeight, TerrainCacheKey& outKey)
+{
+    // Equal settings print the same, so the text stands in for file bytes
+    MString settings = noise.toString();
+    outKey.sourceHash = hashBytes(settings.asChar(), settings.length());
+    outKey.sourceSize = 0;
+    outKey.terrainWidth = terrainWidth;
+    outKey.terrainHeight = terrainHeight;
+    outKey.maxHeight = maxHeight;
+    outKey.rawWidth = 0;
+}
+
+uint64_t TerrainCache::rangeHash(double normalizeClip, int trimBase)
+{
+    if (normalizeClip < 0.0 && trimBase == 0) {
+        return 0;
+    }
+
+    char settings[64];
+    int length = snprintf(settings, sizeof(settings), "normalize=%.17g,base=%d",
+        normalizeClip < 0.0 ? -1.0 : normalizeClip, trimBase);
+    uint64_t h = hashBytes(settings, (size_t)length);
+    return h != 0 ? h : 1;
+}
+
+MStatus TerrainCache::write(const MString& path, const TerrainCacheKey& key, unsigned int imageWidth,
+    unsigned int imageHeight, const CachedColumnHeights& heights, const TerrainSpans& spans,
+    const BrickLayout* bricks, uint64_t bricksHash)
+{
+    FileHeader header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT_VERSION;
+    header.endianTag = ENDIAN_TAG;
+    header.sourceHash = key.sourceHash;
+    header.sourceSize = key.sourceSize;
+    header.rangeHash = key.rangeHash;
+    header.terrainWidth = key.terrainWidth;
+    header.terrainHeight = key.terrainHeight;
+    header.maxHeight = key.maxHeight;
+    header.rawWidth = key.rawWidth;
+    header.imageWidth = imageWidth;
+    header.imageHeight = imageHeight;
+    header.lowestColumn = heights.lowestColumn;
+    header.tallestColumn = heights.tallestColumn;
+    header.base = heights.base;
+    header.voxelCount = spans.voxelCount;
+    header.spanCount = spans.spans.size();
+    header.spansOffset = sizeof(FileHeader);
+
+    uint64_t end = header.spansOffset + header.spanCount * sizeof(ColumnSpan);
+    if (bricks) {
+        header.bricksHash = bricksHash;
+        header.brickTypeCount = bricks->types.size();
+        header.brickTypesOffset = end;
+        header.brickCount = bricks->bricks.size();
+        header.bricksOffset = alignUp(header.brickTypesOffset + header.brickTypeCount * sizeof(BrickType));
+    }
+
+    // Written next to the target and renamed over it, so a reader never sees half a file
+    std::string tempPath = std::string(path.asChar()) + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            MGlobal::displayError("Failed to open terrain cache for writing: " + path);
+            return MS::kFailure;
+        }
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(spans.spans.data()), header.spanCount * sizeof(ColumnSpan));
+        if (bricks) {
+            const char padding[8] = {};
+            file.write(reinterpret_cast<const char*>(bricks->types.data()), header.brickTypeCount * sizeof(BrickType));
+            file.write(padding, header.bricksOffset - (header.brickTypesOffset + header.brickTypeCount * sizeof(BrickType)));
+            file.write(reinterpret_cast<const char*>(bricks->bricks.data()), header.brickCount * sizeof(BrickInstance));
+        }
+
+        if (!file) {
+            MGlobal::displayError("Failed to write terrain cache: " + path);
+            file.close();
+            std::error_code error;
+            std::filesystem::remove(tempPath, error);
+            return MS::kFailure;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tempPath, path.asChar(), error);
+    if (error) {
+        MGlobal::displayError("Failed to replace terrain cache: " + path);
+        std::filesystem::remove(tempPath, error);
+        return MS::kFailure;
+    }
+
+    return MS::kSuccess;
+}
+
+MStatus TerrainCache::read(const MString& path, const TerrainCacheKey& key, uint64_t bricksHash,
+    TerrainSpans& outSpans, BrickLayout* outBricks, unsigned int& outImageWidth,
+    unsigned int& outImageHeight, CachedColumnHeights& outHeights, bool& outLoaded, bool& outHasBricks)
+{
+    outLoaded = false;
+    outHasBricks = false;
+
+    std::error_code error;
+    if (!std::filesystem::exists(path.asChar(), error)) {
+        return MS::kSuccess;
+    }
+
+    MappedFile file;
+    MStatus status = file.open(path);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    FileHeader header;
+    if (file.size() < sizeof(header)
+        || (memcpy(&header, file.data(), sizeof(header)), memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)) {
+        MGlobal::displayWarning("Not a terrain cache, it will be overwritten: " + path);
+        return MS::kSuccess;
+    }
+
+    if (header.version != FORMAT_VERSION || header.endianTag != ENDIAN_TAG) {
+        MGlobal::displayInfo("Terrain cache is from another version, regenerating: " + path);
+        return MS::kSuccess;
+    }
+
+    TerrainCacheKey fileKey;
+    fileKey.sourceHash = header.sourceHash;
+    fileKey.sourceSize = header.sourceSize;
+    fileKey.rangeHash = header.rangeHash;
+    fileKey.terrainWidth = header.terrainWidth;
+    fileKey.terrainHeight = header.terrainHeight;
+    fileKey.maxHeight = header.maxHeight;
+    fileKey.rawWidth = header.rawWidth;
+    if (!(fileKey == key)) {
+        MGlobal::displayInfo("Terrain cache does not match the height map or parameters, regenerating: " + path);
+        return MS::kSuccess;
+    }
+
+    bool hasBricks = outBricks && header.bricksHash != 0 && header.bricksHash == bricksHash;
+    if (header.spanCount != (uint64_t)header.terrainWidth * header.terrainHeight
+        || !sectionFits(header.spansOffset, header.spanCount, sizeof(ColumnSpan), file.size())
+        || (header.bricksHash != 0 && (!sectionFits(header.brickTypesOffset, header.brickTypeCount, sizeof(BrickType), file.size())
+            || !sectionFits(header.bricksOffset, header.brickCount, sizeof(BrickInstance), file.size())))) {
+        MGlobal::displayWarning("Terrain cache is truncated or damaged, regenerating: " + path);
+        return MS::kSuccess;
+    }
+
+    const uint8_t* data = static_cast<const uint8_t*>(file.data());
+    outSpans.clear();
+    outSpans.terrainWidth = header.terrainWidth;
+    outSpans.terrainHeight = header.terrainHeight;
+    outSpans.spans.resize(header.spanCount);
+    copyParallel(outSpans.spans.data(), data + header.spansOffset, header.spanCount * sizeof(ColumnSpan));
+
+    // The count sizes the particle arrays, so it comes from the spans themselves
+    bool valid = spansValid(outSpans);
+    if (valid) {
+        outSpans.updateVoxelCount();
+        valid = outSpans.voxelCount == header.voxelCount;
+    }
+
+    if (valid && hasBricks) {
+        outBricks->clear();
+        outBricks->types.resize(header.brickTypeCount);
+        memcpy(outBricks->types.data(), data + header.brickTypesOffset, header.brickTypeCount * sizeof(BrickType));
+        outBricks->bricks.resize(header.brickCount);
+        copyParallel(outBricks->bricks.data(), data + header.bricksOffset, header.brickCount * sizeof(BrickInstance));
+        valid = bricksValid(*outBricks, header.terrainWidth, header.terrainHeight);
+    }
+
+    if (!valid) {
+        outSpans.clear();
+        if (outBricks) {
+            outBricks->clear();
+        }
+        MGlobal::displayWarning("Terrain cache is truncated or damaged, regenerating: " + path);
+        return MS::kSuccess;
+    }
+
+    outImageWidth = header.imageWidth;
+    outImageHeight = header.imageHeight;
+    outHeights.lowestColumn = header.lowestColumn;
+    outHeights.tallestColumn = header.tallestColumn;
+    outHeights.base = header.base;
+    outLoaded = true;
+    outHasBricks = hasBricks;
+    return MS::kSuccess;
+}
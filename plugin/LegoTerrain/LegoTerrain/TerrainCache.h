@@ -0,0 +1,99 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "TerrainSpans.h"
+#include "BrickMerger.h"
+#include "ProceduralNoise.h"
+#include <cstdint>
+
+/**
+ * @brief What a cached terrain was generated from
+ *
+ * Two terrains with equal keys are identical, whichever backend made them.
+ * The source is identified by the hash and size of the heightmap file's
+ * bytes, so a touched but unchanged file still matches. A procedural
+ * source is identified by the hash of its settings and a size of 0.
+ * rangeHash identifies the height range settings, 0 for the defaults.
+ */
+struct TerrainCacheKey
+{
+    uint64_t sourceHash = 0;
+    uint64_t sourceSize = 0;
+    uint32_t terrainWidth = 0;
+    uint32_t terrainHeight = 0;
+    uint32_t maxHeight = 0;
+    uint32_t rawWidth = 0;
+    uint64_t rangeHash = 0;
+
+    bool operator==(const TerrainCacheKey& other) const
+    {
+        return sourceHash == other.sourceHash && sourceSize == other.sourceSize
+            && terrainWidth == other.terrainWidth && terrainHeight == other.terrainHeight
+            && maxHeight == other.maxHeight && rawWidth == other.rawWidth
+            && rangeHash == other.rangeHash;
+    }
+};
+
+/**
+ * @brief Column heights of a cached terrain, kept so a cache hit reports them too
+ */
+struct CachedColumnHeights
+{
+    uint32_t lowestColumn = 0;      // Before the base is cut
+    uint32_t tallestColumn = 0;
+    uint32_t base = 0;              // Layers cut from every column
+};
+
+/**
+ * @brief Generated terrains on disk, to skip decode and generation on reuse
+ *
+ * A cache file is a fixed header with the key, followed by the spans and,
+ * when the terrain was merged, the brick types and instances. Sections are
+ * stored exactly as they are laid out in memory, 8-byte aligned, so reading
+ * a file maps it and copies each section out in one pass; no field is
+ * parsed or converted.
+ *
+ * Files are little-endian and versioned. A file from another format
+ * version, or whose generation code has changed since, is treated as stale
+ * and regenerated.
+ */
+class TerrainCache
+{
+public:
+    // Bump when the layout or the generated output changes
+    static const uint32_t FORMAT_VERSION = 3;
+
+    // Hash the heightmap's bytes and fill in the key for these parameters
+    static MStatus makeKey(const MString& heightmapPath, unsigned int rawWidth, unsigned int terrainWidth,
+        unsigned int terrainHeight, unsigned int maxHeight, TerrainCacheKey& outKey);
+
+    // Key of a procedural terrain, from its noise settings
+    static void makeKey(const NoiseSettings& noise, unsigned int terrainWidth, unsigned int terrainHeight,
+        unsigned int maxHeight, TerrainCacheKey& outKey);
+
+    // Identifies the height range settings: normalizeClip below 0 leaves the
+    // samples as they are, trimBase is a layer count or -1 for automatic
+    static uint64_t rangeHash(double normalizeClip, int trimBase);
+
+    // Identifies a catalogue, so bricks are only reused with the one they were merged with
+    static uint64_t catalogueHash(const BrickCatalogue& catalogue);
+
+    // Write atomically: the file is replaced only once it is complete
+    static MStatus write(const MString& path, const TerrainCacheKey& key, unsigned int imageWidth,
+        unsigned int imageHeight, const CachedColumnHeights& heights, const TerrainSpans& spans,
+        const BrickLayout* bricks, uint64_t bricksHash);
+
+    /**
+     * @brief Load the terrain cached at path when its key matches
+     *
+     * A missing or stale file is not an error: outLoaded is left false.
+     * Bricks are read into outBricks when the file has them for bricksHash,
+     * which outHasBricks reports.
+     */
+    static MStatus read(const MString& path, const TerrainCacheKey& key, uint64_t bricksHash,
+        TerrainSpans& outSpans, BrickLayout* outBricks, unsigned int& outImageWidth,
+        unsigned int& outImageHeight, CachedColumnHeights& outHeights, bool& outLoaded, bool& outHasBricks);
+
+    // 64-bit hash of a byte range, computed in parallel blocks
+    static uint64_t hashBytes(const void* data, size_t size);
+};
@@ -0,0 +1,186 @@
+#include "TerrainColoring.h"
+#include "CoreTypes.h"
+#include <cmath>
+#include <cstdlib>
+
+namespace
+{
+    const double HALF_PI = 1.57079632679489661923;
+
+    struct RampKey
+    {
+        double position;
+        uint32_t color;
+    };
+
+    MStatus parseColor(const MString& text, uint32_t& outColor)
+    {
+        const char* digits = text.asChar();
+        char* end = nullptr;
+        unsigned long value = strtoul(digits, &end, 16);
+        if (text.length() != 6 || end != digits + 6) {
+            MGlobal::displayError("Ramp colour must be given as RRGGBB: " + text);
+            return MS::kFailure;
+        }
+
+        outColor = (uint32_t)value;
+        return MS::kSuccess;
+    }
+
+    uint32_t blend(uint32_t from, uint32_t to, double t)
+    {
+        uint32_t color = 0;
+        for (int shift = 16; shift >= 0; shift -= 8) {
+            double a = (from >> shift) & 0xFF;
+            double b = (to >> shift) & 0xFF;
+            color |= (uint32_t)std::lround(a + (b - a) * t) << shift;
+        }
+        return color;
+    }
+}
+
+const char* TerrainColoring::DEFAULT_HEIGHT_RAMP = "height:0=0055bf,0.08=f2cd37,0.15=237841,0.6=6c6e68,0.85=a0a5a9,1=ffffff";
+const char* TerrainColoring::DEFAULT_SLOPE_RAMP = "slope:0=237841,0.45=958a73,0.7=6c6e68,1=6c6e68";
+
+MStatus TerrainColoring::parseRamp(const MString& spec, TerrainColoring& outColoring)
+{
+    outColoring = TerrainColoring();
+
+    MStringArray parts;
+    spec.split(':', parts);
+    if (parts.length() == 0 || parts.length() > 2) {
+        MGlobal::displayError("Colour ramp must be given as SOURCE[:POSITION=RRGGBB,...]: " + spec);
+        return MS::kFailure;
+    }
+
+    MString source = parts[0].toLowerCase();
+    if (source != "height" && source != "slope") {
+        MGlobal::displayError("Colour ramp source must be height or slope: " + parts[0]);
+        return MS::kFailure;
+    }
+
+    // A bare source takes its default keys
+    if (parts.length() == 1) {
+        return parseRamp(source == "height" ? DEFAULT_HEIGHT_RAMP : DEFAULT_SLOPE_RAMP, outColoring);
+    }
+
+    MStringArray entries;
+    parts[1].split(',', entries);
+
+    std::vector<RampKey> keys;
+    for (unsigned int i = 0; i < entries.length(); i++) {
+        MStringArray fields;
+        entries[i].split('=', fields);
+
+        if (fields.length() != 2 || !fields[0].isDouble()) {
+            MGlobal::displayError("Ramp key must be given as POSITION=RRGGBB: " + entries[i]);
+            return MS::kFailure;
+        }
+
+        RampKey key;
+        key.position = fields[0].asDouble();
+        if (key.position < 0.0 || key.position > 1.0 || (!keys.empty() && key.position < keys.back().position)) {
+            MGlobal::displayError("Ramp positions must be increasing and between 0 and 1: " + entries[i]);
+            return MS::kFailure;
+        }
+
+        MStatus status = parseColor(fields[1], key.color);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+
+        keys.push_back(key);
+    }
+
+    if (keys.empty()) {
+        MGlobal::displayError("Colour ramp has no keys: " + spec);
+        return MS::kFailure;
+    }
+
+    // Bake the ramp, holding the end colours past the first and last key
+    outColoring.fTable.resize(RAMP_SIZE);
+    size_t next = 0;
+    for (unsigned int i = 0; i < RAMP_SIZE; i++) {
+        double position = (double)i / (RAMP_SIZE - 1);
+        while (next < keys.size() && keys[next].position < position) {
+            next++;
+        }
+
+        if (next == 0) {
+            outColoring.fTable[i] = keys.front().color;
+        }
+        else if (next == keys.size()) {
+            outColoring.fTable[i] = keys.back().color;
+        }
+        else {
+            const RampKey& from = keys[next - 1];
+            const RampKey& to = keys[next];
+            double t = (position - from.position) / (to.position - from.position);
+            outColoring.fTable[i] = blend(from.color, to.color, t);
+        }
+    }
+
+    outColoring.fSource = source == "height" ? ColorSource::Height : ColorSource::Slope;
+    return MS::kSuccess;
+}
+
+MStatus TerrainColoring::loadColorMap(const MString& path, TerrainColoring& outColoring)
+{
+    outColoring = TerrainColoring();
+
+    MImage image;
+    MStatus status = image.readFromFile(path);
+    if (status != MS::kSuccess) {
+        MGlobal::displayError("Failed to load colour map: " + path);
+        return status;
+    }
+
+    unsigned int width, height;
+    image.getSize(width, height);
+
+    const unsigned char* pixels = image.pixels();
+    if (width == 0 || height == 0 || !pixels) {
+        MGlobal::displayError("Colour map has no pixels: " + path);
+        return MS::kFailure;
+    }
+
+    // Packed down from RGBA, in the same row order as the heightmap
+    size_t pixelCount = (size_t)width * height;
+    outColoring.fTable.resize(pixelCount);
+    for (size_t i = 0; i < pixelCount; i++) {
+        const unsigned char* pixel = pixels + i * 4;
+        outColoring.fTable[i] = ((uint32_t)pixel[0] << 16) | ((uint32_t)pixel[1] << 8) | pixel[2];
+    }
+
+    outColoring.fMapWidth = width;
+    outColoring.fMapHeight = height;
+    outColoring.fSource = ColorSource::ColorMap;
+    return MS::kSuccess;
+}
+
+uint32_t TerrainColoring::columnColor(const TerrainSpans& spans, size_t column) const
+{
+    const ColumnSpan& span = spans.spans[column];
+
+    if (fSource == ColorSource::ColorMap) {
+        // Nearest pixel, on the grid the heightmap resample uses
+        uint64_t du = std::max(spans.terrainWidth, 2u) - 1;
+        uint64_t dv = std::max(spans.terrainHeight, 2u) - 1;
+        uint64_t px = ((uint64_t)span.x * (fMapWidth - 1) + du / 2) / du;
+        uint64_t py = ((uint64_t)span.z * (fMapHeight - 1) + dv / 2) / dv;
+        return fTable[(size_t)py * fMapWidth + (size_t)px];
+    }
+
+    if (fSource == ColorSource::Slope) {
+        // Steepest drop from this column's top to a neighbour's, as an angle
+        int drop = 0;
+        int top = span.yMax;
+        if (span.x > 0) drop = std::max(drop, top - spans.spans[column - 1].yMax);
+        if (span.x + 1u < spans.terrainWidth) drop = std::max(drop, top - spans.spans[column + 1].yMax);
+        if (span.z > 0) drop = std::max(drop, top - spans.spans[column - spans.terrainWidth].yMax);
+        if (span.z + 1u < spans.terrainHeight) drop = std::max(drop, top - spans.spans[column + spans.terrainWidth].yMax);
+
+        double steepness = std::atan((double)drop) / HALF_PI;
+        return fTable[std::min<size_t>((size_t)std::lround(steepness * (RAMP_SIZE - 1)), RAMP_SIZE - 1)];
+    }
+
+    return 0;
+}
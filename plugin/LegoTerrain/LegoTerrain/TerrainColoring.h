@@ -0,0 +1,77 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "TerrainSpans.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief What a voxel's colour is picked by
+ */
+enum class ColorSource
+{
+    None,
+    ColorMap,   // The colour map pixel above the column
+    Height,     // The voxel's height over the terrain's max height
+    Slope       // The column's steepest drop to a neighbour
+};
+
+/**
+ * @brief Voxel colours, resolved while the positions are expanded
+ *
+ * Colours are kept as packed 0xRRGGBB. A colour map is sampled at each
+ * column with the same pixel mapping as the heightmap resample. Ramps are
+ * baked into a RAMP_SIZE table once, so colouring a voxel is a table load
+ * and needs nothing but the spans being expanded.
+ */
+class TerrainColoring
+{
+public:
+    // Entries in a baked ramp
+    static const unsigned int RAMP_SIZE = 256;
+
+    static const char* DEFAULT_HEIGHT_RAMP;
+    static const char* DEFAULT_SLOPE_RAMP;
+
+    /**
+     * @brief Parse a ramp like "height" or "slope:0=237841,0.5=958a73,1=6c6e68"
+     *
+     * Keys are a position between 0 and 1 and a hex RRGGBB colour, in
+     * increasing order. Colours between keys are blended linearly.
+     */
+    static MStatus parseRamp(const MString& spec, TerrainColoring& outColoring);
+
+    // Colour each column from an 8-bit image, stretched over the terrain
+    static MStatus loadColorMap(const MString& path, TerrainColoring& outColoring);
+
+    ColorSource source() const { return fSource; }
+    bool isEnabled() const { return fSource != ColorSource::None; }
+
+    // Height a height ramp spans, normally the terrain's max height
+    void setMaxHeight(unsigned int maxHeight) { fMaxHeight = maxHeight > 0 ? maxHeight : 1; }
+
+    // Colour shared by every voxel of a column, 0 for height ramps
+    uint32_t columnColor(const TerrainSpans& spans, size_t column) const;
+
+    // Colour of the voxel at height y in a column with the given columnColor
+    uint32_t voxelColor(uint32_t columnColor, unsigned int y) const
+    {
+        if (fSource != ColorSource::Height) return columnColor;
+        return fTable[std::min<size_t>((size_t)y * (RAMP_SIZE - 1) / fMaxHeight, RAMP_SIZE - 1)];
+    }
+
+    // Packed colour as an rgbPP vector, 0 to 1 per channel
+    static MVector toVector(uint32_t color)
+    {
+        const double scale = 1.0 / 255.0;
+        return MVector(((color >> 16) & 0xFF) * scale, ((color >> 8) & 0xFF) * scale, (color & 0xFF) * scale);
+    }
+
+private:
+    ColorSource fSource = ColorSource::None;
+    unsigned int fMaxHeight = 256;
+    unsigned int fMapWidth = 0;
+    unsigned int fMapHeight = 0;
+    std::vector<uint32_t> fTable;   // Baked ramp, or the colour map's pixels
+};
@@ -0,0 +1,565 @@
+#include "TerrainComputeBackend.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
+#include "CoreTypes.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <string>
+
+namespace
+{
+    // Per column and slot: the halo height grid, the device spans and their host copy
+    const double TILE_COLUMN_BYTES = sizeof(uint16_t) + 2 * sizeof(ColumnSpan);
+
+    // Tile sides stay a multiple of the fill kernel's work-group side
+    const unsigned int TILE_ALIGNMENT = 16;
+
+    // Image rows per task when diffing heightfields
+    const size_t DIFF_ROWS = 64;
+
+    double millisecondsSince(std::chrono::high_resolution_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() * 1000.0;
+    }
+
+    // Cells in [0, terrainSize) whose sample pixels i0 or i0 + 1 fall in [p0, p1]
+    void affectedCells(unsigned int p0, unsigned int p1, unsigned int imageSize, unsigned int terrainSize,
+        unsigned int& outBegin, unsigned int& outEnd)
+    {
+        if (imageSize < 2) {
+            outBegin = 0;
+            outEnd = terrainSize;
+            return;
+        }
+
+        // i0 = c * n / denom, as in the resample
+        uint64_t n = imageSize - 1;
+        uint64_t denom = std::max(terrainSize, 2u) - 1;
+        uint64_t first = p0 == 0 ? 0 : ((uint64_t)(p0 - 1) * denom + n - 1) / n;
+        uint64_t last = ((uint64_t)(p1 + 1) * denom - 1) / n;
+
+        outBegin = (unsigned int)std::min<uint64_t>(first, terrainSize);
+        outEnd = (unsigned int)std::min<uint64_t>(last + 1, terrainSize);
+    }
+
+    // Column height of a cell whose four samples are all value, as the resample rounds it
+    unsigned int quantizeValue(uint32_t value, const HeightRange& range, uint32_t maxValue, unsigned int maxHeight)
+    {
+        if (value <= range.lowValue) return 0;
+        uint64_t den = range.high(maxValue) - range.lowValue;
+        uint64_t scaled = (uint64_t)(value - range.lowValue) * maxHeight;
+        uint64_t heightVoxels = scaled / den;
+        if ((scaled % den) * 2 >= den) heightVoxels++;
+        return (unsigned int)std::min<uint64_t>(heightVoxels, maxHeight);
+    }
+
+    unsigned int quantizeHeight(float value, const HeightRange& range, unsigned int maxHeight)
+    {
+        float h = value - range.lowHeight;
+        float scaled = h * range.scale(maxHeight);
+        if (!(scaled > 0.0f)) return 0;
+        if (scaled >= (float)maxHeight) return maxHeight;
+        return (unsigned int)std::min<float>(std::floor(scaled + 0.5f), (float)maxHeight);
+    }
+}
+
+MStatus TerrainComputeBackend::validate(
+    const Heightfield& heightfield,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    unsigned int maxHeight,
+    const HeightRange& range) const
+{
+    if (!isInitialized()) {
+        MGlobal::displayError(MString(name()) + " backend not initialized. Call initialize() first.");
+        return MS::kFailure;
+    }
+
+    if (terrainWidth < 1 || terrainHeight < 1) {
+        MGlobal::displayError("Terrain size must be atleast 1x1");
+        return MS::kFailure;
+    }
+
+    // Span coordinates are stored as 16 bit values
+    if (terrainWidth > TerrainSpans::MAX_DIMENSION || terrainHeight > TerrainSpans::MAX_DIMENSION) {
+        MGlobal::displayError(MString("Terrain size must be at most ") + (int)TerrainSpans::MAX_DIMENSION
+            + "x" + (int)TerrainSpans::MAX_DIMENSION);
+        return MS::kFailure;
+    }
+
+    if (maxHeight > TerrainSpans::MAX_HEIGHT) {
+        MGlobal::displayError(MString("Max height must be at most ") + (int)TerrainSpans::MAX_HEIGHT);
+        return MS::kFailure;
+    }
+
+    if (!heightfield.isProcedural() && (heightfield.width == 0 || heightfield.height == 0)) {
+        MGlobal::displayError("Invalid image dimensions");
+        return MS::kFailure;
+    }
+
+    if (heightfield.format == SampleFormat::Float32 ? !(range.highHeight > range.lowHeight)
+        : range.high(heightfield.maxValue) <= range.lowValue) {
+        MGlobal::displayError("Height range must be higher at the top than at the ground");
+        return MS::kFailure;
+    }
+
+    return MS::kSuccess;
+}
+
+unsigned int TerrainComputeBackend::tileSizeForBudget(
+    const Heightfield& heightfield,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    size_t memoryBudget) const
+{
+    unsigned int terrainSide = std::max(terrainWidth, terrainHeight);
+
+    // Image bytes a tile uploads per terrain column it covers
+    double imageColumnBytes = (double)heightfield.width * heightfield.height * heightfield.sampleSize()
+        / ((double)terrainWidth * terrainHeight);
+
+    // Every pipeline slot holds a tile of its own
+    double columnBytes = (TILE_COLUMN_BYTES + imageColumnBytes) * pipelineDepth();
+    double columns = memoryBudget > 0 ? (double)memoryBudget / columnBytes : 1e300;
+
+    // No single buffer may exceed what the backend can allocate
+    double maxBuffer = (double)maxBufferBytes();
+    columns = std::min(columns, maxBuffer / sizeof(ColumnSpan));
+    if (imageColumnBytes > 0.0) {
+        columns = std::min(columns, maxBuffer / imageColumnBytes);
+    }
+
+    double side = std::floor(std::sqrt(columns));
+    if (side >= terrainSide) {
+        return terrainSide;
+    }
+
+    unsigned int tileSize = (unsigned int)side / TILE_ALIGNMENT * TILE_ALIGNMENT;
+    return std::max(tileSize, TILE_ALIGNMENT);
+}
+
+size_t TerrainComputeBackend::workingSetBytes(const Heightfield& heightfield, unsigned int tileSize, unsigned int slots,
+    unsigned int terrainWidth, unsigned int terrainHeight)
+{
+    double tileColumns = (double)std::min(tileSize, terrainWidth) * std::min(tileSize, terrainHeight);
+    double imageColumnBytes = (double)heightfield.width * heightfield.height * heightfield.sampleSize()
+        / ((double)terrainWidth * terrainHeight);
+    return (size_t)(tileColumns * (TILE_COLUMN_BYTES + imageColumnBytes) * slots);
+}
+
+TerrainTile TerrainComputeBackend::haloRegion(const TerrainTile& tile, unsigned int terrainWidth, unsigned int terrainHeight)
+{
+    TerrainTile region;
+    region.x = tile.x > 0 ? tile.x - 1 : 0;
+    region.z = tile.z > 0 ? tile.z - 1 : 0;
+    region.width = std::min(tile.x + tile.width + 1, terrainWidth) - region.x;
+    region.height = std::min(tile.z + tile.height + 1, terrainHeight) - region.z;
+    return region;
+}
+
+TerrainTile TerrainComputeBackend::imageRegion(const Heightfield& heightfield, const TerrainTile& region,
+    unsigned int terrainWidth, unsigned int terrainHeight)
+{
+    // Same sample positions as the resample: x * (width - 1) / (terrainWidth - 1)
+    uint64_t du = std::max(terrainWidth, 2u) - 1;
+    uint64_t dv = std::max(terrainHeight, 2u) - 1;
+    unsigned int width = heightfield.width;
+    unsigned int height = heightfield.height;
+
+    unsigned int x0 = (unsigned int)((uint64_t)region.x * (width - 1) / du);
+    unsigned int y0 = (unsigned int)((uint64_t)region.z * (height - 1) / dv);
+    unsigned int x1 = std::min((unsigned int)((uint64_t)(region.x + region.width - 1) * (width - 1) / du) + 1, width - 1);
+    unsigned int y1 = std::min((unsigned int)((uint64_t)(region.z + region.height - 1) * (height - 1) / dv) + 1, height - 1);
+
+    TerrainTile image;
+    image.x = x0;
+    image.z = y0;
+    image.width = x1 - x0 + 1;
+    image.height = y1 - y0 + 1;
+    return image;
+}
+
+MStatus TerrainComputeBackend::beginTile(
+    unsigned int slot,
+    const Heightfield& heightfield,
+    const TerrainTile& tile,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    unsigned int maxHeight,
+    const HeightRange& range)
+{
+    if (fSlotSpans.size() <= slot) {
+        fSlotSpans.resize(slot + 1);
+        fSlotStatus.resize(slot + 1);
+    }
+
+    fSlotStatus[slot] = generateTile(heightfield, tile, terrainWidth, terrainHeight, maxHeight, range, fSlotSpans[slot]);
+    return fSlotStatus[slot];
+}
+
+MStatus TerrainComputeBackend::endTile(unsigned int slot, const ColumnSpan*& outSpans)
+{
+    outSpans = fSlotSpans[slot].data();
+    return fSlotStatus[slot];
+}
+
+MStatus TerrainComputeBackend::generateTilesFromHeightfield(
+    const Heightfield& heightfield,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    unsigned int maxHeight,
+    size_t memoryBudget,
+    const HeightRange& range,
+    const TileCallback& onTile)
+{
+    fStats = GenerationStats();
+
+    MStatus status = validate(heightfield, terrainWidth, terrainHeight, maxHeight, range);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    if (heightfield.isBlack()) {
+        MGlobal::displayWarning("Image is completely black, no voxels to generate");
+        return MS::kSuccess;
+    }
+
+    unsigned int tileSize = tileSizeForBudget(heightfield, terrainWidth, terrainHeight, memoryBudget);
+
+    std::vector<TerrainTile> tiles;
+    for (unsigned int z = 0; z < terrainHeight; z += tileSize) {
+        for (unsigned int x = 0; x < terrainWidth; x += tileSize) {
+            TerrainTile tile;
+            tile.x = x;
+            tile.z = z;
+            tile.width = std::min(tileSize, terrainWidth - x);
+            tile.height = std::min(tileSize, terrainHeight - z);
+            tiles.push_back(tile);
+        }
+    }
+
+    unsigned int depth = std::max(pipelineDepth(), 1u);
+    if (tiles.size() > 1) {
+        MGlobal::displayInfo(MString("Generating in ") + (unsigned int)tiles.size() + " tiles of "
+            + tileSize + "x" + tileSize + ", " + depth + " in flight");
+    }
+
+    fStats.tileCount = (unsigned int)tiles.size();
+    fStats.tileSize = tileSize;
+    fStats.workingSetBytes = workingSetBytes(heightfield, tileSize, std::min<unsigned int>(depth, (unsigned int)tiles.size()), terrainWidth, terrainHeight);
+
+    // Keep up to depth tiles in flight; the callback for one tile overlaps
+    // the generation of the ones after it
+    size_t next = 0;
+    for (size_t done = 0; done < tiles.size(); done++) {
+        auto startSubmit = std::chrono::high_resolution_clock::now();
+        while (next < tiles.size() && next < done + depth) {
+            ProfileScope scope("beginTile");
+            status = beginTile((unsigned int)(next % depth), heightfield, tiles[next], terrainWidth, terrainHeight, maxHeight, range);
+            if (status != MS::kSuccess) {
+                abortTiles();
+                return status;
+            }
+            next++;
+        }
+        fStats.submitMs += millisecondsSince(startSubmit);
+
+        auto startWait = std::chrono::high_resolution_clock::now();
+        const ColumnSpan* spans = nullptr;
+        {
+            ProfileScope scope("endTile");
+            status = endTile((unsigned int)(done % depth), spans);
+        }
+        fStats.waitMs += millisecondsSince(startWait);
+
+        auto startAssemble = std::chrono::high_resolution_clock::now();
+        if (status == MS::kSuccess) {
+            ProfileScope scope("assembleTile");
+            status = onTile(tiles[done], spans);
+        }
+        fStats.assembleMs += millisecondsSince(startAssemble);
+        if (status != MS::kSuccess) {
+            abortTiles();
+            return status;
+        }
+    }
+
+    fStats.generateMs = fStats.submitMs + fStats.waitMs;
+    return MS::kSuccess;
+}
+
+TerrainTile TerrainComputeBackend::affectedRegion(const Heightfield& heightfield, const TerrainTile& pixels,
+    unsigned int terrainWidth, unsigned int terrainHeight)
+{
+    TerrainTile cells;
+    if (pixels.columnCount() == 0) {
+        return cells;
+    }
+
+    unsigned int x0, x1, z0, z1;
+    affectedCells(pixels.x, pixels.x + pixels.width - 1, heightfield.width, terrainWidth, x0, x1);
+    affectedCells(pixels.z, pixels.z + pixels.height - 1, heightfield.height, terrainHeight, z0, z1);
+    if (x0 >= x1 || z0 >= z1) {
+        return cells;
+    }
+
+    cells.x = x0;
+    cells.z = z0;
+    cells.width = x1 - x0;
+    cells.height = z1 - z0;
+
+    // A changed height also moves the base of each neighbouring column
+    return haloRegion(cells, terrainWidth, terrainHeight);
+}
+
+bool TerrainComputeBackend::diffHeightfields(const Heightfield& before, const Heightfield& after, TerrainTile& outPixels)
+{
+    outPixels = TerrainTile();
+    if (before.width != after.width || before.height != after.height
+        || before.format != after.format || before.maxValue != after.maxValue || before.isProcedural()) {
+        return false;
+    }
+
+    unsigned int width = before.width;
+    unsigned int height = before.height;
+    size_t sampleSize = before.sampleSize();
+    size_t rowBytes = (size_t)width * sampleSize;
+    const uint8_t* a = static_cast<const uint8_t*>(before.data());
+    const uint8_t* b = static_cast<const uint8_t*>(after.data());
+
+    // Changed column range of every row; rows that match keep first > last
+    std::vector<unsigned int> first(height, width);
+    std::vector<unsigned int> last(height, 0);
+
+    ThreadPool::global().parallelFor(0, height, DIFF_ROWS, [&](size_t rowBegin, size_t rowEnd) {
+        for (size_t y = rowBegin; y < rowEnd; y++) {
+            const uint8_t* rowA = a + y * rowBytes;
+            const uint8_t* rowB = b + y * rowBytes;
+            if (memcmp(rowA, rowB, rowBytes) == 0) continue;
+
+            unsigned int x0 = 0;
+            while (memcmp(rowA + x0 * sampleSize, rowB + x0 * sampleSize, sampleSize) == 0) x0++;
+            unsigned int x1 = width - 1;
+            while (memcmp(rowA + x1 * sampleSize, rowB + x1 * sampleSize, sampleSize) == 0) x1--;
+
+            first[y] = x0;
+            last[y] = x1;
+        }
+    });
+
+    unsigned int x0 = width, x1 = 0, y0 = height, y1 = 0;
+    for (unsigned int y = 0; y < height; y++) {
+        if (first[y] > last[y]) continue;
+        x0 = std::min(x0, first[y]);
+        x1 = std::max(x1, last[y]);
+        y0 = std::min(y0, y);
+        y1 = y;
+    }
+
+    if (y0 < height) {
+        outPixels.x = x0;
+        outPixels.z = y0;
+        outPixels.width = x1 - x0 + 1;
+        outPixels.height = y1 - y0 + 1;
+    }
+    return true;
+}
+
+MStatus TerrainComputeBackend::regenerateRegion(
+    const Heightfield& heightfield,
+    const TerrainTile& region,
+    unsigned int maxHeight,
+    TerrainSpans& inOutSpans,
+    const HeightRange& range)
+{
+    unsigned int terrainWidth = inOutSpans.terrainWidth;
+    unsigned int terrainHeight = inOutSpans.terrainHeight;
+
+    MStatus status = validate(heightfield, terrainWidth, terrainHeight, maxHeight, range);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    if (inOutSpans.spans.size() != (size_t)terrainWidth * terrainHeight
+        || region.x + region.width > terrainWidth || region.z + region.height > terrainHeight) {
+        MGlobal::displayError("Region regeneration needs the whole terrain and a region inside it");
+        return MS::kFailure;
+    }
+
+    if (region.columnCount() == 0) {
+        return MS::kSuccess;
+    }
+
+    std::vector<ColumnSpan> regionSpans;
+    status = generateTile(heightfield, region, terrainWidth, terrainHeight, maxHeight, range, regionSpans);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    // Swap the rows in, keeping count of the voxels that came and went
+    int64_t voxelDelta = 0;
+    for (unsigned int row = 0; row < region.height; row++) {
+        const ColumnSpan* src = regionSpans.data() + (size_t)row * region.width;
+        ColumnSpan* dst = inOutSpans.spans.data() + (size_t)(region.z + row) * terrainWidth + region.x;
+        for (unsigned int x = 0; x < region.width; x++) {
+            voxelDelta += (int64_t)src[x].voxelCount() - dst[x].voxelCount();
+            dst[x] = src[x];
+        }
+    }
+    inOutSpans.voxelCount = (uint64_t)((int64_t)inOutSpans.voxelCount + voxelDelta);
+
+    return MS::kSuccess;
+}
+
+MStatus TerrainComputeBackend::generateSpansFromHeightfield(
+    const Heightfield& heightfield,
+    TerrainSpans& outSpans,
+    unsigned int terrainWidth,
+    unsigned int terrainHeight,
+    unsigned int maxHeight,
+    size_t memoryBudget,
+    const HeightRange& range)
+{
+    outSpans.clear();
+    fStats = GenerationStats();
+
+    MStatus status = validate(heightfield, terrainWidth, terrainHeight, maxHeight, range);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    outSpans.terrainWidth = terrainWidth;
+    outSpans.terrainHeight = terrainHeight;
+
+    if (heightfield.isBlack()) {
+        MGlobal::displayWarning("Image is completely black, no voxels to generate");
+        return MS::kSuccess;
+    }
+
+    MGlobal::displayInfo(MString("Max height: ") + maxHeight);
+
+    unsigned int tileSize = tileSizeForBudget(heightfield, terrainWidth, terrainHeight, memoryBudget);
+    if (tileSize >= terrainWidth && tileSize >= terrainHeight) {
+        // One tile, written straight into the output
+        TerrainTile tile;
+        tile.width = terrainWidth;
+        tile.height = terrainHeight;
+
+        auto startGenerate = std::chrono::high_resolution_clock::now();
+        {
+            ProfileScope scope("generateTile");
+            status = generateTile(heightfield, tile, terrainWidth, terrainHeight, maxHeight, range, outSpans.spans);
+        }
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+
+        fStats.tileCount = 1;
+        fStats.tileSize = std::max(terrainWidth, terrainHeight);
+        fStats.generateMs = millisecondsSince(startGenerate);
+        fStats.workingSetBytes = workingSetBytes(heightfield, fStats.tileSize, 1, terrainWidth, terrainHeight);
+    }
+    else {
+        // Place each tile's rows into the row-major output as it finishes
+        outSpans.spans.resize((size_t)terrainWidth * terrainHeight);
+        ColumnSpan* spans = outSpans.spans.data();
+
+        status = generateTilesFromHeightfield(heightfield, terrainWidth, terrainHeight, maxHeight, memoryBudget, range,
+            [&](const TerrainTile& tile, const ColumnSpan* tileSpans) {
+                for (unsigned int row = 0; row < tile.height; row++) {
+                    std::copy_n(tileSpans + (size_t)row * tile.width, tile.width,
+                        spans + (size_t)(tile.z + row) * terrainWidth + tile.x);
+                }
+                return MStatus(MS::kSuccess);
+            });
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    }
+
+    auto startCount = std::chrono::high_resolution_clock::now();
+    {
+        ProfileScope scope("countVoxels");
+        outSpans.updateVoxelCount();
+    }
+    fStats.countMs = millisecondsSince(startCount);
+
+    MGlobal::displayInfo(MString("Generated ") + std::to_string(outSpans.voxelCount).c_str() + " voxels in "
+        + (int)outSpans.spans.size() + " columns");
+
+    return MS::kSuccess;
+}
+
+MStatus TerrainComputeBackend::normalizedRange(const Heightfield& heightfield, double clip, HeightRange& outRange)
+{
+    outRange = HeightRange();
+    if (heightfield.isProcedural() || heightfield.histogram.empty()) {
+        MGlobal::displayError("Only measured height maps can be normalized");
+        return MS::kFailure;
+    }
+    if (!(clip >= 0.0 && clip < 0.5)) {
+        MGlobal::displayError("Normalize clip must be at least 0 and below 0.5");
+        return MS::kFailure;
+    }
+
+    // First and last bins once clip of the samples have been passed at each end
+    const std::vector<uint64_t>& histogram = heightfield.histogram;
+    uint64_t total = 0;
+    for (uint64_t count : histogram) total += count;
+    uint64_t skip = (uint64_t)(clip * (double)total);
+
+    size_t lowBin = 0;
+    for (uint64_t seen = histogram[0]; seen <= skip && lowBin + 1 < histogram.size(); seen += histogram[++lowBin]) {}
+    size_t highBin = histogram.size() - 1;
+    for (uint64_t seen = histogram[highBin]; seen <= skip && highBin > 0; seen += histogram[--highBin]) {}
+
+    bool flat;
+    if (heightfield.format == SampleFormat::Float32) {
+        float binWidth = 1.0f / Heightfield::HISTOGRAM_BINS;
+        outRange.lowHeight = clip > 0.0 ? std::max(lowBin * binWidth, heightfield.floorHeight) : heightfield.floorHeight;
+        outRange.highHeight = clip > 0.0 ? std::min((highBin + 1) * binWidth, heightfield.peakHeight) : heightfield.peakHeight;
+        flat = !(outRange.highHeight > outRange.lowHeight);
+    }
+    else {
+        unsigned int shift = heightfield.histogramShift;
+        outRange.lowValue = clip > 0.0 ? std::max((uint32_t)lowBin << shift, heightfield.minValue) : heightfield.minValue;
+        outRange.highValue = clip > 0.0 ? std::min((((uint32_t)highBin + 1) << shift) - 1, heightfield.peakValue) : heightfield.peakValue;
+        flat = outRange.highValue <= outRange.lowValue;
+    }
+
+    if (flat) {
+        MGlobal::displayError("Height map is flat, there is no range to normalize");
+        outRange = HeightRange();
+        return MS::kFailure;
+    }
+    return MS::kSuccess;
+}
+
+MStatus TerrainComputeBackend::heightRange(const Heightfield& heightfield, double normalizeClip, int trimBase,
+    unsigned int maxHeight, HeightRange& outRange)
+{
+    outRange = HeightRange();
+    if (normalizeClip >= 0.0) {
+        MStatus status = normalizedRange(heightfield, normalizeClip, outRange);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    }
+
+    unsigned int lowest = 0;
+    unsigned int tallest = 0;
+    heightBounds(heightfield, outRange, maxHeight, lowest, tallest);
+    outRange.base = trimBase < 0 ? lowest : (unsigned int)trimBase;
+
+    if (outRange.base > 0 && outRange.base >= tallest) {
+        MGlobal::displayWarning(MString("Trimming ") + outRange.base + " base layers leaves only the bottom layer, the tallest column is "
+            + tallest + " high");
+    }
+    return MS::kSuccess;
+}
+
+void TerrainComputeBackend::heightBounds(const Heightfield& heightfield, const HeightRange& range, unsigned int maxHeight,
+    unsigned int& outLowest, unsigned int& outTallest)
+{
+    // Noise isn't measured, so any height is possible
+    if (heightfield.isProcedural()) {
+        outLowest = 0;
+        outTallest = maxHeight;
+    }
+    else if (heightfield.format == SampleFormat::Float32) {
+        outLowest = quantizeHeight(heightfield.floorHeight, range, maxHeight);
+        outTallest = quantizeHeight(heightfield.peakHeight, range, maxHeight);
+    }
+    else {
+        outLowest = quantizeValue(heightfield.minValue, range, heightfield.maxValue, maxHeight);
+        outTallest = quantizeValue(heightfield.peakValue, range, heightfield.maxValue, maxHeight);
+    }
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "Heightfield.h"
+#include "TerrainSpans.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/**
+ * @brief Rectangle of terrain columns generated in one pass
+ */
+struct TerrainTile
+{
+    unsigned int x = 0;
+    unsigned int z = 0;
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+    size_t columnCount() const { return (size_t)width * height; }
+};
+
+/**
+ * @brief Where the time of the last generateSpansFromHeightfield call went
+ *
+ * For a single tile, generateMs covers the whole tile and submitMs and
+ * waitMs stay 0. When tiled, generateMs is submitMs plus waitMs.
+ */
+struct GenerationStats
+{
+    unsigned int tileCount = 0;
+    unsigned int tileSize = 0;
+    double generateMs = 0.0;        // Producing the tiles
+    double submitMs = 0.0;          // Starting tiles: packing their input and queueing the work
+    double waitMs = 0.0;            // Waiting for started tiles to finish
+    double assembleMs = 0.0;        // Placing finished tiles into the output
+    double countMs = 0.0;           // Summing the voxel count
+    size_t workingSetBytes = 0;     // Tile buffers held at once, estimated
+};
+
+/**
+ * @brief Interface for the heightmap to voxel converters
+ *
+ * Every backend runs the same pipeline: resample the heightmap once into a
+ * quantized height grid, then fill each column down to its lowest neighbour
+ * and emit it as a ColumnSpan. Backends must produce identical output for
+ * identical input, so callers can pick one purely on availability and speed.
+ *
+ * Large terrains are generated in tiles. Each tile resamples itself plus a
+ * one-cell halo, so the min-neighbour fill is seamless across tiles, and
+ * only the image rows and columns the tile samples are read. Peak memory
+ * then depends on the tile size rather than on the terrain size.
+ *
+ * Tiles are pipelined: a backend with pipelineDepth() slots has up to that
+ * many tiles in flight, so the callback for one tile runs while the next
+ * ones are uploaded and generated.
+ *
+ * Argument validation is shared here; backends only implement generateTile
+ * on an already decoded Heightfield.
+ */
+class TerrainComputeBackend
+{
+public:
+    // Called in row-major tile order as soon as each tile is finished, with
+    // tile.columnCount() spans that stay valid until the callback returns
+    typedef std::function<MStatus(const TerrainTile& tile, const ColumnSpan* spans)> TileCallback;
+
+    virtual ~TerrainComputeBackend() {}
+
+    virtual MStatus initialize() = 0;
+    virtual void cleanup() = 0;
+    virtual bool isInitialized() const = 0;
+    virtual const char* name() const = 0;
+
+    /**
+     * @brief Generate the whole terrain into outSpans, one span per column
+     *
+     * With a memoryBudget in bytes the terrain is generated tile by tile so
+     * that the working set stays within it; 0 uses a single tile when the
+     * backend can hold one. range picks the samples at the ground and at
+     * maxHeight and the layers cut from the bottom.
+     */
+    MStatus generateSpansFromHeightfield(
+        const Heightfield& heightfield,
+        TerrainSpans& outSpans,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        unsigned int maxHeight = 256,
+        size_t memoryBudget = 0,
+        const HeightRange& range = HeightRange()
+    );
+
+    // Stream the terrain out tile by tile without keeping it
+    MStatus generateTilesFromHeightfield(
+        const Heightfield& heightfield,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        unsigned int maxHeight,
+        size_t memoryBudget,
+        const HeightRange& range,
+        const TileCallback& onTile
+    );
+
+    /**
+     * @brief Regenerate the columns of region in place after a heightmap edit
+     *
+     * inOutSpans must hold the whole terrain, generated at the same size,
+     * maxHeight and range from a heightfield of the same size. Only the region's spans
+     * are rewritten and voxelCount is adjusted by the difference, so the cost
+     * follows the size of the region rather than of the terrain.
+     */
+    MStatus regenerateRegion(
+        const Heightfield& heightfield,
+        const TerrainTile& region,
+        unsigned int maxHeight,
+        TerrainSpans& inOutSpans,
+        const HeightRange& range = HeightRange()
+    );
+
+    // Columns whose spans depend on the given image pixels: every cell that
+    // samples one of them, plus the neighbours its height is a base for
+    static TerrainTile affectedRegion(const Heightfield& heightfield, const TerrainTile& pixels,
+        unsigned int terrainWidth, unsigned int terrainHeight);
+
+    /**
+     * @brief Bounding rectangle of the pixels that differ between two heightfields
+     *
+     * Returns false when they can't be compared because their size or sample
+     * format differ. outPixels is empty when no pixel changed.
+     */
+    static bool diffHeightfields(const Heightfield& before, const Heightfield& after, TerrainTile& outPixels);
+
+    /**
+     * @brief Range that stretches the measured samples over the whole height
+     *
+     * clip is the fraction of samples at each end, read off the histogram,
+     * that is left out of the range so a few outliers don't flatten the
+     * rest; 0 uses the exact min and peak. Fails for a flat heightfield.
+     */
+    static MStatus normalizedRange(const Heightfield& heightfield, double clip, HeightRange& outRange);
+
+    // Height of the lowest and tallest columns range gives, before base layers are cut.
+    // Both are exact: the resample never leaves the span of its corner samples.
+    static void heightBounds(const Heightfield& heightfield, const HeightRange& range, unsigned int maxHeight,
+        unsigned int& outLowest, unsigned int& outTallest);
+
+    /**
+     * @brief Range for the height range settings of a command
+     *
+     * normalizeClip below 0 leaves the samples as they are, otherwise it is
+     * the clip of normalizedRange. trimBase is the number of base layers to
+     * cut, or -1 to cut everything below the lowest column.
+     */
+    static MStatus heightRange(const Heightfield& heightfield, double normalizeClip, int trimBase,
+        unsigned int maxHeight, HeightRange& outRange);
+
+    const GenerationStats& lastStats() const { return fStats; }
+
+    // Record device timings of every queued command on Profiler::active();
+    // backends without a device ignore it
+    virtual MStatus setProfiling(bool /*enabled*/) { return MS::kSuccess; }
+
+    // Tile side that keeps one tile's working set within memoryBudget
+    unsigned int tileSizeForBudget(
+        const Heightfield& heightfield,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        size_t memoryBudget
+    ) const;
+
+protected:
+    /**
+     * @brief Fill outSpans with one span per column of the tile, row-major
+     */
+    virtual MStatus generateTile(
+        const Heightfield& heightfield,
+        const TerrainTile& tile,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        unsigned int maxHeight,
+        const HeightRange& range,
+        std::vector<ColumnSpan>& outSpans
+    ) = 0;
+
+    // Largest single allocation the backend can make
+    virtual size_t maxBufferBytes() const { return SIZE_MAX; }
+
+    /**
+     * @brief Asynchronous tile interface used by the pipeline
+     *
+     * beginTile starts a tile in a slot below pipelineDepth() and endTile
+     * waits for it. A slot is only reused after endTile. abortTiles waits for
+     * everything in flight and drops the results. The default runs
+     * generateTile synchronously in beginTile.
+     */
+    virtual unsigned int pipelineDepth() const { return 1; }
+    virtual MStatus beginTile(
+        unsigned int slot,
+        const Heightfield& heightfield,
+        const TerrainTile& tile,
+        unsigned int terrainWidth,
+        unsigned int terrainHeight,
+        unsigned int maxHeight,
+        const HeightRange& range
+    );
+    virtual MStatus endTile(unsigned int slot, const ColumnSpan*& outSpans);
+    virtual void abortTiles() {}
+
+    // The tile grown by the one-cell halo, clipped to the terrain
+    static TerrainTile haloRegion(const TerrainTile& tile, unsigned int terrainWidth, unsigned int terrainHeight);
+
+    // Image pixels the resample of region reads, as x, y, width, height
+    static TerrainTile imageRegion(const Heightfield& heightfield, const TerrainTile& region,
+        unsigned int terrainWidth, unsigned int terrainHeight);
+
+private:
+    GenerationStats fStats;
+    std::vector<std::vector<ColumnSpan>> fSlotSpans;
+    std::vector<MStatus> fSlotStatus;
+
+    MStatus validate(const Heightfield& heightfield, unsigned int terrainWidth,
+        unsigned int terrainHeight, unsigned int maxHeight, const HeightRange& range) const;
+
+    // Bytes the buffers of slots tiles of tileSize take
+    static size_t workingSetBytes(const Heightfield& heightfield, unsigned int tileSize, unsigned int slots,
+        unsigned int terrainWidth, unsigned int terrainHeight);
+};
@@ -0,0 +1,114 @@
+#include "TerrainComputeService.h"
+#include "CpuTerrainBackend.h"
+#include "CoreTypes.h"
+#include "TerrainQuery.h"
+#if LEGOTERRAIN_HAS_OPENCL
+#include "HeightmapComputeShader.h"
+#endif
+
+TerrainComputeService* TerrainComputeService::sInstance = nullptr;
+
+TerrainComputeService::TerrainComputeService()
+{
+}
+
+TerrainComputeService::~TerrainComputeService()
+{
+#if LEGOTERRAIN_HAS_OPENCL
+    if (fOpenCL) {
+        fOpenCL->cleanup();
+    }
+#endif
+    if (fCpu) {
+        fCpu->cleanup();
+    }
+}
+
+void TerrainComputeService::create()
+{
+    if (!sInstance) {
+        sInstance = new TerrainComputeService();
+    }
+}
+
+void TerrainComputeService::destroy()
+{
+    delete sInstance;
+    sInstance = nullptr;
+}
+
+TerrainComputeService* TerrainComputeService::instance()
+{
+    return sInstance;
+}
+
+TerrainComputeBackend* TerrainComputeService::backend(const MString& preference, MStatus* status)
+{
+    TerrainComputeBackend* selected = nullptr;
+#if LEGOTERRAIN_HAS_OPENCL
+    bool useOpenCL = preference == "opencl" || (preference == "auto" && HeightmapComputeShader::isAvailable());
+    if (useOpenCL) {
+        if (!fOpenCL) {
+            fOpenCL.reset(new HeightmapComputeShader());
+        }
+        selected = fOpenCL.get();
+    }
+#else
+    if (preference == "opencl") {
+        MGlobal::displayError("Built without OpenCL, use the cpu or auto backend");
+        if (status) {
+            *status = MS::kFailure;
+        }
+        return nullptr;
+    }
+#endif
+    if (!selected) {
+        if (!fCpu) {
+            fCpu.reset(new CpuTerrainBackend());
+        }
+        selected = fCpu.get();
+    }
+
+    MStatus result = MS::kSuccess;
+    if (!selected->isInitialized()) {
+        result = selected->initialize();
+        if (result != MS::kSuccess) {
+            MGlobal::displayError(MString("Failed to initialize ") + selected->name() + " backend");
+            selected = nullptr;
+        }
+    }
+
+    if (status) {
+        *status = result;
+    }
+    return selected;
+}
+
+HeightmapCache& TerrainComputeService::heightmapCache()
+{
+    return fHeightmapCache;
+}
+
+void TerrainComputeService::setTerrain(const MString& name, std::shared_ptr<const TerrainQuery> query)
+{
+    fTerrains[name.asChar()] = std::move(query);
+}
+
+std::shared_ptr<const TerrainQuery> TerrainComputeService::terrain(const MString& name) const
+{
+    auto found = fTerrains.find(name.asChar());
+    return found != fTerrains.end() ? found->second : nullptr;
+}
+
+void TerrainComputeService::removeTerrain(const MString& name, const TerrainQuery* only)
+{
+    auto found = fTerrains.find(name.asChar());
+    if (found != fTerrains.end() && found->second.get() == only) {
+        fTerrains.erase(found);
+    }
+}
+
+void TerrainComputeService::clearTerrains()
+{
+    fTerrains.clear();
+}
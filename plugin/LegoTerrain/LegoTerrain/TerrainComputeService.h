@@ -0,0 +1,62 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "HeightmapCache.h"
+#include <map>
+#include <memory>
+#include <string>
+
+class TerrainComputeBackend;
+class HeightmapComputeShader;
+class CpuTerrainBackend;
+class TerrainQuery;
+
+/**
+ * @brief Plugin-lifetime owner of the compute backends
+ *
+ * Created in initializePlugin and destroyed in uninitializePlugin. Backends
+ * are initialized on first use and then kept alive, so compiled kernels and
+ * device buffers carry over between voxelizeTerrain invocations, as do the
+ * decoded heightmaps in the cache. Generated terrains are kept by output
+ * name for legoTerrainQuery until the scene is replaced.
+ */
+class TerrainComputeService
+{
+public:
+    static void create();
+    static void destroy();
+    static TerrainComputeService* instance();
+
+    /**
+     * @brief Get an initialized backend for "cpu", "opencl" or "auto"
+     *
+     * Auto prefers OpenCL and falls back to the CPU when there is no
+     * OpenCL context, or when the build has no OpenCL at all.
+     */
+    TerrainComputeBackend* backend(const MString& preference, MStatus* status = nullptr);
+
+    HeightmapCache& heightmapCache();
+
+    // Terrain last generated under this output name, null if there is none
+    void setTerrain(const MString& name, std::shared_ptr<const TerrainQuery> query);
+    std::shared_ptr<const TerrainQuery> terrain(const MString& name) const;
+
+    // Removes the terrain, but only while it is still the given one
+    void removeTerrain(const MString& name, const TerrainQuery* only);
+
+    // Drops every terrain, when the scene they were made in goes away
+    void clearTerrains();
+
+private:
+    TerrainComputeService();
+    ~TerrainComputeService();
+
+#if LEGOTERRAIN_HAS_OPENCL
+    std::unique_ptr<HeightmapComputeShader> fOpenCL;
+#endif
+    std::unique_ptr<CpuTerrainBackend> fCpu;
+    HeightmapCache fHeightmapCache;
+    std::map<std::string, std::shared_ptr<const TerrainQuery>> fTerrains;
+
+    static TerrainComputeService* sInstance;
+};
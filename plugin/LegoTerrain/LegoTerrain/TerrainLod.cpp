@@ -0,0 +1,170 @@
+#include "TerrainLod.h"
+#include "TerrainColoring.h"
+#include "ThreadPool.h"
+#include "CoreTypes.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    // Blocks per task when expanding instances
+    const size_t EXPAND_CHUNK = 1 << 14;
+}
+
+void LodLayout::clear()
+{
+    terrainWidth = 0;
+    terrainHeight = 0;
+    blocks.clear();
+    chunkLevels.clear();
+}
+
+void LodLayout::expandInstances(float voxelSize, MVector* outCenters, MVector* outScales,
+    const TerrainSpans* spans, const TerrainColoring* coloring, MVector* outColors) const
+{
+    bool colored = spans && coloring && outColors;
+    ThreadPool::global().parallelFor(0, blocks.size(), EXPAND_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const LodBlock& block = blocks[i];
+            unsigned int size = 1u << block.level;
+            unsigned int width = std::min(size, terrainWidth - block.x);
+            unsigned int depth = std::min(size, terrainHeight - block.z);
+
+            float worldX = ((float)block.x + (width - 1) * 0.5f) * voxelSize;
+            float worldY = ((float)block.y + (size - 1) * 0.5f) * voxelSize;
+            float worldZ = ((float)block.z + (depth - 1) * 0.5f) * voxelSize;
+
+            outCenters[i] = MVector(worldX, worldY, worldZ);
+            outScales[i] = MVector(width, size, depth);
+
+            if (colored) {
+                size_t column = (size_t)block.z * spans->terrainWidth + block.x;
+                outColors[i] = TerrainColoring::toVector(coloring->voxelColor(coloring->columnColor(*spans, column), block.y));
+            }
+        }
+    });
+}
+
+void LodPyramid::clear()
+{
+    fHeights.clear();
+}
+
+void LodPyramid::build(const TerrainSpans& spans)
+{
+    fHeights.build(spans, MAX_LEVELS);
+}
+
+MStatus LodPyramid::select(const LodSettings& settings, LodLayout& outLayout) const
+{
+    outLayout.clear();
+    if (fHeights.isEmpty()) {
+        return MS::kSuccess;
+    }
+
+    if (settings.levels > MAX_LEVELS) {
+        MGlobal::displayError(MString("LOD levels must be at most ") + MAX_LEVELS);
+        return MS::kFailure;
+    }
+    if (!(settings.baseDistance > 0.0f) || !(settings.voxelSize > 0.0f)) {
+        MGlobal::displayError("LOD distance must be greater than 0");
+        return MS::kFailure;
+    }
+
+    ThreadPool& pool = ThreadPool::global();
+    unsigned int terrainWidth = fHeights.level(0).width;
+    unsigned int terrainHeight = fHeights.level(0).height;
+    unsigned int chunksX = (terrainWidth + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    unsigned int chunksZ = (terrainHeight + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    size_t chunkCount = (size_t)chunksX * chunksZ;
+
+    outLayout.terrainWidth = terrainWidth;
+    outLayout.terrainHeight = terrainHeight;
+    std::vector<uint8_t>& levels = outLayout.chunkLevels;
+    levels.resize(chunkCount);
+
+    // Level from the distance between the camera and the chunk's bounds,
+    // whose height range is one cell of the coarsest level
+    const HeightPyramid::Level& top = fHeights.level(MAX_LEVELS);
+    float voxelSize = settings.voxelSize;
+    for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+        unsigned int cx = (unsigned int)(chunk % chunksX);
+        unsigned int cz = (unsigned int)(chunk / chunksX);
+        size_t topCell = (size_t)cz * top.width + cx;
+
+        double minX = (double)cx * CHUNK_SIZE * voxelSize;
+        double maxX = (double)std::min((cx + 1) * CHUNK_SIZE, terrainWidth) * voxelSize;
+        double minZ = (double)cz * CHUNK_SIZE * voxelSize;
+        double maxZ = (double)std::min((cz + 1) * CHUNK_SIZE, terrainHeight) * voxelSize;
+        double minY = (double)top.low[topCell] * voxelSize;
+        double maxY = (double)(top.high[topCell] + 1) * voxelSize;
+
+        double dx = std::max({ minX - settings.camera.x, 0.0, settings.camera.x - maxX });
+        double dy = std::max({ minY - settings.camera.y, 0.0, settings.camera.y - maxY });
+        double dz = std::max({ minZ - settings.camera.z, 0.0, settings.camera.z - maxZ });
+        double distance = std::sqrt(dx * dx + dy * dy + dz * dz);
+
+        unsigned int level = 0;
+        if (distance >= settings.baseDistance) {
+            level = (unsigned int)std::floor(std::log2(distance / settings.baseDistance)) + 1;
+        }
+        levels[chunk] = (uint8_t)std::min(level, settings.levels);
+    }
+
+    // Keep neighbours within one level, lowering the coarser side until stable
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+            unsigned int cx = (unsigned int)(chunk % chunksX);
+            unsigned int cz = (unsigned int)(chunk / chunksX);
+            uint8_t limit = levels[chunk];
+            if (cx > 0) limit = std::min<uint8_t>(limit, levels[chunk - 1] + 1);
+            if (cx + 1 < chunksX) limit = std::min<uint8_t>(limit, levels[chunk + 1] + 1);
+            if (cz > 0) limit = std::min<uint8_t>(limit, levels[chunk - chunksX] + 1);
+            if (cz + 1 < chunksZ) limit = std::min<uint8_t>(limit, levels[chunk + chunksX] + 1);
+            if (limit < levels[chunk]) {
+                levels[chunk] = limit;
+                changed = true;
+            }
+        }
+    }
+
+    // Each chunk emits a stack of blocks per cell of its level, covering
+    // every voxel from the lowest base to the highest top beneath it
+    std::vector<std::vector<LodBlock>> chunkBlocks(chunkCount);
+    pool.parallelFor(0, chunkCount, 1, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++) {
+            unsigned int level = levels[chunk];
+            const HeightPyramid::Level& grid = fHeights.level(level);
+            unsigned int cellsPerChunk = CHUNK_SIZE >> level;
+            unsigned int x0 = (unsigned int)(chunk % chunksX) * cellsPerChunk;
+            unsigned int z0 = (unsigned int)(chunk / chunksX) * cellsPerChunk;
+            unsigned int x1 = std::min(x0 + cellsPerChunk, grid.width);
+            unsigned int z1 = std::min(z0 + cellsPerChunk, grid.height);
+            std::vector<LodBlock>& out = chunkBlocks[chunk];
+
+            for (unsigned int z = z0; z < z1; z++) {
+                for (unsigned int x = x0; x < x1; x++) {
+                    size_t cell = (size_t)z * grid.width + x;
+                    unsigned int yBegin = grid.low[cell] >> level;
+                    unsigned int yEnd = grid.high[cell] >> level;
+                    for (unsigned int y = yBegin; y <= yEnd; y++) {
+                        out.push_back({ (uint16_t)(x << level), (uint16_t)(z << level), (uint16_t)(y << level), (uint8_t)level, 0 });
+                    }
+                }
+            }
+        }
+    });
+
+    size_t totalBlocks = 0;
+    for (const std::vector<LodBlock>& blocks : chunkBlocks) {
+        totalBlocks += blocks.size();
+    }
+
+    outLayout.blocks.reserve(totalBlocks);
+    for (const std::vector<LodBlock>& blocks : chunkBlocks) {
+        outLayout.blocks.insert(outLayout.blocks.end(), blocks.begin(), blocks.end());
+    }
+
+    return MS::kSuccess;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "HeightPyramid.h"
+#include "TerrainSpans.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief One LOD block: a stack of 2^level voxels on each side
+ *
+ * x, z and y are the block's lowest voxel. Blocks on the terrain's far edges
+ * are cut to the columns that exist, so their footprint can be narrower
+ * than 2^level.
+ */
+struct LodBlock
+{
+    uint16_t x;
+    uint16_t z;
+    uint16_t y;
+    uint8_t level;
+    uint8_t padding;
+};
+
+static_assert(sizeof(LodBlock) == 8, "LodBlock should stay packed");
+
+/**
+ * @brief Where the viewer is and how quickly detail falls off
+ */
+struct LodSettings
+{
+    MVector camera;                 // World space, same units as the instances
+    float voxelSize = 1.0f;
+    float baseDistance = 64.0f;     // World distance where level 1 starts, doubling per level
+    unsigned int levels = 4;        // Coarsest level
+};
+
+/**
+ * @brief Terrain as LOD blocks, ready for the particle instancer
+ */
+struct LodLayout
+{
+    unsigned int terrainWidth = 0;
+    unsigned int terrainHeight = 0;
+    std::vector<LodBlock> blocks;
+    std::vector<uint8_t> chunkLevels;
+
+    void clear();
+
+    /**
+     * @brief Block centres and per-axis scales for a unit brick of voxelSize
+     *
+     * Both arrays must hold blocks.size() elements. A level 0 block sits
+     * exactly where TerrainSpans::expandPositions puts its voxel. With a
+     * coloring, each block takes the colour of its lowest voxel, written to
+     * outColors in the same pass.
+     */
+    void expandInstances(float voxelSize, MVector* outCenters, MVector* outScales,
+        const TerrainSpans* spans = nullptr, const TerrainColoring* coloring = nullptr, MVector* outColors = nullptr) const;
+};
+
+/**
+ * @brief Min/max height pyramid used to emit coarser bricks far away
+ *
+ * The first MAX_LEVELS levels of a HeightPyramid. The
+ * terrain is cut into CHUNK_SIZE chunks, and each chunk picks a level from
+ * its distance to the camera. A coarse block covers every voxel of the
+ * columns beneath it, so chunks at different levels overlap slightly at
+ * their border but never leave a gap, and neighbouring chunks are kept
+ * within one level of each other.
+ *
+ * Building the pyramid is linear in the terrain; selecting levels for a new
+ * camera position only walks the chunks, so a moving camera is cheap.
+ */
+class LodPyramid
+{
+public:
+    // Coarsest level; a level 6 block is 64 voxels on a side
+    static const unsigned int MAX_LEVELS = 6;
+
+    // Chunk side in columns, a multiple of the coarsest block
+    static const unsigned int CHUNK_SIZE = 1u << MAX_LEVELS;
+
+    void build(const TerrainSpans& spans);
+    void clear();
+    bool isEmpty() const { return fHeights.isEmpty(); }
+
+    MStatus select(const LodSettings& settings, LodLayout& outLayout) const;
+
+private:
+    HeightPyramid fHeights;
+};
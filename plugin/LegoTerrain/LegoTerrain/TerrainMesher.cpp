@@ -0,0 +1,397 @@
+#include "TerrainMesher.h"
+#include "ThreadPool.h"
+#include "CoreTypes.h"
+#include <algorithm>
+#include <climits>
+#include <numeric>
+
+namespace
+{
+    // Lattice points are packed z, x, y from the high bits down, so sorted
+    // keys run row by row like the spans. A side of MAX_DIMENSION columns
+    // has one more lattice point than that.
+    const unsigned int COORD_BITS = 17;
+    const uint64_t COORD_MASK = (1ull << COORD_BITS) - 1;
+
+    uint64_t latticeKey(unsigned int x, unsigned int y, unsigned int z)
+    {
+        return ((uint64_t)z << (2 * COORD_BITS)) | ((uint64_t)x << COORD_BITS) | y;
+    }
+
+    unsigned int keyZ(uint64_t key)
+    {
+        return (unsigned int)(key >> (2 * COORD_BITS));
+    }
+
+    // Faces of one chunk, indexing vertices of its own
+    struct ChunkMesh
+    {
+        std::vector<uint64_t> keys;     // Sorted, unique lattice points
+        std::vector<uint32_t> quads;    // 4 indices into keys per quad
+    };
+
+    // Collects the quads of one chunk as lattice points. Each voxel spans
+    // lattice points [x, x + 1], [y, y + 1] and [z, z + 1].
+    class ChunkBuilder
+    {
+    public:
+        void top(unsigned int x, unsigned int z, unsigned int width, unsigned int depth, unsigned int y)
+        {
+            quad(latticeKey(x, y, z), latticeKey(x, y, z + depth), latticeKey(x + width, y, z + depth), latticeKey(x + width, y, z));
+        }
+
+        void bottom(unsigned int x, unsigned int z, unsigned int width, unsigned int depth, unsigned int y)
+        {
+            quad(latticeKey(x, y, z), latticeKey(x + width, y, z), latticeKey(x + width, y, z + depth), latticeKey(x, y, z + depth));
+        }
+
+        // Face at lattice x facing +x or -x, one voxel deep from z, between lattice heights y0 and y1
+        void sideX(unsigned int x, unsigned int z, unsigned int y0, unsigned int y1, bool positive)
+        {
+            if (positive) {
+                quad(latticeKey(x, y0, z), latticeKey(x, y1, z), latticeKey(x, y1, z + 1), latticeKey(x, y0, z + 1));
+            }
+            else {
+                quad(latticeKey(x, y0, z), latticeKey(x, y0, z + 1), latticeKey(x, y1, z + 1), latticeKey(x, y1, z));
+            }
+        }
+
+        // Face at lattice z facing +z or -z, one voxel wide from x
+        void sideZ(unsigned int x, unsigned int z, unsigned int y0, unsigned int y1, bool positive)
+        {
+            if (positive) {
+                quad(latticeKey(x, y0, z), latticeKey(x + 1, y0, z), latticeKey(x + 1, y1, z), latticeKey(x, y1, z));
+            }
+            else {
+                quad(latticeKey(x, y0, z), latticeKey(x, y1, z), latticeKey(x + 1, y1, z), latticeKey(x + 1, y0, z));
+            }
+        }
+
+        // Shares the corners within the chunk
+        void finish(ChunkMesh& out)
+        {
+            out.keys = fCorners;
+            std::sort(out.keys.begin(), out.keys.end());
+            out.keys.erase(std::unique(out.keys.begin(), out.keys.end()), out.keys.end());
+
+            out.quads.resize(fCorners.size());
+            for (size_t i = 0; i < fCorners.size(); i++) {
+                out.quads[i] = (uint32_t)(std::lower_bound(out.keys.begin(), out.keys.end(), fCorners[i]) - out.keys.begin());
+            }
+            fCorners = std::vector<uint64_t>();
+        }
+
+    private:
+        std::vector<uint64_t> fCorners;
+
+        void quad(uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+        {
+            fCorners.push_back(a);
+            fCorners.push_back(b);
+            fCorners.push_back(c);
+            fCorners.push_back(d);
+        }
+    };
+
+    // Calls emit(y0, y1) for each run of voxels in [low, high] the neighbour
+    // column does not cover; every voxel is exposed without a neighbour
+    template<typename Emit>
+    void exposedRuns(unsigned int low, unsigned int high, const ColumnSpan* neighbour, Emit emit)
+    {
+        if (!neighbour) {
+            emit(low, high);
+            return;
+        }
+        if (low < neighbour->yMin) {
+            emit(low, std::min<unsigned int>(high, neighbour->yMin - 1u));
+        }
+        if (high > neighbour->yMax) {
+            emit(std::max<unsigned int>(low, neighbour->yMax + 1u), high);
+        }
+    }
+
+    // Splits a grid into rectangles of equal value, reporting each once as
+    // emit(x, z, width, depth, value)
+    template<typename Emit>
+    void greedyRectangles(const std::vector<uint16_t>& grid, unsigned int width, unsigned int depth, Emit emit)
+    {
+        std::vector<uint8_t> used(grid.size(), 0);
+        for (unsigned int z = 0; z < depth; z++) {
+            for (unsigned int x = 0; x < width; x++) {
+                size_t cell = (size_t)z * width + x;
+                if (used[cell]) continue;
+
+                uint16_t value = grid[cell];
+                unsigned int runWidth = 1;
+                while (x + runWidth < width && !used[cell + runWidth] && grid[cell + runWidth] == value) {
+                    runWidth++;
+                }
+
+                unsigned int runDepth = 1;
+                for (; z + runDepth < depth; runDepth++) {
+                    size_t row = cell + (size_t)runDepth * width;
+                    bool matches = true;
+                    for (unsigned int i = 0; i < runWidth && matches; i++) {
+                        matches = !used[row + i] && grid[row + i] == value;
+                    }
+                    if (!matches) break;
+                }
+
+                for (unsigned int i = 0; i < runDepth; i++) {
+                    std::fill_n(used.begin() + cell + (size_t)i * width, runWidth, (uint8_t)1);
+                }
+                emit(x, z, runWidth, runDepth, value);
+            }
+        }
+    }
+
+    void meshChunk(const TerrainSpans& spans, unsigned int x0, unsigned int z0, unsigned int x1, unsigned int z1,
+        bool mergeFaces, ChunkMesh& out)
+    {
+        unsigned int terrainWidth = spans.terrainWidth;
+        unsigned int terrainHeight = spans.terrainHeight;
+        const ColumnSpan* columns = spans.spans.data();
+        ChunkBuilder builder;
+
+        auto column = [&](unsigned int x, unsigned int z) {
+            return columns + (size_t)z * terrainWidth + x;
+        };
+
+        // Tops and bottoms
+        if (mergeFaces) {
+            unsigned int width = x1 - x0;
+            unsigned int depth = z1 - z0;
+            std::vector<uint16_t> tops((size_t)width * depth);
+            std::vector<uint16_t> bottoms((size_t)width * depth);
+            for (unsigned int z = z0; z < z1; z++) {
+                for (unsigned int x = x0; x < x1; x++) {
+                    size_t cell = (size_t)(z - z0) * width + (x - x0);
+                    tops[cell] = column(x, z)->yMax;
+                    bottoms[cell] = column(x, z)->yMin;
+                }
+            }
+
+            greedyRectangles(tops, width, depth, [&](unsigned int x, unsigned int z, unsigned int w, unsigned int d, uint16_t y) {
+                builder.top(x0 + x, z0 + z, w, d, y + 1u);
+            });
+            greedyRectangles(bottoms, width, depth, [&](unsigned int x, unsigned int z, unsigned int w, unsigned int d, uint16_t y) {
+                builder.bottom(x0 + x, z0 + z, w, d, y);
+            });
+        }
+        else {
+            for (unsigned int z = z0; z < z1; z++) {
+                for (unsigned int x = x0; x < x1; x++) {
+                    builder.top(x, z, 1, 1, column(x, z)->yMax + 1u);
+                    builder.bottom(x, z, 1, 1, column(x, z)->yMin);
+                }
+            }
+        }
+
+        // Sides, wherever a column reaches past its neighbour
+        for (unsigned int z = z0; z < z1; z++) {
+            for (unsigned int x = x0; x < x1; x++) {
+                const ColumnSpan* span = column(x, z);
+                const ColumnSpan* neighbours[4] = {
+                    x + 1 < terrainWidth ? column(x + 1, z) : nullptr,
+                    x > 0 ? column(x - 1, z) : nullptr,
+                    z + 1 < terrainHeight ? column(x, z + 1) : nullptr,
+                    z > 0 ? column(x, z - 1) : nullptr
+                };
+
+                for (int side = 0; side < 4; side++) {
+                    exposedRuns(span->yMin, span->yMax, neighbours[side], [&](unsigned int low, unsigned int high) {
+                        unsigned int step = mergeFaces ? high - low + 1 : 1;
+                        for (unsigned int y = low; y <= high; y += step) {
+                            unsigned int top = std::min(y + step, high + 1u);
+                            switch (side) {
+                            case 0: builder.sideX(x + 1, z, y, top, true); break;
+                            case 1: builder.sideX(x, z, y, top, false); break;
+                            case 2: builder.sideZ(x, z + 1, y, top, true); break;
+                            default: builder.sideZ(x, z, y, top, false); break;
+                            }
+                        }
+                    });
+                }
+            }
+        }
+
+        builder.finish(out);
+    }
+}
+
+void TerrainMesh::clear()
+{
+    points.clear();
+    faceCounts.clear();
+    faceVertices.clear();
+}
+
+MStatus TerrainMesher::build(const TerrainSpans& spans, float voxelSize, bool mergeFaces, TerrainMesh& outMesh)
+{
+    outMesh.clear();
+    if (spans.spans.empty()) {
+        return MS::kSuccess;
+    }
+
+    ThreadPool& pool = ThreadPool::global();
+    unsigned int terrainWidth = spans.terrainWidth;
+    unsigned int terrainHeight = spans.terrainHeight;
+    unsigned int chunksX = (terrainWidth + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    unsigned int chunksZ = (terrainHeight + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    size_t chunkCount = (size_t)chunksX * chunksZ;
+
+    std::vector<ChunkMesh> chunks(chunkCount);
+    pool.parallelFor(0, chunkCount, 1, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++) {
+            unsigned int x0 = (unsigned int)(chunk % chunksX) * CHUNK_SIZE;
+            unsigned int z0 = (unsigned int)(chunk / chunksX) * CHUNK_SIZE;
+            meshChunk(spans, x0, z0, std::min(x0 + CHUNK_SIZE, terrainWidth), std::min(z0 + CHUNK_SIZE, terrainHeight),
+                mergeFaces, chunks[chunk]);
+        }
+    });
+
+    // Chunks share the lattice points on their borders. Every point lands in
+    // the band of CHUNK_SIZE lattice rows its z falls in, so each band is
+    // deduplicated on its own and the bands are already in order.
+    size_t bandCount = (size_t)chunksZ + 1;
+    std::vector<std::vector<uint64_t>> bands(bandCount);
+    pool.parallelFor(0, bandCount, 1, [&](size_t begin, size_t end) {
+        for (size_t band = begin; band < end; band++) {
+            uint64_t lowKey = latticeKey(0, 0, (unsigned int)band * CHUNK_SIZE);
+            uint64_t highKey = latticeKey(0, 0, (unsigned int)(band + 1) * CHUNK_SIZE);
+            std::vector<uint64_t>& keys = bands[band];
+
+            // Only the chunk rows above and below the band reach into it
+            size_t rowBegin = band > 0 ? band - 1 : 0;
+            size_t rowEnd = std::min<size_t>(band + 1, chunksZ);
+            for (size_t row = rowBegin; row < rowEnd; row++) {
+                for (size_t chunk = row * chunksX; chunk < (row + 1) * chunksX; chunk++) {
+                    const std::vector<uint64_t>& chunkKeys = chunks[chunk].keys;
+                    auto first = std::lower_bound(chunkKeys.begin(), chunkKeys.end(), lowKey);
+                    auto last = std::lower_bound(first, chunkKeys.end(), highKey);
+                    keys.insert(keys.end(), first, last);
+                }
+            }
+
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        }
+    });
+
+    std::vector<size_t> bandOffsets(bandCount + 1, 0);
+    for (size_t band = 0; band < bandCount; band++) {
+        bandOffsets[band + 1] = bandOffsets[band] + bands[band].size();
+    }
+
+    // Maya indexes mesh vertices and face vertices with ints
+    size_t vertexCount = bandOffsets.back();
+    if (vertexCount > (size_t)INT_MAX) {
+        MGlobal::displayError("Terrain is too large for a single mesh");
+        return MS::kFailure;
+    }
+
+    // Index of a lattice point among the shared vertices, -1 if no face has a corner there
+    auto findVertex = [&](uint64_t key) {
+        size_t band = keyZ(key) / CHUNK_SIZE;
+        const std::vector<uint64_t>& keys = bands[band];
+        auto found = std::lower_bound(keys.begin(), keys.end(), key);
+        return found != keys.end() && *found == key ? (int)(bandOffsets[band] + (found - keys.begin())) : -1;
+    };
+
+    // Point each chunk's quads at the shared vertices. Merged faces also
+    // take in every vertex along their edges, so a long edge is split
+    // wherever a smaller face's corner meets it and no T-junction is left.
+    // Unmerged edges are one voxel long and have no points in between.
+    std::vector<std::vector<int>> chunkCounts(chunkCount);
+    std::vector<std::vector<int>> chunkVertices(chunkCount);
+    pool.parallelFor(0, chunkCount, 1, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++) {
+            ChunkMesh& mesh = chunks[chunk];
+            std::vector<int> shared(mesh.keys.size());
+            for (size_t i = 0; i < mesh.keys.size(); i++) {
+                shared[i] = findVertex(mesh.keys[i]);
+            }
+
+            std::vector<int>& counts = chunkCounts[chunk];
+            std::vector<int>& vertices = chunkVertices[chunk];
+            counts.reserve(mesh.quads.size() / 4);
+            vertices.reserve(mesh.quads.size());
+
+            for (size_t quad = 0; quad < mesh.quads.size(); quad += 4) {
+                size_t first = vertices.size();
+                for (size_t corner = 0; corner < 4; corner++) {
+                    uint32_t fromCorner = mesh.quads[quad + corner];
+                    vertices.push_back(shared[fromCorner]);
+                    if (!mergeFaces) continue;
+
+                    uint64_t from = mesh.keys[fromCorner];
+                    uint64_t to = mesh.keys[mesh.quads[quad + (corner + 1) % 4]];
+
+                    // Edges run along one axis, so the lattice points between
+                    // the corners are a fixed key step apart
+                    uint64_t difference = from < to ? to - from : from - to;
+                    uint64_t step = difference >= (1ull << (2 * COORD_BITS)) ? 1ull << (2 * COORD_BITS)
+                        : difference >= (1ull << COORD_BITS) ? 1ull << COORD_BITS : 1ull;
+                    if (step == 1 && difference > 1) {
+                        // Points up a column are neighbours among the sorted keys
+                        uint64_t low = std::min(from, to);
+                        size_t band = keyZ(low) / CHUNK_SIZE;
+                        const std::vector<uint64_t>& keys = bands[band];
+                        size_t first = std::upper_bound(keys.begin(), keys.end(), low) - keys.begin();
+                        size_t last = std::lower_bound(keys.begin() + first, keys.end(), low + difference) - keys.begin();
+                        for (size_t i = 0; i < last - first; i++) {
+                            size_t index = from < to ? first + i : last - 1 - i;
+                            vertices.push_back((int)(bandOffsets[band] + index));
+                        }
+                        continue;
+                    }
+                    for (uint64_t offset = step; offset < difference; offset += step) {
+                        int vertex = findVertex(from < to ? from + offset : from - offset);
+                        if (vertex >= 0) {
+                            vertices.push_back(vertex);
+                        }
+                    }
+                }
+                counts.push_back((int)(vertices.size() - first));
+            }
+            mesh = ChunkMesh();
+        }
+    });
+
+    std::vector<size_t> faceOffsets(chunkCount + 1, 0);
+    std::vector<size_t> vertexOffsets(chunkCount + 1, 0);
+    for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+        faceOffsets[chunk + 1] = faceOffsets[chunk] + chunkCounts[chunk].size();
+        vertexOffsets[chunk + 1] = vertexOffsets[chunk] + chunkVertices[chunk].size();
+    }
+    if (vertexOffsets.back() > (size_t)INT_MAX) {
+        MGlobal::displayError("Terrain is too large for a single mesh");
+        return MS::kFailure;
+    }
+
+    outMesh.faceCounts.resize(faceOffsets.back());
+    outMesh.faceVertices.resize(vertexOffsets.back());
+    pool.parallelFor(0, chunkCount, 1, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; chunk++) {
+            std::copy(chunkCounts[chunk].begin(), chunkCounts[chunk].end(), outMesh.faceCounts.begin() + faceOffsets[chunk]);
+            std::copy(chunkVertices[chunk].begin(), chunkVertices[chunk].end(), outMesh.faceVertices.begin() + vertexOffsets[chunk]);
+            chunkCounts[chunk] = std::vector<int>();
+            chunkVertices[chunk] = std::vector<int>();
+        }
+    });
+
+    // Lattice points sit half a voxel off the voxel centres
+    outMesh.points.resize(vertexCount * 3);
+    pool.parallelFor(0, bandCount, 1, [&](size_t begin, size_t end) {
+        for (size_t band = begin; band < end; band++) {
+            float* out = outMesh.points.data() + bandOffsets[band] * 3;
+            for (uint64_t key : bands[band]) {
+                *out++ = ((float)((key >> COORD_BITS) & COORD_MASK) - 0.5f) * voxelSize;
+                *out++ = ((float)(key & COORD_MASK) - 0.5f) * voxelSize;
+                *out++ = ((float)keyZ(key) - 0.5f) * voxelSize;
+            }
+        }
+    });
+
+    return MS::kSuccess;
+}
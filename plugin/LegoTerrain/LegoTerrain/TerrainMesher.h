@@ -0,0 +1,51 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "TerrainSpans.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Terrain surface as one indexed polygon mesh
+ */
+struct TerrainMesh
+{
+    std::vector<float> points;          // x, y, z per vertex
+    std::vector<int> faceCounts;        // Vertices per face, 4 unless merged faces have points along their edges
+    std::vector<int> faceVertices;      // Vertex indices per face, counter-clockwise seen from outside
+
+    size_t vertexCount() const { return points.size() / 3; }
+    size_t faceCount() const { return faceCounts.size(); }
+
+    void clear();
+};
+
+/**
+ * @brief Builds the visible surface of the voxels as a single mesh
+ *
+ * Only faces between a filled and an empty cell are emitted, so the faces
+ * buried between neighbouring voxels never exist. Every column is solid
+ * from yMin to yMax, so the tops, the bottoms and the parts of each side
+ * that stick out past the neighbouring column are all there is.
+ *
+ * Faces are emitted in parallel per CHUNK_SIZE square of columns, then
+ * vertices at the same lattice point are shared across the whole mesh, so
+ * the result is watertight.
+ *
+ * With mergeFaces, tops and bottoms of equal height are merged into
+ * rectangles within a chunk and each exposed side run into a single quad.
+ * Every vertex that lies along a merged face's edge, where a smaller
+ * neighbouring face has its corner, is added to that face, so merged faces
+ * become flat polygons with more than four corners and the mesh stays
+ * closed, without T-junctions.
+ */
+class TerrainMesher
+{
+public:
+    // Columns per chunk side
+    static const unsigned int CHUNK_SIZE = 64;
+
+    // Voxels are cubes of voxelSize centred on their index times voxelSize,
+    // like the instanced cubes
+    static MStatus build(const TerrainSpans& spans, float voxelSize, bool mergeFaces, TerrainMesh& outMesh);
+};
@@ -0,0 +1,266 @@
+#include "TerrainQuery.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    // Rays per task when casting a batch
+    const size_t RAY_CHUNK = 64;
+
+    // Every cell taken off the stack puts back at most four children, so
+    // 1 + 3 * 16 cells is the most the deepest pyramid ever holds
+    const size_t STACK_SIZE = 64;
+
+    // Tallest column a span can describe, as the top of the box queries
+    const double MAX_VOXEL_Y = TerrainSpans::MAX_HEIGHT;
+
+    struct RayCell
+    {
+        unsigned int level;
+        unsigned int x;
+        unsigned int z;
+        double tEnter;
+        int enterAxis;              // -1 when the ray starts inside the cell
+    };
+
+    struct BoxCell
+    {
+        unsigned int level;
+        unsigned int x;
+        unsigned int z;
+    };
+
+    // Narrows [tEnter, tExit] to where the ray is strictly between lo and hi on one axis
+    bool clipAxis(double origin, double direction, double inverse, double lo, double hi, int axis,
+        double& tEnter, double& tExit, int& enterAxis)
+    {
+        if (direction == 0.0) {
+            return origin > lo && origin < hi;
+        }
+
+        double t0 = (lo - origin) * inverse;
+        double t1 = (hi - origin) * inverse;
+        if (t0 > t1) std::swap(t0, t1);
+        if (t0 > tEnter) {
+            tEnter = t0;
+            enterAxis = axis;
+        }
+        tExit = std::min(tExit, t1);
+        return tEnter < tExit;
+    }
+}
+
+void TerrainQuery::build(const TerrainSpans& spans, float voxelSize)
+{
+    fVoxelSize = voxelSize;
+    fHeights.build(spans, HeightPyramid::rootLevel(spans.terrainWidth, spans.terrainHeight));
+}
+
+void TerrainQuery::clear()
+{
+    fHeights.clear();
+}
+
+bool TerrainQuery::surfaceHeight(double x, double z, double& outY) const
+{
+    if (isEmpty()) {
+        return false;
+    }
+
+    // Column whose cube the point is over
+    double column = std::floor(x / fVoxelSize + 0.5);
+    double row = std::floor(z / fVoxelSize + 0.5);
+    if (!(column >= 0.0 && column < terrainWidth() && row >= 0.0 && row < terrainHeight())) {
+        return false;
+    }
+
+    const HeightPyramid::Level& base = fHeights.level(0);
+    outY = ((double)base.high[(size_t)row * base.width + (size_t)column] + 0.5) * fVoxelSize;
+    return true;
+}
+
+TerrainHit TerrainQuery::castRay(const TerrainRay& ray) const
+{
+    TerrainHit hit;
+    double length = ray.direction.length();
+    if (isEmpty() || !(length > 0.0) || !(ray.maxDistance >= 0.0)) {
+        return hit;
+    }
+
+    // Lattice space, where voxel (x, y, z) fills x to x + 1 on each axis.
+    // The direction is a unit vector scaled by 1 / voxelSize, so distances
+    // along the ray stay in world units.
+    MVector unit = ray.direction * (1.0 / length);
+    double scale = 1.0 / fVoxelSize;
+    double origin[3] = { ray.origin.x * scale + 0.5, ray.origin.y * scale + 0.5, ray.origin.z * scale + 0.5 };
+    double direction[3] = { unit.x * scale, unit.y * scale, unit.z * scale };
+    double inverse[3];
+    for (int axis = 0; axis < 3; axis++) {
+        inverse[axis] = direction[axis] != 0.0 ? 1.0 / direction[axis] : 0.0;
+    }
+
+    unsigned int terrainWidth = this->terrainWidth();
+    unsigned int terrainHeight = this->terrainHeight();
+
+    // The part of the ray inside a cell's block of columns, up to its highest top
+    auto clipCell = [&](unsigned int level, unsigned int x, unsigned int z, RayCell& outCell) {
+        const HeightPyramid::Level& grid = fHeights.level(level);
+        size_t index = (size_t)z * grid.width + x;
+        double x0 = (double)((uint64_t)x << level);
+        double z0 = (double)((uint64_t)z << level);
+        double x1 = (double)std::min<uint64_t>((uint64_t)(x + 1) << level, terrainWidth);
+        double z1 = (double)std::min<uint64_t>((uint64_t)(z + 1) << level, terrainHeight);
+
+        outCell = { level, x, z, 0.0, -1 };
+        double tExit = ray.maxDistance;
+        return clipAxis(origin[0], direction[0], inverse[0], x0, x1, 0, outCell.tEnter, tExit, outCell.enterAxis)
+            && clipAxis(origin[2], direction[2], inverse[2], z0, z1, 2, outCell.tEnter, tExit, outCell.enterAxis)
+            && clipAxis(origin[1], direction[1], inverse[1], grid.low[index], grid.high[index] + 1.0, 1,
+                outCell.tEnter, tExit, outCell.enterAxis);
+    };
+
+    // Depth first, nearest child first. Children split their parent's
+    // footprint, so the ray crosses them one after another and the first
+    // column reached is the nearest hit.
+    RayCell stack[STACK_SIZE];
+    size_t depth = 0;
+    if (clipCell(fHeights.topLevel(), 0, 0, stack[0])) {
+        depth = 1;
+    }
+
+    while (depth > 0) {
+        RayCell cell = stack[--depth];
+        if (cell.level > 0) {
+            const HeightPyramid::Level& fine = fHeights.level(cell.level - 1);
+            RayCell children[4];
+            int childCount = 0;
+            for (unsigned int dz = 0; dz < 2; dz++) {
+                for (unsigned int dx = 0; dx < 2; dx++) {
+                    unsigned int x = cell.x * 2 + dx;
+                    unsigned int z = cell.z * 2 + dz;
+                    if (x < fine.width && z < fine.height && clipCell(cell.level - 1, x, z, children[childCount])) {
+                        childCount++;
+                    }
+                }
+            }
+
+            // Farthest first, so the nearest comes off the stack next
+            for (int i = 1; i < childCount; i++) {
+                RayCell child = children[i];
+                int j = i;
+                for (; j > 0 && children[j - 1].tEnter < child.tEnter; j--) {
+                    children[j] = children[j - 1];
+                }
+                children[j] = child;
+            }
+            for (int i = 0; i < childCount; i++) {
+                stack[depth++] = children[i];
+            }
+            continue;
+        }
+
+        const HeightPyramid::Level& base = fHeights.level(0);
+        size_t index = (size_t)cell.z * base.width + cell.x;
+        uint16_t yMin = base.low[index];
+        uint16_t yMax = base.high[index];
+
+        hit.hit = true;
+        hit.distance = cell.tEnter;
+        hit.point = ray.origin + unit * cell.tEnter;
+        hit.x = (uint16_t)cell.x;
+        hit.z = (uint16_t)cell.z;
+        if (cell.enterAxis == 1) {
+            hit.y = direction[1] < 0.0 ? yMax : yMin;
+        }
+        else {
+            double y = std::floor(origin[1] + direction[1] * cell.tEnter);
+            hit.y = (uint16_t)std::min<double>(std::max<double>(y, yMin), yMax);
+        }
+        if (cell.enterAxis >= 0) {
+            double normal[3] = { 0.0, 0.0, 0.0 };
+            normal[cell.enterAxis] = direction[cell.enterAxis] > 0.0 ? -1.0 : 1.0;
+            hit.normal = MVector(normal[0], normal[1], normal[2]);
+        }
+        return hit;
+    }
+
+    return hit;
+}
+
+void TerrainQuery::castRays(const TerrainRay* rays, size_t count, TerrainHit* outHits) const
+{
+    ThreadPool::global().parallelFor(0, count, RAY_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            outHits[i] = castRay(rays[i]);
+        }
+    });
+}
+
+uint64_t TerrainQuery::countVoxels(const MVector& boxMin, const MVector& boxMax, uint64_t limit) const
+{
+    if (isEmpty() || limit == 0) {
+        return 0;
+    }
+
+    // Voxel i spans (i - 0.5, i + 0.5) voxel sizes, so these are the first
+    // and last indices that reach strictly into the box
+    auto first = [&](double lo) { return std::max(std::floor(lo / fVoxelSize - 0.5) + 1.0, 0.0); };
+    auto last = [&](double hi, double end) { return std::min(std::ceil(hi / fVoxelSize + 0.5) - 1.0, end); };
+    double fx0 = first(boxMin.x), fx1 = last(boxMax.x, terrainWidth() - 1.0);
+    double fy0 = first(boxMin.y), fy1 = last(boxMax.y, MAX_VOXEL_Y);
+    double fz0 = first(boxMin.z), fz1 = last(boxMax.z, terrainHeight() - 1.0);
+    if (!(fx0 <= fx1 && fy0 <= fy1 && fz0 <= fz1)) {
+        return 0;
+    }
+
+    unsigned int x0 = (unsigned int)fx0, x1 = (unsigned int)fx1;
+    unsigned int y0 = (unsigned int)fy0, y1 = (unsigned int)fy1;
+    unsigned int z0 = (unsigned int)fz0, z1 = (unsigned int)fz1;
+
+    // Cells are only pushed when their footprint overlaps the box, and only
+    // opened when their height range does too
+    BoxCell stack[STACK_SIZE];
+    size_t depth = 0;
+    stack[depth++] = { fHeights.topLevel(), 0, 0 };
+
+    uint64_t count = 0;
+    while (depth > 0) {
+        BoxCell cell = stack[--depth];
+        const HeightPyramid::Level& grid = fHeights.level(cell.level);
+        size_t index = (size_t)cell.z * grid.width + cell.x;
+        unsigned int low = grid.low[index];
+        unsigned int high = grid.high[index];
+        if (high < y0 || low > y1) {
+            continue;
+        }
+
+        if (cell.level == 0) {
+            count += std::min(high, y1) - std::max(low, y0) + 1;
+            if (count >= limit) {
+                return limit;
+            }
+            continue;
+        }
+
+        unsigned int childLevel = cell.level - 1;
+        const HeightPyramid::Level& fine = fHeights.level(childLevel);
+        for (unsigned int dz = 0; dz < 2; dz++) {
+            for (unsigned int dx = 0; dx < 2; dx++) {
+                unsigned int x = cell.x * 2 + dx;
+                unsigned int z = cell.z * 2 + dz;
+                if (x >= fine.width || z >= fine.height) {
+                    continue;
+                }
+
+                uint64_t cx0 = (uint64_t)x << childLevel, cx1 = ((uint64_t)(x + 1) << childLevel) - 1;
+                uint64_t cz0 = (uint64_t)z << childLevel, cz1 = ((uint64_t)(z + 1) << childLevel) - 1;
+                if (cx1 >= x0 && cx0 <= x1 && cz1 >= z0 && cz0 <= z1) {
+                    stack[depth++] = { childLevel, x, z };
+                }
+            }
+        }
+    }
+
+    return count;
+}
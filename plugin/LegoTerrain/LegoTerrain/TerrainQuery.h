@@ -0,0 +1,82 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include "HeightPyramid.h"
+#include "TerrainSpans.h"
+#include <cstdint>
+#include <limits>
+
+/**
+ * @brief A ray in world space, same units as the instances
+ */
+struct TerrainRay
+{
+    MVector origin;
+    MVector direction;              // Any length but 0
+    double maxDistance = std::numeric_limits<double>::infinity();
+};
+
+/**
+ * @brief Where a ray first meets the terrain
+ *
+ * normal is the axis of the face the ray came in through, pointing back at
+ * it, and is 0 when the ray starts inside a voxel.
+ */
+struct TerrainHit
+{
+    bool hit = false;
+    double distance = 0.0;          // Along the ray's direction, in world units
+    MVector point;
+    MVector normal;
+    uint16_t x = 0;                 // Voxel that was hit
+    uint16_t y = 0;
+    uint16_t z = 0;
+};
+
+/**
+ * @brief Point, ray and box queries against a generated terrain
+ *
+ * Voxels are cubes of voxelSize centred on their index times voxelSize, like
+ * the instanced cubes, and every column is solid from yMin to yMax. Queries
+ * take world positions in those units.
+ *
+ * A HeightPyramid up to a single root cell bounds every block of columns, so
+ * rays and boxes skip whole blocks they can't touch. A ray walks the cells it
+ * crosses front to back and stops at the first column it enters, so its cost
+ * follows the number of cells near its path rather than the terrain size.
+ * The query is read-only once built and safe to use from several threads.
+ */
+class TerrainQuery
+{
+public:
+    void build(const TerrainSpans& spans, float voxelSize);
+    void clear();
+    bool isEmpty() const { return fHeights.isEmpty(); }
+
+    unsigned int terrainWidth() const { return isEmpty() ? 0 : fHeights.level(0).width; }
+    unsigned int terrainHeight() const { return isEmpty() ? 0 : fHeights.level(0).height; }
+    float voxelSize() const { return fVoxelSize; }
+    size_t byteSize() const { return fHeights.byteSize(); }
+
+    // Top of the column under world (x, z); false off the terrain
+    bool surfaceHeight(double x, double z, double& outY) const;
+
+    TerrainHit castRay(const TerrainRay& ray) const;
+
+    // Casts count rays in parallel over ThreadPool::global()
+    void castRays(const TerrainRay* rays, size_t count, TerrainHit* outHits) const;
+
+    /**
+     * @brief Voxels that overlap the world box from boxMin to boxMax
+     *
+     * Voxels that only touch the box's faces don't count. Counting stops
+     * once limit is reached, so a limit of 1 asks whether the box is
+     * occupied at all.
+     */
+    uint64_t countVoxels(const MVector& boxMin, const MVector& boxMax,
+        uint64_t limit = std::numeric_limits<uint64_t>::max()) const;
+
+private:
+    HeightPyramid fHeights;
+    float fVoxelSize = 1.0f;
+};
@@ -0,0 +1,154 @@
+#include "TerrainSpans.h"
+#include "TerrainColoring.h"
+#include "ThreadPool.h"
+#include <cstring>
+#include <numeric>
+
+namespace
+{
+    // Spans per task when expanding
+    const size_t EXPAND_CHUNK = 1 << 14;
+}
+
+void TerrainSpans::clear()
+{
+    terrainWidth = 0;
+    terrainHeight = 0;
+    voxelCount = 0;
+    spans.clear();
+}
+
+void TerrainSpans::updateVoxelCount()
+{
+    ThreadPool& pool = ThreadPool::global();
+    size_t numChunks = (spans.size() + EXPAND_CHUNK - 1) / EXPAND_CHUNK;
+    std::vector<uint64_t> chunkCounts(numChunks, 0);
+
+    pool.parallelFor(0, spans.size(), EXPAND_CHUNK, [&](size_t begin, size_t end) {
+        uint64_t count = 0;
+        for (size_t i = begin; i < end; i++) {
+            count += spans[i].voxelCount();
+        }
+        chunkCounts[begin / EXPAND_CHUNK] = count;
+    });
+
+    voxelCount = std::accumulate(chunkCounts.begin(), chunkCounts.end(), uint64_t(0));
+}
+
+void TerrainSpans::expandPositions(float voxelSize, MVectorArray& outPositions) const
+{
+    outPositions.setLength((unsigned int)voxelCount);
+    if (voxelCount > 0) {
+        expandPositions(voxelSize, &outPositions[0]);
+    }
+}
+
+void TerrainSpans::expandPositions(float voxelSize, MVector* outPositions,
+    const TerrainColoring* coloring, MVector* outColors) const
+{
+    expandRange(voxelSize, 0, spans.size(), outPositions, coloring, outColors);
+}
+
+void TerrainSpans::expandRange(float voxelSize, size_t first, size_t last, MVector* out,
+    const TerrainColoring* coloring, MVector* outColors) const
+{
+    ThreadPool& pool = ThreadPool::global();
+    size_t numChunks = (last - first + EXPAND_CHUNK - 1) / EXPAND_CHUNK;
+
+    // Count per chunk, then scan to get where each chunk starts writing
+    std::vector<uint64_t> chunkOffsets(numChunks + 1, 0);
+    pool.parallelFor(first, last, EXPAND_CHUNK, [&](size_t begin, size_t end) {
+        uint64_t count = 0;
+        for (size_t i = begin; i < end; i++) {
+            count += spans[i].voxelCount();
+        }
+        chunkOffsets[(begin - first) / EXPAND_CHUNK + 1] = count;
+    });
+    std::partial_sum(chunkOffsets.begin(), chunkOffsets.end(), chunkOffsets.begin());
+
+    bool colored = coloring && outColors;
+    pool.parallelFor(first, last, EXPAND_CHUNK, [&](size_t begin, size_t end) {
+        uint64_t chunkOffset = chunkOffsets[(begin - first) / EXPAND_CHUNK];
+        MVector* chunkOut = out + chunkOffset;
+        MVector* colorOut = colored ? outColors + chunkOffset : nullptr;
+        for (size_t i = begin; i < end; i++) {
+            const ColumnSpan& span = spans[i];
+            float worldX = (float)span.x * voxelSize;
+            float worldZ = (float)span.z * voxelSize;
+
+            for (uint32_t h = span.yMin; h <= span.yMax; h++) {
+                float worldY = (float)h * voxelSize;
+                *chunkOut++ = MVector(worldX, worldY, worldZ);
+            }
+
+            if (colored) {
+                uint32_t columnColor = coloring->columnColor(*this, i);
+                for (uint32_t h = span.yMin; h <= span.yMax; h++) {
+                    *colorOut++ = TerrainColoring::toVector(coloring->voxelColor(columnColor, h));
+                }
+            }
+        }
+    });
+}
+
+void TerrainSpans::rowOffsets(std::vector<uint64_t>& outOffsets) const
+{
+    outOffsets.assign(terrainHeight + 1, 0);
+    if (spans.empty()) {
+        return;
+    }
+
+    ThreadPool::global().parallelFor(0, terrainHeight, 1, [&](size_t rowBegin, size_t rowEnd) {
+        for (size_t row = rowBegin; row < rowEnd; row++) {
+            const ColumnSpan* rowSpans = spans.data() + row * terrainWidth;
+            uint64_t count = 0;
+            for (unsigned int x = 0; x < terrainWidth; x++) {
+                count += rowSpans[x].voxelCount();
+            }
+            outOffsets[row + 1] = count;
+        }
+    });
+    std::partial_sum(outOffsets.begin(), outOffsets.end(), outOffsets.begin());
+}
+
+void TerrainSpans::spliceRows(float voxelSize, unsigned int rowBegin, unsigned int rowEnd,
+    MVectorArray& positions, std::vector<uint64_t>& rowOffsets) const
+{
+    uint64_t oldBegin = rowOffsets[rowBegin];
+    uint64_t oldEnd = rowOffsets[rowEnd];
+    uint64_t oldTotal = rowOffsets[terrainHeight];
+
+    // New offsets within the band
+    uint64_t offset = oldBegin;
+    for (unsigned int row = rowBegin; row < rowEnd; row++) {
+        const ColumnSpan* rowSpans = spans.data() + (size_t)row * terrainWidth;
+        for (unsigned int x = 0; x < terrainWidth; x++) {
+            offset += rowSpans[x].voxelCount();
+        }
+        rowOffsets[row + 1] = offset;
+    }
+    uint64_t newEnd = offset;
+
+    // Move the rows after the band in one go, growing before or shrinking after the move
+    uint64_t tailCount = oldTotal - oldEnd;
+    if (newEnd != oldEnd) {
+        if (newEnd > oldEnd) {
+            positions.setLength((unsigned int)(newEnd + tailCount));
+        }
+        if (tailCount > 0) {
+            memmove(static_cast<void*>(&positions[(unsigned int)newEnd]), static_cast<const void*>(&positions[(unsigned int)oldEnd]),
+                (size_t)tailCount * sizeof(MVector));
+        }
+        if (newEnd < oldEnd) {
+            positions.setLength((unsigned int)(newEnd + tailCount));
+        }
+
+        for (unsigned int row = rowEnd; row < terrainHeight; row++) {
+            rowOffsets[row + 1] = rowOffsets[row + 1] - oldEnd + newEnd;
+        }
+    }
+
+    if (newEnd > oldBegin) {
+        expandRange(voxelSize, (size_t)rowBegin * terrainWidth, (size_t)rowEnd * terrainWidth, &positions[(unsigned int)oldBegin]);
+    }
+}
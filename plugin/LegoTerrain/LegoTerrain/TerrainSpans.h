@@ -0,0 +1,83 @@
+#pragma once
+
+#include "CoreTypes.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class TerrainColoring;
+
+/**
+ * @brief One terrain column, filled from yMin up to yMax inclusive
+ *
+ * Packed into 8 bytes and laid out like an OpenCL ushort4, so the device
+ * writes it directly and the host reads it back without conversion.
+ */
+struct ColumnSpan
+{
+    uint16_t x;
+    uint16_t z;
+    uint16_t yMin;
+    uint16_t yMax;
+
+    uint32_t voxelCount() const { return (uint32_t)yMax - yMin + 1; }
+};
+
+static_assert(sizeof(ColumnSpan) == 8, "ColumnSpan must match the kernel's ushort4");
+
+/**
+ * @brief Generated terrain as one span per column, in row-major order
+ */
+struct TerrainSpans
+{
+    // Largest terrain side a 16 bit span coordinate can address
+    static constexpr unsigned int MAX_DIMENSION = 65536;
+
+    // Tallest column a 16 bit span height can address
+    static constexpr unsigned int MAX_HEIGHT = 65535;
+
+    unsigned int terrainWidth = 0;
+    unsigned int terrainHeight = 0;
+    uint64_t voxelCount = 0;
+    std::vector<ColumnSpan> spans;
+
+    void clear();
+
+    // Sum the span lengths into voxelCount
+    void updateVoxelCount();
+
+    /**
+     * @brief Expand the spans into one position per voxel
+     *
+     * Runs in parallel over ThreadPool::global(). Positions are the voxel
+     * indices times voxelSize, computed in float. The array is sized once
+     * and written in place, so it can go straight to the particle shape.
+     */
+    void expandPositions(float voxelSize, MVectorArray& outPositions) const;
+
+    // As above, into storage that already holds voxelCount positions. With a
+    // coloring, each voxel's rgbPP colour is written to outColors in the
+    // same pass.
+    void expandPositions(float voxelSize, MVector* outPositions,
+        const TerrainColoring* coloring = nullptr, MVector* outColors = nullptr) const;
+
+    // Index of the first voxel of every row in the expanded positions, plus
+    // voxelCount at the end
+    void rowOffsets(std::vector<uint64_t>& outOffsets) const;
+
+    /**
+     * @brief Update expanded positions after the spans of some rows changed
+     *
+     * positions and rowOffsets hold the expansion from before the change.
+     * Rows [rowBegin, rowEnd) are expanded again, the rows after them are
+     * moved by the change in voxel count and the rows before them are left
+     * alone. Both are brought up to date.
+     */
+    void spliceRows(float voxelSize, unsigned int rowBegin, unsigned int rowEnd,
+        MVectorArray& positions, std::vector<uint64_t>& rowOffsets) const;
+
+private:
+    // Expand spans [begin, end) into out, and their colours into outColors when given
+    void expandRange(float voxelSize, size_t begin, size_t end, MVector* out,
+        const TerrainColoring* coloring = nullptr, MVector* outColors = nullptr) const;
+};
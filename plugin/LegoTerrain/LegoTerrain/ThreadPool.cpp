@@ -0,0 +1,145 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+    : fPending(0)
+    , fNextQueue(0)
+    , fStop(false)
+{
+    if (numThreads == 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The calling thread always helps, so one less worker is needed
+    unsigned int numWorkers = numThreads > 1 ? numThreads - 1 : 0;
+
+    // One queue per worker plus one for tasks pushed from outside the pool
+    for (unsigned int i = 0; i < numWorkers + 1; i++) {
+        fQueues.emplace_back(new WorkQueue());
+    }
+
+    for (unsigned int i = 0; i < numWorkers; i++) {
+        fThreads.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(fWakeMutex);
+        fStop = true;
+    }
+    fWake.notify_all();
+
+    for (std::thread& thread : fThreads) {
+        thread.join();
+    }
+}
+
+ThreadPool& ThreadPool::global()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+unsigned int ThreadPool::concurrency() const
+{
+    return (unsigned int)fThreads.size() + 1;
+}
+
+void ThreadPool::push(std::function<void()> task)
+{
+    size_t index = fNextQueue.fetch_add(1) % fQueues.size();
+    {
+        std::lock_guard<std::mutex> lock(fQueues[index]->mutex);
+        fQueues[index]->tasks.push_back(std::move(task));
+    }
+    fPending.fetch_add(1);
+
+    {
+        std::lock_guard<std::mutex> lock(fWakeMutex);
+    }
+    fWake.notify_one();
+}
+
+bool ThreadPool::runOne(size_t home)
+{
+    std::function<void()> task;
+
+    // Own queue first (LIFO for cache locality), then steal (FIFO) from the rest
+    for (size_t i = 0; i < fQueues.size() && !task; i++) {
+        WorkQueue& queue = *fQueues[(home + i) % fQueues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+
+        if (i == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+
+    if (!task) {
+        return false;
+    }
+
+    fPending.fetch_sub(1);
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(size_t index)
+{
+    for (;;) {
+        if (runOne(index)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(fWakeMutex);
+        fWake.wait(lock, [this] { return fStop || fPending.load() > 0; });
+        if (fStop) {
+            return;
+        }
+    }
+}
+
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain,
+    const std::function<void(size_t, size_t)>& body)
+{
+    if (begin >= end) {
+        return;
+    }
+
+    grain = std::max<size_t>(grain, 1);
+    size_t numChunks = (end - begin + grain - 1) / grain;
+
+    // Not worth a round trip through the queues
+    if (numChunks == 1 || fThreads.empty()) {
+        for (size_t chunk = begin; chunk < end; chunk += grain) {
+            body(chunk, std::min(chunk + grain, end));
+        }
+        return;
+    }
+
+    auto remaining = std::make_shared<std::atomic<size_t>>(numChunks);
+    for (size_t chunk = begin; chunk < end; chunk += grain) {
+        size_t chunkEnd = std::min(chunk + grain, end);
+        push([&body, remaining, chunk, chunkEnd] {
+            body(chunk, chunkEnd);
+            remaining->fetch_sub(1);
+        });
+    }
+
+    // Help out until every chunk of this range has finished
+    size_t home = fQueues.size() - 1;
+    while (remaining->load() > 0) {
+        if (!runOne(home)) {
+            std::this_thread::yield();
+        }
+    }
+}
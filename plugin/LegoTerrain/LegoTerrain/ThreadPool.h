@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Work-stealing thread pool for the CPU backend
+ *
+ * Every worker owns a task deque. Workers pop from the back of their own
+ * deque and steal from the front of the others when it runs dry, so uneven
+ * tiles (flat areas next to cliffs) still balance across all cores. The
+ * thread calling parallelFor helps run tasks until its range is complete,
+ * which makes nested calls safe.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int numThreads = 0);
+    ~ThreadPool();
+
+    // Shared pool sized to the hardware concurrency
+    static ThreadPool& global();
+
+    // Worker threads plus the calling thread
+    unsigned int concurrency() const;
+
+    /**
+     * @brief Run body(chunkBegin, chunkEnd) over [begin, end) in chunks of grain
+     *
+     * Returns once every chunk has run.
+     */
+    void parallelFor(size_t begin, size_t end, size_t grain,
+        const std::function<void(size_t, size_t)>& body);
+
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> fQueues;
+    std::vector<std::thread> fThreads;
+    std::mutex fWakeMutex;
+    std::condition_variable fWake;
+    std::atomic<size_t> fPending;
+    std::atomic<size_t> fNextQueue;
+    bool fStop;
+
+    void push(std::function<void()> task);
+    bool runOne(size_t home);
+    void workerLoop(size_t index);
+};
@@ -1,8 +1,13 @@
 #include "VoxelizeTerrainCmd.h"
-#include "HeightmapComputeShader.h"
+#include "TerrainComputeBackend.h"
+#include "TerrainComputeService.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
 #include <maya/MImage.h>
 #include <maya/MArgDatabase.h>
 #include <maya/MVectorArray.h>
+#include <maya/MDoubleArray.h>
+#include <maya/MStringArray.h>
 #include <maya/MSelectionList.h>
 #include <maya/MDagPath.h>
 #include <maya/MFnInstancer.h>
@@ -10,8 +15,21 @@
 #include <maya/MPlug.h>
 #include <maya/MPointArray.h>
 #include <maya/MFnDependencyNode.h>
+#include <maya/MFnTypedAttribute.h>
+#include <maya/MFnStringArrayData.h>
+#include <maya/MIntArray.h>
+#include <maya/MMatrix.h>
+#include <maya/MFnMesh.h>
+#include <maya/MFnMeshData.h>
+#include <maya/MFloatPointArray.h>
+#include <algorithm>
 #include <chrono>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <future>
+#include <string>
+#include <utility>
 
 const char* VoxelizeTerrainCmd::commandName = "voxelizeTerrain";
 
@@ -25,6 +43,96 @@ const char* VoxelizeTerrainCmd::maxHeightFlag = "-m";
 const char* VoxelizeTerrainCmd::maxHeightFlagLong = "-maxHeight";
 const char* VoxelizeTerrainCmd::outputNameFlag = "-o";
 const char* VoxelizeTerrainCmd::outputNameFlagLong = "-outputName";
+const char* VoxelizeTerrainCmd::backendFlag = "-b";
+const char* VoxelizeTerrainCmd::backendFlagLong = "-backend";
+const char* VoxelizeTerrainCmd::cacheBudgetFlag = "-cb";
+const char* VoxelizeTerrainCmd::cacheBudgetFlagLong = "-cacheBudget";
+const char* VoxelizeTerrainCmd::bricksFlag = "-bk";
+const char* VoxelizeTerrainCmd::bricksFlagLong = "-bricks";
+const char* VoxelizeTerrainCmd::rawWidthFlag = "-rw";
+const char* VoxelizeTerrainCmd::rawWidthFlagLong = "-rawWidth";
+const char* VoxelizeTerrainCmd::memoryBudgetFlag = "-mb";
+const char* VoxelizeTerrainCmd::memoryBudgetFlagLong = "-memoryBudget";
+const char* VoxelizeTerrainCmd::lodCameraFlag = "-lc";
+const char* VoxelizeTerrainCmd::lodCameraFlagLong = "-lodCamera";
+const char* VoxelizeTerrainCmd::lodDistanceFlag = "-ld";
+const char* VoxelizeTerrainCmd::lodDistanceFlagLong = "-lodDistance";
+const char* VoxelizeTerrainCmd::lodLevelsFlag = "-ll";
+const char* VoxelizeTerrainCmd::lodLevelsFlagLong = "-lodLevels";
+const char* VoxelizeTerrainCmd::manifestFlag = "-mf";
+const char* VoxelizeTerrainCmd::manifestFlagLong = "-manifest";
+const char* VoxelizeTerrainCmd::colorMapFlag = "-cm";
+const char* VoxelizeTerrainCmd::colorMapFlagLong = "-colorMap";
+const char* VoxelizeTerrainCmd::colorRampFlag = "-cr";
+const char* VoxelizeTerrainCmd::colorRampFlagLong = "-colorRamp";
+const char* VoxelizeTerrainCmd::statsFlag = "-st";
+const char* VoxelizeTerrainCmd::statsFlagLong = "-stats";
+const char* VoxelizeTerrainCmd::generateOnlyFlag = "-go";
+const char* VoxelizeTerrainCmd::generateOnlyFlagLong = "-generateOnly";
+const char* VoxelizeTerrainCmd::profileFlag = "-pf";
+const char* VoxelizeTerrainCmd::profileFlagLong = "-profile";
+const char* VoxelizeTerrainCmd::profileTraceFlag = "-pt";
+const char* VoxelizeTerrainCmd::profileTraceFlagLong = "-profileTrace";
+const char* VoxelizeTerrainCmd::meshFlag = "-ms";
+const char* VoxelizeTerrainCmd::meshFlagLong = "-mesh";
+const char* VoxelizeTerrainCmd::mergeFacesFlag = "-mg";
+const char* VoxelizeTerrainCmd::mergeFacesFlagLong = "-mergeFaces";
+const char* VoxelizeTerrainCmd::terrainCacheFlag = "-tc";
+const char* VoxelizeTerrainCmd::terrainCacheFlagLong = "-terrainCache";
+const char* VoxelizeTerrainCmd::proceduralFlag = "-pr";
+const char* VoxelizeTerrainCmd::proceduralFlagLong = "-procedural";
+const char* VoxelizeTerrainCmd::normalizeHeightsFlag = "-nh";
+const char* VoxelizeTerrainCmd::normalizeHeightsFlagLong = "-normalizeHeights";
+const char* VoxelizeTerrainCmd::trimBaseFlag = "-tb";
+const char* VoxelizeTerrainCmd::trimBaseFlagLong = "-trimBase";
+
+namespace
+{
+	MPlug nodePlug(const MObject& node, const char* name)
+	{
+		return MFnDependencyNode(node).findPlug(name, false);
+	}
+
+	MStatus checkHeightmapPath(const MString& heightMapPath)
+	{
+		if (heightMapPath.length() == 0) {
+			MGlobal::displayError("Height map path is empty");
+			return MS::kFailure;
+		}
+
+		// Existence and the PNG signature are checked when the file is decoded,
+		// which the heightmap cache skips for unchanged files
+		if (!HeightmapCache::isSupportedPath(heightMapPath)) {
+			MGlobal::displayError("Height map file must be a .png, .r16 or .r32 file: " + heightMapPath);
+			return MS::kFailure;
+		}
+
+		return MS::kSuccess;
+	}
+
+	std::string trimmed(const std::string& text)
+	{
+		size_t begin = text.find_first_not_of(" \t\r\n");
+		if (begin == std::string::npos) return std::string();
+		size_t end = text.find_last_not_of(" \t\r\n");
+		return text.substr(begin, end - begin + 1);
+	}
+
+	double millisecondsSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() * 1000.0;
+	}
+
+	std::string jsonString(const MString& text)
+	{
+		std::string quoted = "\"";
+		for (const char* c = text.asChar(); *c; c++) {
+			if (*c == '"' || *c == '\\') quoted += '\\';
+			quoted += *c;
+		}
+		return quoted + "\"";
+	}
+}
 
 VoxelizeTerrainCmd::VoxelizeTerrainCmd()
 {
@@ -35,6 +143,26 @@ VoxelizeTerrainCmd::VoxelizeTerrainCmd()
 	VoxelizeTerrainCmd::m_maxHeight = 256;
 	
 	VoxelizeTerrainCmd::m_outputName = "terrain";
+	VoxelizeTerrainCmd::m_backend = "auto";
+	VoxelizeTerrainCmd::m_cacheBudgetMB = -1;
+	VoxelizeTerrainCmd::m_mergeBricks = false;
+	VoxelizeTerrainCmd::m_rawWidth = 0;
+	VoxelizeTerrainCmd::m_memoryBudgetMB = 0;
+	VoxelizeTerrainCmd::m_lodCamera = "";
+	VoxelizeTerrainCmd::m_lodDistance = 64.0f;
+	VoxelizeTerrainCmd::m_lodLevels = 4;
+	VoxelizeTerrainCmd::m_stats = false;
+	VoxelizeTerrainCmd::m_generateOnly = false;
+	VoxelizeTerrainCmd::m_profile = false;
+	VoxelizeTerrainCmd::m_profileTrace = "";
+	VoxelizeTerrainCmd::m_mesh = false;
+	VoxelizeTerrainCmd::m_mergeFaces = false;
+	VoxelizeTerrainCmd::m_meshFaces = 0;
+	VoxelizeTerrainCmd::m_terrainCache = "";
+	VoxelizeTerrainCmd::m_bricksFromCache = false;
+	VoxelizeTerrainCmd::m_procedural = false;
+	VoxelizeTerrainCmd::m_normalizeClip = -1.0;
+	VoxelizeTerrainCmd::m_trimBase = 0;
 	VoxelizeTerrainCmd::m_hasValidData = false;
 }
 
@@ -56,6 +184,31 @@ MSyntax VoxelizeTerrainCmd::newSyntax()
 	syntax.addFlag(terrainDimensionsFlag, terrainDimensionsFlagLong, MSyntax::kLong, MSyntax::kLong);
 	syntax.addFlag(maxHeightFlag, maxHeightFlagLong, MSyntax::kLong);
 	syntax.addFlag(outputNameFlag, outputNameFlagLong, MSyntax::kString);
+	syntax.addFlag(backendFlag, backendFlagLong, MSyntax::kString);
+	syntax.addFlag(cacheBudgetFlag, cacheBudgetFlagLong, MSyntax::kLong);
+	syntax.addFlag(bricksFlag, bricksFlagLong, MSyntax::kString);
+	syntax.addFlag(rawWidthFlag, rawWidthFlagLong, MSyntax::kLong);
+	syntax.addFlag(memoryBudgetFlag, memoryBudgetFlagLong, MSyntax::kLong);
+	syntax.addFlag(lodCameraFlag, lodCameraFlagLong, MSyntax::kString);
+	syntax.addFlag(lodDistanceFlag, lodDistanceFlagLong, MSyntax::kDouble);
+	syntax.addFlag(lodLevelsFlag, lodLevelsFlagLong, MSyntax::kLong);
+	syntax.addFlag(manifestFlag, manifestFlagLong, MSyntax::kString);
+	syntax.addFlag(colorMapFlag, colorMapFlagLong, MSyntax::kString);
+	syntax.addFlag(colorRampFlag, colorRampFlagLong, MSyntax::kString);
+	syntax.addFlag(statsFlag, statsFlagLong);
+	syntax.addFlag(generateOnlyFlag, generateOnlyFlagLong);
+	syntax.addFlag(profileFlag, profileFlagLong);
+	syntax.addFlag(profileTraceFlag, profileTraceFlagLong, MSyntax::kString);
+	syntax.addFlag(meshFlag, meshFlagLong);
+	syntax.addFlag(mergeFacesFlag, mergeFacesFlagLong);
+	syntax.addFlag(terrainCacheFlag, terrainCacheFlagLong, MSyntax::kString);
+	syntax.addFlag(proceduralFlag, proceduralFlagLong, MSyntax::kString);
+	syntax.addFlag(normalizeHeightsFlag, normalizeHeightsFlagLong, MSyntax::kDouble);
+	syntax.addFlag(trimBaseFlag, trimBaseFlagLong, MSyntax::kLong);
+
+	// Several heightmaps, each with its own output name, run as a batch
+	syntax.makeFlagMultiUse(heightMapFlag);
+	syntax.makeFlagMultiUse(outputNameFlag);
 
 	syntax.setObjectType(MSyntax::kStringObjects);
 
@@ -67,80 +220,146 @@ MStatus VoxelizeTerrainCmd::doIt(const MArgList& args)
 	MStatus status = parseArguments(args);
 	if (!status) return status;
 
-	return redoIt();
+	if (!m_hasValidData) {
+		return MS::kFailure;
+	}
+
+	if (m_profile) {
+		return executeProfiled();
+	}
+
+	return executeCommand();
 }
 
 MStatus VoxelizeTerrainCmd::redoIt()
 {
-	if (!m_hasValidData) {
-		return MS::kFailure;
+	// Replays the recorded node creation; the terrain itself was generated once in doIt
+	MStatus status = m_dagModifier.doIt();
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	for (const auto& query : m_queries) {
+		TerrainComputeService::instance()->setTerrain(query.first, query.second);
 	}
 
-	return executeCommand();
+	if (m_jobs.empty()) {
+		return restoreShape(m_spans, m_bricks, m_lod, m_meshData, m_meshFaces);
+	}
+
+	// Every job of a batch kept its own columns, so each shape is refilled in turn
+	for (const BatchTerrain& terrain : m_batchTerrains) {
+		m_particleSystemObj = terrain.particleSystemObj;
+		m_meshShapeObj = terrain.meshShapeObj;
+		m_brickScale = terrain.brickScale;
+		m_maxHeight = terrain.maxHeight;
+		status = restoreShape(terrain.spans, terrain.bricks, terrain.lod, terrain.meshData, terrain.meshFaces);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+
+	return MS::kSuccess;
 }
 
-MStatus VoxelizeTerrainCmd::undoIt()
+MStatus VoxelizeTerrainCmd::restoreShape(const TerrainSpans& spans, const BrickLayout& bricks, const LodLayout& lod,
+	const MObject& meshData, size_t meshFaces)
 {
 	MStatus status;
-	MDagModifier dgMod;
+	if (m_mesh) {
+		MFnMesh meshFn(m_meshShapeObj, &status);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		if ((size_t)meshFn.numPolygons() != meshFaces) {
+			return meshFn.copyInPlace(meshData);
+		}
+		return MS::kSuccess;
+	}
 
-	MGlobal::clearSelectionList();
+	// The restored shape normally keeps its particles, refill it from the kept data if not
+	MFnParticleSystem particleFn(m_particleSystemObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
 
-	if (!m_instancerObj.isNull()) {
-		dgMod.deleteNode(m_instancerObj);
-	}
-	if (!m_cubeObj.isNull()) {
-		dgMod.deleteNode(m_cubeObj);
+	const BrickLayout* brickLayout = m_mergeBricks ? &bricks : nullptr;
+	const LodLayout* lodLayout = m_lodCamera.length() > 0 ? &lod : nullptr;
+	uint64_t expectedCount = brickLayout ? brickLayout->bricks.size() : lodLayout ? lodLayout->blocks.size() : spans.voxelCount;
+	if (particleFn.count() != expectedCount) {
+		return setParticleData(spans, brickLayout, lodLayout);
 	}
-	if (!m_particleTransformObj.isNull()) {
-		dgMod.deleteNode(m_particleTransformObj);
+
+	return MS::kSuccess;
+}
+
+MStatus VoxelizeTerrainCmd::undoIt()
+{
+	MGlobal::clearSelectionList();
+
+	// A later voxelizeTerrain may have replaced a terrain since, that one stays
+	for (const auto& query : m_queries) {
+		TerrainComputeService::instance()->removeTerrain(query.first, query.second.get());
 	}
 
-	return dgMod.doIt();
+	return m_dagModifier.undoIt();
 }
 
 bool VoxelizeTerrainCmd::isUndoable() const {
-	return true;
+	// Nothing to undo when no nodes were made
+	return !m_generateOnly;
 }
 
 MStatus VoxelizeTerrainCmd::parseArguments(const MArgList& args)
 {
 	MArgDatabase argData(newSyntax(), args);
 
-	// Get heightmap path
-	if (argData.isFlagSet(heightMapFlag)) {
-		MString heightMapPath = argData.flagArgumentString(heightMapFlag, 0);
-		
-		if (heightMapPath.length() == 0) {
-			MGlobal::displayError("Height map path is empty");
+	// Get heightmap paths, more than one makes a batch
+	MStringArray heightMapPaths;
+	for (unsigned int i = 0; i < argData.numberOfFlagUses(heightMapFlag); i++) {
+		MArgList flagArgs;
+		argData.getFlagArgumentList(heightMapFlag, i, flagArgs);
+		MString heightMapPath = flagArgs.asString(0);
+
+		MStatus status = checkHeightmapPath(heightMapPath);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		heightMapPaths.append(heightMapPath);
+	}
+	if (heightMapPaths.length() > 0) {
+		m_heightmapPath = heightMapPaths[0];
+	}
+
+	// Get procedural noise settings, which stand in for the heightmap
+	if (argData.isFlagSet(proceduralFlag)) {
+		if (heightMapPaths.length() > 0 || argData.isFlagSet(manifestFlag)) {
+			MGlobal::displayError("Procedural terrain has no height map, it can't be combined with height map paths or a manifest");
 			return MS::kFailure;
 		}
 
-		std::ifstream file(heightMapPath.asChar(), std::ios::binary);
-		if (!file.good()) {
-			MGlobal::displayError("Height map file does not exist: " + heightMapPath);
+		MStatus status = NoiseSettings::parse(argData.flagArgumentString(proceduralFlag, 0), m_noise);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		m_procedural = true;
+	}
+
+	// Get height normalization, stretching the measured samples over the max height
+	if (argData.isFlagSet(normalizeHeightsFlag)) {
+		double clip = argData.flagArgumentDouble(normalizeHeightsFlag, 0);
+
+		if (m_procedural) {
+			MGlobal::displayError("Procedural heights aren't measured, they can't be normalized");
 			return MS::kFailure;
 		}
-
-		MString lowercasePath = heightMapPath.toLowerCase();
-		if (!(lowercasePath.substring(lowercasePath.length() - 4, lowercasePath.length() - 1) == ".png")) {
-			MGlobal::displayError("Height map file is not in PNG format: " + heightMapPath);
-			file.close();
+		if (clip < 0.0 || clip >= 0.5) {
+			MGlobal::displayError("Normalize clip must be a fraction of the samples, at least 0 and below 0.5");
 			return MS::kFailure;
 		}
 
-		unsigned char pngSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
-		unsigned char fileSignature[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+		m_normalizeClip = clip;
+	}
 
-		file.read(reinterpret_cast<char*>(fileSignature), 8);
-		file.close();
+	// Get base trim, -1 cuts every layer below the lowest column
+	if (argData.isFlagSet(trimBaseFlag)) {
+		int trimBase = argData.flagArgumentInt(trimBaseFlag, 0);
 
-		if (file.gcount() < 8 || memcmp(fileSignature, pngSignature, 8) != 0) {
-			MGlobal::displayError("Height map file is not in PNG format: " + heightMapPath);
+		if (trimBase < -1) {
+			MGlobal::displayError("Trim base must be a integer of layers, 0 or greater, or -1 for automatic");
 			return MS::kFailure;
 		}
 
-		m_heightmapPath = heightMapPath;
+		m_trimBase = trimBase;
 	}
 
 	// Get brick scale
@@ -173,183 +392,1139 @@ MStatus VoxelizeTerrainCmd::parseArguments(const MArgList& args)
 	if (argData.isFlagSet(maxHeightFlag)) {
 		int maxHeight = argData.flagArgumentInt(maxHeightFlag, 0);
 
-		int MAX_HEIGHT = 256;
+		int MAX_HEIGHT = TerrainSpans::MAX_HEIGHT;
 		if (maxHeight < 0) maxHeight = 0;
 		if (maxHeight > MAX_HEIGHT) maxHeight = MAX_HEIGHT;
 
 		m_maxHeight = maxHeight;
 	}
 
-	// Get output name
-	if (argData.isFlagSet(outputNameFlag)) {
-		MString outputName = argData.flagArgumentString(outputNameFlag, 0);
+	// Get output names, one per heightmap in a batch
+	MStringArray outputNames;
+	for (unsigned int i = 0; i < argData.numberOfFlagUses(outputNameFlag); i++) {
+		MArgList flagArgs;
+		argData.getFlagArgumentList(outputNameFlag, i, flagArgs);
+		MString outputName = flagArgs.asString(0);
 
 		if (outputName.length() == 0) {
 			MGlobal::displayError("You must specify an output name for the terrain");
 			return MS::kFailure;
 		}
 
-		m_outputName = outputName;
+		outputNames.append(outputName);
+	}
+	if (outputNames.length() > 0) {
+		m_outputName = outputNames[0];
+	}
+
+	// Get compute backend
+	if (argData.isFlagSet(backendFlag)) {
+		MString backend = argData.flagArgumentString(backendFlag, 0).toLowerCase();
+
+		if (backend != "cpu" && backend != "opencl" && backend != "auto") {
+			MGlobal::displayError("Backend must be one of cpu, opencl or auto: " + backend);
+			return MS::kFailure;
+		}
+
+		m_backend = backend;
+	}
+
+	// Get heightmap cache budget, applied to the shared cache
+	if (argData.isFlagSet(cacheBudgetFlag)) {
+		int cacheBudget = argData.flagArgumentInt(cacheBudgetFlag, 0);
+
+		if (cacheBudget < 0) {
+			MGlobal::displayError("Cache budget must be a integer of megabytes, 0 or greater");
+			return MS::kFailure;
+		}
+
+		m_cacheBudgetMB = cacheBudget;
+	}
+
+	// Get raw heightmap width, raw files are assumed square without it
+	if (argData.isFlagSet(rawWidthFlag)) {
+		int rawWidth = argData.flagArgumentInt(rawWidthFlag, 0);
+
+		if (rawWidth <= 0) {
+			MGlobal::displayError("Raw width must be a integer greater than 0");
+			return MS::kFailure;
+		}
+
+		m_rawWidth = rawWidth;
+	}
+
+	// Get generation memory budget, 0 generates in one tile when it fits
+	if (argData.isFlagSet(memoryBudgetFlag)) {
+		int memoryBudget = argData.flagArgumentInt(memoryBudgetFlag, 0);
+
+		if (memoryBudget < 0) {
+			MGlobal::displayError("Memory budget must be a integer of megabytes, 0 or greater");
+			return MS::kFailure;
+		}
+
+		m_memoryBudgetMB = memoryBudget;
+	}
+
+	// Get brick catalogue, "default" uses BrickCatalogue::DEFAULT_SPEC
+	if (argData.isFlagSet(bricksFlag)) {
+		MString bricks = argData.flagArgumentString(bricksFlag, 0);
+		if (bricks == "default") {
+			bricks = BrickCatalogue::DEFAULT_SPEC;
+		}
+
+		MStatus status = BrickCatalogue::parse(bricks, m_brickCatalogue);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		m_mergeBricks = true;
+	}
+
+	// Get LOD camera, LOD is off without one
+	if (argData.isFlagSet(lodCameraFlag)) {
+		MString lodCamera = argData.flagArgumentString(lodCameraFlag, 0);
+
+		if (lodCamera.length() == 0) {
+			MGlobal::displayError("LOD camera name is empty");
+			return MS::kFailure;
+		}
+
+		m_lodCamera = lodCamera;
+	}
+
+	// Get LOD distance, where level 1 starts in world units
+	if (argData.isFlagSet(lodDistanceFlag)) {
+		float lodDistance = static_cast<float>(argData.flagArgumentDouble(lodDistanceFlag, 0));
+
+		if (lodDistance <= 0) {
+			MGlobal::displayError("LOD distance must be a float greater than 0");
+			return MS::kFailure;
+		}
+
+		m_lodDistance = lodDistance;
+	}
+
+	// Get coarsest LOD level
+	if (argData.isFlagSet(lodLevelsFlag)) {
+		int lodLevels = argData.flagArgumentInt(lodLevelsFlag, 0);
+
+		if (lodLevels < 0 || lodLevels > (int)LodPyramid::MAX_LEVELS) {
+			MGlobal::displayError(MString("LOD levels must be a integer between 0 and ") + LodPyramid::MAX_LEVELS);
+			return MS::kFailure;
+		}
+
+		m_lodLevels = lodLevels;
+	}
+
+	if (m_mergeBricks && m_lodCamera.length() > 0) {
+		MGlobal::displayError("Bricks and LOD can't be combined, pick one");
+		return MS::kFailure;
+	}
+
+	// Get mesh output, an alternative to the instancer for rendering and export
+	m_mesh = argData.isFlagSet(meshFlag);
+	m_mergeFaces = argData.isFlagSet(mergeFacesFlag);
+
+	if (m_mergeFaces && !m_mesh) {
+		MGlobal::displayError("Merging faces needs mesh output");
+		return MS::kFailure;
+	}
+	if (m_mesh && (m_mergeBricks || m_lodCamera.length() > 0)) {
+		MGlobal::displayError("Mesh output can't be combined with bricks or LOD, pick one");
+		return MS::kFailure;
+	}
+	if (m_mesh && (argData.isFlagSet(colorMapFlag) || argData.isFlagSet(colorRampFlag))) {
+		MGlobal::displayError("Colours are written per particle, they can't be combined with mesh output");
+		return MS::kFailure;
+	}
+
+	// Get voxel colours, from a colour map or a height or slope ramp
+	if (argData.isFlagSet(colorMapFlag) && argData.isFlagSet(colorRampFlag)) {
+		MGlobal::displayError("A colour map and a colour ramp can't be combined, pick one");
+		return MS::kFailure;
+	}
+	if (argData.isFlagSet(colorMapFlag)) {
+		MStatus status = TerrainColoring::loadColorMap(argData.flagArgumentString(colorMapFlag, 0), m_coloring);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+	if (argData.isFlagSet(colorRampFlag)) {
+		MStatus status = TerrainColoring::parseRamp(argData.flagArgumentString(colorRampFlag, 0), m_coloring);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+
+	// Get reporting options, for benchmarks
+	m_stats = argData.isFlagSet(statsFlag);
+	m_generateOnly = argData.isFlagSet(generateOnlyFlag);
+
+	// Get profiling options, a trace path turns profiling on
+	if (argData.isFlagSet(profileTraceFlag)) {
+		m_profileTrace = argData.flagArgumentString(profileTraceFlag, 0);
+
+		if (m_profileTrace.length() == 0) {
+			MGlobal::displayError("Profile trace path is empty");
+			return MS::kFailure;
+		}
+	}
+	m_profile = argData.isFlagSet(profileFlag) || m_profileTrace.length() > 0;
+
+	// Get the terrain cache file
+	if (argData.isFlagSet(terrainCacheFlag)) {
+		m_terrainCache = argData.flagArgumentString(terrainCacheFlag, 0);
+
+		if (m_terrainCache.length() == 0) {
+			MGlobal::displayError("Terrain cache path is empty");
+			return MS::kFailure;
+		}
+	}
+
+	// Get batch jobs, from a manifest or from repeated heightmap flags. Their
+	// parameters default to the flags parsed above.
+	m_jobs.clear();
+	if (argData.isFlagSet(manifestFlag)) {
+		if (heightMapPaths.length() > 0) {
+			MGlobal::displayError("A manifest and height map paths can't be combined, pick one");
+			return MS::kFailure;
+		}
+
+		MStatus status = parseManifest(argData.flagArgumentString(manifestFlag, 0));
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+	else if (heightMapPaths.length() > 1) {
+		if (outputNames.length() > 1 && outputNames.length() != heightMapPaths.length()) {
+			MGlobal::displayError(MString("Got ") + outputNames.length() + " output names for "
+				+ heightMapPaths.length() + " height maps, give one each or a single base name");
+			return MS::kFailure;
+		}
+
+		for (unsigned int i = 0; i < heightMapPaths.length(); i++) {
+			MString outputName = outputNames.length() > 1 ? outputNames[i] : m_outputName + "_" + (i + 1);
+			m_jobs.push_back({ heightMapPaths[i], outputName, m_terrainWidth, m_terrainHeight, m_maxHeight, m_brickScale });
+		}
+	}
+
+	if (m_terrainCache.length() > 0 && !m_jobs.empty()) {
+		MGlobal::displayError("A terrain cache holds one terrain, it can't be combined with a batch");
+		return MS::kFailure;
 	}
 
 	m_hasValidData = true;
 	return MS::kSuccess;
 }
 
+MStatus VoxelizeTerrainCmd::parseManifest(const MString& manifestPath)
+{
+	std::ifstream file(manifestPath.asChar());
+	if (!file) {
+		MGlobal::displayError("Failed to open manifest: " + manifestPath);
+		return MS::kFailure;
+	}
+
+	// Relative heightmap paths are relative to the manifest
+	std::filesystem::path manifestDir = std::filesystem::path(manifestPath.asChar()).parent_path();
+
+	// One job per line: heightmap,outputName[,width,height[,maxHeight[,brickScale]]]
+	std::string line;
+	unsigned int lineNumber = 0;
+	while (std::getline(file, line)) {
+		lineNumber++;
+		line = trimmed(line);
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		std::vector<std::string> fields;
+		size_t fieldBegin = 0;
+		while (true) {
+			size_t comma = line.find(',', fieldBegin);
+			fields.push_back(trimmed(line.substr(fieldBegin, comma - fieldBegin)));
+			if (comma == std::string::npos) break;
+			fieldBegin = comma + 1;
+		}
+
+		MString linePrefix = MString("Manifest line ") + lineNumber + ": ";
+		if (fields.size() < 2 || fields.size() == 3 || fields.size() > 6) {
+			MGlobal::displayError(linePrefix + "expected heightmap,outputName[,width,height[,maxHeight[,brickScale]]]");
+			return MS::kFailure;
+		}
+
+		std::filesystem::path heightMapPath(fields[0]);
+		if (heightMapPath.is_relative()) {
+			heightMapPath = manifestDir / heightMapPath;
+		}
+
+		BatchJob job = { heightMapPath.string().c_str(), fields[1].c_str(), m_terrainWidth, m_terrainHeight, m_maxHeight, m_brickScale };
+
+		MStatus status = checkHeightmapPath(job.heightmapPath);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		if (job.outputName.length() == 0) {
+			MGlobal::displayError(linePrefix + "output name is empty");
+			return MS::kFailure;
+		}
+
+		if (fields.size() >= 4) {
+			MString width = fields[2].c_str();
+			MString height = fields[3].c_str();
+			if (!width.isInt() || !height.isInt() || width.asInt() <= 0 || height.asInt() <= 0) {
+				MGlobal::displayError(linePrefix + "terrain width and height must be a integer greater than 0");
+				return MS::kFailure;
+			}
+
+			job.terrainWidth = width.asInt();
+			job.terrainHeight = height.asInt();
+		}
+
+		if (fields.size() >= 5) {
+			MString maxHeight = fields[4].c_str();
+			if (!maxHeight.isInt()) {
+				MGlobal::displayError(linePrefix + "max height must be a integer");
+				return MS::kFailure;
+			}
+
+			int MAX_HEIGHT = TerrainSpans::MAX_HEIGHT;
+			job.maxHeight = std::min(std::max(maxHeight.asInt(), 0), MAX_HEIGHT);
+		}
+
+		if (fields.size() >= 6) {
+			MString brickScale = fields[5].c_str();
+			if (!brickScale.isDouble() || brickScale.asDouble() <= 0) {
+				MGlobal::displayError(linePrefix + "brick scale must be a float greater than 0");
+				return MS::kFailure;
+			}
+
+			job.brickScale = brickScale.asFloat();
+		}
+
+		m_jobs.push_back(job);
+	}
+
+	if (m_jobs.empty()) {
+		MGlobal::displayError("Manifest has no jobs: " + manifestPath);
+		return MS::kFailure;
+	}
+
+	return MS::kSuccess;
+}
+
 MStatus VoxelizeTerrainCmd::executeCommand() {
+	if (!m_jobs.empty()) {
+		return executeBatch();
+	}
+
 	MStatus status;
+	m_timings = StageTimings();
 
 	// Start total timer
 	auto startTotal = std::chrono::high_resolution_clock::now();
 
-	// Load the heightmap to get voxel positions
+	// Load the terrain columns from the cache, or generate them from the heightmap
 	auto startLoad = std::chrono::high_resolution_clock::now();
-	status = loadHeightmap(m_heightmapPath, m_voxelPositions);
-	CHECK_MSTATUS_AND_RETURN_IT(status);
+	TerrainCacheKey cacheKey;
+	bool cacheLoaded = false;
+	if (m_terrainCache.length() > 0) {
+		status = readTerrainCache(cacheKey, cacheLoaded);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+	if (!cacheLoaded) {
+		status = m_procedural ? generateProcedural(m_spans) : loadHeightmap(m_heightmapPath, m_spans);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
 	auto endLoad = std::chrono::high_resolution_clock::now();
 	double loadTime = std::chrono::duration<double>(endLoad - startLoad).count() * 1000.0;
 
-	// Use the voxel positions to create a particle system
-	auto startParticles = std::chrono::high_resolution_clock::now();
-	status = createParticleSystem(m_voxelPositions);
+	MStringArray result;
+	status = instanceTerrain(startTotal, loadTime, result);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	// Save what was generated or merged for the next run
+	if (m_terrainCache.length() > 0 && (!cacheLoaded || (m_mergeBricks && !m_bricksFromCache))) {
+		ProfileScope scope("writeTerrainCache");
+		status = TerrainCache::write(m_terrainCache, cacheKey, m_imageWidth, m_imageHeight, m_timings.heights, m_spans,
+			m_mergeBricks ? &m_bricks : nullptr, m_mergeBricks ? TerrainCache::catalogueHash(m_brickCatalogue) : 0);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+
+	MPxCommand::setResult(result);
+
+	return MS::kSuccess;
+}
+
+MStatus VoxelizeTerrainCmd::executeProfiled()
+{
+	TerrainComputeService* service = TerrainComputeService::instance();
+	if (!service) {
+		MGlobal::displayError("Terrain compute service is not running");
+		return MS::kFailure;
+	}
+
+	// Device timings need queues created for profiling, so they are only
+	// switched on for the length of this command
+	MStatus status;
+	TerrainComputeBackend* backend = service->backend(m_backend, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	status = backend->setProfiling(true);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	Profiler profiler;
+	{
+		Profiler::Activation activation(&profiler);
+		ProfileScope scope("voxelizeTerrain");
+		status = executeCommand();
+	}
+	backend->setProfiling(false);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	if (m_profileTrace.length() > 0) {
+		status = profiler.writeChromeTrace(m_profileTrace);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+
+	// The timeline replaces the usual result
+	MPxCommand::setResult(MString(profiler.toJson().c_str()));
+
+	return MS::kSuccess;
+}
+
+MStatus VoxelizeTerrainCmd::executeBatch()
+{
+	TerrainComputeService* service = TerrainComputeService::instance();
+	if (!service) {
+		MGlobal::displayError("Terrain compute service is not running");
+		return MS::kFailure;
+	}
+
+	HeightmapCache& cache = service->heightmapCache();
+	if (m_cacheBudgetMB >= 0) {
+		cache.setBudget((size_t)m_cacheBudgetMB * 1024 * 1024);
+	}
+
+	// Every job runs on the same backend, so OpenCL is set up and the kernel built once
+	MStatus status;
+	TerrainComputeBackend* backend = service->backend(m_backend, &status);
 	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	struct DecodedJob
+	{
+		MStatus status;
+		MString error;
+		std::shared_ptr<const Heightfield> heightfield;
+		double decodeTime = 0.0;
+	};
+
+	unsigned int rawWidth = m_rawWidth;
+	auto decode = [&cache, rawWidth](MString path) {
+		DecodedJob decoded;
+		ProfileScope scope("acquireHeightmap");
+		auto startDecode = std::chrono::high_resolution_clock::now();
+		decoded.status = cache.acquireDeferred(path, decoded.heightfield, rawWidth, decoded.error);
+		decoded.decodeTime = millisecondsSince(startDecode);
+		return decoded;
+	};
+
+	// Later heightmaps decode on worker threads while the current job
+	// generates; only a few run ahead so the decoded images stay bounded
+	size_t decodeAhead = std::max<size_t>(2, ThreadPool::global().concurrency() / 2);
+	std::deque<std::future<DecodedJob>> decodes;
+	size_t nextDecode = 0;
+	auto startDecodes = [&]() {
+		while (nextDecode < m_jobs.size() && decodes.size() < decodeAhead) {
+			decodes.push_back(std::async(std::launch::async, decode, m_jobs[nextDecode++].heightmapPath));
+		}
+	};
+
+	auto startBatch = std::chrono::high_resolution_clock::now();
+	MStringArray result;
+	unsigned int failedJobs = 0;
+	for (const BatchJob& job : m_jobs) {
+		auto startTotal = std::chrono::high_resolution_clock::now();
+		m_timings = StageTimings();
+		startDecodes();
+		DecodedJob decoded;
+		{
+			ProfileScope scope("waitForDecode");
+			decoded = decodes.front().get();
+		}
+		decodes.pop_front();
+		startDecodes();
+
+		m_heightmapPath = job.heightmapPath;
+		m_outputName = job.outputName;
+		m_terrainWidth = job.terrainWidth;
+		m_terrainHeight = job.terrainHeight;
+		m_maxHeight = job.maxHeight;
+		m_brickScale = job.brickScale;
+
+		// A bad heightmap skips its job, the rest of the batch still runs
+		status = decoded.status;
+		if (status == MS::kSuccess) {
+			m_imageWidth = decoded.heightfield->width;
+			m_imageHeight = decoded.heightfield->height;
+			status = generateSpans(*backend, *decoded.heightfield, m_spans);
+		}
+		else if (decoded.error.length() > 0) {
+			MGlobal::displayError(decoded.error);
+		}
+		if (status != MS::kSuccess) {
+			MGlobal::displayError("Skipped batch job " + job.outputName);
+			failedJobs++;
+			continue;
+		}
+		decoded.heightfield.reset();
+
+		// Load time includes any wait for the decode to finish
+		double loadTime = millisecondsSince(startTotal);
+
+		m_timings.decode = decoded.decodeTime;
+		if (!m_stats) {
+			result.append(job.outputName);
+		}
+		status = instanceTerrain(startTotal, loadTime, result);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		if (!m_stats) {
+			result.append(MString() + decoded.decodeTime);
+		}
+
+		// Hand the job's data to its redo record, the next job generates into fresh members
+		if (!m_generateOnly) {
+			BatchTerrain terrain;
+			terrain.particleSystemObj = m_particleSystemObj;
+			terrain.meshShapeObj = m_meshShapeObj;
+			terrain.meshData = m_meshData;
+			terrain.meshFaces = m_meshFaces;
+			terrain.brickScale = m_brickScale;
+			terrain.maxHeight = m_maxHeight;
+			if (!m_mesh) {
+				terrain.spans = std::move(m_spans);
+				terrain.bricks = std::move(m_bricks);
+				terrain.lod = std::move(m_lod);
+			}
+			m_batchTerrains.push_back(std::move(terrain));
+		}
+	}
+
+	unsigned int jobCount = (unsigned int)m_jobs.size();
+	MGlobal::displayInfo(MString("Batch generated ") + (jobCount - failedJobs) + " of " + jobCount
+		+ " terrains in " + millisecondsSince(startBatch) + " ms");
+
+	MPxCommand::setResult(result);
+
+	return failedJobs == jobCount ? MS::kFailure : MS::kSuccess;
+}
+
+MStatus VoxelizeTerrainCmd::instanceTerrain(std::chrono::high_resolution_clock::time_point startTotal, double loadTime, MStringArray& result)
+{
+	MStatus status;
+
+	// Pack the voxels into larger bricks
+	double mergeTime = 0.0;
+	if (m_mergeBricks && !m_bricksFromCache) {
+		auto startMerge = std::chrono::high_resolution_clock::now();
+		{
+			ProfileScope scope("mergeBricks");
+			status = BrickMerger::merge(m_spans, m_brickCatalogue, m_bricks);
+		}
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		auto endMerge = std::chrono::high_resolution_clock::now();
+		mergeTime = std::chrono::duration<double>(endMerge - startMerge).count() * 1000.0;
+
+		MGlobal::displayInfo(MString("Merged ") + std::to_string(m_spans.voxelCount).c_str() + " voxels into "
+			+ (unsigned int)m_bricks.bricks.size() + " bricks of " + (unsigned int)m_bricks.types.size() + " types");
+	}
+
+	// Pick a level per chunk from the camera distance
+	bool useLod = m_lodCamera.length() > 0;
+	double lodTime = 0.0;
+	if (useLod) {
+		auto startLod = std::chrono::high_resolution_clock::now();
+		status = buildLod(m_spans, m_lod);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		auto endLod = std::chrono::high_resolution_clock::now();
+		lodTime = std::chrono::duration<double>(endLod - startLod).count() * 1000.0;
+
+		MGlobal::displayInfo(MString("LOD reduced ") + std::to_string(m_spans.voxelCount).c_str() + " voxels to "
+			+ (unsigned int)m_lod.blocks.size() + " blocks");
+	}
+
+	// Expand the columns, bricks or LOD blocks into a particle system, or mesh the columns
+	auto startParticles = std::chrono::high_resolution_clock::now();
+	if (!m_generateOnly) {
+		if (m_mesh) {
+			status = createMesh(m_spans);
+		}
+		else {
+			status = createParticleSystem(m_spans, m_mergeBricks ? &m_bricks : nullptr, useLod ? &m_lod : nullptr);
+		}
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
 	auto endParticles = std::chrono::high_resolution_clock::now();
 	double particleTime = std::chrono::duration<double>(endParticles - startParticles).count() * 1000.0;
 
+	// Keep the columns queryable by output name. Generate-only runs can't be
+	// undone, so nothing would ever take their terrain back.
+	if (!m_generateOnly) {
+		auto startQuery = std::chrono::high_resolution_clock::now();
+		registerQuery();
+		auto endQuery = std::chrono::high_resolution_clock::now();
+		m_timings.query = std::chrono::duration<double>(endQuery - startQuery).count() * 1000.0;
+	}
+
 	auto endTotal = std::chrono::high_resolution_clock::now();
 	double totalTime = std::chrono::duration<double>(endTotal - startTotal).count() * 1000.0;
 
-	MStringArray result;
+	m_timings.merge = mergeTime;
+	m_timings.lod = lodTime;
+	m_timings.total = totalTime;
+	if (m_stats) {
+		result.append(timingsJson());
+		return MS::kSuccess;
+	}
+
 	result.append(MString() + loadTime);
 	result.append(MString() + particleTime);
 	result.append(MString() + totalTime);
-	result.append(MString() + m_voxelPositions.size());
-
-	MPxCommand::setResult(result);
+	result.append(MString() + std::to_string(m_spans.voxelCount).c_str());
+	result.append(MString() + std::to_string(outputCount()).c_str());
+	result.append(MString() + mergeTime);
+	result.append(MString() + lodTime);
 
 	return MS::kSuccess;
 }
 
-MStatus VoxelizeTerrainCmd::createParticleSystem(const std::vector<MVector>& voxelPositions)
+MString VoxelizeTerrainCmd::timingsJson() const
+{
+	const GenerationStats& generation = m_timings.generation;
+	uint64_t instances = outputCount();
+
+	std::string json = "{";
+	json += "\"name\": " + jsonString(m_outputName);
+	json += ", \"heightmap\": " + jsonString(m_heightmapPath);
+	if (m_procedural) {
+		json += ", \"procedural\": " + jsonString(m_noise.toString());
+	}
+	json += ", \"lowestColumn\": " + std::to_string(m_timings.heights.lowestColumn);
+	json += ", \"tallestColumn\": " + std::to_string(m_timings.heights.tallestColumn);
+	json += ", \"base\": " + std::to_string(m_timings.heights.base);
+	json += ", \"backend\": " + jsonString(m_timings.backend);
+	json += ", \"imageWidth\": " + std::to_string(m_imageWidth);
+	json += ", \"imageHeight\": " + std::to_string(m_imageHeight);
+	json += ", \"terrainWidth\": " + std::to_string(m_terrainWidth);
+	json += ", \"terrainHeight\": " + std::to_string(m_terrainHeight);
+	json += ", \"maxHeight\": " + std::to_string(m_maxHeight);
+	json += ", \"brickScale\": " + std::to_string(m_brickScale);
+	json += ", \"voxels\": " + std::to_string(m_spans.voxelCount);
+	json += ", \"instances\": " + std::to_string(instances);
+	json += ", \"tiles\": " + std::to_string(generation.tileCount);
+	json += ", \"tileSize\": " + std::to_string(generation.tileSize);
+	json += ", \"workingSetBytes\": " + std::to_string(generation.workingSetBytes);
+	json += ", \"decodeMs\": " + std::to_string(m_timings.decode);
+	json += ", \"generateMs\": " + std::to_string(m_timings.generate);
+	json += ", \"tileGenerateMs\": " + std::to_string(generation.generateMs);
+	json += ", \"tileSubmitMs\": " + std::to_string(generation.submitMs);
+	json += ", \"tileWaitMs\": " + std::to_string(generation.waitMs);
+	json += ", \"tileAssembleMs\": " + std::to_string(generation.assembleMs);
+	json += ", \"voxelCountMs\": " + std::to_string(generation.countMs);
+	json += ", \"mergeMs\": " + std::to_string(m_timings.merge);
+	json += ", \"lodMs\": " + std::to_string(m_timings.lod);
+	json += ", \"sceneNodesMs\": " + std::to_string(m_timings.sceneNodes);
+	json += ", \"sceneDataMs\": " + std::to_string(m_timings.sceneData);
+	json += ", \"queryMs\": " + std::to_string(m_timings.query);
+	json += ", \"totalMs\": " + std::to_string(m_timings.total);
+	json += "}";
+
+	return MString(json.c_str());
+}
+
+uint64_t VoxelizeTerrainCmd::outputCount() const
+{
+	if (m_mesh) return m_meshFaces;
+	if (m_mergeBricks) return m_bricks.bricks.size();
+	if (m_lodCamera.length() > 0) return m_lod.blocks.size();
+	return m_spans.voxelCount;
+}
+
+MStatus VoxelizeTerrainCmd::createParticleSystem(const TerrainSpans& spans, const BrickLayout* bricks, const LodLayout* lod)
 {
 	MStatus status;
+	Profiler* profiler = Profiler::active();
+	double queueStart = profiler ? profiler->now() : 0.0;
 
-	// Create particle object
+	// Particle shape under its own transform. Names that are taken get a
+	// numeric suffix, and every node is tracked by MObject, not by name.
 	MString particleName = "voxelParticles_" + m_outputName;
-	MGlobal::executeCommand("particle -name " + particleName);
+	m_particleTransformObj = m_dagModifier.createNode("transform", MObject::kNullObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	m_particleSystemObj = m_dagModifier.createNode("particle", m_particleTransformObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	m_dagModifier.renameNode(m_particleTransformObj, particleName);
+	m_dagModifier.renameNode(m_particleSystemObj, particleName + "Shape");
+
+	if (bricks) {
+		// Per particle brick type and its initial state, used by the instancer as the object index
+		const char* brickTypeAttrs[] = { "brickType", "brickType0" };
+		for (const char* attrName : brickTypeAttrs) {
+			MFnTypedAttribute typedAttrFn;
+			MObject attr = typedAttrFn.create(attrName, attrName, MFnData::kDoubleArray, MObject::kNullObj, &status);
+			CHECK_MSTATUS_AND_RETURN_IT(status);
+			status = m_dagModifier.addAttribute(m_particleSystemObj, attr);
+			CHECK_MSTATUS_AND_RETURN_IT(status);
+		}
+	}
 
-	MGlobal::executeCommand("select -clear");
+	if (lod) {
+		// Per particle block size, used by the instancer as the scale
+		const char* lodScaleAttrs[] = { "lodScale", "lodScale0" };
+		for (const char* attrName : lodScaleAttrs) {
+			MFnTypedAttribute typedAttrFn;
+			MObject attr = typedAttrFn.create(attrName, attrName, MFnData::kVectorArray, MObject::kNullObj, &status);
+			CHECK_MSTATUS_AND_RETURN_IT(status);
+			status = m_dagModifier.addAttribute(m_particleSystemObj, attr);
+			CHECK_MSTATUS_AND_RETURN_IT(status);
+		}
+	}
 
-	// Get the particle shape node
-	MSelectionList selList;
-	MString particleShapeName = particleName + "Shape";
-	status = selList.add(particleShapeName);
-	if (status != MS::kSuccess) {
-		MGlobal::displayError("Particle shape was not found: " + particleShapeName);
-		return status;
+	if (m_coloring.isEnabled()) {
+		// Per particle colour, read by the particle renderer and by instancer shaders
+		const char* colorAttrs[] = { "rgbPP", "rgbPP0" };
+		for (const char* attrName : colorAttrs) {
+			MFnTypedAttribute typedAttrFn;
+			MObject attr = typedAttrFn.create(attrName, attrName, MFnData::kVectorArray, MObject::kNullObj, &status);
+			CHECK_MSTATUS_AND_RETURN_IT(status);
+			status = m_dagModifier.addAttribute(m_particleSystemObj, attr);
+			CHECK_MSTATUS_AND_RETURN_IT(status);
+		}
 	}
 
-	status = selList.getDependNode(0, m_particleSystemObj);
+	// One cube per voxel, or one shape per brick type in catalogue order
+	std::vector<BrickType> cubeTypes = bricks ? bricks->types : std::vector<BrickType>{ { 1, 1 } };
+
+	MObject shadingGroupObj;
+	unsigned int shadingGroupIndex = 0;
+	{
+		ProfileScope scope("findShadingGroupSlot");
+		status = findShadingGroupSlot(shadingGroupObj, shadingGroupIndex);
+	}
 	CHECK_MSTATUS_AND_RETURN_IT(status);
 
-	MFnParticleSystem particleFn(m_particleSystemObj, &status);
+	m_cubeObjs.clear();
+	for (const BrickType& type : cubeTypes) {
+		MString cubeName = "voxelCube_" + m_outputName;
+		if (bricks) {
+			cubeName += MString("_") + (unsigned int)type.width + "x" + (unsigned int)type.depth;
+		}
+
+		MObject cubeTransformObj = m_dagModifier.createNode("transform", MObject::kNullObj, &status);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		MObject cubeMeshObj = m_dagModifier.createNode("mesh", cubeTransformObj, &status);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		MObject polyCubeObj = m_dagModifier.MDGModifier::createNode("polyCube", &status);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		m_dagModifier.renameNode(cubeTransformObj, cubeName);
+		m_dagModifier.renameNode(cubeMeshObj, cubeName + "Shape");
+		m_dagModifier.renameNode(polyCubeObj, cubeName + "_polyCube");
+
+		m_dagModifier.newPlugValueDouble(nodePlug(polyCubeObj, "width"), m_brickScale * type.width);
+		m_dagModifier.newPlugValueDouble(nodePlug(polyCubeObj, "height"), m_brickScale);
+		m_dagModifier.newPlugValueDouble(nodePlug(polyCubeObj, "depth"), m_brickScale * type.depth);
+		status = m_dagModifier.connect(nodePlug(polyCubeObj, "output"), nodePlug(cubeMeshObj, "inMesh"));
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+
+		// Shaded like a new polyCube, and hidden since only its instances are shown
+		MPlug memberPlug = nodePlug(shadingGroupObj, "dagSetMembers").elementByLogicalIndex(shadingGroupIndex++);
+		status = m_dagModifier.connect(nodePlug(cubeMeshObj, "instObjGroups").elementByLogicalIndex(0), memberPlug);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		m_dagModifier.newPlugValueBool(nodePlug(cubeTransformObj, "visibility"), false);
+
+		m_cubeObjs.push_back(cubeTransformObj);
+	}
+
+	// Instancer fed by the particle shape's first instance slot
+	m_instancerObj = m_dagModifier.createNode("instancer", MObject::kNullObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	m_dagModifier.renameNode(m_instancerObj, "voxelInstancer_" + m_outputName);
+
+	MFnDependencyNode particleNodeFn(m_particleSystemObj);
+	MPlug instanceDataPlug = nodePlug(m_particleSystemObj, "instanceData").elementByLogicalIndex(0);
+	MPlug pointDataPlug = instanceDataPlug.child(particleNodeFn.attribute("instancePointData"));
+	MPlug mappingPlug = instanceDataPlug.child(particleNodeFn.attribute("instanceAttributeMapping"));
+
+	status = m_dagModifier.connect(pointDataPlug, nodePlug(m_instancerObj, "inputPoints"));
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	MPlug hierarchyPlug = nodePlug(m_instancerObj, "inputHierarchy");
+	for (unsigned int i = 0; i < m_cubeObjs.size(); i++) {
+		status = m_dagModifier.connect(nodePlug(m_cubeObjs[i], "matrix"), hierarchyPlug.elementByLogicalIndex(i));
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+
+	// Same mapping particleInstancer writes, plus the brick type as object
+	// index or the block size as scale
+	MStringArray mapping;
+	mapping.append("position");
+	mapping.append("worldPosition");
+	if (bricks) {
+		mapping.append("objectIndex");
+		mapping.append("brickType");
+	}
+	if (lod) {
+		mapping.append("scale");
+		mapping.append("lodScale");
+	}
+	MFnStringArrayData mappingDataFn;
+	MObject mappingData = mappingDataFn.create(mapping, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	m_dagModifier.newPlugValue(mappingPlug, mappingData);
+
+	m_dagModifier.newPlugValueBool(nodePlug(m_instancerObj, "hideOnPlayback"), true);
+
+	// Queueing the graph only records it, doIt below is where the nodes are made
+	if (profiler) {
+		profiler->addEvent("queueSceneNodes", "host", profiler->threadTrack(), queueStart, profiler->now() - queueStart);
+	}
+
+	// The particle shape is left unconnected from time1, so playback never moves it
+	auto startNodes = std::chrono::high_resolution_clock::now();
+	{
+		ProfileScope scope("MDagModifier::doIt");
+		status = m_dagModifier.doIt();
+	}
 	CHECK_MSTATUS_AND_RETURN_IT(status);
+	m_timings.sceneNodes = millisecondsSince(startNodes);
 
-	int oldCount = particleFn.count();
-	int newCount = voxelPositions.size();
-	int totalCount = oldCount + newCount;
+	auto startData = std::chrono::high_resolution_clock::now();
+	status = setParticleData(spans, bricks, lod);
+	m_timings.sceneData = millisecondsSince(startData);
 
-	// Set new count first
-	particleFn.setCount(totalCount);
+	return status;
+}
 
-	// Get attribute arrays
+MStatus VoxelizeTerrainCmd::setParticleData(const TerrainSpans& spans, const BrickLayout* bricks, const LodLayout* lod)
+{
+	MStatus status;
+	MFnParticleSystem particleFn(m_particleSystemObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	// The shape is always one this command created, so its arrays are written
+	// whole; the spans or bricks are expanded straight into them in parallel,
+	// together with their colours
+	const TerrainColoring* coloring = m_coloring.isEnabled() ? &m_coloring : nullptr;
+	m_coloring.setMaxHeight(m_maxHeight);
+
+	unsigned int count = (unsigned int)(lod ? lod->blocks.size() : bricks ? bricks->bricks.size() : spans.voxelCount);
 	MVectorArray positions;
-	MVectorArray velocities;
-	particleFn.position(positions);
-	particleFn.velocity(velocities);
+	MDoubleArray brickTypes;
+	MVectorArray lodScales;
+	MVectorArray colors;
+	positions.setLength(count);
+	if (coloring) {
+		colors.setLength(count);
+	}
+	MVector* colorOut = coloring && count > 0 ? &colors[0] : nullptr;
+
+	{
+		ProfileScope scope("expandInstances");
+		if (lod) {
+			lodScales.setLength(count);
+			if (count > 0) {
+				lod->expandInstances(m_brickScale, &positions[0], &lodScales[0], &spans, coloring, colorOut);
+			}
+		}
+		else if (bricks) {
+			brickTypes.setLength(count);
+			if (count > 0) {
+				bricks->expandInstances(m_brickScale, &positions[0], &brickTypes[0], &spans, coloring, colorOut);
+			}
+		}
+		else if (count > 0) {
+			spans.expandPositions(m_brickScale, &positions[0], coloring, colorOut);
+		}
+	}
 
-	// Resize
-	positions.setLength(totalCount);
-	velocities.setLength(totalCount);
+	// New particles start at rest, so velocity is left at its default
+	{
+		ProfileScope scope("MFnParticleSystem::setCount");
+		particleFn.setCount(positions.length());
+	}
+	{
+		ProfileScope scope("MFnParticleSystem::setPerParticleAttribute(position)");
+		particleFn.setPerParticleAttribute("position", positions);
+	}
 
-	// Bulk copy new data
-	memcpy(&positions[oldCount], voxelPositions.data(), newCount * sizeof(MVector));
+	if (bricks) {
+		ProfileScope scope("MFnParticleSystem::setPerParticleAttribute(brickType)");
+		particleFn.setPerParticleAttribute("brickType", brickTypes);
+	}
+	if (lod) {
+		ProfileScope scope("MFnParticleSystem::setPerParticleAttribute(lodScale)");
+		particleFn.setPerParticleAttribute("lodScale", lodScales);
+	}
+	if (coloring) {
+		ProfileScope scope("MFnParticleSystem::setPerParticleAttribute(rgbPP)");
+		particleFn.setPerParticleAttribute("rgbPP", colors);
+	}
 
-	// Zero out new velocities
-	memset(&velocities[oldCount], 0, newCount * sizeof(MVector));
+	{
+		ProfileScope scope("MFnParticleSystem::saveInitialState");
+		particleFn.saveInitialState();
+	}
 
-	// Apply back
-	particleFn.setPerParticleAttribute("position", positions);
-	particleFn.setPerParticleAttribute("velocity", velocities);
+	return MS::kSuccess;
+}
 
-	particleFn.saveInitialState();
+MStatus VoxelizeTerrainCmd::createMesh(const TerrainSpans& spans)
+{
+	MStatus status;
 
-	MString cubeName = "voxelCube_" + m_outputName;
-	MGlobal::executeCommand("polyCube -name " + cubeName + " -width " + m_brickScale +
-		" -height " + m_brickScale + " -depth " + m_brickScale, status);
+	TerrainMesh mesh;
+	{
+		ProfileScope scope("TerrainMesher::build");
+		status = TerrainMesher::build(spans, m_brickScale, m_mergeFaces, mesh);
+	}
 	CHECK_MSTATUS_AND_RETURN_IT(status);
 
-	// Track cube to be instanced
-	MSelectionList cubeList;
-	cubeList.add(cubeName);
-	cubeList.getDependNode(0, m_cubeObj);
+	MGlobal::displayInfo(MString("Meshed ") + std::to_string(spans.voxelCount).c_str() + " voxels into "
+		+ std::to_string(mesh.faceCount()).c_str() + " faces, down from " + std::to_string(spans.voxelCount * 6).c_str());
 
-	// Track particle transform
-	MSelectionList transformList;
-	transformList.add(particleName);
-	transformList.getDependNode(0, m_particleTransformObj);
+	// The shape and its transform go through the modifier so undo removes them
+	MString meshName = "voxelMesh_" + m_outputName;
+	m_meshTransformObj = m_dagModifier.createNode("transform", MObject::kNullObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	m_meshShapeObj = m_dagModifier.createNode("mesh", m_meshTransformObj, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	m_dagModifier.renameNode(m_meshTransformObj, meshName);
+	m_dagModifier.renameNode(m_meshShapeObj, meshName + "Shape");
+
+	MObject shadingGroupObj;
+	unsigned int shadingGroupIndex = 0;
+	{
+		ProfileScope scope("findShadingGroupSlot");
+		status = findShadingGroupSlot(shadingGroupObj, shadingGroupIndex);
+	}
+	CHECK_MSTATUS_AND_RETURN_IT(status);
 
-	MString instancerName = "voxelInstancer_" + m_outputName;
-	MGlobal::executeCommand("particleInstancer -name " + instancerName +
-		" -addObject -object " + cubeName + " " + particleName, status);
+	MPlug memberPlug = nodePlug(shadingGroupObj, "dagSetMembers").elementByLogicalIndex(shadingGroupIndex);
+	status = m_dagModifier.connect(nodePlug(m_meshShapeObj, "instObjGroups").elementByLogicalIndex(0), memberPlug);
 	CHECK_MSTATUS_AND_RETURN_IT(status);
 
-	status = selList.clear();
-	status = selList.add(instancerName);
+	auto startNodes = std::chrono::high_resolution_clock::now();
+	{
+		ProfileScope scope("MDagModifier::doIt");
+		status = m_dagModifier.doIt();
+	}
 	CHECK_MSTATUS_AND_RETURN_IT(status);
-	status = selList.getDependNode(0, m_instancerObj);
+	m_timings.sceneNodes = millisecondsSince(startNodes);
+
+	auto startData = std::chrono::high_resolution_clock::now();
+	unsigned int vertexCount = (unsigned int)mesh.vertexCount();
+	unsigned int faceCount = (unsigned int)mesh.faceCount();
+	MFloatPointArray points(vertexCount);
+	ThreadPool::global().parallelFor(0, vertexCount, 1 << 14, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const float* point = mesh.points.data() + i * 3;
+			points[(unsigned int)i] = MFloatPoint(point[0], point[1], point[2]);
+		}
+	});
+	MIntArray faceCounts(mesh.faceCounts.data(), faceCount);
+	MIntArray faceConnects(mesh.faceVertices.data(), (unsigned int)mesh.faceVertices.size());
+	mesh = TerrainMesh();
+
+	MFnMeshData meshDataFn;
+	m_meshData = meshDataFn.create(&status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	{
+		ProfileScope scope("MFnMesh::create");
+		MFnMesh meshFn;
+		meshFn.create((int)vertexCount, (int)faceCount, points, faceCounts, faceConnects, m_meshData, &status);
+	}
 	CHECK_MSTATUS_AND_RETURN_IT(status);
 
-	// Set hideOnPlayback attribute on the instancer
-	MFnDependencyNode instancerFn(m_instancerObj, &status);
+	{
+		ProfileScope scope("MFnMesh::copyInPlace");
+		MFnMesh shapeFn(m_meshShapeObj, &status);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+		status = shapeFn.copyInPlace(m_meshData);
+	}
 	CHECK_MSTATUS_AND_RETURN_IT(status);
-	MPlug hideOnPlaybackPlug = instancerFn.findPlug("hideOnPlayback", status);
+	m_timings.sceneData = millisecondsSince(startData);
+
+	m_meshFaces = faceCount;
+	return MS::kSuccess;
+}
+
+MStatus VoxelizeTerrainCmd::buildLod(const TerrainSpans& spans, LodLayout& outLod)
+{
+	MSelectionList selList;
+	MDagPath cameraPath;
+	MStatus status = selList.add(m_lodCamera);
 	if (status == MS::kSuccess) {
-		hideOnPlaybackPlug.setBool(true);
+		status = selList.getDagPath(0, cameraPath);
+	}
+	if (status != MS::kSuccess) {
+		MGlobal::displayError("LOD camera was not found: " + m_lodCamera);
+		return MS::kFailure;
 	}
 
-	MGlobal::executeCommand("hide " + cubeName);
-	MGlobal::executeCommand("disconnectAttr time1.outTime " + particleShapeName + ".currentTime", false, false);
+	MMatrix cameraMatrix = cameraPath.inclusiveMatrix();
 
-	return MS::kSuccess;
+	LodSettings settings;
+	settings.camera = MVector(cameraMatrix(3, 0), cameraMatrix(3, 1), cameraMatrix(3, 2));
+	settings.voxelSize = m_brickScale;
+	settings.baseDistance = m_lodDistance;
+	settings.levels = m_lodLevels;
+
+	LodPyramid pyramid;
+	{
+		ProfileScope scope("LodPyramid::build");
+		pyramid.build(spans);
+	}
+
+	ProfileScope scope("LodPyramid::select");
+	return pyramid.select(settings, outLod);
 }
 
-MStatus VoxelizeTerrainCmd::loadHeightmap(const MString& filepath, std::vector<MVector>& outVoxelPositions)
+void VoxelizeTerrainCmd::registerQuery()
 {
-	HeightmapComputeShader shader;
-	MStatus status = shader.initialize();
+	std::shared_ptr<TerrainQuery> query = std::make_shared<TerrainQuery>();
+	{
+		ProfileScope scope("TerrainQuery::build");
+		query->build(m_spans, m_brickScale);
+	}
+
+	TerrainComputeService::instance()->setTerrain(m_outputName, query);
+	m_queries.emplace_back(m_outputName, std::move(query));
+}
 
+MStatus VoxelizeTerrainCmd::findShadingGroupSlot(MObject& outShadingGroup, unsigned int& outIndex)
+{
+	MSelectionList selList;
+	MStatus status = selList.add("initialShadingGroup");
 	if (status != MS::kSuccess) {
-		MGlobal::displayError("Failed to initialize HeightmapComputeShader");
+		MGlobal::displayError("initialShadingGroup was not found");
 		return status;
 	}
 
-	status = shader.generateVoxelsFromHeightmap(
-		filepath,
-		outVoxelPositions,
-		m_imageWidth,
-		m_imageHeight,
+	status = selList.getDependNode(0, outShadingGroup);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	// Past the highest member in use, like connectAttr -nextAvailable
+	MIntArray indices;
+	nodePlug(outShadingGroup, "dagSetMembers").getExistingArrayAttributeIndices(indices);
+	outIndex = 0;
+	for (unsigned int i = 0; i < indices.length(); i++) {
+		outIndex = std::max(outIndex, (unsigned int)indices[i] + 1);
+	}
+
+	return MS::kSuccess;
+}
+
+MStatus VoxelizeTerrainCmd::loadHeightmap(const MString& filepath, TerrainSpans& outSpans)
+{
+	TerrainComputeService* service = TerrainComputeService::instance();
+	if (!service) {
+		MGlobal::displayError("Terrain compute service is not running");
+		return MS::kFailure;
+	}
+
+	HeightmapCache& cache = service->heightmapCache();
+	if (m_cacheBudgetMB >= 0) {
+		cache.setBudget((size_t)m_cacheBudgetMB * 1024 * 1024);
+	}
+
+	// Decoded once here, or reused from an earlier run on the same file
+	auto startDecode = std::chrono::high_resolution_clock::now();
+	std::shared_ptr<const Heightfield> heightfield;
+	MStatus status;
+	{
+		ProfileScope scope("acquireHeightmap");
+		status = cache.acquire(filepath, heightfield, m_rawWidth);
+	}
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	m_timings.decode = millisecondsSince(startDecode);
+
+	m_imageWidth = heightfield->width;
+	m_imageHeight = heightfield->height;
+
+	TerrainComputeBackend* backend = service->backend(m_backend, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	return generateSpans(*backend, *heightfield, outSpans);
+}
+
+MStatus VoxelizeTerrainCmd::generateProcedural(TerrainSpans& outSpans)
+{
+	TerrainComputeService* service = TerrainComputeService::instance();
+	if (!service) {
+		MGlobal::displayError("Terrain compute service is not running");
+		return MS::kFailure;
+	}
+
+	// Nothing to decode: the backend evaluates the noise tile by tile
+	m_imageWidth = 0;
+	m_imageHeight = 0;
+
+	MStatus status;
+	TerrainComputeBackend* backend = service->backend(m_backend, &status);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	return generateSpans(*backend, Heightfield::procedural(m_noise), outSpans);
+}
+
+MStatus VoxelizeTerrainCmd::readTerrainCache(TerrainCacheKey& outKey, bool& outLoaded)
+{
+	ProfileScope scope("readTerrainCache");
+	auto startRead = std::chrono::high_resolution_clock::now();
+
+	MStatus status;
+	if (m_procedural) {
+		TerrainCache::makeKey(m_noise, m_terrainWidth, m_terrainHeight, m_maxHeight, outKey);
+	}
+	else {
+		status = TerrainCache::makeKey(m_heightmapPath, m_rawWidth, m_terrainWidth, m_terrainHeight, m_maxHeight, outKey);
+		CHECK_MSTATUS_AND_RETURN_IT(status);
+	}
+	outKey.rangeHash = TerrainCache::rangeHash(m_normalizeClip, m_trimBase);
+
+	uint64_t bricksHash = m_mergeBricks ? TerrainCache::catalogueHash(m_brickCatalogue) : 0;
+	status = TerrainCache::read(m_terrainCache, outKey, bricksHash, m_spans, m_mergeBricks ? &m_bricks : nullptr,
+		m_imageWidth, m_imageHeight, m_timings.heights, outLoaded, m_bricksFromCache);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+
+	if (outLoaded) {
+		m_timings.backend = "cache";
+		m_timings.generate = millisecondsSince(startRead);
+		MGlobal::displayInfo(MString("Loaded ") + std::to_string(m_spans.voxelCount).c_str()
+			+ " voxels from terrain cache " + m_terrainCache);
+	}
+
+	return MS::kSuccess;
+}
+
+MStatus VoxelizeTerrainCmd::generateSpans(TerrainComputeBackend& backend, const Heightfield& heightfield, TerrainSpans& outSpans)
+{
+	ProfileScope scope("generateSpans");
+	auto startGenerate = std::chrono::high_resolution_clock::now();
+
+	// Each heightmap of a batch is normalized and trimmed from its own measurements
+	HeightRange range;
+	MStatus status = TerrainComputeBackend::heightRange(heightfield, m_normalizeClip, m_trimBase, m_maxHeight, range);
+	CHECK_MSTATUS_AND_RETURN_IT(status);
+	TerrainComputeBackend::heightBounds(heightfield, range, m_maxHeight, m_timings.heights.lowestColumn, m_timings.heights.tallestColumn);
+	m_timings.heights.base = range.base;
+
+	status = backend.generateSpansFromHeightfield(
+		heightfield,
+		outSpans,
 		m_terrainWidth,
 		m_terrainHeight,
-		m_brickScale,
-		m_maxHeight
+		m_maxHeight,
+		(size_t)m_memoryBudgetMB * 1024 * 1024,
+		range
 	);
+	m_timings.generate = millisecondsSince(startGenerate);
+	m_timings.generation = backend.lastStats();
+	m_timings.backend = backend.name();
 
 	if (status == MS::kSuccess) {
-		MGlobal::displayInfo(MString("Generated ") + (int)outVoxelPositions.size() + " voxels");
+		MGlobal::displayInfo(MString("Generated ") + std::to_string(outSpans.voxelCount).c_str() + " voxels on " + backend.name());
 		MGlobal::displayInfo(MString("Image dimensions: ") + m_imageWidth + "x" + m_imageHeight);
 	}
 
-	shader.cleanup();
 	return status;
 }
\ No newline at end of file
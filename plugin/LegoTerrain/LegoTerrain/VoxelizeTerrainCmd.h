@@ -1,10 +1,24 @@
 #pragma once
 
+#include <chrono>
+#include <memory>
+#include <utility>
 #include <vector>
 #include <maya/MGlobal.h>
 #include <maya/MPxCommand.h>
 #include <maya/MSyntax.h>
 #include <maya/MFnParticleSystem.h>
+#include <maya/MStringArray.h>
+#include <maya/MDagModifier.h>
+#include "TerrainSpans.h"
+#include "TerrainMesher.h"
+#include "TerrainCache.h"
+#include "BrickMerger.h"
+#include "TerrainLod.h"
+#include "TerrainColoring.h"
+#include "Heightfield.h"
+#include "TerrainComputeBackend.h"
+#include "TerrainQuery.h"
 
 class VoxelizeTerrainCmd : public MPxCommand
 {
@@ -35,13 +49,77 @@ private:
 	static const char* maxHeightFlagLong;
 	static const char* outputNameFlag;
 	static const char* outputNameFlagLong;
+	static const char* backendFlag;
+	static const char* backendFlagLong;
+	static const char* cacheBudgetFlag;
+	static const char* cacheBudgetFlagLong;
+	static const char* bricksFlag;
+	static const char* bricksFlagLong;
+	static const char* rawWidthFlag;
+	static const char* rawWidthFlagLong;
+	static const char* memoryBudgetFlag;
+	static const char* memoryBudgetFlagLong;
+	static const char* lodCameraFlag;
+	static const char* lodCameraFlagLong;
+	static const char* lodDistanceFlag;
+	static const char* lodDistanceFlagLong;
+	static const char* lodLevelsFlag;
+	static const char* lodLevelsFlagLong;
+	static const char* manifestFlag;
+	static const char* manifestFlagLong;
+	static const char* colorMapFlag;
+	static const char* colorMapFlagLong;
+	static const char* colorRampFlag;
+	static const char* colorRampFlagLong;
+	static const char* statsFlag;
+	static const char* statsFlagLong;
+	static const char* generateOnlyFlag;
+	static const char* generateOnlyFlagLong;
+	static const char* profileFlag;
+	static const char* profileFlagLong;
+	static const char* profileTraceFlag;
+	static const char* profileTraceFlagLong;
+	static const char* meshFlag;
+	static const char* meshFlagLong;
+	static const char* mergeFacesFlag;
+	static const char* mergeFacesFlagLong;
+	static const char* terrainCacheFlag;
+	static const char* terrainCacheFlagLong;
+	static const char* proceduralFlag;
+	static const char* proceduralFlagLong;
+	static const char* normalizeHeightsFlag;
+	static const char* normalizeHeightsFlagLong;
+	static const char* trimBaseFlag;
+	static const char* trimBaseFlagLong;
 
-	std::vector<MVector> m_voxelPositions;
+	// One terrain of a batch, with the parameters that can differ per job
+	struct BatchJob
+	{
+		MString heightmapPath;
+		MString outputName;
+		unsigned int terrainWidth;
+		unsigned int terrainHeight;
+		unsigned int maxHeight;
+		float brickScale;
+	};
 
+	TerrainSpans m_spans;
+	BrickLayout m_bricks;
+	LodLayout m_lod;
+
+	// Records every node and connection, so undo and redo replay it without regenerating
+	MDagModifier m_dagModifier;
 	MObject m_particleSystemObj;
 	MObject m_particleTransformObj;
-	MObject m_cubeObj;
+	std::vector<MObject> m_cubeObjs;
 	MObject m_instancerObj;
+	MObject m_meshTransformObj;
+	MObject m_meshShapeObj;
+	MObject m_meshData;             // Geometry of the mesh shape, kept to restore it on redo
+	size_t m_meshFaces;
+
+	// Terrains handed to legoTerrainQuery, by output name, to take back on undo
+	std::vector<std::pair<MString, std::shared_ptr<const TerrainQuery>>> m_queries;
 
 	MString m_heightmapPath;
 	float m_brickScale;
@@ -51,11 +129,94 @@ private:
 	unsigned int m_imageWidth;
 	unsigned int m_imageHeight;
 	MString m_outputName;
+	MString m_backend;
+	int m_cacheBudgetMB;
+	bool m_mergeBricks;
+	unsigned int m_rawWidth;
+	unsigned int m_memoryBudgetMB;
+	BrickCatalogue m_brickCatalogue;
+	MString m_lodCamera;
+	float m_lodDistance;
+	unsigned int m_lodLevels;
+	TerrainColoring m_coloring;     // Writes rgbPP when a colour map or ramp is given
+	bool m_stats;                   // Return each terrain's stage timings as JSON
+	bool m_generateOnly;            // Stop before creating any nodes
+	bool m_profile;                 // Return a timeline of every host stage and device command as JSON
+	MString m_profileTrace;         // Also write the timeline as a Chrome trace here
+	bool m_mesh;                    // Build one mesh of the visible faces instead of instancing cubes
+	bool m_mergeFaces;              // Merge coplanar faces of that mesh
+	MString m_terrainCache;         // Load the terrain from this file when it matches, else write it there
+	bool m_bricksFromCache;         // m_bricks came with the cached terrain, so merging is skipped
+	bool m_procedural;              // Generate heights from m_noise instead of a heightmap
+	NoiseSettings m_noise;
+	double m_normalizeClip;         // Stretch the samples over the whole height, clipping this fraction at each end; below 0 for off
+	int m_trimBase;                 // Base layers cut from every column, -1 for all below the lowest
+
+	// Milliseconds per stage of the terrain being built, for -stats
+	struct StageTimings
+	{
+		double decode = 0.0;
+		double generate = 0.0;
+		double merge = 0.0;
+		double lod = 0.0;
+		double sceneNodes = 0.0;
+		double sceneData = 0.0;
+		double query = 0.0;
+		double total = 0.0;
+		GenerationStats generation;
+		MString backend;
+		CachedColumnHeights heights;    // Also kept in and restored from the terrain cache
+	};
+	StageTimings m_timings;
+	std::vector<BatchJob> m_jobs;   // Empty unless several heightmaps or a manifest are given
+
+	// A batch job's shape and what redo refills it from; a single terrain uses the members above
+	struct BatchTerrain
+	{
+		MObject particleSystemObj;
+		MObject meshShapeObj;
+		MObject meshData;
+		size_t meshFaces = 0;
+		TerrainSpans spans;         // 8 bytes a column, left empty for a mesh
+		BrickLayout bricks;
+		LodLayout lod;
+		float brickScale = 1.0f;
+		unsigned int maxHeight = 0;
+	};
+	std::vector<BatchTerrain> m_batchTerrains;
 	bool m_hasValidData;
 
 	MStatus parseArguments(const MArgList& args);
+	MStatus parseManifest(const MString& manifestPath);
 	MStatus executeCommand();
+	// Runs executeCommand with a profiler active and device profiling on
+	MStatus executeProfiled();
+	// Decodes upcoming heightmaps on worker threads while the current job generates
+	MStatus executeBatch();
+	// Merges or LODs m_spans and instances them, appending the timings to result
+	MStatus instanceTerrain(std::chrono::high_resolution_clock::time_point startTotal, double loadTime, MStringArray& result);
+	MString timingsJson() const;
 
-	MStatus loadHeightmap(const MString& filepath, std::vector<MVector>& outVoxelPositions);
-	MStatus createParticleSystem(const std::vector<MVector>& voxelPositions);
+	MStatus loadHeightmap(const MString& filepath, TerrainSpans& outSpans);
+	// Generates m_noise straight into spans, with no image to read
+	MStatus generateProcedural(TerrainSpans& outSpans);
+	// Loads m_spans, and m_bricks when merging, from m_terrainCache if it matches
+	MStatus readTerrainCache(TerrainCacheKey& outKey, bool& outLoaded);
+	MStatus generateSpans(TerrainComputeBackend& backend, const Heightfield& heightfield, TerrainSpans& outSpans);
+	// Instances one cube per voxel, one shape per brick type when bricks is set,
+	// or one cube scaled per block when lod is set. Adds rgbPP when coloured.
+	MStatus createParticleSystem(const TerrainSpans& spans, const BrickLayout* bricks, const LodLayout* lod);
+	// Writes positions, and brick types or block scales, and colours into the particle shape
+	MStatus setParticleData(const TerrainSpans& spans, const BrickLayout* bricks, const LodLayout* lod);
+	// Refills the particle or mesh shape on redo when Maya brings it back empty
+	MStatus restoreShape(const TerrainSpans& spans, const BrickLayout& bricks, const LodLayout& lod,
+		const MObject& meshData, size_t meshFaces);
+	// Builds the visible faces of the voxels into one mesh shape
+	MStatus createMesh(const TerrainSpans& spans);
+	// Particles, bricks, LOD blocks or mesh faces in the output
+	uint64_t outputCount() const;
+	MStatus buildLod(const TerrainSpans& spans, LodLayout& outLod);
+	// Builds the query pyramid of m_spans and registers it under m_outputName
+	void registerQuery();
+	MStatus findShadingGroupSlot(MObject& outShadingGroup, unsigned int& outIndex);
 };
\ No newline at end of file
@@ -1,7 +1,26 @@
 #include <maya/MFnPlugin.h>
 #include <maya/MGlobal.h>
+#include <maya/MSceneMessage.h>
+#include <maya/MMessage.h>
 
 #include "VoxelizeTerrainCmd.h"
+#include "LegoTerrainQueryCmd.h"
+#include "LegoTerrainNode.h"
+#include "TerrainComputeService.h"
+
+namespace
+{
+	// Scene callbacks that drop the queryable terrains of the outgoing scene
+	MCallbackId beforeNewCallback = 0;
+	MCallbackId beforeOpenCallback = 0;
+
+	void clearTerrains(void*)
+	{
+		if (TerrainComputeService::instance()) {
+			TerrainComputeService::instance()->clearTerrains();
+		}
+	}
+}
 
 MStatus initializePlugin(MObject obj)
 {
@@ -11,6 +30,13 @@ MStatus initializePlugin(MObject obj)
 	MFnPlugin fnPlugin(obj, pluginVendor, pluginVersion);
 
 	fnPlugin.registerCommand(VoxelizeTerrainCmd::commandName, VoxelizeTerrainCmd::creator, VoxelizeTerrainCmd::newSyntax);
+	fnPlugin.registerCommand(LegoTerrainQueryCmd::commandName, LegoTerrainQueryCmd::creator, LegoTerrainQueryCmd::newSyntax);
+	fnPlugin.registerNode(LegoTerrainNode::nodeName, LegoTerrainNode::id, LegoTerrainNode::creator, LegoTerrainNode::initialize);
+
+	TerrainComputeService::create();
+
+	beforeNewCallback = MSceneMessage::addCallback(MSceneMessage::kBeforeNew, clearTerrains);
+	beforeOpenCallback = MSceneMessage::addCallback(MSceneMessage::kBeforeOpen, clearTerrains);
 
 	MGlobal::displayInfo("Plugin has been initialized!");
 
@@ -19,6 +45,17 @@ MStatus initializePlugin(MObject obj)
 
 MStatus uninitializePlugin(MObject obj)
 {
+	MFnPlugin fnPlugin(obj);
+
+	fnPlugin.deregisterCommand(VoxelizeTerrainCmd::commandName);
+	fnPlugin.deregisterCommand(LegoTerrainQueryCmd::commandName);
+	fnPlugin.deregisterNode(LegoTerrainNode::id);
+
+	MMessage::removeCallback(beforeNewCallback);
+	MMessage::removeCallback(beforeOpenCallback);
+
+	TerrainComputeService::destroy();
+
 	MGlobal::displayInfo("Plugin has been uninitialized!");
 
 	return (MS::kSuccess);
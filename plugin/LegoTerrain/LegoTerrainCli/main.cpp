@@ -0,0 +1,507 @@
+#include "CoreTypes.h"
+#include "BrickMerger.h"
+#include "HeightmapCache.h"
+#include "Profiler.h"
+#include "TerrainCache.h"
+#include "TerrainComputeBackend.h"
+#include "TerrainComputeService.h"
+#include "TerrainMesher.h"
+#include "TerrainSpans.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Generates a terrain without Maya, for farm nodes: decodes a heightmap or
+ * takes procedural noise settings, generates on all cores or OpenCL,
+ * optionally merges bricks, and writes a terrain cache the plugin can load
+ * and/or an OBJ of the visible surface.
+ * Flags have the names of the voxelizeTerrain command's.
+ */
+
+namespace
+{
+    // Vertices or faces formatted per task when writing OBJ
+    const size_t OBJ_CHUNK = 1 << 16;
+
+    struct Options
+    {
+        std::string heightmapPath;
+        std::string procedural;         // Noise settings, in place of a heightmap
+        unsigned int terrainWidth = 512;
+        unsigned int terrainHeight = 512;
+        unsigned int maxHeight = 256;
+        unsigned int rawWidth = 0;
+        float brickScale = 1.0f;
+        std::string backend = "auto";
+        unsigned int memoryBudgetMB = 0;
+        double normalizeClip = -1.0;    // Below 0 leaves the samples as they are
+        int trimBase = 0;               // -1 cuts every layer below the lowest column
+        std::string bricks;
+        std::string terrainCache;
+        std::string obj;
+        bool mergeFaces = false;
+        bool stats = false;
+        std::string profileTrace;
+        bool quiet = false;
+    };
+
+    void printUsage()
+    {
+        fprintf(stderr,
+            "Usage: legoTerrainCli [options] <heightmap.png|.r16|.r32>\n"
+            "       legoTerrainCli [options] --procedural SETTINGS\n"
+            "\n"
+            "  -d,  --terrainDimensions W H   Terrain size in voxels (512 512)\n"
+            "  -m,  --maxHeight N             Height of the tallest column (256)\n"
+            "  -rw, --rawWidth N              Width of a .r16/.r32 heightmap that isn't square\n"
+            "  -s,  --brickScale S            Voxel size of the exported mesh (1)\n"
+            "  -b,  --backend cpu|opencl|auto Where to generate (auto)\n"
+            "  -mb, --memoryBudget MB         Generate in tiles that fit this budget\n"
+            "  -nh, --normalizeHeights CLIP   Stretch the samples over the max height, clipping\n"
+            "                                 this fraction of them at each end (e.g. 0.001)\n"
+            "  -tb, --trimBase N|auto         Cut N layers, or all below the lowest column\n"
+            "  -bk, --bricks SPEC             Merge into bricks, \"default\" or e.g. 1x1,1x2,2x2\n"
+            "  -pr, --procedural SETTINGS     Generate noise, e.g. seed=7,octaves=6,type=ridged,warp=40\n"
+            "  -tc, --terrainCache PATH       Load the terrain from this cache, or write it there\n"
+            "  -ob, --obj PATH                Write the visible surface as an OBJ mesh\n"
+            "  -mg, --mergeFaces              Merge coplanar faces of that mesh\n"
+            "  -st, --stats                   Print the stage timings as JSON on stdout\n"
+            "  -pt, --profileTrace PATH       Write a Chrome trace of every stage\n"
+            "  -q,  --quiet                   Only print warnings and errors\n");
+    }
+
+    bool parseUnsigned(const char* text, unsigned int minimum, unsigned int& outValue)
+    {
+        char* end = nullptr;
+        unsigned long value = strtoul(text, &end, 10);
+        if (*text == '\0' || *end != '\0' || value < minimum || value > 0xFFFFFFFFul) {
+            return false;
+        }
+        outValue = (unsigned int)value;
+        return true;
+    }
+
+    MStatus parseOptions(int argc, char** argv, Options& outOptions)
+    {
+        for (int i = 1; i < argc; i++) {
+            std::string flag = argv[i];
+            auto is = [&](const char* shortName, const char* longName) {
+                return flag == shortName || flag == longName;
+            };
+            auto next = [&](const char*& outValue) {
+                if (i + 1 >= argc) {
+                    MGlobal::displayError(MString("Missing value for ") + flag.c_str());
+                    return false;
+                }
+                outValue = argv[++i];
+                return true;
+            };
+            auto nextUnsigned = [&](unsigned int minimum, unsigned int& outValue) {
+                const char* value;
+                if (!next(value)) return false;
+                if (!parseUnsigned(value, minimum, outValue)) {
+                    MGlobal::displayError(MString("Invalid value for ") + flag.c_str() + ": " + value);
+                    return false;
+                }
+                return true;
+            };
+
+            const char* value = nullptr;
+            if (is("-d", "--terrainDimensions")) {
+                if (!nextUnsigned(1, outOptions.terrainWidth) || !nextUnsigned(1, outOptions.terrainHeight)) return MS::kFailure;
+            }
+            else if (is("-m", "--maxHeight")) {
+                if (!nextUnsigned(1, outOptions.maxHeight)) return MS::kFailure;
+            }
+            else if (is("-rw", "--rawWidth")) {
+                if (!nextUnsigned(1, outOptions.rawWidth)) return MS::kFailure;
+            }
+            else if (is("-s", "--brickScale")) {
+                if (!next(value)) return MS::kFailure;
+                outOptions.brickScale = (float)atof(value);
+                if (outOptions.brickScale <= 0.0f) {
+                    MGlobal::displayError(MString("Brick scale must be positive: ") + value);
+                    return MS::kFailure;
+                }
+            }
+            else if (is("-b", "--backend")) {
+                if (!next(value)) return MS::kFailure;
+                outOptions.backend = MString(value).toLowerCase().asChar();
+                if (outOptions.backend != "cpu" && outOptions.backend != "opencl" && outOptions.backend != "auto") {
+                    MGlobal::displayError(MString("Backend must be cpu, opencl or auto: ") + value);
+                    return MS::kFailure;
+                }
+            }
+            else if (is("-mb", "--memoryBudget")) {
+                if (!nextUnsigned(0, outOptions.memoryBudgetMB)) return MS::kFailure;
+            }
+            else if (is("-nh", "--normalizeHeights")) {
+                if (!next(value)) return MS::kFailure;
+                char* end = nullptr;
+                outOptions.normalizeClip = strtod(value, &end);
+                if (*value == '\0' || *end != '\0' || !(outOptions.normalizeClip >= 0.0 && outOptions.normalizeClip < 0.5)) {
+                    MGlobal::displayError(MString("Normalize clip must be at least 0 and below 0.5: ") + value);
+                    return MS::kFailure;
+                }
+            }
+            else if (is("-tb", "--trimBase")) {
+                if (!next(value)) return MS::kFailure;
+                unsigned int trimBase = 0;
+                if (std::string(value) == "auto" || std::string(value) == "-1") {
+                    outOptions.trimBase = -1;
+                }
+                else if (parseUnsigned(value, 0, trimBase) && trimBase <= 0x7FFFFFFFu) {
+                    outOptions.trimBase = (int)trimBase;
+                }
+                else {
+                    MGlobal::displayError(MString("Trim base must be a layer count or auto: ") + value);
+                    return MS::kFailure;
+                }
+            }
+            else if (is("-bk", "--bricks")) {
+                if (!next(value)) return MS::kFailure;
+                outOptions.bricks = value;
+            }
+            else if (is("-pr", "--procedural")) {
+                if (!next(value)) return MS::kFailure;
+                outOptions.procedural = value;
+            }
+            else if (is("-tc", "--terrainCache")) {
+                if (!next(value)) return MS::kFailure;
+                outOptions.terrainCache = value;
+            }
+            else if (is("-ob", "--obj")) {
+                if (!next(value)) return MS::kFailure;
+                outOptions.obj = value;
+            }
+            else if (is("-mg", "--mergeFaces")) {
+                outOptions.mergeFaces = true;
+            }
+            else if (is("-st", "--stats")) {
+                outOptions.stats = true;
+            }
+            else if (is("-pt", "--profileTrace")) {
+                if (!next(value)) return MS::kFailure;
+                outOptions.profileTrace = value;
+            }
+            else if (is("-q", "--quiet")) {
+                outOptions.quiet = true;
+            }
+            else if (is("-?", "--help")) {
+                printUsage();
+                exit(0);
+            }
+            else if (flag.size() > 1 && flag[0] == '-') {
+                MGlobal::displayError(MString("Unknown flag: ") + flag.c_str());
+                return MS::kFailure;
+            }
+            else if (outOptions.heightmapPath.empty()) {
+                outOptions.heightmapPath = flag;
+            }
+            else {
+                MGlobal::displayError(MString("Only one heightmap can be given, got ") + flag.c_str());
+                return MS::kFailure;
+            }
+        }
+
+        if (outOptions.heightmapPath.empty() == outOptions.procedural.empty()) {
+            printUsage();
+            return MS::kFailure;
+        }
+        if (!outOptions.procedural.empty() && outOptions.normalizeClip >= 0.0) {
+            MGlobal::displayError("Procedural heights aren't measured, they can't be normalized");
+            return MS::kFailure;
+        }
+        if (outOptions.mergeFaces && outOptions.obj.empty()) {
+            MGlobal::displayError("Merging faces needs an OBJ path");
+            return MS::kFailure;
+        }
+        if (outOptions.terrainCache.empty() && outOptions.obj.empty() && !outOptions.stats) {
+            MGlobal::displayWarning("Neither a terrain cache nor an OBJ path was given, nothing will be written");
+        }
+        return MS::kSuccess;
+    }
+
+    std::string jsonString(const std::string& text)
+    {
+        std::string json = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') json += '\\';
+            json += c;
+        }
+        return json + "\"";
+    }
+
+    double millisecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0;
+    }
+
+    // Formats count items in parallel chunks and writes them in order.
+    // format(i, text) appends item i to text.
+    template <typename Format>
+    bool writeChunked(std::ofstream& file, size_t count, const Format& format)
+    {
+        size_t chunkCount = (count + OBJ_CHUNK - 1) / OBJ_CHUNK;
+        size_t batch = std::max<size_t>(1, ThreadPool::global().concurrency()) * 2;
+        std::vector<std::string> texts(batch);
+
+        for (size_t first = 0; first < chunkCount; first += batch) {
+            size_t last = std::min(first + batch, chunkCount);
+            ThreadPool::global().parallelFor(first, last, 1, [&](size_t begin, size_t end) {
+                for (size_t chunk = begin; chunk < end; chunk++) {
+                    std::string& text = texts[chunk - first];
+                    text.clear();
+                    for (size_t i = chunk * OBJ_CHUNK; i < std::min(count, (chunk + 1) * OBJ_CHUNK); i++) {
+                        format(i, text);
+                    }
+                }
+            });
+            for (size_t chunk = first; chunk < last; chunk++) {
+                file.write(texts[chunk - first].data(), texts[chunk - first].size());
+            }
+        }
+        return (bool)file;
+    }
+
+    MStatus writeObj(const std::string& path, const TerrainMesh& mesh)
+    {
+        ProfileScope scope("writeObj");
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            MGlobal::displayError(MString("Failed to open OBJ for writing: ") + path.c_str());
+            return MS::kFailure;
+        }
+
+        file << "# " << mesh.vertexCount() << " vertices, " << mesh.faceCount() << " faces\n";
+
+        // Where each face's vertices start
+        std::vector<size_t> faceOffsets(mesh.faceCount() + 1, 0);
+        for (size_t i = 0; i < mesh.faceCount(); i++) {
+            faceOffsets[i + 1] = faceOffsets[i] + (size_t)mesh.faceCounts[i];
+        }
+
+        const float* points = mesh.points.data();
+        const int* vertices = mesh.faceVertices.data();
+        bool written = writeChunked(file, mesh.vertexCount(), [points](size_t i, std::string& text) {
+            char line[96];
+            text.append(line, (size_t)snprintf(line, sizeof(line), "v %g %g %g\n", points[i * 3], points[i * 3 + 1], points[i * 3 + 2]));
+        }) && writeChunked(file, mesh.faceCount(), [&faceOffsets, vertices](size_t i, std::string& text) {
+            char index[16];
+            text += 'f';
+            for (size_t j = faceOffsets[i]; j < faceOffsets[i + 1]; j++) {
+                text.append(index, (size_t)snprintf(index, sizeof(index), " %d", vertices[j] + 1));
+            }
+            text += '\n';
+        });
+
+        if (!written) {
+            MGlobal::displayError(MString("Failed to write OBJ: ") + path.c_str());
+            return MS::kFailure;
+        }
+        return MS::kSuccess;
+    }
+
+    MStatus run(const Options& options, std::string& outStats)
+    {
+        auto startTotal = std::chrono::steady_clock::now();
+        TerrainComputeService* service = TerrainComputeService::instance();
+        MStatus status;
+
+        NoiseSettings noise;
+        bool procedural = !options.procedural.empty();
+        if (procedural) {
+            status = NoiseSettings::parse(options.procedural.c_str(), noise);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+        }
+
+        BrickCatalogue catalogue;
+        bool mergeBricks = !options.bricks.empty();
+        if (mergeBricks) {
+            status = BrickCatalogue::parse(options.bricks == "default" ? BrickCatalogue::DEFAULT_SPEC : options.bricks.c_str(), catalogue);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+        }
+        uint64_t bricksHash = mergeBricks ? TerrainCache::catalogueHash(catalogue) : 0;
+
+        // Load from the cache when it matches, like the command does
+        TerrainSpans spans;
+        BrickLayout bricks;
+        TerrainCacheKey cacheKey;
+        unsigned int imageWidth = 0, imageHeight = 0;
+        bool cacheLoaded = false, bricksLoaded = false;
+        std::string backendName = "cache";
+        double decodeMs = 0.0, generateMs = 0.0, mergeMs = 0.0, meshMs = 0.0;
+        CachedColumnHeights heights;
+        if (!options.terrainCache.empty()) {
+            ProfileScope scope("readTerrainCache");
+            auto startRead = std::chrono::steady_clock::now();
+            if (procedural) {
+                TerrainCache::makeKey(noise, options.terrainWidth, options.terrainHeight, options.maxHeight, cacheKey);
+            }
+            else {
+                status = TerrainCache::makeKey(options.heightmapPath.c_str(), options.rawWidth,
+                    options.terrainWidth, options.terrainHeight, options.maxHeight, cacheKey);
+                CHECK_MSTATUS_AND_RETURN_IT(status);
+            }
+            cacheKey.rangeHash = TerrainCache::rangeHash(options.normalizeClip, options.trimBase);
+            status = TerrainCache::read(options.terrainCache.c_str(), cacheKey, bricksHash, spans,
+                mergeBricks ? &bricks : nullptr, imageWidth, imageHeight, heights, cacheLoaded, bricksLoaded);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            generateMs = millisecondsSince(startRead);
+        }
+
+        if (!cacheLoaded) {
+            auto startDecode = std::chrono::steady_clock::now();
+            std::shared_ptr<const Heightfield> heightfield;
+            if (procedural) {
+                // Nothing to decode, the backend evaluates the noise tile by tile
+                heightfield = std::make_shared<Heightfield>(Heightfield::procedural(noise));
+            }
+            else {
+                ProfileScope scope("acquireHeightmap");
+                status = service->heightmapCache().acquire(options.heightmapPath.c_str(), heightfield, options.rawWidth);
+            }
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            decodeMs = millisecondsSince(startDecode);
+            imageWidth = heightfield->width;
+            imageHeight = heightfield->height;
+
+            TerrainComputeBackend* backend = service->backend(options.backend.c_str(), &status);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            backendName = backend->name();
+
+            // Normalized and trimmed from the heightmap's own measurements
+            HeightRange range;
+            status = TerrainComputeBackend::heightRange(*heightfield, options.normalizeClip, options.trimBase,
+                options.maxHeight, range);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            TerrainComputeBackend::heightBounds(*heightfield, range, options.maxHeight, heights.lowestColumn, heights.tallestColumn);
+            heights.base = range.base;
+
+            auto startGenerate = std::chrono::steady_clock::now();
+            if (!options.profileTrace.empty()) {
+                backend->setProfiling(true);
+            }
+            {
+                ProfileScope scope("generateSpans");
+                status = backend->generateSpansFromHeightfield(*heightfield, spans, options.terrainWidth,
+                    options.terrainHeight, options.maxHeight, (size_t)options.memoryBudgetMB * 1024 * 1024, range);
+            }
+            backend->setProfiling(false);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            generateMs = millisecondsSince(startGenerate);
+        }
+
+        if (mergeBricks && !bricksLoaded) {
+            ProfileScope scope("mergeBricks");
+            auto startMerge = std::chrono::steady_clock::now();
+            status = BrickMerger::merge(spans, catalogue, bricks);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            mergeMs = millisecondsSince(startMerge);
+            MGlobal::displayInfo(MString("Merged ") + std::to_string(spans.voxelCount).c_str() + " voxels into "
+                + (unsigned int)bricks.bricks.size() + " bricks of " + (unsigned int)bricks.types.size() + " types");
+        }
+
+        if (!options.terrainCache.empty() && (!cacheLoaded || (mergeBricks && !bricksLoaded))) {
+            ProfileScope scope("writeTerrainCache");
+            status = TerrainCache::write(options.terrainCache.c_str(), cacheKey, imageWidth, imageHeight, heights, spans,
+                mergeBricks ? &bricks : nullptr, bricksHash);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+        }
+
+        size_t faceCount = 0;
+        if (!options.obj.empty()) {
+            auto startMesh = std::chrono::steady_clock::now();
+            TerrainMesh mesh;
+            {
+                ProfileScope scope("buildMesh");
+                status = TerrainMesher::build(spans, options.brickScale, options.mergeFaces, mesh);
+            }
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            status = writeObj(options.obj, mesh);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            meshMs = millisecondsSince(startMesh);
+            faceCount = mesh.faceCount();
+            MGlobal::displayInfo(MString("Wrote ") + (unsigned int)faceCount + " faces to " + options.obj.c_str());
+        }
+
+        std::string json = "{";
+        json += "\"heightmap\": " + jsonString(options.heightmapPath);
+        if (procedural) {
+            json += ", \"procedural\": " + jsonString(noise.toString().asChar());
+        }
+        json += ", \"backend\": " + jsonString(backendName);
+        json += ", \"imageWidth\": " + std::to_string(imageWidth);
+        json += ", \"imageHeight\": " + std::to_string(imageHeight);
+        json += ", \"terrainWidth\": " + std::to_string(options.terrainWidth);
+        json += ", \"terrainHeight\": " + std::to_string(options.terrainHeight);
+        json += ", \"maxHeight\": " + std::to_string(options.maxHeight);
+        json += ", \"lowestColumn\": " + std::to_string(heights.lowestColumn);
+        json += ", \"tallestColumn\": " + std::to_string(heights.tallestColumn);
+        json += ", \"base\": " + std::to_string(heights.base);
+        json += ", \"voxels\": " + std::to_string(spans.voxelCount);
+        json += ", \"bricks\": " + std::to_string(bricks.bricks.size());
+        json += ", \"faces\": " + std::to_string(faceCount);
+        json += ", \"cacheHit\": " + std::string(cacheLoaded ? "true" : "false");
+        json += ", \"decodeMs\": " + std::to_string(decodeMs);
+        json += ", \"generateMs\": " + std::to_string(generateMs);
+        json += ", \"mergeMs\": " + std::to_string(mergeMs);
+        json += ", \"meshMs\": " + std::to_string(meshMs);
+        json += ", \"totalMs\": " + std::to_string(millisecondsSince(startTotal));
+        json += "}";
+        outStats = json;
+
+        return MS::kSuccess;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (parseOptions(argc, argv, options) != MS::kSuccess) {
+        return 2;
+    }
+
+    if (options.quiet) {
+        MGlobal::setMessageHandler([](MGlobal::MessageLevel level, const MString& message) {
+            if (level != MGlobal::kInfo) {
+                fprintf(stderr, "%s%s\n", level == MGlobal::kError ? "Error: " : "Warning: ", message.asChar());
+            }
+        });
+    }
+
+    TerrainComputeService::create();
+    std::string stats;
+    MStatus status;
+    if (!options.profileTrace.empty()) {
+        Profiler profiler;
+        {
+            Profiler::Activation activation(&profiler);
+            ProfileScope scope("legoTerrainCli");
+            status = run(options, stats);
+        }
+        if (status == MS::kSuccess) {
+            status = profiler.writeChromeTrace(options.profileTrace.c_str());
+        }
+    }
+    else {
+        status = run(options, stats);
+    }
+    TerrainComputeService::destroy();
+
+    if (status != MS::kSuccess) {
+        return 1;
+    }
+    if (options.stats) {
+        printf("%s\n", stats.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,287 @@
+"""Headless benchmark for the voxelizeTerrain command.
+
+Run with mayapy, no GUI needed:
+
+    mayapy benchmark.py --plugin C:/path/LegoTerrain.mll --out results.json
+    mayapy benchmark.py --plugin ... --out new.json --baseline results.json
+
+Synthetic .r16 heightmaps are written to a temporary folder, one pattern and
+size at a time. Every case is generated once with -generateOnly for the
+generation stages, then instanced once per brick scale when its instance
+count is under --max-scene-voxels. Each run is repeated and the fastest is
+kept. Every case runs in its own mayapy process, so its peak memory is its
+own and not the largest of the cases before it. Needs numpy in mayapy's
+environment.
+"""
+
+import argparse
+import ctypes
+import datetime
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import numpy as np
+
+PATTERNS = ["flat", "ramp", "cliffs", "noise", "checkerboard"]
+DEFAULT_SIZES = [256, 512, 1024, 2048, 4096, 8192]
+DEFAULT_MAX_HEIGHTS = [64, 256, 1024]
+DEFAULT_BRICK_SCALES = [0.5, 1.0, 2.0]
+
+# Stage timings compared against a baseline, by JSON key
+TRACKED_STAGES = ["decodeMs", "generateMs", "tileWaitMs", "tileAssembleMs", "sceneNodesMs", "sceneDataMs", "totalMs"]
+
+
+def make_heightmap(pattern, size, seed=1):
+    """Returns a size x size uint16 array for one of PATTERNS."""
+    # Broadcast a row against a column instead of holding two full index grids
+    x = np.arange(size, dtype=np.int64)[np.newaxis, :]
+    y = np.arange(size, dtype=np.int64)[:, np.newaxis]
+
+    if pattern == "flat":
+        return np.full((size, size), 32768, dtype=np.uint16)
+
+    if pattern == "ramp":
+        return np.broadcast_to(x * 65535 // max(size - 1, 1), (size, size)).astype(np.uint16)
+
+    if pattern == "cliffs":
+        # Terraces a few pixels wide, so most columns stand next to a drop
+        step = max(size // 64, 4)
+        levels = (x // step + y // step) % 8
+        return (levels * 9362).astype(np.uint16)
+
+    if pattern == "noise":
+        # A few octaves of bilinear value noise
+        rng = np.random.default_rng(seed)
+        height = np.zeros((size, size), dtype=np.float32)
+        amplitude = 1.0
+        cells = 4
+        while cells <= size and amplitude > 1.0 / 64.0:
+            grid = rng.random((cells + 1, cells + 1), dtype=np.float32)
+            u = (x * cells / size).astype(np.float32)
+            v = (y * cells / size).astype(np.float32)
+            x0 = u.astype(np.int64)
+            y0 = v.astype(np.int64)
+            fx = u - x0
+            fy = v - y0
+            top = grid[y0, x0] * (1 - fx) + grid[y0, x0 + 1] * fx
+            bottom = grid[y0 + 1, x0] * (1 - fx) + grid[y0 + 1, x0 + 1] * fx
+            height += (top * (1 - fy) + bottom * fy) * amplitude
+            amplitude *= 0.5
+            cells *= 2
+        height -= height.min()
+        height /= max(height.max(), 1e-9)
+        return (height * 65535).astype(np.uint16)
+
+    if pattern == "checkerboard":
+        # Every column drops to a zero neighbour: the longest spans possible
+        return (((x + y) % 2) * 65535).astype(np.uint16)
+
+    raise ValueError("Unknown pattern: " + pattern)
+
+
+def write_r16(path, samples):
+    samples.astype("<u2").tofile(path)
+
+
+def process_memory_bytes():
+    """Resident and peak resident memory of this process, in bytes."""
+    if sys.platform == "win32":
+        class ProcessMemoryCounters(ctypes.Structure):
+            _fields_ = [
+                ("cb", ctypes.c_ulong),
+                ("PageFaultCount", ctypes.c_ulong),
+                ("PeakWorkingSetSize", ctypes.c_size_t),
+                ("WorkingSetSize", ctypes.c_size_t),
+                ("QuotaPeakPagedPoolUsage", ctypes.c_size_t),
+                ("QuotaPagedPoolUsage", ctypes.c_size_t),
+                ("QuotaPeakNonPagedPoolUsage", ctypes.c_size_t),
+                ("QuotaNonPagedPoolUsage", ctypes.c_size_t),
+                ("PagefileUsage", ctypes.c_size_t),
+                ("PeakPagefileUsage", ctypes.c_size_t),
+            ]
+
+        counters = ProcessMemoryCounters()
+        counters.cb = ctypes.sizeof(counters)
+        process = ctypes.windll.kernel32.GetCurrentProcess()
+        ctypes.windll.psapi.GetProcessMemoryInfo(process, ctypes.byref(counters), counters.cb)
+        return counters.WorkingSetSize, counters.PeakWorkingSetSize
+
+    import resource
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if sys.platform == "darwin":
+        # Bytes on macOS, which has no current figure here; the peak stands in
+        return peak, peak
+
+    # Kilobytes on Linux
+    with open("/proc/self/statm") as statm:
+        resident = int(statm.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+    return resident, peak * 1024
+
+
+def run_case(cmds, path, name, size, max_height, brick_scale, backend, generate_only, repeat):
+    """Fastest of repeat runs, as the command's -stats JSON plus throughput and memory."""
+    start_memory, _ = process_memory_bytes()
+    best = None
+    for _ in range(repeat):
+        stats = json.loads(cmds.voxelizeTerrain(
+            heightMapPath=path,
+            outputName=name,
+            terrainDimensions=(size, size),
+            maxHeight=max_height,
+            brickScale=brick_scale,
+            backend=backend,
+            cacheBudget=0,
+            generateOnly=generate_only,
+            stats=True
+        )[0])
+        if not generate_only:
+            cmds.file(new=True, force=True)
+        if best is None or stats["totalMs"] < best["totalMs"]:
+            best = stats
+
+    voxels = best["voxels"]
+    best["generateOnly"] = generate_only
+    best["generateVoxelsPerSecond"] = voxels / (best["generateMs"] / 1000.0) if best["generateMs"] > 0 else 0.0
+    best["totalVoxelsPerSecond"] = voxels / (best["totalMs"] / 1000.0) if best["totalMs"] > 0 else 0.0
+
+    # The process only ran this case, so its peak is the case's; the rise over
+    # the memory before it leaves out Maya and the plugin
+    _, peak_memory = process_memory_bytes()
+    best["peakMemoryBytes"] = peak_memory
+    best["caseMemoryBytes"] = max(peak_memory - start_memory, 0)
+    return best
+
+
+# Marks the result line among Maya's own output on a case process's stdout
+RESULT_PREFIX = "BENCHMARK_RESULT "
+
+
+def run_case_process(plugin, case):
+    """Runs one case in a fresh mayapy and returns its result."""
+    output = subprocess.run(
+        [sys.executable, os.path.abspath(__file__), "--plugin", plugin, "--case", json.dumps(case)],
+        stdout=subprocess.PIPE, check=True, universal_newlines=True).stdout
+    for line in output.splitlines():
+        if line.startswith(RESULT_PREFIX):
+            return json.loads(line[len(RESULT_PREFIX):])
+    raise RuntimeError("Case %s printed no result" % case["name"])
+
+
+def case_main(plugin, case):
+    """Body of a case process: one case, printed as JSON."""
+    import maya.standalone
+    maya.standalone.initialize(name="python")
+    import maya.cmds as cmds
+
+    cmds.loadPlugin(plugin)
+    result = run_case(cmds, case["path"], case["name"], case["size"], case["maxHeight"], case["brickScale"],
+                      case["backend"], case["generateOnly"], case["repeat"])
+    result["mayaVersion"] = cmds.about(version=True)
+    print(RESULT_PREFIX + json.dumps(result))
+    sys.stdout.flush()
+    maya.standalone.uninitialize()
+
+
+def case_key(result):
+    return (result["heightmap"].split("/")[-1].split("\\")[-1], result["backend"], result["terrainWidth"],
+            result["maxHeight"], result["brickScale"], result["generateOnly"])
+
+
+def compare(results, baseline_path, threshold):
+    """Prints the tracked stages that got slower than threshold, returns how many."""
+    with open(baseline_path) as baseline_file:
+        baseline = {case_key(r): r for r in json.load(baseline_file)["results"]}
+
+    regressions = 0
+    for result in results:
+        before = baseline.get(case_key(result))
+        if before is None:
+            continue
+        for stage in TRACKED_STAGES:
+            old, new = before.get(stage, 0.0), result.get(stage, 0.0)
+            # Stages under a millisecond are noise
+            if old >= 1.0 and new > old * (1.0 + threshold):
+                regressions += 1
+                print("REGRESSION %s %s: %.2fms -> %.2fms (+%.0f%%)" % (
+                    result["name"], stage, old, new, (new / old - 1.0) * 100.0))
+
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark voxelizeTerrain without the Maya GUI")
+    parser.add_argument("--plugin", required=True, help="Path to the LegoTerrain plugin")
+    parser.add_argument("--out", help="JSON file to write")
+    parser.add_argument("--patterns", nargs="+", default=PATTERNS, choices=PATTERNS)
+    parser.add_argument("--sizes", nargs="+", type=int, default=DEFAULT_SIZES)
+    parser.add_argument("--max-heights", nargs="+", type=int, default=DEFAULT_MAX_HEIGHTS)
+    parser.add_argument("--brick-scales", nargs="+", type=float, default=DEFAULT_BRICK_SCALES)
+    parser.add_argument("--backends", nargs="+", default=["cpu", "opencl"])
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--max-scene-voxels", type=int, default=20000000,
+                        help="Skip scene ingest for terrains with more voxels")
+    parser.add_argument("--baseline", help="Earlier JSON to compare against")
+    parser.add_argument("--threshold", type=float, default=0.10, help="Slowdown that counts as a regression")
+    parser.add_argument("--case", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.case:
+        case_main(args.plugin, json.loads(args.case))
+        return
+    if not args.out:
+        parser.error("the following arguments are required: --out")
+
+    results = []
+    work_dir = tempfile.mkdtemp(prefix="legoterrain_bench_")
+    try:
+        for pattern in args.patterns:
+            for size in args.sizes:
+                path = os.path.join(work_dir, "%s_%d.r16" % (pattern, size)).replace("\\", "/")
+                write_r16(path, make_heightmap(pattern, size))
+
+                for backend in args.backends:
+                    for max_height in args.max_heights:
+                        name = "%s_%d_%s_h%d" % (pattern, size, backend, max_height)
+                        print("Running " + name)
+
+                        case = {"path": path, "name": name, "size": size, "maxHeight": max_height, "brickScale": 1.0,
+                                "backend": backend, "generateOnly": True, "repeat": args.repeat}
+                        generated = run_case_process(args.plugin, case)
+                        results.append(generated)
+
+                        if generated["voxels"] > args.max_scene_voxels:
+                            continue
+                        for brick_scale in args.brick_scales:
+                            case.update(brickScale=brick_scale, generateOnly=False)
+                            results.append(run_case_process(args.plugin, case))
+
+                os.remove(path)
+    finally:
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    report = {
+        "meta": {
+            "date": datetime.datetime.now().isoformat(),
+            "maya": results[0]["mayaVersion"] if results else "",
+            "platform": platform.platform(),
+            "processor": platform.processor(),
+            "cpuCount": os.cpu_count(),
+            "repeat": args.repeat,
+        },
+        "results": results,
+    }
+    with open(args.out, "w") as out_file:
+        json.dump(report, out_file, indent=2)
+    print("Wrote %d results to %s" % (len(results), args.out))
+
+    regressions = compare(results, args.baseline, args.threshold) if args.baseline else 0
+    sys.exit(1 if regressions else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -19,7 +19,7 @@ class VoxelizeTerrainUI(QtWidgets.QDialog):
         heightmap_layout = QtWidgets.QHBoxLayout()
         heightmap_label = QtWidgets.QLabel("Heightmap Path:")
         self.heightmap_field = QtWidgets.QLineEdit()
-        self.heightmap_field.setPlaceholderText("Path to PNG heightmap file")
+        self.heightmap_field.setPlaceholderText("Path to PNG, .r16 or .r32 heightmap file")
         self.browse_button = QtWidgets.QPushButton("Browse...")
         self.browse_button.clicked.connect(self.browse_heightmap)
         heightmap_layout.addWidget(heightmap_label)
@@ -62,7 +62,7 @@ class VoxelizeTerrainUI(QtWidgets.QDialog):
         max_height_layout = QtWidgets.QHBoxLayout()
         max_height_label = QtWidgets.QLabel("Max Height:")
         self.max_height_spin = QtWidgets.QSpinBox()
-        self.max_height_spin.setRange(0, 256)
+        self.max_height_spin.setRange(0, 65535)
         self.max_height_spin.setValue(256)
         max_height_layout.addWidget(max_height_label)
         max_height_layout.addWidget(self.max_height_spin)
@@ -88,7 +88,7 @@ class VoxelizeTerrainUI(QtWidgets.QDialog):
             self,
             "Select Heightmap",
             "",
-            "PNG Images (*.png);;All Files (*)"
+            "Heightmaps (*.png *.r16 *.r32);;All Files (*)"
         )
         if file_path:
             self.heightmap_field.setText(file_path)
@@ -126,7 +126,7 @@ class VoxelizeTerrainUI(QtWidgets.QDialog):
             )
 
             if result:
-                load_time, particle_time, total_time, voxel_count = result
+                load_time, particle_time, total_time, voxel_count = result[:4]
                 message = (
                     f"Terrain '{output_name}' generated successfully!\n\n"
                     f"Performance:\n"